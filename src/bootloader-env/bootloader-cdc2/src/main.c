@@ -223,10 +223,14 @@ static uint8_t ep0State = EP0STATE_CONTROL_PACKET;
 // CDC config
 static CDC_LINECODING lineCoding = {0};
 
+// BUS_IS and EP_IS bits latched by usb_irq_handler() and not handled yet
+static volatile uint32_t pendingBus, pendingEp;
+
 // Start the uploaded code
 static void execute()
 {
     arm32_interrupt_disable(); // Disable IRQs so nothing is going to stop us
+    intc_disable_irq(IRQ_USBOTG);
 
     // Set the INTC Vector base address to the new table which should be the first thing in the new code
     intc_set_irq_base(LOAD_ADDR);
@@ -319,10 +323,12 @@ static void usb_init()
     // Usb thingy
     USB->ISCR = (USB->ISCR & ~0x70) | (0x3F << 12); // FORCE_VBUS_VALID to HIGH, FORCE_ID to HIGH, DPDM_PULLUP_EN enable, ID_PULLUP_EN enable
     USB->VEND0 = 0;
-    USB->BUS_IE = 0xFF; // enable all
+    USB->BUS_IE = 0x07; // Suspend, resume, reset, the SOF would wake the CPU every frame
     USB->BUS_IS = 0xFF; // Clear interrupts
-    USB->EP_IE = 0;
+    USB->EP_IE = 1 | (1 << 19); // EP0, EP3 data out received
     USB->EP_IS = 0xFFFFFFFF;              // Clear endpoint iterrupts
+    pendingBus = 0;
+    pendingEp = 0;
     USB->POWER &= ~((1 << 7) | (1 << 6)); // Disable ISO update & soft connect
     USB->POWER |= ((1 << 6) | (1 << 5));  // Enable soft connect & high speed mode
 }
@@ -486,7 +492,7 @@ static void usb_handle_ep0_control_packet()
     {
         printStr("\tCDC GET_LINE_CODING\n");
 
-        USB->TXCSR = 0x48; // Serviced RxPktRdy | DataEnd
+        USB->TXCSR = 0x40; // Serviced RxPktRdy, DataEnd comes with the last data packet
 
         ep0_send_buf(&lineCoding, sizeof(CDC_LINECODING));
     }
@@ -739,8 +745,23 @@ static void handle_ep3_in()
     USB->EP_IDX = 0; // Reset the EP index pointer just to be sure
 }
 
-static void usb_handler()
+// Latches the USB interrupt sources for usb_handler()
+static void usb_irq_handler()
+{
+    uint32_t isr = USB->BUS_IS;
+    USB->BUS_IS = isr;
+    pendingBus |= isr;
+
+    isr = USB->EP_IS;
+    USB->EP_IS = isr;
+    pendingEp |= isr;
+}
+
+// Returns 0 when there was nothing to do and no DMA is running
+static uint8_t usb_handler()
 {
+    uint8_t busy = ep3State == EP3STATE_WAIT_DMA; // The end of the DMA is polled
+
     // Handle DMA status
     if (ep3State == EP3STATE_WAIT_DMA)
     {
@@ -774,9 +795,13 @@ static void usb_handler()
         }
     }
 
-    // Handle USB bus interrupts
-    uint8_t busISR = USB->BUS_IS; // IRQs are cleared when this register is read
-    USB->BUS_IS = busISR;
+    // Take the USB interrupts latched by usb_irq_handler()
+    uint32_t cpsr = arm32_interrupt_save();
+    uint8_t busISR = pendingBus;
+    uint32_t epISR = pendingEp;
+    pendingBus = 0;
+    pendingEp = 0;
+    arm32_interrupt_restore(cpsr);
 
 #if DEBUG
     if (busISR != 0 && busISR != 8) // Don't care about SOF
@@ -797,13 +822,14 @@ static void usb_handler()
         printStr("USB Resume\n");
     }
 
-    if (busISR & 3) // Reset
+    if (busISR & 4) // Reset
     {
         printStr("USB Reset\n");
 
         USB->EP_IS = 0xFFFFFFFF; // Clear all endpoint IRQs
         USB->EP_IDX = 0;
         USB->TXFUNCADDR = 0;
+        epISR = 0; // Whatever was latched before belongs to the old session
     }
 
 #if DEBUG
@@ -814,12 +840,9 @@ static void usb_handler()
 #endif
 
     // Handle endpoint interrupts
-    uint32_t epISR = USB->EP_IS; // IRQs are cleared when this register is read
-    USB->EP_IS = epISR;
-
     if (epISR == 0)
     {
-        return; // No active IRQs
+        return busy || busISR != 0; // No active IRQs
     }
 
 #if DEBUG
@@ -840,6 +863,7 @@ static void usb_handler()
     {
         handle_ep3_in();
     }
+    return 1;
 }
 
 int main(void)
@@ -849,10 +873,19 @@ int main(void)
 
     printStr("USB\n");
     usb_init();
+    intc_set_irq_handler(IRQ_USBOTG, usb_irq_handler);
+    intc_enable_irq(IRQ_USBOTG);
 
     while (1)
     {
-        usb_handler();
+        if (!usb_handler())
+        {
+            // Sleep until the next USB event, unless one came in since
+            uint32_t cpsr = arm32_interrupt_save();
+            if (!(pendingBus | pendingEp))
+                arm32_wait_for_interrupt();
+            arm32_interrupt_restore(cpsr);
+        }
     }
     return 0;
 }
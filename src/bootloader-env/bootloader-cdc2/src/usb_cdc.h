@@ -12,7 +12,7 @@ extern "C" {
 typedef union PACKED
 {
     uint8_t data[7];
-    struct
+    struct PACKED // 7 bytes on the wire, unpacked the union would be 8
     {
         uint32_t dwDTERate; // Baud
         uint8_t bCharFormat; // 0 = 1 stop bit, 1 = 1.5 stop bit, 2 = 2 stop bit
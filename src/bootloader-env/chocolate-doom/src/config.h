@@ -39,6 +39,19 @@
 /* Define to 1 if you have the `mmap' function. */
 #undef HAVE_MMAP
 
+/* Define to 1 to load WAD files into the DRAM region reserved by the
+   linker script and serve lumps from it without copying. */
+#define HAVE_DRAM_WAD 1
+
+/* Define to the file R_InitData keeps its texture column and sprite tables
+   in between boots. Leave undefined to rebuild them from the patches every
+   time. */
+#define DATA_CACHE_FILE "DOOM.CCH"
+
+/* Define to 1 to build the zone allocator with segregated free lists and LRU
+   purging (z_bins.c) instead of the rover based one (z_zone.c). */
+#define HAVE_ZONE_BINS 1
+
 /* Define to 1 if you have the `sched_setaffinity' function. */
 #undef HAVE_SCHED_SETAFFINITY
 
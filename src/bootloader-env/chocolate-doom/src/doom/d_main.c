@@ -1189,6 +1189,103 @@ static void G_CheckDemoStatusAtExit (void)
     G_CheckDemoStatus();
 }
 
+//
+// D_PreloadRange
+//
+// Prefetch the lumps between two marker lumps.
+//
+
+static void D_PreloadRange(const char *start, const char *end)
+{
+    lumpindex_t first, last, i;
+
+    first = W_CheckNumForName(start);
+    last = W_CheckNumForName(end);
+
+    if (first < 0 || last < first)
+    {
+        return;
+    }
+
+    for (i = first + 1; i < last; ++i)
+    {
+        W_PrefetchLumpNum(i);
+    }
+}
+
+static void D_PreloadName(const char *name)
+{
+    lumpindex_t lump;
+
+    lump = W_CheckNumForName(name);
+
+    if (lump >= 0)
+    {
+        W_PrefetchLumpNum(lump);
+    }
+}
+
+//
+// D_PreloadStartup
+//
+// Queue the lumps read by R_Init and by the first screen, in the order
+// they are read.  The card fetches them in the background while the
+// refresh daemon is being set up, instead of one at a time on demand.
+//
+
+static void D_PreloadStartup(void)
+{
+    char mapname[9];
+    lumpindex_t lump;
+    int i;
+
+    // R_InitTextures, R_InitSpriteLumps, R_InitColormaps
+
+    D_PreloadName(DEH_String("PNAMES"));
+    D_PreloadName(DEH_String("TEXTURE1"));
+    D_PreloadName(DEH_String("TEXTURE2"));
+
+    // Wall patches and sprites are only read to rebuild the data cache
+
+    if (!R_DataCacheValid())
+    {
+        D_PreloadRange("P_START", "P_END");
+        D_PreloadRange("S_START", "S_END");
+    }
+
+    D_PreloadName(DEH_String("COLORMAP"));
+
+    // The first screen is either the start map or the title page
+
+    if (!autostart)
+    {
+        D_PreloadName(DEH_String("TITLEPIC"));
+        return;
+    }
+
+    if (gamemode == commercial)
+    {
+        M_snprintf(mapname, sizeof(mapname), "MAP%02i", startmap);
+    }
+    else
+    {
+        M_snprintf(mapname, sizeof(mapname), "E%iM%i",
+                   startepisode, startmap);
+    }
+
+    lump = W_CheckNumForName(mapname);
+
+    if (lump >= 0)
+    {
+        for (i = ML_LABEL; i <= ML_BLOCKMAP; ++i)
+        {
+            W_PrefetchLumpNum(lump + i);
+        }
+    }
+
+    D_PreloadRange("F_START", "F_END");
+}
+
 //
 // D_DoomMain
 //
@@ -1688,6 +1785,8 @@ void D_DoomMain (void)
         startloadgame = -1;
     }
 
+    D_PreloadStartup();
+
     DEH_printf("M_Init: Init miscellaneous info.\n");
     M_Init ();
 
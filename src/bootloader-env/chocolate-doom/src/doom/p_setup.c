@@ -32,6 +32,7 @@
 #include "g_game.h"
 
 #include "i_system.h"
+#include "i_timer.h"
 #include "w_wad.h"
 
 #include "doomdef.h"
@@ -41,6 +42,8 @@
 
 #include "doomstat.h"
 
+#include "diskcache.h"
+
 
 void	P_SpawnMapThing (mapthing_t*	mthing);
 
@@ -777,7 +780,10 @@ P_SetupLevel
     int		i;
     char	lumpname[9];
     int		lumpnum;
+    int		starttime = I_GetTimeMS ();
 	
+    disk_cache_reset_stats ();
+
     totalkills = totalitems = totalsecret = wminfo.maxfrags = 0;
     wminfo.partime = 180;
     for (i=0 ; i<MAXPLAYERS ; i++)
@@ -869,6 +875,8 @@ P_SetupLevel
 
     //printf ("free memory: 0x%x\n", Z_FreeMemory());
 
+    printf ("P_SetupLevel: %d ms\n", I_GetTimeMS () - starttime);
+    disk_cache_report ();
 }
 
 
@@ -23,6 +23,8 @@
 
 #include "doomstat.h"
 
+#include "prof.h"
+
 
 int	leveltime;
 
@@ -125,6 +127,7 @@ void P_RunThinkers (void)
 void P_Ticker (void)
 {
     int		i;
+    PROF_SCOPE("P_Ticker");
     
     // run the tic
     if (paused)
@@ -19,6 +19,7 @@
 
 #include <stdio.h>
 
+#include "config.h"
 #include "deh_main.h"
 #include "i_swap.h"
 #include "i_system.h"
@@ -38,6 +39,12 @@
 
 #include "r_data.h"
 
+#ifdef DATA_CACHE_FILE
+#include "m_misc.h"
+#include "sha1.h"
+#include "w_checksum.h"
+#endif
+
 //
 // Graphics.
 // DOOM graphics for walls and sprites
@@ -163,6 +170,233 @@ fixed_t*	spritetopoffset;
 lighttable_t	*colormaps;
 
 
+#ifdef DATA_CACHE_FILE
+
+//
+// DATA CACHE FILE
+// R_GenerateLookup and R_InitSpriteLumps have to read every wall
+//  patch and every sprite, which takes seconds from the card.
+// Their results are saved to DATA_CACHE_FILE and read back on
+//  the next boot as long as the WAD directory checksum matches.
+// Composite textures are still built on demand, most of them
+//  are never needed.
+//
+
+#define DATA_CACHE_MAGIC   0x48434344 // "DCCH"
+#define DATA_CACHE_VERSION 1
+
+typedef struct
+{
+    int			magic;
+    int			version;
+    sha1_digest_t	checksum;
+    int			numtextures;
+    int			numcolumns;	// Sum of all texture widths
+    int			numspritelumps;
+} datacache_header_t;
+
+// File contents, NULL unless it matches the loaded WADs.
+// Followed by texturecompositesize[numtextures],
+//  spritewidth, spriteoffset, spritetopoffset[numspritelumps],
+//  then texturecolumnlump and texturecolumnofs of every texture.
+static byte*		datacache;
+static sha1_digest_t	datacache_checksum;
+static boolean		datacache_opened;
+
+
+static void R_OpenDataCache (void)
+{
+    datacache_header_t*	header;
+    int			length;
+
+    // D_PreloadStartup may have looked at it already
+    if (datacache_opened)
+	return;
+    datacache_opened = true;
+
+    datacache = NULL;
+    W_Checksum (datacache_checksum);
+
+    if (!M_FileExists (DATA_CACHE_FILE))
+	return;
+
+    length = M_ReadFile (DATA_CACHE_FILE, &datacache);
+    header = (datacache_header_t *) datacache;
+
+    if (length < sizeof(*header)
+	|| header->magic != DATA_CACHE_MAGIC
+	|| header->version != DATA_CACHE_VERSION
+	|| memcmp (header->checksum, datacache_checksum,
+		   sizeof(sha1_digest_t))
+	|| length != sizeof(*header)
+		     + header->numtextures * sizeof(int)
+		     + header->numspritelumps * 3 * sizeof(fixed_t)
+		     + header->numcolumns * (sizeof(short) + sizeof(unsigned short)))
+    {
+	printf ("R_OpenDataCache: %s is stale\n", DATA_CACHE_FILE);
+	Z_Free (datacache);
+	datacache = NULL;
+    }
+}
+
+
+//
+// R_ReadTextureCache
+// Fills the column lookups from the cache file,
+//  returns false if it does not fit the texture list.
+//
+static boolean R_ReadTextureCache (void)
+{
+    datacache_header_t*	header;
+    byte*		collump;
+    byte*		colofs;
+    int			numcolumns;
+    int			i;
+
+    if (!datacache)
+	return false;
+
+    header = (datacache_header_t *) datacache;
+
+    numcolumns = 0;
+    for (i=0 ; i<numtextures ; i++)
+	numcolumns += textures[i]->width;
+
+    if (header->numtextures != numtextures
+	|| header->numcolumns != numcolumns)
+    {
+	Z_Free (datacache);
+	datacache = NULL;
+	return false;
+    }
+
+    memcpy (texturecompositesize, datacache + sizeof(*header),
+	    numtextures * sizeof(int));
+
+    collump = datacache + sizeof(*header)
+	      + numtextures * sizeof(int)
+	      + header->numspritelumps * 3 * sizeof(fixed_t);
+    colofs = collump + numcolumns * sizeof(short);
+
+    for (i=0 ; i<numtextures ; i++)
+    {
+	texturecomposite[i] = 0;
+	memcpy (texturecolumnlump[i], collump,
+		textures[i]->width * sizeof(short));
+	memcpy (texturecolumnofs[i], colofs,
+		textures[i]->width * sizeof(unsigned short));
+	collump += textures[i]->width * sizeof(short);
+	colofs += textures[i]->width * sizeof(unsigned short);
+    }
+
+    return true;
+}
+
+
+//
+// R_ReadSpriteCache
+//
+static boolean R_ReadSpriteCache (void)
+{
+    datacache_header_t*	header;
+    byte*		p;
+    int			size;
+
+    if (!datacache)
+	return false;
+
+    header = (datacache_header_t *) datacache;
+
+    if (header->numspritelumps != numspritelumps)
+    {
+	Z_Free (datacache);
+	datacache = NULL;
+	return false;
+    }
+
+    size = numspritelumps * sizeof(fixed_t);
+    p = datacache + sizeof(*header) + numtextures * sizeof(int);
+
+    memcpy (spritewidth, p, size);
+    memcpy (spriteoffset, p + size, size);
+    memcpy (spritetopoffset, p + size * 2, size);
+
+    return true;
+}
+
+
+//
+// R_CloseDataCache
+// Writes a new cache file if the old one could not be used.
+//
+static void R_CloseDataCache (boolean valid)
+{
+    datacache_header_t*	header;
+    byte*		buffer;
+    byte*		p;
+    int			numcolumns;
+    int			length;
+    int			size;
+    int			i;
+
+    if (datacache)
+    {
+	Z_Free (datacache);
+	datacache = NULL;
+    }
+
+    if (valid)
+	return;
+
+    numcolumns = 0;
+    for (i=0 ; i<numtextures ; i++)
+	numcolumns += textures[i]->width;
+
+    length = sizeof(*header)
+	     + numtextures * sizeof(int)
+	     + numspritelumps * 3 * sizeof(fixed_t)
+	     + numcolumns * (sizeof(short) + sizeof(unsigned short));
+    buffer = Z_Malloc (length, PU_STATIC, NULL);
+
+    header = (datacache_header_t *) buffer;
+    header->magic = DATA_CACHE_MAGIC;
+    header->version = DATA_CACHE_VERSION;
+    memcpy (header->checksum, datacache_checksum, sizeof(sha1_digest_t));
+    header->numtextures = numtextures;
+    header->numcolumns = numcolumns;
+    header->numspritelumps = numspritelumps;
+
+    p = buffer + sizeof(*header);
+    memcpy (p, texturecompositesize, numtextures * sizeof(int));
+    p += numtextures * sizeof(int);
+
+    size = numspritelumps * sizeof(fixed_t);
+    memcpy (p, spritewidth, size);
+    memcpy (p + size, spriteoffset, size);
+    memcpy (p + size * 2, spritetopoffset, size);
+    p += size * 3;
+
+    for (i=0 ; i<numtextures ; i++)
+    {
+	memcpy (p, texturecolumnlump[i], textures[i]->width * sizeof(short));
+	p += textures[i]->width * sizeof(short);
+    }
+    for (i=0 ; i<numtextures ; i++)
+    {
+	memcpy (p, texturecolumnofs[i],
+		textures[i]->width * sizeof(unsigned short));
+	p += textures[i]->width * sizeof(unsigned short);
+    }
+
+    if (M_WriteFile (DATA_CACHE_FILE, buffer, length))
+	printf ("R_CloseDataCache: wrote %s\n", DATA_CACHE_FILE);
+
+    Z_Free (buffer);
+}
+
+#endif
+
+
 //
 // MAPTEXTURE_T CACHING
 // When a texture is first needed,
@@ -605,6 +839,9 @@ void R_InitTextures (void)
     
     // Precalculate whatever possible.	
 
+#ifdef DATA_CACHE_FILE
+    if (!R_ReadTextureCache ())
+#endif
     for (i=0 ; i<numtextures ; i++)
 	R_GenerateLookup (i);
     
@@ -656,6 +893,11 @@ void R_InitSpriteLumps (void)
     spritewidth = Z_Malloc (numspritelumps*sizeof(*spritewidth), PU_STATIC, 0);
     spriteoffset = Z_Malloc (numspritelumps*sizeof(*spriteoffset), PU_STATIC, 0);
     spritetopoffset = Z_Malloc (numspritelumps*sizeof(*spritetopoffset), PU_STATIC, 0);
+
+#ifdef DATA_CACHE_FILE
+    if (R_ReadSpriteCache ())
+	return;
+#endif
 	
     for (i=0 ; i< numspritelumps ; i++)
     {
@@ -686,6 +928,22 @@ void R_InitColormaps (void)
 
 
 
+//
+// R_DataCacheValid
+// True if DATA_CACHE_FILE matches the loaded WADs,
+//  R_InitData then reads no wall patches and no sprites.
+//
+boolean R_DataCacheValid (void)
+{
+#ifdef DATA_CACHE_FILE
+    R_OpenDataCache ();
+    return datacache != NULL;
+#else
+    return false;
+#endif
+}
+
+
 //
 // R_InitData
 // Locates all the lumps
@@ -694,13 +952,25 @@ void R_InitColormaps (void)
 //
 void R_InitData (void)
 {
+#ifdef DATA_CACHE_FILE
+    boolean	valid;
+
+    R_OpenDataCache ();
+#endif
     R_InitTextures ();
     printf (".");
+#ifdef DATA_CACHE_FILE
+    // R_InitTextures drops the cache if it does not fit
+    valid = datacache != NULL;
+#endif
     R_InitFlats ();
     printf (".");
     R_InitSpriteLumps ();
     printf (".");
     R_InitColormaps ();
+#ifdef DATA_CACHE_FILE
+    R_CloseDataCache (valid && datacache != NULL);
+#endif
 }
 
 
@@ -34,6 +34,7 @@ R_GetColumn
 
 // I/O, setting up the stuff.
 void R_InitData (void);
+boolean R_DataCacheValid (void);
 void R_PrecacheLevel (void);
 
 
@@ -35,6 +35,8 @@
 #include "r_local.h"
 #include "r_sky.h"
 
+#include "prof.h"
+
 
 
 
@@ -861,6 +863,8 @@ void R_SetupFrame (player_t* player)
 //
 void R_RenderPlayerView (player_t* player)
 {	
+    PROF_SCOPE("R_RenderPlayerView");
+
     R_SetupFrame (player);
 
     // Clear buffers.
@@ -0,0 +1,30 @@
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+// Sector cache in front of the SD card (diskio.c)
+#define DISKIO_CACHE_SIZE      (1024 * 1024) // Bytes of DRAM holding cached sectors
+#define DISKIO_CACHE_PAGE      8             // Sectors per cache page, pages are read as one transfer
+#define DISKIO_CACHE_READAHEAD 16            // Pages fetched at once when reads run sequentially
+#define DISKIO_CACHE_BYPASS    64            // Transfers of at least this many sectors skip the cache
+#define DISKIO_CACHE_FLUSH_MS  2000          // Dirty pages idle this long are written by disk_cache_poll
+#define DISKIO_CACHE_PRELOAD_SLOTS 4         // Background transfers of up to DISKIO_CACHE_READAHEAD pages in flight
+#define DISKIO_CACHE_PRELOAD_RUNS  256       // Ranges disk_cache_prefetch can hold before they get a slot
+
+// Prints hit/miss counters over UART
+void disk_cache_report(void);
+void disk_cache_reset_stats(void);
+// Writes dirty pages back once no write came in for DISKIO_CACHE_FLUSH_MS, call it regularly from the main loop
+void disk_cache_poll(void);
+// Queues sectors to be read into the cache in the background, in order, while the caller keeps working.
+// Transfers run from the SD IRQ, finished ones enter the cache on the next disk access or disk_cache_poll.
+// Returns 0 if the range could not be queued.
+uint8_t disk_cache_prefetch(uint32_t sector, uint32_t count);
+
+#ifdef __cplusplus
+}
+#endif
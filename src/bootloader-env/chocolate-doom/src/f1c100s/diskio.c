@@ -5,18 +5,103 @@
 #include "ff.h" /* Obtains integer types */
 #include "diskio.h" /* Declarations of disk functions */
 #include "sdcard.h"
+#include "sdqueue.h"
+#include "diskcache.h"
+#include "dmamem.h"
+#include "arm32.h"
 #include "f1c100s_gpio.h"
 #include "f1c100s_clock.h"
 #include "f1c100s_sdc.h"
 #include "f1c100s_uart.h"
 #include <stdio.h>
+#include <string.h>
 
 /* Definitions of physical drive number for each drive */
 #define DEV_MMC 0 /* Map MMC/SD card to physical drive 0 */
 
+#define SECTOR_SIZE 512
+#define CACHE_PAGE_BYTES (DISKIO_CACHE_PAGE * SECTOR_SIZE)
+#define CACHE_PAGES (DISKIO_CACHE_SIZE / CACHE_PAGE_BYTES)
+#define CACHE_HASH 256
+
+typedef struct cache_page {
+    LBA_t page; // First sector / DISKIO_CACHE_PAGE
+    uint8_t valid;
+    uint8_t dirty; // Newer than the card, written back on sync/eviction
+    uint8_t preloaded; // Brought in by disk_cache_prefetch and not read yet
+    uint8_t* data;
+    struct cache_page* hash_next;
+    struct cache_page* lru_prev;
+    struct cache_page* lru_next;
+} cache_page_t;
+
+typedef enum {
+    PRELOAD_FREE = 0,
+    PRELOAD_BUSY, // Transfer queued on the card
+    PRELOAD_DONE, // Transfer ended, waiting for cache_preload_reap to move the pages into the cache
+} cache_preload_state_e;
+
+// Background transfer of up to DISKIO_CACHE_READAHEAD pages
+typedef struct {
+    sdq_request_t req;
+    LBA_t page;
+    uint32_t count;
+    uint32_t gen; // cache_write_gen when queued, data is dropped if the card was written since
+    volatile cache_preload_state_e state;
+} cache_preload_t;
+
+typedef struct {
+    LBA_t page;
+    uint32_t count;
+} cache_run_t;
+
+extern volatile uint32_t systime;
+
 static sdcard_t sdcard;
 
+static uint8_t cache_data[CACHE_PAGES][CACHE_PAGE_BYTES] __attribute__((aligned(32)));
+static uint8_t cache_fetch_buf[DISKIO_CACHE_READAHEAD * CACHE_PAGE_BYTES] __attribute__((aligned(32)));
+static uint8_t* cache_flush_buf; // Write-combining, only ever written by the CPU and read by the IDMAC
+static cache_page_t* cache_flush_list[CACHE_PAGES];
+static cache_page_t cache_pages[CACHE_PAGES];
+static cache_page_t* cache_hash[CACHE_HASH];
+static cache_page_t cache_lru; // Sentinel, lru_next is the most recently used page
+static uint8_t cache_enabled = 0;
+static LBA_t cache_next_page = (LBA_t)-1; // Page right after the last fetch, a miss here means sequential reading
+static uint32_t cache_dirty_count = 0;
+static uint32_t cache_last_write = 0;
+
+static uint8_t cache_preload_buf[DISKIO_CACHE_PRELOAD_SLOTS][DISKIO_CACHE_READAHEAD * CACHE_PAGE_BYTES] __attribute__((aligned(32)));
+static cache_preload_t cache_preload[DISKIO_CACHE_PRELOAD_SLOTS];
+// Pages waiting for a free slot, the IRQ side takes from the head, disk_cache_prefetch adds at the tail
+static cache_run_t cache_runs[DISKIO_CACHE_PRELOAD_RUNS];
+static uint32_t cache_run_head = 0;
+static uint32_t cache_run_tail = 0;
+static uint32_t cache_preload_ahead = 0; // Pages queued or preloaded but not read yet
+static volatile uint32_t cache_write_gen = 0;
+
+static uint32_t cache_hits = 0;
+static uint32_t cache_misses = 0;
+static uint32_t cache_prefetched = 0;
+static uint32_t cache_bypassed = 0;
+static uint32_t cache_writes = 0; // Transfers issued by write-back
+static uint32_t cache_written = 0; // Pages written back
+static uint32_t cache_preloaded = 0; // Pages brought in by disk_cache_prefetch
+static uint32_t cache_preload_used = 0; // Preloaded pages read before being evicted
+
 DRESULT sdcard_ioctl(BYTE cmd, void* buff);
+static DRESULT sdcard_queue_rw(BYTE* buff, LBA_t sector, UINT count, uint8_t write);
+static void cache_init(void);
+static cache_page_t* cache_lookup(LBA_t page);
+static cache_page_t* cache_fetch(LBA_t page);
+static DRESULT cache_read(BYTE* buff, LBA_t sector, UINT count);
+static void cache_update(const BYTE* buff, LBA_t sector, UINT count);
+static void cache_patch(BYTE* buff, LBA_t sector, UINT count);
+static DRESULT cache_write(const BYTE* buff, LBA_t sector, UINT count);
+static DRESULT cache_flush(void);
+static uint8_t cache_covers(LBA_t sector, UINT count);
+static void cache_preload_reap(void);
+static void cache_preload_issue(void);
 
 /*-----------------------------------------------------------------------*/
 /* Get Drive Status                                                      */
@@ -42,14 +127,18 @@ DSTATUS disk_initialize(BYTE pdrv) {
         clk_enable(CCU_BUS_CLK_GATE0, 8);
         clk_reset_clear(CCU_BUS_SOFT_RST0, 8);
 
-        gpio_init(GPIOF, PIN1 | PIN2 | PIN3, GPIO_MODE_AF2, GPIO_PULL_NONE, GPIO_DRV_3);
+        gpio_init(GPIOF, PIN0 | PIN1 | PIN2 | PIN3 | PIN4 | PIN5, GPIO_MODE_AF2, GPIO_PULL_NONE, GPIO_DRV_3);
 
         sdcard.sdc_base = SDC0_BASE;
         sdcard.voltage  = MMC_VDD_27_36;
-        sdcard.width    = MMC_BUS_WIDTH_1;
+        sdcard.width    = MMC_BUS_WIDTH_4;
         sdcard.clock    = 50000000;
 
-        if(sdcard_detect(&sdcard) == 1) return 0;
+        if(sdcard_detect(&sdcard) == 1) {
+            sdq_init(&sdcard);
+            cache_init();
+            return 0;
+        }
     }
     return STA_NOINIT;
 }
@@ -58,20 +147,17 @@ DSTATUS disk_initialize(BYTE pdrv) {
 /* Read Sector(s)                                                        */
 /*-----------------------------------------------------------------------*/
 DRESULT disk_read(BYTE pdrv, BYTE* buff, LBA_t sector, UINT count) {
-    uint64_t result;
-
-    //uart_tx(UART1, '?');
-
     switch(pdrv) {
     case DEV_MMC:
-        result = sdcard_read(&sdcard, buff, sector, count);
-
-        //uart_tx(UART1, '.');
-
-        if(result == count)
+        if(!cache_enabled) return sdcard_queue_rw(buff, sector, count, 0);
+        cache_preload_reap();
+        if((count >= DISKIO_CACHE_BYPASS) && !cache_covers(sector, count)) {
+            cache_bypassed++;
+            if(sdcard_queue_rw(buff, sector, count, 0) != RES_OK) return RES_ERROR;
+            cache_patch(buff, sector, count);
             return RES_OK;
-        else
-            return RES_ERROR;
+        }
+        return cache_read(buff, sector, count);
     }
     return RES_PARERR;
 }
@@ -82,16 +168,16 @@ DRESULT disk_read(BYTE pdrv, BYTE* buff, LBA_t sector, UINT count) {
 #if FF_FS_READONLY == 0
 
 DRESULT disk_write(BYTE pdrv, const BYTE* buff, LBA_t sector, UINT count) {
-    int result;
-
     switch(pdrv) {
     case DEV_MMC:
-        result = sdcard_write(&sdcard, (uint8_t*)buff, sector, count);
-
-        if(result == count)
-            return RES_OK;
-        else
-            return RES_ERROR;
+        if(!cache_enabled) return sdcard_queue_rw((BYTE*)buff, sector, count, 1);
+        cache_preload_reap();
+        if(count >= DISKIO_CACHE_BYPASS) {
+            cache_bypassed++;
+            cache_update(buff, sector, count);
+            return sdcard_queue_rw((BYTE*)buff, sector, count, 1);
+        }
+        return cache_write(buff, sector, count);
     }
     return RES_PARERR;
 }
@@ -111,6 +197,9 @@ DRESULT disk_ioctl(BYTE pdrv, BYTE cmd, void* buff) {
 DRESULT sdcard_ioctl(BYTE cmd, void* buff) {
     switch(cmd) {
     case CTRL_SYNC:
+        if(cache_enabled && (cache_flush() != RES_OK)) return RES_ERROR;
+        while(!sdq_idle())
+            sdq_poll();
         return RES_OK;
         break;
     case GET_SECTOR_COUNT:
@@ -131,3 +220,441 @@ DRESULT sdcard_ioctl(BYTE cmd, void* buff) {
 
     return RES_PARERR;
 }
+
+static DRESULT sdcard_queue_rw(BYTE* buff, LBA_t sector, UINT count, uint8_t write) {
+    sdq_request_t req = {0};
+
+    req.buf = buff;
+    req.blkno = sector;
+    req.blkcnt = count;
+    req.write = write;
+
+    // Background reads queued before this write may return the old data
+    if(write) cache_write_gen++;
+
+    if(!sdq_submit(&req)) return RES_ERROR;
+    return sdq_wait(&req) ? RES_OK : RES_ERROR;
+}
+
+/*-----------------------------------------------------------------------*/
+/* Sector cache                                                          */
+/*-----------------------------------------------------------------------*/
+void disk_cache_report(void) {
+    uint32_t total = cache_hits + cache_misses;
+
+    printf("Disk cache: %lu hits, %lu misses (%lu%% hit), %lu prefetched, %lu bypassed\r\n", cache_hits, cache_misses,
+        total ? (cache_hits * 100 / total) : 0, cache_prefetched, cache_bypassed);
+    printf("Disk cache: %lu dirty, %lu pages written back in %lu transfers\r\n", cache_dirty_count, cache_written,
+        cache_writes);
+    printf("Disk cache: %lu pages preloaded, %lu read\r\n", cache_preloaded, cache_preload_used);
+}
+
+void disk_cache_poll(void) {
+    if(!cache_enabled) return;
+    cache_preload_reap();
+    if(cache_dirty_count && (systime - cache_last_write >= DISKIO_CACHE_FLUSH_MS)) cache_flush();
+}
+
+void disk_cache_reset_stats(void) {
+    cache_hits = 0;
+    cache_misses = 0;
+    cache_prefetched = 0;
+    cache_bypassed = 0;
+    cache_writes = 0;
+    cache_written = 0;
+    cache_preloaded = 0;
+    cache_preload_used = 0;
+}
+
+uint8_t disk_cache_prefetch(uint32_t sector, uint32_t count) {
+    LBA_t page, end;
+    LBA_t last = sdcard.blk_cnt / DISKIO_CACHE_PAGE;
+    cache_run_t* run;
+    uint32_t cpsr;
+    uint8_t ok = 1;
+
+    if(!cache_enabled || (count == 0)) return 0;
+
+    page = sector / DISKIO_CACHE_PAGE;
+    end = (sector + count - 1) / DISKIO_CACHE_PAGE + 1;
+    if(end > last) end = last;
+    if(page >= end) return 0;
+
+    cpsr = arm32_interrupt_save();
+    run = &cache_runs[(cache_run_tail + DISKIO_CACHE_PRELOAD_RUNS - 1) % DISKIO_CACHE_PRELOAD_RUNS];
+    if((cache_run_head != cache_run_tail) && (run->page <= page) && (run->page + run->count >= page)) {
+        // Continues the last queued run, neighbouring lumps end up as one stream of transfers
+        if(end > run->page + run->count) run->count = end - run->page;
+    } else if((cache_run_tail + 1) % DISKIO_CACHE_PRELOAD_RUNS != cache_run_head) {
+        run = &cache_runs[cache_run_tail];
+        run->page = page;
+        run->count = end - page;
+        cache_run_tail = (cache_run_tail + 1) % DISKIO_CACHE_PRELOAD_RUNS;
+    } else {
+        ok = 0;
+    }
+    arm32_interrupt_restore(cpsr);
+
+    cache_preload_reap();
+    return ok;
+}
+
+static void cache_lru_unlink(cache_page_t* p) {
+    p->lru_prev->lru_next = p->lru_next;
+    p->lru_next->lru_prev = p->lru_prev;
+}
+
+static void cache_lru_push(cache_page_t* p) {
+    p->lru_prev = &cache_lru;
+    p->lru_next = cache_lru.lru_next;
+    cache_lru.lru_next->lru_prev = p;
+    cache_lru.lru_next = p;
+}
+
+// Marks a cached page as just used
+static void cache_use(cache_page_t* p) {
+    uint32_t cpsr;
+
+    cache_lru_unlink(p);
+    cache_lru_push(p);
+    if(p->preloaded) {
+        p->preloaded = 0;
+        cache_preload_used++;
+        cpsr = arm32_interrupt_save();
+        cache_preload_ahead--;
+        arm32_interrupt_restore(cpsr);
+    }
+}
+
+static void cache_init(void) {
+    uint32_t i;
+
+    // The page math assumes 512 byte sectors, anything else reads uncached
+    cache_enabled = (sdcard.read_bl_len == SECTOR_SIZE) && (sdcard.write_bl_len == SECTOR_SIZE);
+
+    if(!cache_flush_buf) cache_flush_buf = dma_mem_alloc(DISKIO_CACHE_READAHEAD * CACHE_PAGE_BYTES);
+    if(!cache_flush_buf) cache_enabled = 0;
+
+    memset(cache_hash, 0, sizeof(cache_hash));
+    cache_lru.lru_next = &cache_lru;
+    cache_lru.lru_prev = &cache_lru;
+    for(i = 0; i < CACHE_PAGES; i++) {
+        cache_pages[i].valid = 0;
+        cache_pages[i].dirty = 0;
+        cache_pages[i].preloaded = 0;
+        cache_pages[i].data = cache_data[i];
+        cache_lru_push(&cache_pages[i]);
+    }
+    cache_next_page = (LBA_t)-1;
+    cache_dirty_count = 0;
+
+    for(i = 0; i < DISKIO_CACHE_PRELOAD_SLOTS; i++)
+        cache_preload[i].state = PRELOAD_FREE;
+    cache_run_head = 0;
+    cache_run_tail = 0;
+    cache_preload_ahead = 0;
+}
+
+static cache_page_t* cache_lookup(LBA_t page) {
+    cache_page_t* p;
+
+    for(p = cache_hash[page % CACHE_HASH]; p != NULL; p = p->hash_next)
+        if(p->page == page) return p;
+    return NULL;
+}
+
+// All pages of the range are cached
+static uint8_t cache_covers(LBA_t sector, UINT count) {
+    LBA_t page, end = (sector + count - 1) / DISKIO_CACHE_PAGE;
+
+    for(page = sector / DISKIO_CACHE_PAGE; page <= end; page++)
+        if(cache_lookup(page) == NULL) return 0;
+    return 1;
+}
+
+// Recycles the least recently used page for the given page number
+static cache_page_t* cache_alloc(LBA_t page) {
+    cache_page_t* p = cache_lru.lru_prev;
+    cache_page_t** link;
+    uint32_t cpsr;
+
+    // Write everything back at once rather than this page alone, the neighbours coalesce into bigger transfers
+    if(p->dirty && (cache_flush() != RES_OK)) return NULL;
+
+    if(p->preloaded) {
+        // Evicted before anyone read it
+        p->preloaded = 0;
+        cpsr = arm32_interrupt_save();
+        cache_preload_ahead--;
+        arm32_interrupt_restore(cpsr);
+    }
+
+    if(p->valid) {
+        for(link = &cache_hash[p->page % CACHE_HASH]; *link != p; link = &(*link)->hash_next)
+            ;
+        *link = p->hash_next;
+    }
+
+    p->page = page;
+    p->valid = 1;
+    p->hash_next = cache_hash[page % CACHE_HASH];
+    cache_hash[page % CACHE_HASH] = p;
+    cache_lru_unlink(p);
+    cache_lru_push(p);
+    return p;
+}
+
+// Reads a missing page, plus the following ones when the access pattern is sequential
+static cache_page_t* cache_fetch(LBA_t page) {
+    uint32_t i, cnt = 1;
+    LBA_t last = sdcard.blk_cnt / DISKIO_CACHE_PAGE;
+    cache_page_t* p;
+
+    if(page >= last) return NULL;
+
+    if(page == cache_next_page) {
+        while((cnt < DISKIO_CACHE_READAHEAD) && (page + cnt < last) && (cache_lookup(page + cnt) == NULL))
+            cnt++;
+    }
+
+    if(sdcard_queue_rw(cache_fetch_buf, page * DISKIO_CACHE_PAGE, cnt * DISKIO_CACHE_PAGE, 0) != RES_OK) return NULL;
+
+    // Allocate the requested page last so it is the most recently used one
+    for(i = cnt; i-- > 0;) {
+        p = cache_alloc(page + i);
+        if(p == NULL) return NULL;
+        memcpy(p->data, cache_fetch_buf + i * CACHE_PAGE_BYTES, CACHE_PAGE_BYTES);
+    }
+    cache_prefetched += cnt - 1;
+    cache_next_page = page + cnt;
+    return p;
+}
+
+static DRESULT cache_read(BYTE* buff, LBA_t sector, UINT count) {
+    LBA_t page;
+    UINT offset, n;
+    cache_page_t* p;
+
+    while(count > 0) {
+        page = sector / DISKIO_CACHE_PAGE;
+        offset = sector % DISKIO_CACHE_PAGE;
+        n = DISKIO_CACHE_PAGE - offset;
+        if(n > count) n = count;
+
+        p = cache_lookup(page);
+        if(p != NULL) {
+            cache_hits++;
+            cache_use(p);
+        } else {
+            cache_misses++;
+            p = cache_fetch(page);
+            if(p == NULL) return RES_ERROR;
+        }
+
+        memcpy(buff, p->data + offset * SECTOR_SIZE, n * SECTOR_SIZE);
+        buff += n * SECTOR_SIZE;
+        sector += n;
+        count -= n;
+    }
+    return RES_OK;
+}
+
+// Keeps cached copies in step with sectors being written
+static void cache_update(const BYTE* buff, LBA_t sector, UINT count) {
+    LBA_t page;
+    UINT offset, n;
+    cache_page_t* p;
+
+    while(count > 0) {
+        page = sector / DISKIO_CACHE_PAGE;
+        offset = sector % DISKIO_CACHE_PAGE;
+        n = DISKIO_CACHE_PAGE - offset;
+        if(n > count) n = count;
+
+        p = cache_lookup(page);
+        if(p != NULL) memcpy(p->data + offset * SECTOR_SIZE, buff, n * SECTOR_SIZE);
+
+        buff += n * SECTOR_SIZE;
+        sector += n;
+        count -= n;
+    }
+}
+
+// Overlays cached pages onto data read around the cache, they may be newer than the card
+static void cache_patch(BYTE* buff, LBA_t sector, UINT count) {
+    LBA_t page;
+    UINT offset, n;
+    cache_page_t* p;
+
+    while(count > 0) {
+        page = sector / DISKIO_CACHE_PAGE;
+        offset = sector % DISKIO_CACHE_PAGE;
+        n = DISKIO_CACHE_PAGE - offset;
+        if(n > count) n = count;
+
+        p = cache_lookup(page);
+        if((p != NULL) && p->dirty) memcpy(buff, p->data + offset * SECTOR_SIZE, n * SECTOR_SIZE);
+
+        buff += n * SECTOR_SIZE;
+        sector += n;
+        count -= n;
+    }
+}
+
+static DRESULT cache_write(const BYTE* buff, LBA_t sector, UINT count) {
+    LBA_t page;
+    UINT offset, n;
+    cache_page_t* p;
+
+    while(count > 0) {
+        page = sector / DISKIO_CACHE_PAGE;
+        offset = sector % DISKIO_CACHE_PAGE;
+        n = DISKIO_CACHE_PAGE - offset;
+        if(n > count) n = count;
+
+        p = cache_lookup(page);
+        if(p != NULL) {
+            cache_use(p);
+        } else if(n == DISKIO_CACHE_PAGE) {
+            p = cache_alloc(page);
+        } else {
+            // Partial page, the rest of it has to come from the card
+            p = cache_fetch(page);
+        }
+        if(p == NULL) return RES_ERROR;
+
+        memcpy(p->data + offset * SECTOR_SIZE, buff, n * SECTOR_SIZE);
+        if(!p->dirty) {
+            p->dirty = 1;
+            cache_dirty_count++;
+        }
+
+        buff += n * SECTOR_SIZE;
+        sector += n;
+        count -= n;
+    }
+    cache_last_write = systime;
+    return RES_OK;
+}
+
+// Writes all dirty pages back in LBA order, consecutive pages go out as one multi-block write
+static DRESULT cache_flush(void) {
+    uint32_t i, j, k, n = 0;
+    cache_page_t* p;
+
+    for(i = 0; i < CACHE_PAGES; i++)
+        if(cache_pages[i].dirty) cache_flush_list[n++] = &cache_pages[i];
+
+    // Insertion sort, the list is short and mostly comes out ordered already
+    for(i = 1; i < n; i++) {
+        p = cache_flush_list[i];
+        for(j = i; (j > 0) && (cache_flush_list[j - 1]->page > p->page); j--)
+            cache_flush_list[j] = cache_flush_list[j - 1];
+        cache_flush_list[j] = p;
+    }
+
+    for(i = 0; i < n; i = j) {
+        j = i + 1;
+        while((j < n) && (j - i < DISKIO_CACHE_READAHEAD) && (cache_flush_list[j]->page == cache_flush_list[j - 1]->page + 1))
+            j++;
+
+        for(k = i; k < j; k++)
+            memcpy(cache_flush_buf + (k - i) * CACHE_PAGE_BYTES, cache_flush_list[k]->data, CACHE_PAGE_BYTES);
+        if(sdcard_queue_rw(cache_flush_buf, cache_flush_list[i]->page * DISKIO_CACHE_PAGE, (j - i) * DISKIO_CACHE_PAGE, 1) != RES_OK)
+            return RES_ERROR;
+
+        for(k = i; k < j; k++)
+            cache_flush_list[k]->dirty = 0;
+        cache_dirty_count -= j - i;
+        cache_writes++;
+        cache_written += j - i;
+    }
+    return RES_OK;
+}
+
+// Called from the SD IRQ when a background transfer ends, keeps the card streaming into the other slots
+static void cache_preload_done(sdq_request_t* req) {
+    cache_preload_t* slot = (cache_preload_t*)req->user;
+
+    slot->state = PRELOAD_DONE;
+    cache_preload_issue();
+}
+
+// Starts queued runs on free slots while the read-ahead window has room, IRQs must be masked
+static void cache_preload_issue(void) {
+    uint32_t i, n;
+    cache_run_t* run;
+    cache_preload_t* slot;
+
+    for(i = 0; i < DISKIO_CACHE_PRELOAD_SLOTS; i++) {
+        slot = &cache_preload[i];
+        if(slot->state != PRELOAD_FREE) continue;
+        if(cache_run_head == cache_run_tail) return;
+        // Running further ahead would only evict preloaded pages nobody read yet
+        if(cache_preload_ahead + DISKIO_CACHE_READAHEAD > CACHE_PAGES / 2) return;
+
+        run = &cache_runs[cache_run_head];
+        n = (run->count > DISKIO_CACHE_READAHEAD) ? DISKIO_CACHE_READAHEAD : run->count;
+        slot->page = run->page;
+        slot->count = n;
+        run->page += n;
+        run->count -= n;
+        if(run->count == 0) cache_run_head = (cache_run_head + 1) % DISKIO_CACHE_PRELOAD_RUNS;
+
+        memset(&slot->req, 0, sizeof(slot->req));
+        slot->req.buf = cache_preload_buf[i];
+        slot->req.blkno = slot->page * DISKIO_CACHE_PAGE;
+        slot->req.blkcnt = n * DISKIO_CACHE_PAGE;
+        slot->req.callback = cache_preload_done;
+        slot->req.user = slot;
+        slot->gen = cache_write_gen;
+        slot->state = PRELOAD_BUSY;
+        cache_preload_ahead += n;
+        if(!sdq_submit(&slot->req)) {
+            slot->state = PRELOAD_FREE;
+            cache_preload_ahead -= n;
+            return;
+        }
+    }
+}
+
+// Moves finished background transfers into the cache and refills the slots
+static void cache_preload_reap(void) {
+    uint32_t i, j, cpsr, skipped;
+    cache_preload_t* slot;
+    cache_page_t* p;
+
+    // Background transfers stall after a card error until someone recovers it here
+    sdq_poll();
+
+    for(i = 0; i < DISKIO_CACHE_PRELOAD_SLOTS; i++) {
+        slot = &cache_preload[i];
+        if(slot->state != PRELOAD_DONE) continue;
+
+        skipped = 0;
+        for(j = slot->count; j-- > 0;) {
+            // Pages cached meanwhile may be newer, a write since queueing makes the whole transfer suspect
+            if((slot->req.status != SDQ_DONE) || (slot->gen != cache_write_gen) || (cache_lookup(slot->page + j) != NULL)) {
+                skipped++;
+                continue;
+            }
+            p = cache_alloc(slot->page + j);
+            if(p == NULL) {
+                skipped++;
+                continue;
+            }
+            memcpy(p->data, cache_preload_buf[i] + j * CACHE_PAGE_BYTES, CACHE_PAGE_BYTES);
+            p->preloaded = 1;
+            cache_preloaded++;
+        }
+
+        cpsr = arm32_interrupt_save();
+        cache_preload_ahead -= skipped;
+        slot->state = PRELOAD_FREE;
+        arm32_interrupt_restore(cpsr);
+    }
+
+    cpsr = arm32_interrupt_save();
+    cache_preload_issue();
+    arm32_interrupt_restore(cpsr);
+}
@@ -5,6 +5,16 @@
 #include "f1c100s_de.h"
 #include "f1c100s_gpio.h"
 #include "f1c100s_pwm.h"
+#include "dmamem.h"
+
+// Startup progress bar, shown on layer 0 until Doom takes over the screen
+#define PROGRESS_W 256
+#define PROGRESS_H 8
+#define PROGRESS_X ((320 - PROGRESS_W) / 2)
+#define PROGRESS_Y (240 - PROGRESS_H * 4)
+
+static uint16_t* progress_fb = NULL;
+static bool progress_shown = false;
 
 static void display_gpio_init(void);
 
@@ -61,6 +71,39 @@ void display_set_bl(uint8_t duty) {
     //pwm_set_pulse_len(PWM1, duty);
 }
 
+void display_progress(uint32_t done, uint32_t total) {
+    uint32_t x, y, fill;
+
+    if(!progress_fb) {
+        progress_fb = dma_mem_alloc(PROGRESS_W * PROGRESS_H * sizeof(uint16_t));
+        if(!progress_fb) return;
+    }
+
+    if(!progress_shown) {
+        debe_layer_init(0);
+        debe_layer_set_size(0, PROGRESS_W, PROGRESS_H);
+        debe_layer_set_pos(0, PROGRESS_X, PROGRESS_Y);
+        debe_layer_set_addr(0, progress_fb);
+        debe_layer_set_mode(0, DEBE_MODE_16BPP_RGB_565);
+        debe_layer_enable(0);
+        progress_shown = true;
+    }
+
+    fill = total ? (uint64_t)done * PROGRESS_W / total : PROGRESS_W;
+    for(y = 0; y < PROGRESS_H; y++) {
+        for(x = 0; x < PROGRESS_W; x++) {
+            progress_fb[y * PROGRESS_W + x] = (x < fill) ? GFX_RGB565(255, 255, 255) : GFX_RGB565(64, 64, 64);
+        }
+    }
+    dma_mem_sync();
+
+    // Done, hand the screen back
+    if(done >= total) {
+        debe_layer_disable(0);
+        progress_shown = false;
+    }
+}
+
 static void display_gpio_init(void) {
     for(uint8_t i = 0; i <= 12; i++) {
         gpio_pin_init(GPIOD, i, GPIO_MODE_AF2, GPIO_PULL_NONE, GPIO_DRV_3);
@@ -5,6 +5,7 @@
 
 void display_init(void);
 void display_set_bl(uint8_t duty);
+void display_progress(uint32_t done, uint32_t total);
 
 #define GFX_RGB565(r, g, b) \
     ((((r & 0xF8) >> 3) << 11) | (((g & 0xFC) >> 2) << 5) | ((b & 0xF8) >> 3))
@@ -0,0 +1,31 @@
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+// Buffers read or written by bus masters (DEBE layers, SDC IDMAC) come from the .dma region of the
+// linker script. sys_mmu_cache_init() maps it bufferable but not cacheable, so CPU stores are merged
+// in the write buffer and reach DRAM without cache_clean_range(), and DMA results need no invalidate.
+// Reads bypass the cache, keep data the CPU works on in normal memory.
+#define DMA_MEM_ALIGN 32 // Cache line, also the IDMAC and DEBE address alignment
+
+extern uint8_t __dma_start;
+extern uint8_t __dma_end;
+
+// Returns DMA_MEM_ALIGN aligned memory, or NULL once the region is used up. There is no free,
+// buffers are allocated once at startup.
+void* dma_mem_alloc(uint32_t size);
+// Bytes left in the region
+uint32_t dma_mem_available(void);
+
+// Drains the write buffer, call it before a bus master reads what the CPU just wrote
+static inline void dma_mem_sync(void) {
+    __asm__ __volatile__("mcr p15, 0, %0, c7, c10, 4" : : "r"(0) : "memory");
+}
+
+#ifdef __cplusplus
+}
+#endif
@@ -12,6 +12,8 @@
 #include "f1c100s_intc.h"
 #include "ff.h"
 #include "input.h"
+#include "sdqueue.h"
+#include "prof.h"
 
 void timer_init(void);
 void timer_irq_handler(void);
@@ -25,6 +27,7 @@ int main(void) {
     display_set_bl(100);
 
     timer_init();
+    prof_init(); // Only with PROF_ENABLE
 
     input_init();
 
@@ -54,6 +57,7 @@ volatile uint32_t systime = 0;
 
 void timer_irq_handler(void) {
     systime++;
+    sdq_tick();
     tim_clear_irq(TIM0);
 }
 
@@ -0,0 +1,140 @@
+#include "prof.h"
+
+#ifdef PROF_ENABLE
+
+#include <stdio.h>
+#include "f1c100s_intc.h"
+
+extern volatile uint32_t systime;
+
+extern uint8_t __text_start;
+extern uint8_t __text_end;
+
+static uint32_t prof_hist[PROF_HIST_SIZE];
+static uint32_t prof_shift;
+static uint32_t prof_samples;
+static uint32_t prof_other; // Samples outside .text
+static uint32_t prof_last_dump;
+static prof_zone_t* prof_zones;
+
+static void prof_sample_irq(void);
+static void prof_reset(void);
+static uint32_t prof_clock(void);
+
+void prof_init(void) {
+    uint32_t size = &__text_end - &__text_start;
+
+    // Smallest bucket that still covers all of .text, at least one instruction
+    for(prof_shift = 2; (size >> prof_shift) >= PROF_HIST_SIZE; prof_shift++)
+        ;
+
+    // Free-running time base
+    tim_init(TIM1, TIM_MODE_CONT, TIM_SRC_HOSC, TIM_PSC_1);
+    tim_set_period(TIM1, 0xFFFFFFFF);
+    tim_start(TIM1);
+
+    // Sampling interrupt
+    tim_init(TIM2, TIM_MODE_CONT, TIM_SRC_HOSC, TIM_PSC_1);
+    tim_set_period(TIM2, PROF_TICK_HZ / PROF_SAMPLE_HZ);
+    tim_int_enable(TIM2);
+    intc_set_irq_handler(IRQ_TIMER2, prof_sample_irq);
+    intc_set_priority(IRQ_TIMER2, INTC_PRIO_LEVELS - 1);
+    intc_enable_irq(IRQ_TIMER2);
+    intc_set_stats_clock(prof_clock);
+    tim_start(TIM2);
+
+    prof_reset();
+}
+
+void prof_poll(void) {
+    if(systime - prof_last_dump >= PROF_DUMP_MS) prof_dump();
+}
+
+void prof_zone_link(prof_zone_t* zone) {
+    zone->next = prof_zones;
+    zone->linked = 1;
+    prof_zones = zone;
+}
+
+// One line per record so tools/prof-symbolize can pick them out of the rest of the log:
+//   prof: begin <ms> <samples> <other> <sample hz> <text start> <bucket shift>
+//   prof: pc <bucket address> <samples>
+//   prof: rest <samples in buckets below the PROF_DUMP_MIN threshold>
+//   prof: zone <name> <calls> <total us> <max us>
+//   prof: irq <number> <calls> <nested> <max latency us> <max us> <total us>
+//   prof: end
+void prof_dump(void) {
+    uint32_t i, min, rest = 0;
+    prof_zone_t* zone;
+    const intc_stats_t* stats;
+
+    // The UART is slow, keep the dump itself out of the next histogram
+    intc_disable_irq(IRQ_TIMER2);
+
+    printf("prof: begin %lu %lu %lu %u %08lx %lu\r\n", (unsigned long)(systime - prof_last_dump),
+           (unsigned long)prof_samples, (unsigned long)prof_other, PROF_SAMPLE_HZ,
+           (unsigned long)&__text_start, (unsigned long)prof_shift);
+
+    min = prof_samples / PROF_DUMP_MIN;
+    for(i = 0; i < PROF_HIST_SIZE; i++) {
+        if(prof_hist[i] == 0) continue;
+        if(prof_hist[i] <= min) {
+            rest += prof_hist[i];
+            continue;
+        }
+        printf("prof: pc %08lx %lu\r\n", (unsigned long)&__text_start + (i << prof_shift), (unsigned long)prof_hist[i]);
+    }
+    printf("prof: rest %lu\r\n", (unsigned long)rest);
+
+    for(zone = prof_zones; zone; zone = zone->next) {
+        printf("prof: zone %s %lu %lu %lu\r\n", zone->name, (unsigned long)zone->calls,
+               (unsigned long)(zone->ticks / (PROF_TICK_HZ / 1000000)), (unsigned long)(zone->max / (PROF_TICK_HZ / 1000000)));
+    }
+    for(i = 0; i <= IRQ_GPIOF; i++) {
+        stats = intc_get_stats(i);
+        if(stats->count == 0) continue;
+        printf("prof: irq %lu %lu %lu %lu %lu %lu\r\n", (unsigned long)i, (unsigned long)stats->count,
+               (unsigned long)stats->nested, (unsigned long)(stats->latency_max / (PROF_TICK_HZ / 1000000)),
+               (unsigned long)(stats->run_max / (PROF_TICK_HZ / 1000000)),
+               (unsigned long)(stats->run_total / (PROF_TICK_HZ / 1000000)));
+    }
+    printf("prof: end\r\n");
+
+    prof_reset();
+    intc_enable_irq(IRQ_TIMER2);
+}
+
+static void prof_reset(void) {
+    uint32_t i;
+    prof_zone_t* zone;
+
+    for(i = 0; i < PROF_HIST_SIZE; i++)
+        prof_hist[i] = 0;
+    prof_samples = 0;
+    prof_other = 0;
+
+    for(zone = prof_zones; zone; zone = zone->next) {
+        zone->calls = 0;
+        zone->ticks = 0;
+        zone->max = 0;
+    }
+    intc_reset_stats();
+    prof_last_dump = systime;
+}
+
+static uint32_t prof_clock(void) {
+    return prof_ticks();
+}
+
+static void prof_sample_irq(void) {
+    uint32_t pc = intc_get_irq_pc() - (uint32_t)&__text_start;
+
+    if(pc < (uint32_t)(&__text_end - &__text_start))
+        prof_hist[pc >> prof_shift]++;
+    else
+        prof_other++;
+    prof_samples++;
+    tim_clear_irq(TIM2);
+}
+
+#endif /* PROF_ENABLE */
@@ -0,0 +1,89 @@
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+// Profiler, built with -DPROF_ENABLE=1 in the DEFS of the build file.
+// TIM1 runs free at PROF_TICK_HZ as the time base of PROF_SCOPE zones. The ARM926 has no cycle counter,
+// one tick is 30 CPU cycles at 720 MHz. TIM2 interrupts PROF_SAMPLE_HZ times a second and counts the
+// interrupted PC in a histogram over .text. It has the highest IRQ priority, so other handlers are sampled too.
+// prof_poll() prints both and the IRQ statistics over UART1 every PROF_DUMP_MS and starts over,
+// tools/prof-symbolize turns the addresses into function names with build.map.
+#define PROF_TICK_HZ   24000000
+#define PROF_SAMPLE_HZ 4000
+#define PROF_DUMP_MS   10000
+#define PROF_HIST_SIZE 32768 // Histogram buckets, each covers a power of two bytes of .text
+#define PROF_DUMP_MIN  1000  // Buckets under 1/PROF_DUMP_MIN of the samples are only summed up
+
+#ifdef PROF_ENABLE
+
+#include "io.h"
+#include "f1c100s_timer.h"
+
+typedef struct prof_zone_s {
+    const char* name;
+    struct prof_zone_s* next;
+    uint8_t linked;
+    uint32_t calls;
+    uint32_t ticks;
+    uint32_t max;
+} prof_zone_t;
+
+typedef struct {
+    prof_zone_t* zone;
+    uint32_t start;
+} prof_scope_t;
+
+void prof_init(void);
+// Call regularly from the main loop, dumps and resets the counters every PROF_DUMP_MS
+void prof_poll(void);
+void prof_dump(void);
+void prof_zone_link(prof_zone_t* zone);
+
+// TIM1 counts down from 0xFFFFFFFF, inverted it counts up and differences wrap correctly
+static inline uint32_t prof_ticks(void) {
+    return ~read32(TIMER_BASE + TIM_1_CUR);
+}
+
+static inline prof_scope_t prof_scope_begin(prof_zone_t* zone) {
+    prof_scope_t scope;
+
+    if(!zone->linked) prof_zone_link(zone);
+    scope.zone = zone;
+    scope.start = prof_ticks();
+    return scope;
+}
+
+static inline void prof_scope_end(prof_scope_t* scope) {
+    uint32_t ticks = prof_ticks() - scope->start;
+
+    scope->zone->calls++;
+    scope->zone->ticks += ticks;
+    if(ticks > scope->zone->max) scope->zone->max = ticks;
+}
+
+#define PROF_CAT_(a, b) a##b
+#define PROF_CAT(a, b)  PROF_CAT_(a, b)
+
+// Times the rest of the enclosing block as zone name, recursion counts every level
+#define PROF_SCOPE(name)                                                  \
+    static prof_zone_t PROF_CAT(prof_zone_, __LINE__) = {name};           \
+    prof_scope_t PROF_CAT(prof_scope_, __LINE__)                          \
+        __attribute__((cleanup(prof_scope_end), unused)) =                \
+            prof_scope_begin(&PROF_CAT(prof_zone_, __LINE__))
+
+#else
+
+#define PROF_SCOPE(name)
+#define prof_init()
+#define prof_poll()
+#define prof_dump()
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
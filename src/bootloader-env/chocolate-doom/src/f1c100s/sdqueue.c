@@ -0,0 +1,175 @@
+#include <stdint.h>
+#include <stddef.h>
+#include "arm32.h"
+#include "sdqueue.h"
+
+// Queue core, the controller is only reached through sdq_backend so this also builds for host tests
+
+static void sdq_start(void);
+static void sdq_finish(sdq_status_e status);
+static void sdq_fail(void);
+
+static const sdq_backend_t* sdq_backend = NULL;
+static void* sdq_ctx = NULL;
+static sdq_request_t* sdq_head = NULL; // Request being transferred, the rest hang off next
+static sdq_request_t* sdq_tail = NULL;
+static uint8_t sdq_busy = 0;      // A chunk is on the wire
+static uint32_t sdq_holdoff = 0;  // Ticks left for a busy card to let the head request start
+static volatile uint8_t sdq_recovering = 0; // A chunk failed, nothing starts until sdq_poll recovered the card
+
+void sdq_init_backend(const sdq_backend_t* backend, void* ctx) {
+    sdq_backend = backend;
+    sdq_ctx = ctx;
+    sdq_head = NULL;
+    sdq_tail = NULL;
+    sdq_busy = 0;
+    sdq_recovering = 0;
+}
+
+uint8_t sdq_submit(sdq_request_t* req) {
+    uint32_t cpsr;
+
+    if((sdq_backend == NULL) || (req->blkcnt == 0)) return 0;
+
+    req->status = SDQ_QUEUED;
+    req->done = 0;
+    req->chunk = 0;
+    req->timeout = SDQ_TIMEOUT_MS;
+    req->retries = SDQ_RETRIES;
+    req->next = NULL;
+
+    cpsr = arm32_interrupt_save();
+    if(sdq_tail != NULL) {
+        sdq_tail->next = req;
+    } else {
+        sdq_head = req;
+        sdq_holdoff = SDQ_BUSY_TIMEOUT_MS;
+    }
+    sdq_tail = req;
+    sdq_start();
+    arm32_interrupt_restore(cpsr);
+    return 1;
+}
+
+uint8_t sdq_wait(sdq_request_t* req) {
+    uint32_t cpsr;
+
+    // Sleep with IRQs masked so the completion cannot slip in between the check and the WFI
+    cpsr = arm32_interrupt_save();
+    while(req->status <= SDQ_ACTIVE) {
+        if(sdq_recovering) {
+            arm32_interrupt_restore(cpsr);
+            sdq_poll();
+        } else {
+            arm32_wait_for_interrupt();
+            arm32_interrupt_restore(cpsr);
+        }
+        cpsr = arm32_interrupt_save();
+    }
+    arm32_interrupt_restore(cpsr);
+    return (req->status == SDQ_DONE);
+}
+
+uint8_t sdq_idle(void) {
+    return (sdq_head == NULL);
+}
+
+void sdq_poll(void) {
+    uint32_t cpsr;
+
+    if(!sdq_recovering) return;
+
+    // Takes up to the card write timeout, IRQs stay on meanwhile and sdq_start leaves the card alone
+    if(sdq_backend->recover != NULL) sdq_backend->recover(sdq_ctx);
+
+    cpsr = arm32_interrupt_save();
+    sdq_recovering = 0;
+    sdq_start();
+    arm32_interrupt_restore(cpsr);
+}
+
+void sdq_tick(void) {
+    if((sdq_backend == NULL) || (sdq_head == NULL)) return;
+
+    if(sdq_busy) {
+        // Only the time on the wire counts against the chunk
+        if(--sdq_head->timeout == 0) {
+            sdq_backend->abort(sdq_ctx);
+            sdq_busy = 0;
+            sdq_recovering = 1;
+            sdq_finish(SDQ_TIMEOUT);
+        }
+    } else if(--sdq_holdoff == 0) {
+        // Card stuck busy, or recovery was not run in time
+        sdq_recovering = 1;
+        sdq_finish(SDQ_TIMEOUT);
+    }
+    // Retry a start that was held off by a busy card
+    sdq_start();
+}
+
+// Puts the next chunk of the head request on the wire, IRQs must be masked
+static void sdq_start(void) {
+    sdq_request_t* req;
+    uint32_t bl_len, cnt;
+
+    while(!sdq_busy && !sdq_recovering && ((req = sdq_head) != NULL)) {
+        // Card is still programming the previous write, sdq_tick tries again
+        if(sdq_backend->busy(sdq_ctx)) return;
+
+        bl_len = req->write ? sdq_backend->write_bl_len : sdq_backend->read_bl_len;
+        cnt = req->blkcnt - req->done;
+        if(cnt > sdq_backend->max_blocks) cnt = sdq_backend->max_blocks;
+
+        req->chunk = cnt;
+        req->status = SDQ_ACTIVE;
+        if(sdq_backend->start(sdq_ctx, req->buf + req->done * bl_len, req->blkno + req->done, cnt, req->write)) {
+            // The chunk timeout starts now, the hold-off one again for whatever comes next
+            req->timeout = SDQ_TIMEOUT_MS;
+            sdq_holdoff = SDQ_BUSY_TIMEOUT_MS;
+            sdq_busy = 1;
+            return;
+        }
+        sdq_fail();
+    }
+}
+
+// Pops the head request and reports it
+static void sdq_finish(sdq_status_e status) {
+    sdq_request_t* req = sdq_head;
+
+    sdq_head = req->next;
+    if(sdq_head == NULL) sdq_tail = NULL;
+    sdq_holdoff = SDQ_BUSY_TIMEOUT_MS;
+
+    req->status = status;
+    if(req->callback != NULL) req->callback(req);
+}
+
+// Lets sdq_start try the failed chunk again once sdq_poll recovered the card, or gives up on the head request
+static void sdq_fail(void) {
+    sdq_recovering = 1;
+    if(sdq_head->retries > 0)
+        sdq_head->retries--;
+    else
+        sdq_finish(SDQ_ERROR);
+}
+
+void sdq_irq(void) {
+    int8_t ret;
+    sdq_request_t* req = sdq_head;
+
+    if(!sdq_busy) return;
+
+    ret = sdq_backend->poll(sdq_ctx);
+    if(ret == 0) return;
+    sdq_busy = 0;
+
+    if(ret < 0) {
+        sdq_fail();
+    } else {
+        req->done += req->chunk;
+        if(req->done >= req->blkcnt) sdq_finish(SDQ_DONE);
+    }
+    sdq_start();
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include "sdcard.h"
+
+// Ticks (sdq_tick calls) a single chunk may take on the wire before it is aborted
+#define SDQ_TIMEOUT_MS (500)
+// Ticks the head request may be held off by a card that stays busy
+#define SDQ_BUSY_TIMEOUT_MS (1000)
+// Extra attempts for a chunk that failed, the card is recovered in between by sdq_poll
+#define SDQ_RETRIES (1)
+
+typedef enum {
+    SDQ_QUEUED = 0,
+    SDQ_ACTIVE,
+    SDQ_DONE,
+    SDQ_ERROR,
+    SDQ_TIMEOUT,
+} sdq_status_e;
+
+typedef struct sdq_request sdq_request_t;
+typedef void (*sdq_callback)(sdq_request_t* req);
+
+struct sdq_request {
+    uint8_t* buf;
+    uint32_t blkno;
+    uint32_t blkcnt;
+    uint8_t write;
+    sdq_callback callback; // Called from the IRQ handler when the request ends, may be NULL
+    void* user;
+
+    volatile sdq_status_e status;
+    volatile uint32_t done; // Blocks transferred so far
+
+    // Private
+    uint32_t chunk;
+    uint32_t timeout;
+    uint32_t retries;
+    sdq_request_t* next;
+};
+
+// Controller under the queue. sdq_init() plugs in the sdcard_t engine, host tests plug in a fake.
+typedef struct {
+    uint8_t (*busy)(void* ctx); // Card still programming, nothing may start
+    uint8_t (*start)(void* ctx, uint8_t* buf, uint32_t blkno, uint32_t blkcnt, uint8_t write);
+    int8_t (*poll)(void* ctx); // 0 while running, 1 done, -1 failed
+    void (*abort)(void* ctx);
+    void (*recover)(void* ctx); // Blocking clean-up after a failed or aborted chunk, only called by sdq_poll
+    uint32_t read_bl_len;
+    uint32_t write_bl_len;
+    uint32_t max_blocks; // Per start call
+} sdq_backend_t;
+
+// Takes over the card, sdcard_read/sdcard_write must not be used while requests are pending
+void sdq_init(sdcard_t* card);
+// Runs the queue on any controller, sdq_irq() has to be called when its transfer ends
+void sdq_init_backend(const sdq_backend_t* backend, void* ctx);
+void sdq_irq(void);
+// Queues the request, it stays owned by the queue until its status leaves SDQ_QUEUED/SDQ_ACTIVE
+uint8_t sdq_submit(sdq_request_t* req);
+// Sleeps until the request ended, returns 1 on success
+uint8_t sdq_wait(sdq_request_t* req);
+uint8_t sdq_idle(void);
+// After a failure the queue stops until this ran, thread context only. sdq_wait calls it,
+// code that only submits has to call it regularly.
+void sdq_poll(void);
+// 1ms housekeeping, call from the system tick IRQ
+void sdq_tick(void);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,47 @@
+#include <stdint.h>
+#include <stddef.h>
+#include "f1c100s_intc.h"
+#include "f1c100s_sdc.h"
+#include "sdcard.h"
+#include "sdqueue.h"
+
+// sdcard_t engine under the request queue, completion comes in through the MMC IRQ
+
+static sdq_backend_t sdq_card_backend;
+
+static uint8_t sdq_card_busy(void* ctx) {
+    return sdcard_busy(ctx);
+}
+
+static uint8_t sdq_card_start(void* ctx, uint8_t* buf, uint32_t blkno, uint32_t blkcnt, uint8_t write) {
+    return sdcard_transfer_start(ctx, buf, blkno, blkcnt, write);
+}
+
+static int8_t sdq_card_poll(void* ctx) {
+    return sdcard_transfer_poll(ctx);
+}
+
+static void sdq_card_abort(void* ctx) {
+    sdcard_transfer_abort(ctx);
+}
+
+static void sdq_card_recover(void* ctx) {
+    sdcard_recover(ctx);
+}
+
+void sdq_init(sdcard_t* card) {
+    intc_irq_vector_e irq = (card->sdc_base == SDC0_BASE) ? IRQ_MMC0 : IRQ_MMC1;
+
+    sdq_card_backend.busy = sdq_card_busy;
+    sdq_card_backend.start = sdq_card_start;
+    sdq_card_backend.poll = sdq_card_poll;
+    sdq_card_backend.abort = sdq_card_abort;
+    sdq_card_backend.recover = sdq_card_recover;
+    sdq_card_backend.read_bl_len = card->read_bl_len;
+    sdq_card_backend.write_bl_len = card->write_bl_len;
+    sdq_card_backend.max_blocks = SDCARD_MAX_TRANSFER_BLOCKS;
+    sdq_init_backend(&sdq_card_backend, card);
+
+    intc_set_irq_handler(irq, sdq_irq);
+    intc_enable_irq(irq);
+}
@@ -0,0 +1,195 @@
+#include <stddef.h>
+#include <stdint.h>
+
+// memcpy/memmove/memset in C for builds without ARM32_FAST_MEMOPS, so they still replace the byte
+// loops of newlib-nano. The same plan as memops-v5.S: the destination is word aligned first, bulk
+// moves go 8 words per iteration, and a source at another offset is merged from aligned loads with
+// shifts, never loading a word that holds no source byte. Little endian only.
+
+#ifndef ARM32_FAST_MEMOPS
+
+// Word accesses into byte buffers, exempt from strict aliasing
+typedef uint32_t __attribute__((may_alias)) memops_word_t;
+
+// GCC would turn these loops back into calls of the functions they implement
+#define MEMOPS_FN __attribute__((optimize("no-tree-loop-distribute-patterns")))
+
+// Copies words * 4 bytes from a source that is not word aligned to an aligned destination
+MEMOPS_FN static void memops_copy_shift(memops_word_t *d, const uint8_t *s, size_t words)
+{
+    uint32_t off = (uintptr_t)s & 3;
+    const memops_word_t *ws = (const memops_word_t *)(s - off);
+    uint32_t rs = off * 8;
+    uint32_t ls = 32 - rs;
+    uint32_t cur = *ws++;
+    uint32_t next;
+
+    for (; words >= 4; words -= 4)
+    {
+        next = ws[0];
+        d[0] = (cur >> rs) | (next << ls);
+        cur = ws[1];
+        d[1] = (next >> rs) | (cur << ls);
+        next = ws[2];
+        d[2] = (cur >> rs) | (next << ls);
+        cur = ws[3];
+        d[3] = (next >> rs) | (cur << ls);
+        ws += 4;
+        d += 4;
+    }
+    while (words--)
+    {
+        next = *ws++;
+        *d++ = (cur >> rs) | (next << ls);
+        cur = next;
+    }
+}
+
+MEMOPS_FN void *memcpy(void *dst, const void *src, size_t n)
+{
+    uint8_t *d = dst;
+    const uint8_t *s = src;
+    memops_word_t *wd;
+    const memops_word_t *ws;
+    size_t words;
+
+    if (n >= 16)
+    {
+        while ((uintptr_t)d & 3)
+        {
+            *d++ = *s++;
+            n--;
+        }
+
+        words = n / 4;
+        wd = (memops_word_t *)d;
+        if ((uintptr_t)s & 3)
+        {
+            memops_copy_shift(wd, s, words);
+        }
+        else
+        {
+            ws = (const memops_word_t *)s;
+            for (; words >= 8; words -= 8)
+            {
+                uint32_t w0 = ws[0], w1 = ws[1], w2 = ws[2], w3 = ws[3];
+                uint32_t w4 = ws[4], w5 = ws[5], w6 = ws[6], w7 = ws[7];
+
+                wd[0] = w0;
+                wd[1] = w1;
+                wd[2] = w2;
+                wd[3] = w3;
+                wd[4] = w4;
+                wd[5] = w5;
+                wd[6] = w6;
+                wd[7] = w7;
+                ws += 8;
+                wd += 8;
+            }
+            while (words--)
+                *wd++ = *ws++;
+        }
+
+        d += n & ~(size_t)3;
+        s += n & ~(size_t)3;
+        n &= 3;
+    }
+
+    while (n--)
+        *d++ = *s++;
+    return dst;
+}
+
+MEMOPS_FN void *memmove(void *dst, const void *src, size_t n)
+{
+    uint8_t *d = dst;
+    const uint8_t *s = src;
+    memops_word_t *wd;
+    const memops_word_t *ws;
+
+    // Forward is safe unless dst lies inside src..src+n
+    if ((uintptr_t)d - (uintptr_t)s >= n)
+        return memcpy(dst, src, n);
+
+    // Copy downwards from the ends, by words when both ends share an alignment
+    d += n;
+    s += n;
+    if (!(((uintptr_t)d ^ (uintptr_t)s) & 3))
+    {
+        while (n > 0 && ((uintptr_t)d & 3))
+        {
+            *--d = *--s;
+            n--;
+        }
+
+        wd = (memops_word_t *)d;
+        ws = (const memops_word_t *)s;
+        for (; n >= 32; n -= 32)
+        {
+            uint32_t w0 = ws[-1], w1 = ws[-2], w2 = ws[-3], w3 = ws[-4];
+            uint32_t w4 = ws[-5], w5 = ws[-6], w6 = ws[-7], w7 = ws[-8];
+
+            wd[-1] = w0;
+            wd[-2] = w1;
+            wd[-3] = w2;
+            wd[-4] = w3;
+            wd[-5] = w4;
+            wd[-6] = w5;
+            wd[-7] = w6;
+            wd[-8] = w7;
+            ws -= 8;
+            wd -= 8;
+        }
+        for (; n >= 4; n -= 4)
+            *--wd = *--ws;
+        d = (uint8_t *)wd;
+        s = (const uint8_t *)ws;
+    }
+
+    while (n--)
+        *--d = *--s;
+    return dst;
+}
+
+MEMOPS_FN void *memset(void *dst, int c, size_t n)
+{
+    uint8_t *d = dst;
+    uint32_t fill = (uint8_t)c * 0x01010101u;
+    memops_word_t *wd;
+    size_t words;
+
+    if (n >= 16)
+    {
+        while ((uintptr_t)d & 3)
+        {
+            *d++ = (uint8_t)c;
+            n--;
+        }
+
+        words = n / 4;
+        wd = (memops_word_t *)d;
+        for (; words >= 8; words -= 8)
+        {
+            wd[0] = fill;
+            wd[1] = fill;
+            wd[2] = fill;
+            wd[3] = fill;
+            wd[4] = fill;
+            wd[5] = fill;
+            wd[6] = fill;
+            wd[7] = fill;
+            wd += 8;
+        }
+        while (words--)
+            *wd++ = fill;
+
+        d += n & ~(size_t)3;
+        n &= 3;
+    }
+
+    while (n--)
+        *d++ = (uint8_t)c;
+    return dst;
+}
+
+#endif /* ARM32_FAST_MEMOPS */
@@ -39,11 +39,16 @@
 #include "z_zone.h"
 
 #include "display.h"
+#include "diskcache.h"
+#include "dmamem.h"
 #include "f1c100s_de.h"
+#include "prof.h"
 
 #define DISPLAYWIDTH  320
 #define DISPLAYHEIGHT 240
 
+extern volatile uint32_t systime;
+
 static byte *stretch_tables[2] = { NULL, NULL };
 static byte *src_buffer;
 static byte *dest_buffer;
@@ -190,6 +195,8 @@ void I_GetEvent(void)
 //
 void I_StartTic (void)
 {
+    disk_cache_poll();
+    prof_poll();
 }
 
 
@@ -289,7 +296,23 @@ static void BlitArea(int x1, int y1, int x2, int y2)
 //
 void I_FinishUpdate (void)
 {
+    static boolean first_frame = true;
+    PROF_SCOPE("I_FinishUpdate");
+
     BlitArea(0, 0, SCREENWIDTH, SCREENHEIGHT);
+
+    // fb_out is write-combining, push the last stores out before DEBE scans it
+
+    dma_mem_sync();
+
+    // Time to first frame, counted from the system tick starting in main()
+
+    if (first_frame)
+    {
+        first_frame = false;
+        printf("First frame after %lu ms\n", (unsigned long) systime);
+        disk_cache_report();
+    }
 }
 
 
@@ -390,7 +413,14 @@ void I_InitGraphics(void)
 	byte *doompal = W_CacheLumpName(DEH_String("PLAYPAL"), PU_CACHE);
     I_InitStretchTables(doompal);
 
-    fb_out = (byte*)Z_Malloc(DISPLAYWIDTH * DISPLAYHEIGHT, PU_STATIC, NULL);
+    // DEBE scans fb_out straight from DRAM, keep it out of the data cache
+
+    fb_out = (byte*)dma_mem_alloc(DISPLAYWIDTH * DISPLAYHEIGHT);
+
+    if (fb_out == NULL)
+    {
+        I_Error("I_InitGraphics: No DMA memory for the framebuffer");
+    }
 
 	debe_layer_init(1);
 	debe_layer_set_size(1, DISPLAYWIDTH, DISPLAYHEIGHT);
@@ -28,6 +28,9 @@
 
 static wad_file_class_t *wad_file_classes[] = 
 {
+#ifdef HAVE_DRAM_WAD
+    &dram_wad_file,
+#endif
     &stdc_wad_file,
 };
 
@@ -42,11 +45,16 @@ wad_file_t *W_OpenFile(const char *path)
     // Use the OS's virtual memory subsystem to map WAD files
     // directly into memory.
     //
+    // There is no command line on the target, so a build with
+    // HAVE_DRAM_WAD always tries to load WAD files into DRAM first.
+    //
 
+#ifndef HAVE_DRAM_WAD
     if (!M_CheckParm("-mmap"))
     {
         return stdc_wad_file.OpenFile(path);
     }
+#endif
 
     // Try all classes in order until we find one that works
 
@@ -76,3 +84,11 @@ size_t W_Read(wad_file_t *wad, unsigned int offset,
     return wad->file_class->Read(wad, offset, buffer, buffer_len);
 }
 
+void W_Prefetch(wad_file_t *wad, unsigned int offset, size_t length)
+{
+    if (wad->file_class->Prefetch != NULL)
+    {
+        wad->file_class->Prefetch(wad, offset, length);
+    }
+}
+
@@ -37,6 +37,11 @@ typedef struct
     // provided buffer.  Returns the number of bytes read.
     size_t (*Read)(wad_file_t *file, unsigned int offset,
                    void *buffer, size_t buffer_len);
+
+    // Start reading the specified range in the background so that a
+    // later Read finds it cached.  May be NULL.
+    void (*Prefetch)(wad_file_t *file, unsigned int offset,
+                     size_t length);
 } wad_file_class_t;
 
 
@@ -46,6 +51,10 @@ extern wad_file_class_t stdc_wad_file;
 extern wad_file_class_t posix_wad_file;
 #endif
 
+#ifdef HAVE_DRAM_WAD
+extern wad_file_class_t dram_wad_file;
+#endif
+
 
 struct _wad_file_s
 {
@@ -79,4 +88,6 @@ void W_CloseFile(wad_file_t *wad);
 size_t W_Read(wad_file_t *wad, unsigned int offset,
               void *buffer, size_t buffer_len);
 
+void W_Prefetch(wad_file_t *wad, unsigned int offset, size_t length);
+
 #endif /* #ifndef __W_FILE__ */
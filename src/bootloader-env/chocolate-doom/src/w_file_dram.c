@@ -0,0 +1,154 @@
+//
+// Copyright(C) 1993-1996 Id Software, Inc.
+// Copyright(C) 2005-2014 Simon Howard
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// DESCRIPTION:
+//	WAD I/O functions, whole file loaded into DRAM.
+//
+
+#include "config.h"
+
+#ifdef HAVE_DRAM_WAD
+
+#include <stdio.h>
+#include <string.h>
+
+#include "i_timer.h"
+#include "m_misc.h"
+#include "w_file.h"
+#include "z_zone.h"
+#include "display.h"
+#include "ff.h"
+
+// Bytes per f_read() while loading, the progress bar moves after each one
+
+#define DRAM_WAD_CHUNK (256 * 1024)
+
+// Region reserved for WAD files by the linker script. Files are stacked
+// from the bottom and only the last one loaded gives its space back.
+
+extern byte __wad_start;
+extern byte __wad_end;
+
+static byte *dram_wad_top = &__wad_start;
+
+static unsigned int W_DRAM_Aligned(unsigned int length)
+{
+    return (length + 31) & ~31;
+}
+
+static wad_file_t *W_DRAM_OpenFile(const char *path)
+{
+    wad_file_t *result;
+    FIL file;
+    FRESULT res;
+    UINT count;
+    unsigned int length, pos, chunk;
+    int start;
+
+    if ((res = f_open (&file, path, FA_OPEN_EXISTING | FA_READ)) != FR_OK)
+    {
+        printf("W_DRAM_OpenFile: Failed with %d\n", res);
+        return NULL;
+    }
+
+    length = M_FileLength(&file);
+
+    // Leave files that do not fit to the next class
+
+    if (length > (unsigned int) (&__wad_end - dram_wad_top))
+    {
+        printf("W_DRAM_OpenFile: %s needs %u bytes, %u left\n",
+               path, length, (unsigned int) (&__wad_end - dram_wad_top));
+        f_close(&file);
+        return NULL;
+    }
+
+    start = I_GetTimeMS();
+
+    for (pos = 0; pos < length; pos += count)
+    {
+        chunk = length - pos;
+
+        if (chunk > DRAM_WAD_CHUNK)
+        {
+            chunk = DRAM_WAD_CHUNK;
+        }
+
+        res = f_read(&file, dram_wad_top + pos, chunk, &count);
+
+        if (res != FR_OK || count != chunk)
+        {
+            printf("W_DRAM_OpenFile: Read failed with %d at %u\n", res, pos);
+            f_close(&file);
+            return NULL;
+        }
+
+        display_progress(pos + count, length);
+    }
+
+    f_close(&file);
+
+    printf("W_DRAM_OpenFile: %s, %u bytes in %d ms\n",
+           path, length, I_GetTimeMS() - start);
+
+    result = Z_Malloc(sizeof(wad_file_t), PU_STATIC, 0);
+    result->file_class = &dram_wad_file;
+    result->mapped = dram_wad_top;
+    result->length = length;
+
+    dram_wad_top += W_DRAM_Aligned(length);
+
+    return result;
+}
+
+static void W_DRAM_CloseFile(wad_file_t *wad)
+{
+    if (wad->mapped + W_DRAM_Aligned(wad->length) == dram_wad_top)
+    {
+        dram_wad_top = wad->mapped;
+    }
+
+    Z_Free(wad);
+}
+
+// Read data from the specified position in the file into the
+// provided buffer.  Returns the number of bytes read.
+
+size_t W_DRAM_Read(wad_file_t *wad, unsigned int offset,
+                   void *buffer, size_t buffer_len)
+{
+    if (offset >= wad->length)
+    {
+        return 0;
+    }
+
+    if (buffer_len > wad->length - offset)
+    {
+        buffer_len = wad->length - offset;
+    }
+
+    memcpy(buffer, wad->mapped + offset, buffer_len);
+
+    return buffer_len;
+}
+
+wad_file_class_t dram_wad_file =
+{
+    W_DRAM_OpenFile,
+    W_DRAM_CloseFile,
+    W_DRAM_Read,
+    NULL,
+};
+
+#endif /* #ifdef HAVE_DRAM_WAD */
@@ -22,6 +22,7 @@
 #include "w_file.h"
 #include "z_zone.h"
 #include "ff.h"
+#include "diskcache.h"
 
 typedef struct
 {
@@ -29,6 +30,44 @@ typedef struct
     FIL fstream;
 } stdc_wad_file_t;
 
+// First guess at the cluster link map size in DWORDs, an unfragmented
+// file needs 4. FatFs reports the real size if it does not fit.
+#define CLMT_INITIAL_SIZE 64
+
+// Build the fast-seek cluster link map so lump seeks never walk the FAT
+// chain. Without it every backwards f_lseek() follows the chain from
+// the first cluster of the WAD.
+
+static void W_StdC_CreateLinkMap(stdc_wad_file_t *stdc_wad)
+{
+    DWORD *clmt;
+    DWORD size = CLMT_INITIAL_SIZE;
+    FRESULT res;
+
+    clmt = Z_Malloc(size * sizeof(DWORD), PU_STATIC, 0);
+    clmt[0] = size;
+    stdc_wad->fstream.cltbl = clmt;
+    res = f_lseek(&stdc_wad->fstream, CREATE_LINKMAP);
+
+    if (res == FR_NOT_ENOUGH_CORE)
+    {
+        size = clmt[0];
+        Z_Free(clmt);
+        clmt = Z_Malloc(size * sizeof(DWORD), PU_STATIC, 0);
+        clmt[0] = size;
+        stdc_wad->fstream.cltbl = clmt;
+        res = f_lseek(&stdc_wad->fstream, CREATE_LINKMAP);
+    }
+
+    if (res != FR_OK)
+    {
+        // Fall back to following the FAT chain
+        printf("W_StdC_CreateLinkMap: Failed with %d\n", res);
+        stdc_wad->fstream.cltbl = NULL;
+        Z_Free(clmt);
+    }
+}
+
 
 static wad_file_t *W_StdC_OpenFile(const char *path)
 {
@@ -50,6 +89,8 @@ static wad_file_t *W_StdC_OpenFile(const char *path)
 	result->wad.length = M_FileLength(&file);
 	result->fstream = file;
 
+	W_StdC_CreateLinkMap(result);
+
 	return &result->wad;
 }
 
@@ -60,6 +101,10 @@ static void W_StdC_CloseFile(wad_file_t *wad)
     stdc_wad = (stdc_wad_file_t *) wad;
 
     f_close(&stdc_wad->fstream);
+    if (stdc_wad->fstream.cltbl != NULL)
+    {
+        Z_Free(stdc_wad->fstream.cltbl);
+    }
     Z_Free(stdc_wad);	
 }
 
@@ -75,19 +120,83 @@ size_t W_StdC_Read(wad_file_t *wad, unsigned int offset,
     stdc_wad = (stdc_wad_file_t *) wad;
 
     // Jump to the specified position in the file.
-	FRESULT res = f_lseek (&stdc_wad->fstream, offset);
+    if (f_lseek (&stdc_wad->fstream, offset) != FR_OK)
+    {
+        return 0;
+    }
 
     // Read into the buffer.
-    res = f_read (&stdc_wad->fstream, buffer, buffer_len, &count);
+    if (f_read (&stdc_wad->fstream, buffer, buffer_len, &count) != FR_OK)
+    {
+        return 0;
+    }
 
     return count;
 }
 
+// Queue the sectors holding the specified range for a background read
+// into the disk cache.  The cluster link map tells where each fragment
+// of the file lives without touching the FAT.
+
+static void W_StdC_Prefetch(wad_file_t *wad, unsigned int offset,
+                            size_t length)
+{
+    stdc_wad_file_t *stdc_wad;
+    FATFS *fs;
+    DWORD *clmt;
+    DWORD first, last, start, end, ncl, from, to;
+
+    stdc_wad = (stdc_wad_file_t *) wad;
+    fs = stdc_wad->fstream.obj.fs;
+    clmt = stdc_wad->fstream.cltbl;
+
+    if (clmt == NULL || length == 0 || offset >= wad->length)
+    {
+        return;
+    }
+
+    if (length > wad->length - offset)
+    {
+        length = wad->length - offset;
+    }
+
+    // File relative sectors of the range, then one run per fragment
+    // that overlaps it.  Fragments are (cluster count, first cluster)
+    // pairs after the table size, ended by a zero count.
+
+    first = offset / fs->ssize;
+    last = (offset + length - 1) / fs->ssize;
+    end = 0;
+
+    for (clmt++; (ncl = *clmt++) != 0; clmt++)
+    {
+        start = end;
+        end += ncl * fs->csize;
+
+        if (end <= first)
+        {
+            continue;
+        }
+        if (start > last)
+        {
+            break;
+        }
+
+        from = first > start ? first : start;
+        to = last < end - 1 ? last : end - 1;
+
+        disk_cache_prefetch(fs->database + (*clmt - 2) * fs->csize
+                              + (from - start),
+                            to - from + 1);
+    }
+}
+
 wad_file_class_t stdc_wad_file = 
 {
     W_StdC_OpenFile,
     W_StdC_CloseFile,
     W_StdC_Read,
+    W_StdC_Prefetch,
 };
 
 
@@ -59,8 +59,19 @@ typedef PACKED_STRUCT (
 lumpinfo_t **lumpinfo;
 unsigned int numlumps = 0;
 
-// Hash table for fast lookups
-static lumpindex_t *lumphash;
+// Open addressing hash table for fast lookups. Names are stored
+// upper-cased and zero padded as two words, so a probe compares two
+// integers instead of calling strncasecmp on a lumpinfo_t somewhere in
+// the zone.
+
+typedef struct
+{
+    uint32_t name[2];
+    lumpindex_t lump;       // -1 for an empty slot
+} lumphash_t;
+
+static lumphash_t *lumphash;
+static unsigned int lumphash_mask;
 
 // Variables for the reload hack: filename of the PWAD to reload, and the
 // lumps from WADs before the reload file, so we can resent numlumps and
@@ -81,12 +92,37 @@ unsigned int W_LumpNameHash(const char *s)
 
     for (i=0; i < 8 && s[i] != '\0'; ++i)
     {
-        result = ((result << 5) ^ result ) ^ toupper(s[i]);
+        result = ((result << 5) ^ result ) ^ toupper((unsigned char) s[i]);
     }
 
     return result;
 }
 
+// Pack a lump name into the two words the hash table compares.
+
+static void W_PackLumpName(const char *s, uint32_t *key)
+{
+    byte packed[8];
+    unsigned int i;
+
+    for (i = 0; i < 8 && s[i] != '\0'; ++i)
+    {
+        packed[i] = toupper((unsigned char) s[i]);
+    }
+
+    for (; i < 8; ++i)
+    {
+        packed[i] = '\0';
+    }
+
+    memcpy(key, packed, sizeof(packed));
+}
+
+static unsigned int W_PackedNameHash(const uint32_t *key)
+{
+    return ((key[0] * 0x9e3779b1u) ^ (key[1] * 0x85ebca77u)) >> 7;
+}
+
 //
 // LUMP BASED ROUTINES.
 //
@@ -266,17 +302,26 @@ lumpindex_t W_CheckNumForName(const char *name)
 
     if (lumphash != NULL)
     {
-        int hash;
+        uint32_t key[2];
+        lumphash_t *slot;
+        unsigned int hash;
 
         // We do! Excellent.
 
-        hash = W_LumpNameHash(name) % numlumps;
+        W_PackLumpName(name, key);
 
-        for (i = lumphash[hash]; i != -1; i = lumpinfo[i]->next)
+        for (hash = W_PackedNameHash(key); ; ++hash)
         {
-            if (!strncasecmp(lumpinfo[i]->name, name, 8))
+            slot = &lumphash[hash & lumphash_mask];
+
+            if (slot->lump < 0)
             {
-                return i;
+                break;
+            }
+
+            if (slot->name[0] == key[0] && slot->name[1] == key[1])
+            {
+                return slot->lump;
             }
         }
     }
@@ -369,6 +414,20 @@ void W_ReadLump(lumpindex_t lump, void *dest)
 
 
 
+//
+// W_LumpIsMapped
+//
+// Lumps are only served from a mapped file when they start on a word
+// boundary. The ARM926 rotates unaligned word loads instead of
+// faulting, so unaligned lumps are still copied into the zone (from
+// the mapping, not the card) to keep structure access safe.
+//
+
+static boolean W_LumpIsMapped(lumpinfo_t *lump)
+{
+    return lump->wad_file->mapped != NULL && (lump->position & 3) == 0;
+}
+
 //
 // W_CacheLumpNum
 //
@@ -398,7 +457,7 @@ void *W_CacheLumpNum(lumpindex_t lumpnum, int tag)
     // region.  If the lump is in an ordinary file, we may already
     // have it cached; otherwise, load it into memory.
 
-    if (lump->wad_file->mapped != NULL)
+    if (W_LumpIsMapped(lump))
     {
         // Memory mapped file, return from the mmapped region.
 
@@ -454,7 +513,7 @@ void W_ReleaseLumpNum(lumpindex_t lumpnum)
 
     lump = lumpinfo[lumpnum];
 
-    if (lump->wad_file->mapped != NULL)
+    if (W_LumpIsMapped(lump))
     {
         // Memory-mapped file, so nothing needs to be done here.
     }
@@ -469,38 +528,87 @@ void W_ReleaseLumpName(const char *name)
     W_ReleaseLumpNum(W_GetNumForName(name));
 }
 
+//
+// W_PrefetchLumpNum
+//
+// Start reading a lump in the background, so that a later
+// W_CacheLumpNum finds its data without waiting for the card.
+// Lumps that are mapped or already cached need nothing.
+//
+
+void W_PrefetchLumpNum(lumpindex_t lumpnum)
+{
+    lumpinfo_t *lump;
+
+    if ((unsigned)lumpnum >= numlumps)
+    {
+	I_Error ("W_PrefetchLumpNum: %i >= numlumps", lumpnum);
+    }
+
+    lump = lumpinfo[lumpnum];
+
+    if (W_LumpIsMapped(lump) || lump->cache != NULL)
+    {
+        return;
+    }
+
+    W_Prefetch(lump->wad_file, lump->position, lump->size);
+}
+
 // Generate a hash table for fast lookups
 
 void W_GenerateHashTable(void)
 {
     lumpindex_t i;
+    unsigned int size;
 
     // Free the old hash table, if there is one:
     if (lumphash != NULL)
     {
         Z_Free(lumphash);
+        lumphash = NULL;
     }
 
     // Generate hash table
     if (numlumps > 0)
     {
-        lumphash = Z_Malloc(sizeof(lumpindex_t) * numlumps, PU_STATIC, NULL);
+        // At most half full, so probe sequences stay short
 
-        for (i = 0; i < numlumps; ++i)
+        for (size = 16; size < numlumps * 2; size <<= 1);
+
+        lumphash = Z_Malloc(sizeof(lumphash_t) * size, PU_STATIC, NULL);
+        lumphash_mask = size - 1;
+
+        for (i = 0; i < size; ++i)
         {
-            lumphash[i] = -1;
+            lumphash[i].lump = -1;
         }
 
         for (i = 0; i < numlumps; ++i)
         {
+            uint32_t key[2];
+            lumphash_t *slot;
             unsigned int hash;
 
-            hash = W_LumpNameHash(lumpinfo[i]->name) % numlumps;
+            W_PackLumpName(lumpinfo[i]->name, key);
+
+            // Later lumps replace earlier ones of the same name, so
+            // patch lump files take precedence
 
-            // Hook into the hash table
+            for (hash = W_PackedNameHash(key); ; ++hash)
+            {
+                slot = &lumphash[hash & lumphash_mask];
+
+                if (slot->lump < 0
+                 || (slot->name[0] == key[0] && slot->name[1] == key[1]))
+                {
+                    break;
+                }
+            }
 
-            lumpinfo[i]->next = lumphash[hash];
-            lumphash[hash] = i;
+            slot->name[0] = key[0];
+            slot->name[1] = key[1];
+            slot->lump = i;
         }
     }
 
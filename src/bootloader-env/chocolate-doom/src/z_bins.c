@@ -0,0 +1,808 @@
+//
+// Copyright(C) 1993-1996 Id Software, Inc.
+// Copyright(C) 2005-2014 Simon Howard
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// DESCRIPTION:
+//	Zone Memory Allocation with segregated free lists.
+//
+
+#include <string.h>
+
+#include "config.h"
+
+#ifdef HAVE_ZONE_BINS
+
+#include "doomtype.h"
+#include "i_system.h"
+#include "m_argv.h"
+
+#include "z_zone.h"
+
+
+//
+// ZONE MEMORY ALLOCATION
+//
+// Blocks tile the zone in address order and there will never be two
+//  contiguous free memblocks, exactly as in z_zone.c.
+// On top of that each free block is kept in the bin of its size class
+//  (one bin per power of two), and each purgable block in an LRU list.
+// Z_Malloc takes a free block from the smallest bin that can hold the
+//  request. Only when there is none it purges one run of neighbouring
+//  purgable and free blocks that is big enough, the one whose most
+//  recently tagged block was tagged longest ago among the runs grown
+//  from the few least recently tagged blocks. If none of those makes
+//  up the request it throws out the least recently tagged block and
+//  tries again, so the work is bounded by the blocks it frees.
+//
+
+#define MEM_ALIGN sizeof(void *)
+#define ZONEID	0x1d4a11
+#define NUMBINS	32
+
+// Purgable blocks tried as seeds of a run, and blocks a run may take
+#define PURGESEEDS	16
+#define PURGESTEPS	32
+
+// With ZONE_TRACE every call from the game is printed as a "Z ..." line,
+//  tests/z_replay.c plays such a log back against both allocators.
+// Blocks the allocator purges by itself are not printed.
+
+#ifdef ZONE_TRACE
+#define ZTRACE(...)	printf("Z " __VA_ARGS__)
+#else
+#define ZTRACE(...)
+#endif
+
+typedef struct memblock_s
+{
+    int			size;	// including the header and possibly tiny fragments
+    void**		user;
+    int			tag;	// PU_FREE if this is free
+    int			id;	// should be ZONEID
+    struct memblock_s*	next;	// neighbours in address order
+    struct memblock_s*	prev;
+    struct memblock_s*	list_next;	// bin if free, LRU if purgable
+    struct memblock_s*	list_prev;
+    unsigned int	stamp;	// when a purgable block was last tagged
+} memblock_t;
+
+
+typedef struct
+{
+    // total bytes malloced, including header
+    int		size;
+
+    // start / end cap for linked list
+    memblock_t	blocklist;
+
+    // free blocks of size [1 << i, 2 << i), binmask bit i set if not empty
+    memblock_t*	bins[NUMBINS];
+    unsigned int binmask;
+
+    // purgable blocks, least recently tagged at list_next
+    memblock_t	purgelist;
+    unsigned int stamp;
+
+} memzone_t;
+
+
+
+static memzone_t *mainzone;
+static boolean zero_on_free;
+static boolean scan_on_free;
+
+
+static int BinForSize(int size)
+{
+    return 31 - __builtin_clz(size);
+}
+
+static void BinInsert(memblock_t *block)
+{
+    int bin = BinForSize(block->size);
+
+    block->list_prev = NULL;
+    block->list_next = mainzone->bins[bin];
+    if (block->list_next != NULL)
+        block->list_next->list_prev = block;
+    mainzone->bins[bin] = block;
+    mainzone->binmask |= 1u << bin;
+}
+
+static void BinRemove(memblock_t *block)
+{
+    int bin = BinForSize(block->size);
+
+    if (block->list_prev != NULL)
+        block->list_prev->list_next = block->list_next;
+    else
+        mainzone->bins[bin] = block->list_next;
+
+    if (block->list_next != NULL)
+        block->list_next->list_prev = block->list_prev;
+
+    if (mainzone->bins[bin] == NULL)
+        mainzone->binmask &= ~(1u << bin);
+}
+
+static void PurgeListAdd(memblock_t *block)
+{
+    block->stamp = ++mainzone->stamp;
+    block->list_next = &mainzone->purgelist;
+    block->list_prev = mainzone->purgelist.list_prev;
+    block->list_prev->list_next = block;
+    mainzone->purgelist.list_prev = block;
+}
+
+static void PurgeListRemove(memblock_t *block)
+{
+    block->list_prev->list_next = block->list_next;
+    block->list_next->list_prev = block->list_prev;
+}
+
+
+//
+// Z_ClearZone
+//
+void Z_ClearZone (memzone_t* zone)
+{
+    memblock_t*		block;
+
+    // set the entire zone to one free block
+    zone->blocklist.next =
+	zone->blocklist.prev =
+	block = (memblock_t *)( (byte *)zone + sizeof(memzone_t) );
+
+    zone->blocklist.user = (void *)zone;
+    zone->blocklist.tag = PU_STATIC;
+
+    block->prev = block->next = &zone->blocklist;
+
+    // a free block.
+    block->tag = PU_FREE;
+    block->user = NULL;
+
+    block->size = zone->size - sizeof(memzone_t);
+
+    memset(zone->bins, 0, sizeof(zone->bins));
+    zone->binmask = 0;
+    zone->purgelist.list_next =
+	zone->purgelist.list_prev = &zone->purgelist;
+    zone->stamp = 0;
+
+    BinInsert(block);
+}
+
+
+
+//
+// Z_Init
+//
+void Z_Init (void)
+{
+    int		size;
+
+    mainzone = (memzone_t *)I_ZoneBase (&size);
+    mainzone->size = size;
+
+    Z_ClearZone(mainzone);
+
+    // [Deliberately undocumented]
+    // Zone memory debugging flag. If set, memory is zeroed after it is freed
+    // to deliberately break any code that attempts to use it after free.
+    //
+    zero_on_free = M_ParmExists("-zonezero");
+
+    // [Deliberately undocumented]
+    // Zone memory debugging flag. If set, each time memory is freed, the zone
+    // heap is scanned to look for remaining pointers to the freed block.
+    //
+    scan_on_free = M_ParmExists("-zonescan");
+}
+
+// Scan the zone heap for pointers within the specified range, and warn about
+// any remaining pointers.
+static void ScanForBlock(void *start, void *end)
+{
+    memblock_t *block;
+    void **mem;
+    int i, len, tag;
+
+    block = mainzone->blocklist.next;
+
+    while (block->next != &mainzone->blocklist)
+    {
+        tag = block->tag;
+
+        if (tag == PU_STATIC || tag == PU_LEVEL || tag == PU_LEVSPEC)
+        {
+            // Scan for pointers on the assumption that pointers are aligned
+            // on word boundaries (word size depending on pointer size):
+            mem = (void **) ((byte *) block + sizeof(memblock_t));
+            len = (block->size - sizeof(memblock_t)) / sizeof(void *);
+
+            for (i = 0; i < len; ++i)
+            {
+                if (start <= mem[i] && mem[i] <= end)
+                {
+                    fprintf(stderr,
+                            "%p has dangling pointer into freed block "
+                            "%p (%p -> %p)\n",
+                            mem, start, &mem[i], mem[i]);
+                }
+            }
+        }
+
+        block = block->next;
+    }
+}
+
+//
+// Z_FreeBlock
+//
+static void Z_FreeBlock (memblock_t* block)
+{
+    memblock_t*		other;
+    void*		ptr;
+
+    ptr = (byte *)block + sizeof(memblock_t);
+
+    if (block->tag != PU_FREE && block->user != NULL)
+    {
+    	// clear the user's mark
+	    *block->user = 0;
+    }
+
+    if (block->tag >= PU_PURGELEVEL)
+    {
+        PurgeListRemove(block);
+    }
+
+    // mark as free
+    block->tag = PU_FREE;
+    block->user = NULL;
+    block->id = 0;
+
+    // If the -zonezero flag is provided, we zero out the block on free
+    // to break code that depends on reading freed memory.
+    if (zero_on_free)
+    {
+        memset(ptr, 0, block->size - sizeof(memblock_t));
+    }
+    if (scan_on_free)
+    {
+        ScanForBlock(ptr,
+                     (byte *) ptr + block->size - sizeof(memblock_t));
+    }
+
+    other = block->prev;
+
+    if (other->tag == PU_FREE)
+    {
+        // merge with previous free block
+        BinRemove(other);
+        other->size += block->size;
+        other->next = block->next;
+        other->next->prev = other;
+
+        block = other;
+    }
+
+    other = block->next;
+    if (other->tag == PU_FREE)
+    {
+        // merge the next free block onto the end
+        BinRemove(other);
+        block->size += other->size;
+        block->next = other->next;
+        block->next->prev = block;
+    }
+
+    BinInsert(block);
+}
+
+//
+// Z_Free
+//
+void Z_Free (void* ptr)
+{
+    memblock_t*		block;
+
+    block = (memblock_t *) ( (byte *)ptr - sizeof(memblock_t));
+
+    if (block->id != ZONEID)
+	I_Error ("Z_Free: freed a pointer without ZONEID");
+
+    ZTRACE("f %lx\n", (unsigned long)ptr);
+
+    Z_FreeBlock(block);
+}
+
+
+
+//
+// Z_FindFree
+// Returns a free block of at least size bytes, or NULL.
+//
+static memblock_t *Z_FindFree (int size)
+{
+    memblock_t*		block;
+    unsigned int	mask;
+    int			bin;
+
+    // The bin of the size itself holds blocks both smaller and larger,
+    // first fit there
+
+    bin = BinForSize(size);
+
+    for (block = mainzone->bins[bin]; block != NULL; block = block->list_next)
+    {
+        if (block->size >= size)
+        {
+            return block;
+        }
+    }
+
+    // Anything in a higher bin is big enough
+
+    if (bin + 1 >= NUMBINS)
+    {
+        return NULL;
+    }
+
+    mask = mainzone->binmask & ~((2u << bin) - 1);
+
+    if (mask == 0)
+    {
+        return NULL;
+    }
+
+    return mainzone->bins[__builtin_ctz(mask)];
+}
+
+
+
+//
+// Z_PurgeRun
+// Grows a run of free and purgable blocks around seed until it holds
+//  size bytes, taking free neighbours first and then the older purgable
+//  one. Returns false if the blocks around seed can not make up size
+//  within PURGESTEPS blocks, else the run, its purgable bytes and its
+//  most recent stamp.
+//
+static boolean Z_PurgeRun (memblock_t *seed, int size,
+                           memblock_t **first, memblock_t **last,
+                           int *cost, unsigned int *newest)
+{
+    memblock_t*		start;
+    memblock_t*		end;
+    memblock_t*		next;
+    memblock_t*		prev;
+    memblock_t*		add;
+    int			total;
+    int			steps;
+
+    start = end = seed;
+    total = *cost = seed->size;
+    *newest = seed->stamp;
+
+    for (steps = 0; total < size; steps++)
+    {
+        if (steps == PURGESTEPS)
+            return false;
+
+        next = end->next;
+        prev = start->prev;
+
+        if (next->tag == PU_FREE)
+            add = end = next;
+        else if (prev->tag == PU_FREE)
+            add = start = prev;
+        else if (next->tag >= PU_PURGELEVEL
+              && (prev->tag < PU_PURGELEVEL
+               || (int)(next->stamp - prev->stamp) < 0))
+            add = end = next;
+        else if (prev->tag >= PU_PURGELEVEL)
+            add = start = prev;
+        else
+            return false;
+
+        total += add->size;
+
+        if (add->tag != PU_FREE)
+        {
+            *cost += add->size;
+
+            if ((int)(add->stamp - *newest) > 0)
+                *newest = add->stamp;
+        }
+    }
+
+    *first = start;
+    *last = end;
+
+    return true;
+}
+
+
+
+//
+// Z_Purge
+// Throws out purgable blocks until a free block of at least size bytes
+//  comes up, returns it or NULL.
+// The PURGESEEDS least recently tagged blocks are tried as seeds. The
+//  oldest blocks alone rarely make up a big enough run, so the run kept
+//  is the one whose newest block is oldest, fewest purgable bytes on a
+//  tie. No seed tagged after that block can do better, which ends the
+//  search early. Only the blocks of that run are purged.
+// When no seed makes a run, the least recently tagged block is freed,
+//  which merges it with its free neighbours, and the search starts over
+//  from the next one. Each round costs at most PURGESEEDS * PURGESTEPS
+//  steps and frees a block, like the purge loop of z_zone.c.
+//
+static memblock_t *Z_Purge (int size)
+{
+    memblock_t*		seed;
+    memblock_t*		first;
+    memblock_t*		last;
+    memblock_t*		best_first;
+    memblock_t*		best_last;
+    memblock_t*		block;
+    memblock_t*		prev;
+    byte*		end;
+    unsigned int	newest;
+    unsigned int	best_newest;
+    int			best_cost;
+    int			cost;
+    int			seeds;
+
+    while (mainzone->purgelist.list_next != &mainzone->purgelist)
+    {
+        best_first = best_last = NULL;
+        best_newest = 0;
+        best_cost = 0;
+
+        for (seed = mainzone->purgelist.list_next, seeds = 0;
+             seed != &mainzone->purgelist && seeds < PURGESEEDS;
+             seed = seed->list_next, seeds++)
+        {
+            if (best_first != NULL && (int)(seed->stamp - best_newest) > 0)
+                break;
+
+            if (!Z_PurgeRun(seed, size, &first, &last, &cost, &newest))
+                continue;
+
+            if (best_first == NULL
+             || (int)(newest - best_newest) < 0
+             || (newest == best_newest && cost < best_cost))
+            {
+                best_first = first;
+                best_last = last;
+                best_newest = newest;
+                best_cost = cost;
+            }
+        }
+
+        if (best_first == NULL)
+        {
+            // Nothing bounded fits, make room the way z_zone.c does
+            Z_FreeBlock (mainzone->purgelist.list_next);
+
+            block = Z_FindFree(size);
+            if (block != NULL)
+                return block;
+
+            continue;
+        }
+
+        // Every block of the run merges into one free block
+
+        end = (byte *)best_last + best_last->size;
+
+        for (block = best_first;
+             block != &mainzone->blocklist && (byte *)block < end;
+             block = block->next)
+        {
+            if (block->tag >= PU_PURGELEVEL)
+            {
+                prev = block->prev;
+                Z_FreeBlock (block);
+                if (prev->tag == PU_FREE)
+                    block = prev;
+            }
+        }
+
+        return Z_FindFree(size);
+    }
+
+    return NULL;
+}
+
+
+
+//
+// Z_Malloc
+// You can pass a NULL user if the tag is < PU_PURGELEVEL.
+//
+#define MINFRAGMENT		64
+
+
+void*
+Z_Malloc
+( int		size,
+  int		tag,
+  void*		user )
+{
+    int		extra;
+    memblock_t* newblock;
+    memblock_t*	base;
+    void *result;
+
+    size = (size + MEM_ALIGN - 1) & ~(MEM_ALIGN - 1);
+
+    // account for size of block header
+    size += sizeof(memblock_t);
+
+    base = Z_FindFree(size);
+
+    if (base == NULL)
+    {
+        base = Z_Purge(size);
+
+        if (base == NULL)
+        {
+            I_Error ("Z_Malloc: failed on allocation of %i bytes", size);
+        }
+    }
+
+    BinRemove(base);
+
+    // found a block big enough
+    extra = base->size - size;
+
+    if (extra >  MINFRAGMENT)
+    {
+        // there will be a free fragment after the allocated block
+        newblock = (memblock_t *) ((byte *)base + size );
+        newblock->size = extra;
+
+        newblock->tag = PU_FREE;
+        newblock->user = NULL;
+        newblock->id = 0;
+        newblock->prev = base;
+        newblock->next = base->next;
+        newblock->next->prev = newblock;
+
+        base->next = newblock;
+        base->size = size;
+
+        BinInsert(newblock);
+    }
+
+	if (user == NULL && tag >= PU_PURGELEVEL)
+	    I_Error ("Z_Malloc: an owner is required for purgable blocks");
+
+    base->user = user;
+    base->tag = tag;
+
+    if (tag >= PU_PURGELEVEL)
+    {
+        PurgeListAdd(base);
+    }
+
+    result  = (void *) ((byte *)base + sizeof(memblock_t));
+
+    if (base->user)
+    {
+        *base->user = result;
+    }
+
+    base->id = ZONEID;
+
+    ZTRACE("m %lx %i %i %lx\n", (unsigned long)result, size - (int)sizeof(memblock_t),
+           tag, (unsigned long)user);
+
+    return result;
+}
+
+
+
+//
+// Z_FreeTags
+//
+void
+Z_FreeTags
+( int		lowtag,
+  int		hightag )
+{
+    memblock_t*	block;
+    memblock_t*	prev;
+
+    ZTRACE("F %i %i\n", lowtag, hightag);
+
+    for (block = mainzone->blocklist.next ;
+	 block != &mainzone->blocklist ;
+	 block = block->next)
+    {
+	// free block?
+	if (block->tag == PU_FREE)
+	    continue;
+
+	if (block->tag >= lowtag && block->tag <= hightag)
+	{
+	    // carry on behind whatever free block this one merges into
+	    prev = block->prev;
+	    Z_FreeBlock (block);
+	    if (prev->tag == PU_FREE)
+		block = prev;
+	}
+    }
+}
+
+
+
+//
+// Z_DumpHeap
+// Note: TFileDumpHeap( stdout ) ?
+//
+void
+Z_DumpHeap
+( int		lowtag,
+  int		hightag )
+{
+    memblock_t*	block;
+
+    printf ("zone size: %i  location: %p\n",
+	    mainzone->size,mainzone);
+
+    printf ("tag range: %i to %i\n",
+	    lowtag, hightag);
+
+    for (block = mainzone->blocklist.next ; ; block = block->next)
+    {
+	if (block->tag >= lowtag && block->tag <= hightag)
+	    printf ("block:%p    size:%7i    user:%p    tag:%3i\n",
+		    block, block->size, block->user, block->tag);
+
+	if (block->next == &mainzone->blocklist)
+	{
+	    // all blocks have been hit
+	    break;
+	}
+
+	if ( (byte *)block + block->size != (byte *)block->next)
+	    printf ("ERROR: block size does not touch the next block\n");
+
+	if ( block->next->prev != block)
+	    printf ("ERROR: next block doesn't have proper back link\n");
+
+	if (block->tag == PU_FREE && block->next->tag == PU_FREE)
+	    printf ("ERROR: two consecutive free blocks\n");
+    }
+}
+
+//
+// Z_CheckHeap
+//
+void Z_CheckHeap (void)
+{
+    memblock_t*	block;
+    int		bin;
+
+    for (block = mainzone->blocklist.next ; ; block = block->next)
+    {
+	if (block->next == &mainzone->blocklist)
+	{
+	    // all blocks have been hit
+	    break;
+	}
+
+	if ( (byte *)block + block->size != (byte *)block->next)
+	    I_Error ("Z_CheckHeap: block size does not touch the next block\n");
+
+	if ( block->next->prev != block)
+	    I_Error ("Z_CheckHeap: next block doesn't have proper back link\n");
+
+	if (block->tag == PU_FREE && block->next->tag == PU_FREE)
+	    I_Error ("Z_CheckHeap: two consecutive free blocks\n");
+    }
+
+    for (bin = 0; bin < NUMBINS; ++bin)
+    {
+	for (block = mainzone->bins[bin]; block != NULL; block = block->list_next)
+	{
+	    if (block->tag != PU_FREE || BinForSize(block->size) != bin)
+		I_Error ("Z_CheckHeap: block in the wrong free list\n");
+	}
+    }
+}
+
+
+
+
+//
+// Z_ChangeTag
+//
+void Z_ChangeTag2(void *ptr, int tag, const char *file, int line)
+{
+    memblock_t*	block;
+
+    block = (memblock_t *) ((byte *)ptr - sizeof(memblock_t));
+
+    if (block->id != ZONEID)
+        I_Error("%s:%i: Z_ChangeTag: block without a ZONEID!",
+                file, line);
+
+    if (tag >= PU_PURGELEVEL && block->user == NULL)
+        I_Error("%s:%i: Z_ChangeTag: an owner is required "
+                "for purgable blocks", file, line);
+
+    ZTRACE("t %lx %i\n", (unsigned long)ptr, tag);
+
+    // Retagging a purgable block makes it the most recently used one
+
+    if (block->tag >= PU_PURGELEVEL)
+        PurgeListRemove(block);
+
+    block->tag = tag;
+
+    if (tag >= PU_PURGELEVEL)
+        PurgeListAdd(block);
+}
+
+void Z_ChangeUser(void *ptr, void **user)
+{
+    memblock_t*	block;
+
+    block = (memblock_t *) ((byte *)ptr - sizeof(memblock_t));
+
+    if (block->id != ZONEID)
+    {
+        I_Error("Z_ChangeUser: Tried to change user for invalid block!");
+    }
+
+    ZTRACE("u %lx %lx\n", (unsigned long)ptr, (unsigned long)user);
+
+    block->user = user;
+    *user = ptr;
+}
+
+
+
+//
+// Z_FreeMemory
+//
+int Z_FreeMemory (void)
+{
+    memblock_t*		block;
+    int			free;
+
+    free = 0;
+
+    for (block = mainzone->blocklist.next ;
+         block != &mainzone->blocklist;
+         block = block->next)
+    {
+        if (block->tag == PU_FREE || block->tag >= PU_PURGELEVEL)
+            free += block->size;
+    }
+
+    return free;
+}
+
+unsigned int Z_ZoneSize(void)
+{
+    return mainzone->size;
+}
+
+#endif /* #ifdef HAVE_ZONE_BINS */
@@ -18,6 +18,10 @@
 
 #include <string.h>
 
+#include "config.h"
+
+#ifndef HAVE_ZONE_BINS
+
 #include "doomtype.h"
 #include "i_system.h"
 #include "m_argv.h"
@@ -516,3 +520,4 @@ unsigned int Z_ZoneSize(void)
     return mainzone->size;
 }
 
+#endif /* #ifndef HAVE_ZONE_BINS */
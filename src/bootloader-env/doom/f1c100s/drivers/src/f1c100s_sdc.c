@@ -1,40 +1,42 @@
 #include <stdint.h>
 #include <stddef.h>
+#include <string.h>
 #include "io.h"
 #include "f1c100s_sdc.h"
 #include "f1c100s_gpio.h"
 #include "f1c100s_clock.h"
+#include "armv5_cache.h"
 
 static uint8_t sdc_transfer_command(uint32_t sdc_base, sdc_cmd_t *cmd, sdc_data_t *dat);
+static uint32_t sdc_data_done_bit(sdc_data_t *dat);
+static uint8_t sdc_wait_data_over(uint32_t sdc_base, sdc_data_t *dat);
 static uint8_t
-sdc_read_bytes(uint32_t sdc_base, uint32_t *buf, uint32_t blkcount, uint32_t blksize);
+sdc_read_bytes(uint32_t sdc_base, sdc_data_t *dat);
 static uint8_t
-sdc_write_bytes(uint32_t sdc_base, uint32_t *buf, uint32_t blkcount, uint32_t blksize);
+sdc_write_bytes(uint32_t sdc_base, sdc_data_t *dat);
+static uint32_t sdc_idma_build_chain(sdc_idma_des_t *des, uint32_t count, uint8_t *buf, uint32_t len);
+static uint8_t sdc_dma_start(uint32_t sdc_base, sdc_data_t *dat);
+static uint8_t sdc_dma_finish(uint32_t sdc_base, sdc_data_t *dat);
+static uint8_t sdc_transfer_dma(uint32_t sdc_base, sdc_cmd_t *cmd, sdc_data_t *dat);
 static uint8_t sdc_transfer_data(uint32_t sdc_base, sdc_cmd_t *cmd, sdc_data_t *dat);
 static uint8_t sdc_update_clock(uint32_t sdc_base);
 
+// IDMA descriptor chain, cache line aligned so cleaning it does not touch neighbouring data
+static sdc_idma_des_t sdc_idma_des[SDC_IDMA_DES_COUNT] __attribute__((aligned(32)));
+// Bounce buffer for callers whose buffer does not start on a cache line
+static uint8_t sdc_idma_bounce[SDC_IDMA_DES_COUNT * SDC_IDMA_DES_MAX_SIZE] __attribute__((aligned(32)));
+// Buffer the IDMAC is currently working on, either the caller's or the bounce buffer
+static uint8_t *sdc_idma_buf;
+
 static uint8_t sdc_transfer_command(uint32_t sdc_base, sdc_cmd_t *cmd, sdc_data_t *dat)
 {
     uint32_t cmdval = SDC_START;
     uint32_t status = 0;
     int timeout = 0;
 
+    // Transfers are ended by auto-stop, a manual CMD12 is only sent to abort a broken one
     if (cmd->cmdidx == MMC_STOP_TRANSMISSION)
-    {
-        timeout = 10000;
-        do
-        {
-            status = read32(sdc_base + SDC_STAR);
-            if (!timeout--)
-            {
-                write32(sdc_base + SDC_GCTL, SDC_HARDWARE_RESET);
-                write32(sdc_base + SDC_RISR, 0xFFFFFFFF);
-                return 0;
-            }
-        } while (status & SDC_CARD_DATA_BUSY);
-        return 1;
-    }
-
+        cmdval |= SDC_STOP_ABORT_CMD;
     if (cmd->cmdidx == MMC_GO_IDLE_STATE)
         cmdval |= SDC_SEND_INIT_SEQUENCE;
     if (cmd->resptype & MMC_RESP_PRESENT)
@@ -53,13 +55,11 @@ static uint8_t sdc_transfer_command(uint32_t sdc_base, sdc_cmd_t *cmd, sdc_data_
             cmdval |= SDC_WRITE;
     }
 
-    if (cmd->cmdidx == MMC_WRITE_MULTIPLE_BLOCK || cmd->cmdidx == MMC_READ_MULTIPLE_BLOCK)
+    if ((cmd->cmdidx == MMC_WRITE_MULTIPLE_BLOCK || cmd->cmdidx == MMC_READ_MULTIPLE_BLOCK) &&
+        !(dat->flag & MMC_DATA_PREDEFINED))
         cmdval |= SDC_SEND_AUTO_STOP;
 
     write32(sdc_base + SDC_CAGR, cmd->cmdarg);
-
-    if (dat != NULL)
-        write32(sdc_base + SDC_GCTL, read32(sdc_base + SDC_GCTL) | 0x80000000);
     write32(sdc_base + SDC_CMDR, cmdval | cmd->cmdidx);
 
     timeout = 100000;
@@ -109,12 +109,35 @@ static uint8_t sdc_transfer_command(uint32_t sdc_base, sdc_cmd_t *cmd, sdc_data_
     return 1;
 }
 
-static uint8_t
-sdc_read_bytes(uint32_t sdc_base, uint32_t *buf, uint32_t blkcount, uint32_t blksize)
+// Open ended multi-block transfers end with the auto-stop, everything else with the last block
+static uint32_t sdc_data_done_bit(sdc_data_t *dat)
+{
+    if (dat->blkcnt > 1 && !(dat->flag & MMC_DATA_PREDEFINED))
+        return SDC_AUTO_COMMAND_DONE;
+    return SDC_DATA_OVER;
+}
+
+static uint8_t sdc_wait_data_over(uint32_t sdc_base, sdc_data_t *dat)
 {
-    uint64_t count = blkcount * blksize;
-    uint32_t *tmp = buf;
     uint32_t status, err, done;
+    uint32_t done_bit = sdc_data_done_bit(dat);
+
+    do
+    {
+        status = read32(sdc_base + SDC_RISR);
+        err = status & SDC_INTERRUPT_ERROR_BIT;
+        done = status & done_bit;
+    } while (!done && !err);
+
+    return !err;
+}
+
+static uint8_t
+sdc_read_bytes(uint32_t sdc_base, sdc_data_t *dat)
+{
+    uint64_t count = dat->blkcnt * dat->blksz;
+    uint32_t *tmp = (uint32_t *)dat->buf;
+    uint32_t status, err;
 
     status = read32(sdc_base + SDC_STAR);
     err = read32(sdc_base + SDC_RISR) & SDC_INTERRUPT_ERROR_BIT;
@@ -130,17 +153,7 @@ sdc_read_bytes(uint32_t sdc_base, uint32_t *buf, uint32_t blkcount, uint32_t blk
         err = read32(sdc_base + SDC_RISR) & SDC_INTERRUPT_ERROR_BIT;
     }
 
-    do
-    {
-        status = read32(sdc_base + SDC_RISR);
-        err = status & SDC_INTERRUPT_ERROR_BIT;
-        if (blkcount > 1)
-            done = status & SDC_AUTO_COMMAND_DONE;
-        else
-            done = status & SDC_DATA_OVER;
-    } while (!done && !err);
-
-    if (err & SDC_INTERRUPT_ERROR_BIT)
+    if (!sdc_wait_data_over(sdc_base, dat))
         return 0;
     write32(sdc_base + SDC_RISR, 0xFFFFFFFF);
 
@@ -150,11 +163,11 @@ sdc_read_bytes(uint32_t sdc_base, uint32_t *buf, uint32_t blkcount, uint32_t blk
 }
 
 static uint8_t
-sdc_write_bytes(uint32_t sdc_base, uint32_t *buf, uint32_t blkcount, uint32_t blksize)
+sdc_write_bytes(uint32_t sdc_base, sdc_data_t *dat)
 {
-    uint64_t count = blkcount * blksize;
-    uint32_t *tmp = buf;
-    uint32_t status, err, done;
+    uint64_t count = dat->blkcnt * dat->blksz;
+    uint32_t *tmp = (uint32_t *)dat->buf;
+    uint32_t status, err;
 
     status = read32(sdc_base + SDC_STAR);
     err = read32(sdc_base + SDC_RISR) & SDC_INTERRUPT_ERROR_BIT;
@@ -170,17 +183,7 @@ sdc_write_bytes(uint32_t sdc_base, uint32_t *buf, uint32_t blkcount, uint32_t bl
         err = read32(sdc_base + SDC_RISR) & SDC_INTERRUPT_ERROR_BIT;
     }
 
-    do
-    {
-        status = read32(sdc_base + SDC_RISR);
-        err = status & SDC_INTERRUPT_ERROR_BIT;
-        if (blkcount > 1)
-            done = status & SDC_AUTO_COMMAND_DONE;
-        else
-            done = status & SDC_DATA_OVER;
-    } while (!done && !err);
-
-    if (err & SDC_INTERRUPT_ERROR_BIT)
+    if (!sdc_wait_data_over(sdc_base, dat))
         return 0;
     write32(sdc_base + SDC_GCTL, read32(sdc_base + SDC_RISR) | SDC_FIFO_RESET);
     write32(sdc_base + SDC_RISR, 0xFFFFFFFF);
@@ -190,6 +193,114 @@ sdc_write_bytes(uint32_t sdc_base, uint32_t *buf, uint32_t blkcount, uint32_t bl
     return 1;
 }
 
+static uint32_t sdc_idma_build_chain(sdc_idma_des_t *des, uint32_t count, uint8_t *buf, uint32_t len)
+{
+    uint32_t i = 0;
+
+    while (len > 0)
+    {
+        uint32_t size = (len > SDC_IDMA_DES_MAX_SIZE) ? SDC_IDMA_DES_MAX_SIZE : len;
+
+        if (i >= count)
+            return 0;
+
+        des[i].config = SDC_IDMA_DES_OWN | SDC_IDMA_DES_CHAIN | SDC_IDMA_DES_DIC;
+        des[i].buf_size = size;
+        des[i].buf_addr = (uint32_t)buf;
+        des[i].next_desc = (uint32_t)&des[i + 1];
+
+        buf += size;
+        len -= size;
+        i++;
+    }
+
+    if (i == 0)
+        return 0;
+
+    des[0].config |= SDC_IDMA_DES_FIRST;
+    des[i - 1].config |= SDC_IDMA_DES_LAST;
+    des[i - 1].config &= ~SDC_IDMA_DES_DIC;
+    des[i - 1].next_desc = 0;
+    return i;
+}
+
+static uint8_t sdc_dma_start(uint32_t sdc_base, sdc_data_t *dat)
+{
+    uint32_t dlen = dat->blkcnt * dat->blksz;
+    uint8_t *buf = dat->buf;
+    uint32_t start;
+    uint32_t count;
+
+    // Invalidating a partial cache line would also throw away whatever else lives in it
+    if (((uint32_t)buf & (32 - 1)) || (dlen & (32 - 1)))
+    {
+        buf = sdc_idma_bounce;
+        if (dat->flag & MMC_DATA_WRITE)
+            memcpy(buf, dat->buf, dlen);
+    }
+    start = (uint32_t)buf;
+    sdc_idma_buf = buf;
+
+    count = sdc_idma_build_chain(sdc_idma_des, SDC_IDMA_DES_COUNT, buf, dlen);
+    if (count == 0)
+        return 0;
+    cache_clean_range((uint32_t)sdc_idma_des, (uint32_t)&sdc_idma_des[count]);
+
+    // Write back dirty lines so the IDMAC sees them (write) and nothing gets evicted over the data (read)
+    if (dat->flag & MMC_DATA_WRITE)
+        cache_clean_range(start, start + dlen);
+    else
+        cache_flush_range(start, start + dlen);
+
+    write32(sdc_base + SDC_GCTL, (read32(sdc_base + SDC_GCTL) & ~SDC_ACCESS_BY_AHB) | SDC_DMA_ENABLE_BIT | SDC_DMA_RESET);
+    write32(sdc_base + SDC_DMAC, SDC_IDMAC_SOFT_RESET);
+    write32(sdc_base + SDC_IDST, 0xFFFFFFFF);
+    write32(sdc_base + SDC_IDIE, 0);
+    write32(sdc_base + SDC_DLBA, (uint32_t)sdc_idma_des);
+    write32(sdc_base + SDC_FWLR, SDC_FIFO_WATERMARK);
+    write32(sdc_base + SDC_DMAC, SDC_IDMAC_FIX_BURST | SDC_IDMAC_IDMA_ON);
+    return 1;
+}
+
+static uint8_t sdc_dma_finish(uint32_t sdc_base, sdc_data_t *dat)
+{
+    uint32_t dlen = dat->blkcnt * dat->blksz;
+    uint32_t start = (uint32_t)sdc_idma_buf;
+    uint8_t ret = !(read32(sdc_base + SDC_IDST) & SDC_IDMAC_ERROR_BIT);
+
+    // Stop the IDMAC and hand the FIFO back to the AHB interface
+    write32(sdc_base + SDC_IMKR, 0);
+    write32(sdc_base + SDC_IDST, 0xFFFFFFFF);
+    write32(sdc_base + SDC_DMAC, 0);
+    write32(sdc_base + SDC_GCTL, read32(sdc_base + SDC_GCTL) | SDC_DMA_RESET);
+    write32(sdc_base + SDC_GCTL, (read32(sdc_base + SDC_GCTL) & ~(SDC_DMA_ENABLE_BIT | SDC_INTERRUPT_ENABLE_BIT)) | SDC_FIFO_RESET);
+    write32(sdc_base + SDC_RISR, 0xFFFFFFFF);
+
+    if (dat->flag & MMC_DATA_READ)
+    {
+        cache_inv_range(start, start + dlen);
+        if (sdc_idma_buf != dat->buf)
+            memcpy(dat->buf, sdc_idma_buf, dlen);
+    }
+
+    return ret;
+}
+
+static uint8_t sdc_transfer_dma(uint32_t sdc_base, sdc_cmd_t *cmd, sdc_data_t *dat)
+{
+    uint8_t ret;
+
+    if (!sdc_dma_start(sdc_base, dat))
+        return 0;
+
+    ret = sdc_transfer_command(sdc_base, cmd, dat);
+    if (ret)
+        ret = sdc_wait_data_over(sdc_base, dat);
+    if (!sdc_dma_finish(sdc_base, dat))
+        ret = 0;
+    return ret;
+}
+
 static uint8_t sdc_transfer_data(uint32_t sdc_base, sdc_cmd_t *cmd, sdc_data_t *dat)
 {
     uint32_t dlen = (uint32_t)(dat->blkcnt * dat->blksz);
@@ -197,17 +308,23 @@ static uint8_t sdc_transfer_data(uint32_t sdc_base, sdc_cmd_t *cmd, sdc_data_t *
 
     write32(sdc_base + SDC_BKSR, dat->blksz);
     write32(sdc_base + SDC_BYCR, dlen);
+
+    // Anything bigger than the descriptor chain goes through the FIFO by hand
+    if (dlen <= SDC_IDMA_DES_COUNT * SDC_IDMA_DES_MAX_SIZE)
+        return sdc_transfer_dma(sdc_base, cmd, dat);
+
+    write32(sdc_base + SDC_GCTL, read32(sdc_base + SDC_GCTL) | SDC_ACCESS_BY_AHB);
     if (dat->flag & MMC_DATA_READ)
     {
         if (!sdc_transfer_command(sdc_base, cmd, dat))
             return 0;
-        ret = sdc_read_bytes(sdc_base, (uint32_t *)dat->buf, dat->blkcnt, dat->blksz);
+        ret = sdc_read_bytes(sdc_base, dat);
     }
     else if (dat->flag & MMC_DATA_WRITE)
     {
         if (!sdc_transfer_command(sdc_base, cmd, dat))
             return 0;
-        ret = sdc_write_bytes(sdc_base, (uint32_t *)dat->buf, dat->blkcnt, dat->blksz);
+        ret = sdc_write_bytes(sdc_base, dat);
     }
     return ret;
 }
@@ -272,3 +389,53 @@ uint8_t sdc_transfer(uint32_t sdc_base, sdc_cmd_t *cmd, sdc_data_t *dat)
         return sdc_transfer_command(sdc_base, cmd, dat);
     return sdc_transfer_data(sdc_base, cmd, dat);
 }
+
+uint8_t sdc_transfer_start(uint32_t sdc_base, sdc_cmd_t *cmd, sdc_data_t *dat)
+{
+    uint32_t dlen = dat->blkcnt * dat->blksz;
+
+    if (dlen > SDC_IDMA_DES_COUNT * SDC_IDMA_DES_MAX_SIZE)
+        return 0;
+
+    write32(sdc_base + SDC_BKSR, dat->blksz);
+    write32(sdc_base + SDC_BYCR, dlen);
+    if (!sdc_dma_start(sdc_base, dat))
+        return 0;
+
+    // Raise the SDC IRQ once the data is in (or out), or the transfer broke
+    write32(sdc_base + SDC_IMKR, SDC_INTERRUPT_ERROR_BIT | sdc_data_done_bit(dat));
+    write32(sdc_base + SDC_GCTL, read32(sdc_base + SDC_GCTL) | SDC_INTERRUPT_ENABLE_BIT);
+
+    if (!sdc_transfer_command(sdc_base, cmd, dat))
+    {
+        sdc_dma_finish(sdc_base, dat);
+        return 0;
+    }
+    return 1;
+}
+
+int8_t sdc_transfer_poll(uint32_t sdc_base, sdc_data_t *dat)
+{
+    uint32_t status = read32(sdc_base + SDC_RISR);
+    uint32_t done = sdc_data_done_bit(dat);
+
+    if (status & SDC_INTERRUPT_ERROR_BIT)
+    {
+        sdc_dma_finish(sdc_base, dat);
+        return -1;
+    }
+    if (!(status & done))
+        return 0;
+    return sdc_dma_finish(sdc_base, dat) ? 1 : -1;
+}
+
+void sdc_transfer_abort(uint32_t sdc_base, sdc_data_t *dat)
+{
+    sdc_dma_finish(sdc_base, dat);
+    write32(sdc_base + SDC_GCTL, SDC_HARDWARE_RESET);
+}
+
+uint8_t sdc_card_busy(uint32_t sdc_base)
+{
+    return (read32(sdc_base + SDC_STAR) & SDC_CARD_DATA_BUSY) != 0;
+}
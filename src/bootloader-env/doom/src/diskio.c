@@ -40,11 +40,11 @@ DSTATUS disk_initialize(BYTE pdrv) {
         clk_enable(CCU_BUS_CLK_GATE0, 8);
         clk_reset_clear(CCU_BUS_SOFT_RST0, 8);
 
-        gpio_init(GPIOF, PIN1 | PIN2 | PIN3, GPIO_MODE_AF2, GPIO_PULL_NONE, GPIO_DRV_3);
+        gpio_init(GPIOF, PIN0 | PIN1 | PIN2 | PIN3 | PIN4 | PIN5, GPIO_MODE_AF2, GPIO_PULL_NONE, GPIO_DRV_3);
 
         sdcard.sdc_base = SDC0_BASE;
         sdcard.voltage  = MMC_VDD_27_36;
-        sdcard.width    = MMC_BUS_WIDTH_1;
+        sdcard.width    = MMC_BUS_WIDTH_4;
         sdcard.clock    = 50000000;
 
         if(sdcard_detect(&sdcard) == 1) return 0;
@@ -33,6 +33,46 @@ typedef struct
 
 extern wad_file_class_t stdc_wad_file;
 
+#if !ORIGCODE
+// First guess at the cluster link map size in DWORDs, an unfragmented
+// file needs 4. FatFs reports the real size if it does not fit.
+#define CLMT_INITIAL_SIZE 64
+
+// Build the fast-seek cluster link map so lump seeks never walk the FAT
+// chain. Without it every backwards f_lseek() follows the chain from
+// the first cluster of the WAD.
+
+static void W_StdC_CreateLinkMap(stdc_wad_file_t *stdc_wad)
+{
+    DWORD *clmt;
+    DWORD size = CLMT_INITIAL_SIZE;
+    FRESULT res;
+
+    clmt = Z_Malloc(size * sizeof(DWORD), PU_STATIC, 0);
+    clmt[0] = size;
+    stdc_wad->fstream.cltbl = clmt;
+    res = f_lseek(&stdc_wad->fstream, CREATE_LINKMAP);
+
+    if (res == FR_NOT_ENOUGH_CORE)
+    {
+        size = clmt[0];
+        Z_Free(clmt);
+        clmt = Z_Malloc(size * sizeof(DWORD), PU_STATIC, 0);
+        clmt[0] = size;
+        stdc_wad->fstream.cltbl = clmt;
+        res = f_lseek(&stdc_wad->fstream, CREATE_LINKMAP);
+    }
+
+    if (res != FR_OK)
+    {
+        // Fall back to following the FAT chain
+        printf("W_StdC_CreateLinkMap: Failed with %d\n", res);
+        stdc_wad->fstream.cltbl = NULL;
+        Z_Free(clmt);
+    }
+}
+#endif
+
 static wad_file_t *W_StdC_OpenFile(char *path)
 {
 #if ORIGCODE
@@ -72,6 +112,8 @@ static wad_file_t *W_StdC_OpenFile(char *path)
 	result->wad.length = M_FileLength(&file);
 	result->fstream = file;
 
+	W_StdC_CreateLinkMap(result);
+
 	return &result->wad;
 #endif
 }
@@ -91,6 +133,10 @@ static void W_StdC_CloseFile(wad_file_t *wad)
     stdc_wad = (stdc_wad_file_t *) wad;
 
     f_close(&stdc_wad->fstream);
+    if (stdc_wad->fstream.cltbl != NULL)
+    {
+        Z_Free(stdc_wad->fstream.cltbl);
+    }
     Z_Free(stdc_wad);	
 #endif
 }
@@ -15,6 +15,10 @@ static void sys_mmu_cache_init(void);
 
 static inline void sdelay(int loops);
 
+// DRAM as sized by the linker script (DRAM_SIZE)
+extern uint8_t __dram_start;
+extern uint8_t __dram_end;
+
 // MMU translation table
 uint32_t mmu_l1_tbl[4096] __attribute__((section(".mmu_tbl")));
 
@@ -71,11 +75,14 @@ void putchar_(char c) {
 }
 
 static void sys_mmu_cache_init(void) {
-    // Initialize translation table
-    mmu_map_l1_entry(mmu_l1_tbl, 0x00000000, 0x00000000, SZ_2G, SECTION_NCNB);
-    mmu_map_l1_entry(mmu_l1_tbl, 0x80000000, 0x80000000, SZ_2G, SECTION_NCNB);
-    // Enable caching for first 32MB of DRAM
-    mmu_map_l1_entry(mmu_l1_tbl, 0x80000000, 0x80000000, SZ_1M * 32, SECTION_CB);
+    // Memory map, later entries override earlier ones
+    const mmu_region_t regions[] = {
+        {0x00000000, SZ_2G, SECTION_NCNB}, // SRAM and MMIO, strongly ordered
+        {0x80000000, SZ_2G, SECTION_NCNB},
+        {(uint32_t)&__dram_start, (uint32_t)(&__dram_end - &__dram_start), SECTION_CB}, // Code, zone heap, stacks
+    };
+
+    mmu_map_regions(mmu_l1_tbl, regions, sizeof(regions) / sizeof(regions[0]));
 
     arm32_ttb_set((uint32_t)(mmu_l1_tbl));
     arm32_tlb_invalidate();
@@ -11,6 +11,13 @@ typedef enum {
     SECTION_CB   = 0x3, // cached, writeback
 } mmu_entry_type_e;
 
+// One entry of a firmware memory map, mapped 1:1
+typedef struct {
+    uint32_t base;
+    uint32_t size; // Bytes, 0 skips the entry
+    mmu_entry_type_e type;
+} mmu_region_t;
+
 static inline void mmu_map_l1_entry(
     uint32_t* tbl,
     uint32_t virt,
@@ -29,6 +36,17 @@ static inline void mmu_map_l1_entry(
     }
 }
 
+// Maps a table of regions, each widened to whole 1 MiB sections. Later entries override earlier ones,
+// so list the background first and the exceptions after it.
+static inline void mmu_map_regions(uint32_t* tbl, const mmu_region_t* regions, uint32_t count) {
+    for(uint32_t i = 0; i < count; i++) {
+        if(regions[i].size == 0) continue;
+        uint32_t first = regions[i].base >> 20;
+        uint32_t last = (regions[i].base + regions[i].size - 1) >> 20;
+        mmu_map_l1_entry(tbl, first << 20, first << 20, (last - first + 1) << 20, regions[i].type);
+    }
+}
+
 #ifdef __cplusplus
 }
 #endif
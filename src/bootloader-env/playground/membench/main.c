@@ -0,0 +1,86 @@
+#include <stdint.h>
+#include "io.h"
+#include "system.h"
+#include "arm32.h"
+#include "f1c100s_uart.h"
+#include "f1c100s_timer.h"
+#include "f1c100s_intc.h"
+#include "dmamem.h"
+#include "membench.h"
+
+static void timer_init(void);
+static void timer_irq_handler(void);
+static uint32_t bench_time_ms(void);
+static void bench_puts(const char *str);
+
+// Uncached scratch region from the linker script, mapped strongly ordered by system.c
+extern uint8_t __nocache_start;
+
+volatile uint32_t systime = 0;
+
+static uint8_t cached_buf[MEMBENCH_SIZE] __attribute__((aligned(32)));
+
+int main(void)
+{
+    system_init();
+    arm32_interrupt_enable(); // Enable interrupts
+
+    timer_init(); // 1ms tick
+
+    membench_port_t port = {
+        .time_ms = bench_time_ms,
+        .puts = bench_puts,
+        .regions = {
+            {"cached, in L1", cached_buf, MEMBENCH_L1},
+            {"cached", cached_buf, MEMBENCH_SIZE},
+            {"write-combined", dma_mem_alloc(MEMBENCH_SIZE), MEMBENCH_SIZE},
+            {"strongly ordered", &__nocache_start, MEMBENCH_SIZE},
+        },
+        .count = 4,
+    };
+
+    bench_puts("membench\r\n");
+    membench_run(&port);
+    membench_libc(&port, cached_buf);
+    bench_puts("membench done\r\n");
+
+    while (1)
+    {
+    }
+
+    return 0;
+}
+
+static void timer_init(void)
+{
+    // Configure timer to generate update event every 1ms
+    tim_init(TIM0, TIM_MODE_CONT, TIM_SRC_HOSC, TIM_PSC_1);
+    tim_set_period(TIM0, 24000000UL / 1000UL);
+    tim_int_enable(TIM0);
+    // IRQ configuration
+    intc_set_irq_handler(IRQ_TIMER0, timer_irq_handler);
+    intc_enable_irq(IRQ_TIMER0);
+
+    tim_start(TIM0);
+}
+
+static void timer_irq_handler(void)
+{
+    systime++;
+    tim_clear_irq(TIM0);
+}
+
+static uint32_t bench_time_ms(void)
+{
+    return systime;
+}
+
+static void bench_puts(const char *str)
+{
+    while (*str)
+    {
+        while (!(uart_get_status(UART1) & UART_LSR_THRE))
+            ;
+        uart_tx(UART1, *str++);
+    }
+}
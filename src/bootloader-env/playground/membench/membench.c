@@ -0,0 +1,302 @@
+#include <stdint.h>
+#include <string.h>
+#include "membench.h"
+
+typedef enum
+{
+    LIBC_MEMCPY = 0,
+    LIBC_MEMMOVE,
+    LIBC_MEMSET,
+    LIBC_COUNT,
+} libc_test_e;
+
+typedef enum
+{
+    BENCH_READ = 0,
+    BENCH_WRITE,
+    BENCH_COPY,
+    BENCH_COUNT,
+} bench_test_e;
+
+// 8 words per ldm/stm, the burst the ARM926 uses for a cache line fill or eviction
+
+static void bench_read(const uint8_t *p, uint32_t bytes)
+{
+    __asm__ __volatile__("1:\n"
+                         "ldmia %0!, {r3-r10}\n"
+                         "subs %1, %1, #32\n"
+                         "bne 1b\n"
+                         : "+r"(p), "+r"(bytes)
+                         :
+                         : "r3", "r4", "r5", "r6", "r7", "r8", "r9", "r10", "cc", "memory");
+}
+
+static void bench_write(uint8_t *p, uint32_t bytes)
+{
+    __asm__ __volatile__("mov r3, #0\n"
+                         "mov r4, #0\n"
+                         "mov r5, #0\n"
+                         "mov r6, #0\n"
+                         "mov r7, #0\n"
+                         "mov r8, #0\n"
+                         "mov r9, #0\n"
+                         "mov r10, #0\n"
+                         "1:\n"
+                         "stmia %0!, {r3-r10}\n"
+                         "subs %1, %1, #32\n"
+                         "bne 1b\n"
+                         : "+r"(p), "+r"(bytes)
+                         :
+                         : "r3", "r4", "r5", "r6", "r7", "r8", "r9", "r10", "cc", "memory");
+}
+
+static void bench_copy(uint8_t *dst, const uint8_t *src, uint32_t bytes)
+{
+    __asm__ __volatile__("1:\n"
+                         "ldmia %1!, {r3-r10}\n"
+                         "stmia %0!, {r3-r10}\n"
+                         "subs %2, %2, #32\n"
+                         "bne 1b\n"
+                         : "+r"(dst), "+r"(src), "+r"(bytes)
+                         :
+                         : "r3", "r4", "r5", "r6", "r7", "r8", "r9", "r10", "cc", "memory");
+}
+
+// Returns KB/s, bytes per millisecond
+static uint32_t bench_test(const membench_port_t *port, bench_test_e test, uint8_t *buf, uint32_t size)
+{
+    uint32_t done, t0, ms;
+    uint32_t half = size / 2;
+
+    t0 = port->time_ms();
+    for (done = 0; done < MEMBENCH_BYTES;)
+    {
+        switch (test)
+        {
+        case BENCH_READ:
+            bench_read(buf, size);
+            done += size;
+            break;
+        case BENCH_WRITE:
+            bench_write(buf, size);
+            done += size;
+            break;
+        default:
+            bench_copy(buf + half, buf, half);
+            done += half;
+            break;
+        }
+    }
+    ms = port->time_ms() - t0;
+
+    return MEMBENCH_BYTES / (ms ? ms : 1);
+}
+
+static uint32_t libc_test(const membench_port_t *port, libc_test_e test, uint8_t *buf, uint32_t size)
+{
+    uint32_t done, t0, ms;
+
+    // Odd offsets so the alignment paths run too, memmove overlaps by a few bytes
+    t0 = port->time_ms();
+    for (done = 0; done < MEMBENCH_BYTES; done += size)
+    {
+        switch (test)
+        {
+        case LIBC_MEMCPY:
+            memcpy(buf + MEMBENCH_SIZE / 2, buf + 1, size);
+            break;
+        case LIBC_MEMMOVE:
+            memmove(buf + 5, buf + 1, size);
+            break;
+        default:
+            memset(buf + 1, (int)done, size);
+            break;
+        }
+    }
+    ms = port->time_ms() - t0;
+
+    return MEMBENCH_BYTES / (ms ? ms : 1);
+}
+
+static void libc_fill(uint8_t *p, uint32_t n, uint32_t seed)
+{
+    while (n--)
+    {
+        seed = seed * 1103515245 + 12345;
+        *p++ = seed >> 16;
+    }
+}
+
+// One call with guard bytes around the destination, compared against the same work done bytewise
+static uint8_t libc_check(libc_test_e test, uint8_t *buf, uint8_t *ref, uint32_t dst, uint32_t src, uint32_t n)
+{
+    uint32_t i;
+    uint32_t len = MEMBENCH_CHECK * 3 + 8;
+
+    libc_fill(buf, len, dst * 977 + src * 31 + n);
+    for (i = 0; i < len; i++)
+        ref[i] = buf[i];
+
+    switch (test)
+    {
+    case LIBC_MEMCPY:
+        memcpy(buf + dst, buf + MEMBENCH_CHECK * 2 + src, n);
+        for (i = 0; i < n; i++)
+            ref[dst + i] = ref[MEMBENCH_CHECK * 2 + src + i];
+        break;
+    case LIBC_MEMMOVE:
+        memmove(buf + dst, buf + src, n);
+        if (dst < src)
+            for (i = 0; i < n; i++)
+                ref[dst + i] = ref[src + i];
+        else
+            for (i = n; i > 0; i--)
+                ref[dst + i - 1] = ref[src + i - 1];
+        break;
+    default:
+        memset(buf + dst, 0x100 | src, n);
+        for (i = 0; i < n; i++)
+            ref[dst + i] = src;
+        break;
+    }
+
+    for (i = 0; i < len; i++)
+        if (buf[i] != ref[i])
+            return 0;
+    return 1;
+}
+
+static char *bench_fmt_str(char *out, const char *str, uint32_t width)
+{
+    uint32_t len = strlen(str);
+
+    while (width-- > len)
+        *out++ = ' ';
+    while (*str)
+        *out++ = *str++;
+    return out;
+}
+
+// KB/s as MB/s with one decimal
+static char *bench_fmt_mbps(char *out, uint32_t kbps, uint32_t width)
+{
+    char tmp[12];
+    uint32_t len = 0;
+    uint32_t val = kbps / 100;
+
+    tmp[len++] = '0' + (val % 10);
+    tmp[len++] = '.';
+    val /= 10;
+    do
+    {
+        tmp[len++] = '0' + (val % 10);
+        val /= 10;
+    } while (val);
+
+    while (width-- > len)
+        *out++ = ' ';
+    while (len)
+        *out++ = tmp[--len];
+    return out;
+}
+
+static char *bench_fmt_u32(char *out, uint32_t val, uint32_t width)
+{
+    char tmp[10];
+    uint32_t len = 0;
+
+    do
+    {
+        tmp[len++] = '0' + (val % 10);
+        val /= 10;
+    } while (val);
+
+    while (width-- > len)
+        *out++ = ' ';
+    while (len)
+        *out++ = tmp[--len];
+    return out;
+}
+
+static void bench_row(const membench_port_t *port, const char *name, uint8_t *buf, uint32_t size)
+{
+    char line[80];
+    char *out;
+    uint32_t i;
+
+    out = line;
+    for (i = 0; name[i] && (i < 16); i++)
+        *out++ = name[i];
+    while (i++ < 16)
+        *out++ = ' ';
+    for (i = 0; i < BENCH_COUNT; i++)
+        out = bench_fmt_mbps(out, bench_test(port, (bench_test_e)i, buf, size), 10);
+    out = bench_fmt_str(out, "\r\n", 2);
+    *out = 0;
+    port->puts(line);
+}
+
+void membench_run(const membench_port_t *port)
+{
+    uint32_t i;
+
+    port->puts("region                read     write      copy  (MB/s)\r\n");
+
+    for (i = 0; i < port->count; i++)
+        bench_row(port, port->regions[i].name, port->regions[i].buf, port->regions[i].size);
+}
+
+uint8_t membench_libc(const membench_port_t *port, uint8_t *buf)
+{
+    static const uint32_t sizes[] = {64, 512, 4096, 65536};
+    char line[80];
+    char *out;
+    uint8_t *ref = buf + MEMBENCH_CHECK * 4;
+    uint32_t n, dst, src, i, j;
+    libc_test_e test;
+
+    for (test = LIBC_MEMCPY; test < LIBC_COUNT; test++)
+    {
+        for (n = 0; n < MEMBENCH_CHECK; n++)
+        {
+            for (dst = 0; dst < 4; dst++)
+            {
+                for (src = 0; src < 4; src++)
+                {
+                    // memmove runs both ways over an overlap of n - 1 to n - 4 bytes
+                    if (!libc_check(test, buf, ref, (test == LIBC_MEMMOVE) ? MEMBENCH_CHECK + dst : dst,
+                                    (test == LIBC_MEMMOVE) ? MEMBENCH_CHECK + 4 + src : src, n) ||
+                        ((test == LIBC_MEMMOVE) &&
+                         !libc_check(test, buf, ref, MEMBENCH_CHECK + 4 + dst, MEMBENCH_CHECK + src, n)))
+                    {
+                        out = bench_fmt_str(line, "memops wrong, test", 18);
+                        out = bench_fmt_u32(out, test, 2);
+                        out = bench_fmt_str(out, " size", 5);
+                        out = bench_fmt_u32(out, n, 3);
+                        out = bench_fmt_str(out, " dst", 4);
+                        out = bench_fmt_u32(out, dst, 2);
+                        out = bench_fmt_str(out, " src", 4);
+                        out = bench_fmt_u32(out, src, 2);
+                        out = bench_fmt_str(out, "\r\n", 2);
+                        *out = 0;
+                        port->puts(line);
+                        return 0;
+                    }
+                }
+            }
+        }
+    }
+    port->puts("memops correct\r\n");
+
+    port->puts("size                memcpy   memmove    memset  (MB/s)\r\n");
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+    {
+        out = bench_fmt_u32(line, sizes[i], 16);
+        for (j = 0; j < LIBC_COUNT; j++)
+            out = bench_fmt_mbps(out, libc_test(port, (libc_test_e)j, buf, sizes[i]), 10);
+        out = bench_fmt_str(out, "\r\n", 2);
+        *out = 0;
+        port->puts(line);
+    }
+    return 1;
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+#define MEMBENCH_SIZE   (512 * 1024)       // Bytes per region, well past the 16 KiB D-cache
+#define MEMBENCH_L1     (8 * 1024)         // Working set that stays in the D-cache
+#define MEMBENCH_BYTES  (32 * 1024 * 1024) // Bytes moved per test and region
+#define MEMBENCH_MAX    4
+#define MEMBENCH_CHECK  96                 // memops are checked for every size below this and 4x4 alignments
+
+typedef struct
+{
+    const char *name;
+    uint8_t *buf;  // 32 byte aligned
+    uint32_t size; // Multiple of 64 bytes, the copy test moves the first half onto the second
+} membench_region_t;
+
+// Everything the benchmark needs from the platform
+typedef struct
+{
+    uint32_t (*time_ms)(void);
+    void (*puts)(const char *str);
+    membench_region_t regions[MEMBENCH_MAX];
+    uint32_t count;
+} membench_port_t;
+
+// Times ldm reads, stm writes and ldm/stm copies over each region and prints one MB/s row per region
+void membench_run(const membench_port_t *port);
+// Checks memcpy/memmove/memset against byte loops for every small size and alignment, then times them
+// for a few sizes in buf (MEMBENCH_SIZE bytes). With ARM32_FAST_MEMOPS these are memops-v5.S, else the
+// newlib-nano ones. Returns 0 if a result was wrong.
+uint8_t membench_libc(const membench_port_t *port, uint8_t *buf);
+
+#ifdef __cplusplus
+}
+#endif
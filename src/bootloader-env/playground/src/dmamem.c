@@ -0,0 +1,20 @@
+#include <stddef.h>
+#include "dmamem.h"
+
+static uint8_t *dma_mem_top = &__dma_start;
+
+void *dma_mem_alloc(uint32_t size)
+{
+    uint8_t *p = dma_mem_top;
+
+    size = (size + DMA_MEM_ALIGN - 1) & ~(DMA_MEM_ALIGN - 1);
+    if (size > dma_mem_available())
+        return NULL;
+    dma_mem_top += size;
+    return p;
+}
+
+uint32_t dma_mem_available(void)
+{
+    return (uint32_t)(&__dma_end - dma_mem_top);
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+// Buffers scanned by DEBE come from the .dma region of the linker script. sys_mmu_cache_init()
+// maps it bufferable but not cacheable, so CPU stores are merged in the write buffer and reach
+// DRAM without any cache maintenance. Reads bypass the cache.
+#define DMA_MEM_ALIGN 32
+
+extern uint8_t __dma_start;
+extern uint8_t __dma_end;
+
+// Returns DMA_MEM_ALIGN aligned memory, or NULL once the region is used up
+void *dma_mem_alloc(uint32_t size);
+uint32_t dma_mem_available(void);
+
+// Drains the write buffer, call it before handing a buffer to DEBE
+static inline void dma_mem_sync(void)
+{
+    __asm__ __volatile__("mcr p15, 0, %0, c7, c10, 4" : : "r"(0) : "memory");
+}
+
+#ifdef __cplusplus
+}
+#endif
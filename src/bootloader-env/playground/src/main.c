@@ -12,12 +12,14 @@
 #include "f1c100s_timer.h"
 #include "f1c100s_intc.h"
 #include "dma.h"
+#include "dmamem.h"
 
 #define DISPLAY_WIDTH 320
 #define DISPLAY_HEIGHT 240
 
-static uint16_t fb1[DISPLAY_WIDTH * DISPLAY_HEIGHT];
-static uint16_t fb2[DISPLAY_WIDTH * DISPLAY_HEIGHT];
+// Write-combining, DEBE scans them without any cache maintenance
+static uint16_t *fb1 = NULL;
+static uint16_t *fb2 = NULL;
 
 static uint16_t *fb;
 
@@ -143,6 +145,12 @@ static void init_display()
     debe_set_bg_color(0x00FFFFFF);
     debe_load(DEBE_UPDATE_AUTO);
 
+    if (fb1 == NULL)
+    {
+        fb1 = dma_mem_alloc(DISPLAY_WIDTH * DISPLAY_HEIGHT * sizeof(uint16_t));
+        fb2 = dma_mem_alloc(DISPLAY_WIDTH * DISPLAY_HEIGHT * sizeof(uint16_t));
+    }
+
     fb = fb1;
 
     debe_layer_init(1);
@@ -805,6 +813,7 @@ int main(void)
             tita();
 
             // Swap FBs
+            dma_mem_sync();
             if (fb == fb1) 
             {
                 fb = fb2;
@@ -8,14 +8,27 @@
 #include "f1c100s_gpio.h"
 #include "f1c100s_uart.h"
 #include "io.h"
+#include "dmamem.h"
 
 static void sys_clk_init(void);
 static void sys_uart_init(void);
+static void sys_mmu_cache_init(void);
+
+// DRAM as sized by the linker script (DRAM_SIZE)
+extern uint8_t __dram_start;
+extern uint8_t __dram_end;
+// Uncached scratch region, only membench uses it
+extern uint8_t __nocache_start;
+extern uint8_t __nocache_end;
+
+// MMU translation table
+uint32_t mmu_l1_tbl[4096] __attribute__((section(".mmu_tbl")));
 
 void system_init(void)
 {
     sys_clk_init();
     sys_uart_init();
+    sys_mmu_cache_init();
     intc_init();
 }
 
@@ -60,6 +73,27 @@ static void sys_uart_init(void)
     uart_init(UART1, 115200);                                           // Configure UART1 to 115200-8-n-1
 }
 
+static void sys_mmu_cache_init(void)
+{
+    // Memory map, later entries override earlier ones
+    const mmu_region_t regions[] = {
+        {0x00000000, SZ_2G, SECTION_NCNB}, // SRAM and MMIO, strongly ordered
+        {0x80000000, SZ_2G, SECTION_NCNB},
+        {(uint32_t)&__dram_start, (uint32_t)(&__dram_end - &__dram_start), SECTION_CB},             // Code, data, stacks
+        {(uint32_t)&__dma_start, (uint32_t)(&__dma_end - &__dma_start), SECTION_NCB},               // Framebuffers, see dmamem.h
+        {(uint32_t)&__nocache_start, (uint32_t)(&__nocache_end - &__nocache_start), SECTION_NCNB}, // Uncached scratch
+    };
+
+    mmu_map_regions(mmu_l1_tbl, regions, sizeof(regions) / sizeof(regions[0]));
+
+    arm32_ttb_set((uint32_t)(mmu_l1_tbl));
+    arm32_tlb_invalidate();
+    arm32_domain_set(0x3); // Domain access - manager
+    arm32_mmu_enable();
+    arm32_icache_enable();
+    arm32_dcache_enable();
+}
+
 void sdelay(int loops)
 {
     __asm__ __volatile__("1:\n"
@@ -164,6 +164,49 @@ typedef enum {
 #define SDC_SEND_AUTO_STOPCCSD (1 << 9)
 #define SDC_CEATA_DEV_IRQ_ENABLE (1 << 10)
 
+/*
+ * Internal DMA controller
+ */
+#define SDC_IDMAC_SOFT_RESET (1 << 0)
+#define SDC_IDMAC_FIX_BURST (1 << 1)
+#define SDC_IDMAC_IDMA_ON (1 << 7)
+#define SDC_IDMAC_REFETCH_DES (1U << 31)
+
+/*
+ * Internal DMA status / interrupt enable bits
+ */
+#define SDC_IDMAC_TRANSMIT_INTERRUPT (1 << 0)
+#define SDC_IDMAC_RECEIVE_INTERRUPT (1 << 1)
+#define SDC_IDMAC_FATAL_BUS_ERROR (1 << 2)
+#define SDC_IDMAC_DES_UNAVAILABLE (1 << 4)
+#define SDC_IDMAC_ERROR_SUM (1 << 5)
+#define SDC_IDMAC_NORMAL_INTERRUPT_SUM (1 << 8)
+#define SDC_IDMAC_ABNORMAL_INTERRUPT_SUM (1 << 9)
+#define SDC_IDMAC_ERROR_BIT \
+    (SDC_IDMAC_FATAL_BUS_ERROR | SDC_IDMAC_DES_UNAVAILABLE | SDC_IDMAC_ERROR_SUM)
+
+/*
+ * Internal DMA descriptor config bits
+ */
+#define SDC_IDMA_DES_DIC (1 << 1)          // Disable interrupt on completion
+#define SDC_IDMA_DES_LAST (1 << 2)         // Last descriptor of the transfer
+#define SDC_IDMA_DES_FIRST (1 << 3)        // First descriptor of the transfer
+#define SDC_IDMA_DES_CHAIN (1 << 4)        // next_desc points to the next descriptor
+#define SDC_IDMA_DES_END_OF_RING (1 << 5)
+#define SDC_IDMA_DES_CARD_ERROR (1 << 30)
+#define SDC_IDMA_DES_OWN (1U << 31)        // Descriptor owned by the IDMAC
+
+#define SDC_IDMA_DES_MAX_SIZE (4096) // Bytes covered by a single descriptor
+#define SDC_IDMA_DES_COUNT (32)      // Up to 128KiB per transfer
+#define SDC_FIFO_WATERMARK (0x20070008) // Burst size 8, RX level 7, TX level 8
+
+typedef struct {
+    uint32_t config;
+    uint32_t buf_size;
+    uint32_t buf_addr;
+    uint32_t next_desc;
+} sdc_idma_des_t;
+
 /*
  * MMC/SD card defines
  */
@@ -223,14 +266,15 @@ typedef enum {
     MMC_GO_IRQ_STATE = 40,
 
     /* SD Commands */
-    MMC_SD_SEND_RELATIVE_ADDR = 3,
-    MMC_SD_SWITCH_FUNC        = 6,
-    MMC_SD_SEND_IF_COND       = 8,
-    MMC_SD_APP_SET_BUS_WIDTH  = 6,
-    MMC_SD_ERASE_WR_BLK_START = 32,
-    MMC_SD_ERASE_WR_BLK_END   = 33,
-    MMC_SD_APP_SEND_OP_COND   = 41,
-    MMC_SD_APP_SEND_SCR       = 51,
+    MMC_SD_SEND_RELATIVE_ADDR         = 3,
+    MMC_SD_SWITCH_FUNC                = 6,
+    MMC_SD_SEND_IF_COND               = 8,
+    MMC_SD_APP_SET_BUS_WIDTH          = 6,
+    MMC_SD_APP_SET_WR_BLK_ERASE_COUNT = 23,
+    MMC_SD_ERASE_WR_BLK_START         = 32,
+    MMC_SD_ERASE_WR_BLK_END           = 33,
+    MMC_SD_APP_SEND_OP_COND           = 41,
+    MMC_SD_APP_SEND_SCR               = 51,
 } mmc_cmd_e;
 
 typedef enum {
@@ -275,8 +319,9 @@ typedef enum {
 } mmc_ocr_mask_e;
 
 typedef enum {
-    MMC_DATA_READ  = (1 << 0),
-    MMC_DATA_WRITE = (1 << 1),
+    MMC_DATA_READ       = (1 << 0),
+    MMC_DATA_WRITE      = (1 << 1),
+    MMC_DATA_PREDEFINED = (1 << 2), // Block count was set with CMD23, no auto-stop
 } mmc_act_e;
 
 typedef enum {
@@ -320,6 +365,16 @@ uint8_t sdc_set_clock(uint32_t sdc_base, uint32_t clock);
 
 uint8_t sdc_transfer(uint32_t sdc_base, sdc_cmd_t* cmd, sdc_data_t* dat);
 
+// Issues a data command and leaves the data phase to the IDMAC, the SDC IRQ fires when it ends
+uint8_t sdc_transfer_start(uint32_t sdc_base, sdc_cmd_t* cmd, sdc_data_t* dat);
+
+// Returns 0 while the transfer started by sdc_transfer_start is running, 1 when done, -1 on error
+int8_t sdc_transfer_poll(uint32_t sdc_base, sdc_data_t* dat);
+
+void sdc_transfer_abort(uint32_t sdc_base, sdc_data_t* dat);
+
+uint8_t sdc_card_busy(uint32_t sdc_base);
+
 #ifdef __cplusplus
 }
 #endif
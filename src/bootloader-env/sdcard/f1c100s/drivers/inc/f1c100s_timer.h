@@ -83,6 +83,8 @@ void tim_init(uint8_t ch, tim_mode_e mode, tim_source_e src, tim_prescaller_e ps
 
 void tim_set_period(uint8_t ch, uint32_t val);
 
+uint32_t tim_get_period(uint8_t ch);
+
 uint32_t tim_get_cnt(uint8_t ch);
 
 void tim_set_cnt(uint8_t ch, uint32_t val);
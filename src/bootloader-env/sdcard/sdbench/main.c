@@ -0,0 +1,84 @@
+#include <stdint.h>
+#include "io.h"
+#include "system.h"
+#include "arm32.h"
+#include "f1c100s_timer.h"
+#include "f1c100s_intc.h"
+#include "print.h"
+#include "ff.h"
+#include "sdbench.h"
+
+static void timer_init(void);
+static void timer_irq_handler(void);
+static uint32_t bench_time_us(void);
+
+volatile uint32_t systime = 0;
+
+static uint8_t bench_buf[SDBENCH_MAX_SIZE] __attribute__((aligned(32)));
+
+int main(void)
+{
+    system_init();
+    arm32_interrupt_enable(); // Enable interrupts
+
+    timer_init(); // 1ms tick, also the time base of the SD driver
+
+    FATFS fs;
+    uint8_t state = f_mount(&fs, "", 1);
+    printf("Mount %d1\n", state);
+    if (state == FR_OK)
+    {
+        sdbench_port_t port = {
+            .time_us = bench_time_us,
+            .puts = printStr,
+            .buf = bench_buf,
+        };
+
+        printStr(sdbench_run(&port) ? "sdbench done\r\n" : "sdbench failed\r\n");
+    }
+
+    while (1)
+    {
+    }
+
+    return 0;
+}
+
+static void timer_init(void)
+{
+    // Configure timer to generate update event every 1ms
+    tim_init(TIM0, TIM_MODE_CONT, TIM_SRC_HOSC, TIM_PSC_1);
+    tim_set_period(TIM0, 24000000UL / 1000UL);
+    tim_int_enable(TIM0);
+    // IRQ configuration
+    intc_set_irq_handler(IRQ_TIMER0, timer_irq_handler);
+    intc_enable_irq(IRQ_TIMER0);
+
+    tim_start(TIM0);
+}
+
+static void timer_irq_handler(void)
+{
+    systime++;
+    tim_clear_irq(TIM0);
+}
+
+// The 1 ms tick plus how far TIM0 has counted down since, the way the SD driver times its waits.
+// A tick that came in between the reads changes systime, a reload the IRQ has not counted yet is
+// still pending at the timer.
+static uint32_t bench_time_us(void)
+{
+    uint32_t ms, cnt, period = tim_get_period(TIM0);
+    uint8_t pending;
+
+    do
+    {
+        ms = systime;
+        cnt = tim_get_cnt(TIM0);
+        pending = tim_get_int_status() & (1 << TIM0);
+    } while (ms != systime);
+
+    if (pending && (cnt > period / 2))
+        ms++;
+    return ms * 1000 + (period - cnt) / (24000000UL / 1000000UL);
+}
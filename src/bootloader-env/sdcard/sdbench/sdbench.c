@@ -0,0 +1,288 @@
+#include <stdint.h>
+#include <string.h>
+#include "ff.h"
+#include "diskio.h"
+#include "sdbench.h"
+
+#define SDBENCH_SEED 0x5DBE7C11
+
+typedef enum {
+    BENCH_SEQ_READ = 0,
+    BENCH_SEQ_WRITE,
+    BENCH_RND_READ,
+    BENCH_RND_WRITE,
+    BENCH_COUNT,
+} bench_test_e;
+
+typedef uint8_t (*bench_fn)(const sdbench_port_t* port, bench_test_e test, uint32_t size, uint32_t* kbps);
+
+static uint32_t bench_rand_state;
+
+static uint32_t bench_rand(void) {
+    bench_rand_state = bench_rand_state * 1103515245 + 12345;
+    return bench_rand_state >> 8;
+}
+
+static uint32_t bench_ops(uint32_t size) {
+    uint32_t ops = SDBENCH_TEST_BYTES / size;
+    return (ops < 4) ? 4 : ops;
+}
+
+// Bytes per millisecond is KB/s
+static uint32_t bench_kbps(uint32_t bytes, uint32_t us) {
+    return (uint64_t)bytes * 1000 / (us ? us : 1);
+}
+
+static char* bench_fmt_u32(char* out, uint32_t val, uint32_t width) {
+    char tmp[10];
+    uint32_t len = 0;
+
+    do {
+        tmp[len++] = '0' + (val % 10);
+        val /= 10;
+    } while(val);
+
+    while(width-- > len)
+        *out++ = ' ';
+    while(len)
+        *out++ = tmp[--len];
+    return out;
+}
+
+static char* bench_fmt_str(char* out, const char* str, uint32_t width) {
+    uint32_t len = strlen(str);
+
+    while(width-- > len)
+        *out++ = ' ';
+    while(*str)
+        *out++ = *str++;
+    return out;
+}
+
+static char* bench_fmt_size(char* out, uint32_t size) {
+    if(size >= 1024 * 1024) {
+        out = bench_fmt_u32(out, size / (1024 * 1024), 5);
+        return bench_fmt_str(out, " MiB", 4);
+    }
+    if(size >= 1024) {
+        out = bench_fmt_u32(out, size / 1024, 5);
+        return bench_fmt_str(out, " KiB", 4);
+    }
+    out = bench_fmt_u32(out, size, 5);
+    return bench_fmt_str(out, " B", 4);
+}
+
+static uint8_t bench_raw(const sdbench_port_t* port, bench_test_e test, uint32_t size, uint32_t* kbps) {
+    WORD ss;
+    LBA_t blocks, region;
+    LBA_t sector;
+    uint32_t i, count, slots, slot, t0, us = 0;
+    uint32_t ops = bench_ops(size);
+    uint8_t write = (test == BENCH_SEQ_WRITE) || (test == BENCH_RND_WRITE);
+    uint8_t random = (test == BENCH_RND_READ) || (test == BENCH_RND_WRITE);
+
+    if(disk_ioctl(0, GET_SECTOR_SIZE, &ss) != RES_OK) return 0;
+    if(disk_ioctl(0, GET_SECTOR_COUNT, &blocks) != RES_OK) return 0;
+
+    count = size / ss;
+    region = SDBENCH_REGION / ss;
+    if((count == 0) || (blocks < region)) return 0;
+    slots = region / count;
+
+    for(i = 0; i < ops; i++) {
+        slot = random ? (bench_rand() % slots) : (i % slots);
+        sector = blocks - region + slot * count;
+
+        if(write) {
+            // Put back what is already there so the card content survives the benchmark
+            if(disk_read(0, port->buf, sector, count) != RES_OK) return 0;
+            t0 = port->time_us();
+            if(disk_write(0, port->buf, sector, count) != RES_OK) return 0;
+        } else {
+            t0 = port->time_us();
+            if(disk_read(0, port->buf, sector, count) != RES_OK) return 0;
+        }
+        // Small requests take well under 1 ms, only a sub-ms time base adds them up right
+        us += port->time_us() - t0;
+    }
+
+    *kbps = bench_kbps(ops * size, us);
+    return 1;
+}
+
+static uint8_t bench_file(const sdbench_port_t* port, bench_test_e test, uint32_t size, uint32_t* kbps) {
+    FIL fil;
+    UINT done;
+    FRESULT res = FR_OK;
+    uint32_t i, slot, t0, us;
+    uint32_t ops = bench_ops(size);
+    uint8_t write = (test == BENCH_SEQ_WRITE) || (test == BENCH_RND_WRITE);
+    uint8_t random = (test == BENCH_RND_READ) || (test == BENCH_RND_WRITE);
+
+    // Sequential write lays the file down, the other tests of the same size work on it
+    if(f_open(&fil, SDBENCH_FILE, (test == BENCH_SEQ_WRITE) ? (FA_CREATE_ALWAYS | FA_WRITE) : (FA_READ | FA_WRITE)) != FR_OK)
+        return 0;
+
+    t0 = port->time_us();
+    for(i = 0; (i < ops) && (res == FR_OK); i++) {
+        slot = random ? (bench_rand() % ops) : i;
+        if(random || (i == 0)) res = f_lseek(&fil, (FSIZE_t)slot * size);
+        if(res != FR_OK) break;
+
+        if(write)
+            res = f_write(&fil, port->buf, size, &done);
+        else
+            res = f_read(&fil, port->buf, size, &done);
+        if((res == FR_OK) && (done != size)) res = FR_DENIED;
+    }
+    if((res == FR_OK) && write) res = f_sync(&fil);
+    us = port->time_us() - t0;
+
+    if(f_close(&fil) != FR_OK) res = FR_DISK_ERR;
+    if(res != FR_OK) return 0;
+
+    *kbps = bench_kbps(ops * size, us);
+    return 1;
+}
+
+static uint8_t bench_table(const sdbench_port_t* port, const char* title, bench_fn fn) {
+    char line[80];
+    char* out;
+    uint32_t size;
+    uint8_t ok = 1;
+    bench_test_e test;
+    // Writes come first so the file tests have something to read
+    static const bench_test_e order[BENCH_COUNT] = {BENCH_SEQ_WRITE, BENCH_SEQ_READ, BENCH_RND_READ, BENCH_RND_WRITE};
+    uint32_t result[BENCH_COUNT];
+    uint8_t valid[BENCH_COUNT];
+    uint32_t i;
+
+    port->puts(title);
+    port->puts("     size    seq rd    seq wr    rnd rd    rnd wr  (KB/s)\r\n");
+
+    for(size = SDBENCH_MIN_SIZE; size <= SDBENCH_MAX_SIZE; size *= 2) {
+        bench_rand_state = SDBENCH_SEED;
+        for(i = 0; i < BENCH_COUNT; i++) {
+            test = order[i];
+            valid[test] = fn(port, test, size, &result[test]);
+            if(!valid[test]) ok = 0;
+        }
+
+        out = bench_fmt_size(line, size);
+        for(i = 0; i < BENCH_COUNT; i++) {
+            if(valid[i])
+                out = bench_fmt_u32(out, result[i], 10);
+            else
+                out = bench_fmt_str(out, "err", 10);
+        }
+        out = bench_fmt_str(out, "\r\n", 2);
+        *out = 0;
+        port->puts(line);
+    }
+    return ok;
+}
+
+// Writes SDBENCH_FILE and SDBENCH_FRAG_FILE one cluster at a time in turn, then deletes the second one,
+// leaving SDBENCH_FILE with one fragment per cluster
+static uint8_t bench_fragment(const sdbench_port_t* port, uint32_t* fragments) {
+    FIL fil, frag;
+    WORD ss;
+    UINT done;
+    FRESULT res = FR_OK;
+    uint32_t i, cluster;
+
+    if(disk_ioctl(0, GET_SECTOR_SIZE, &ss) != RES_OK) return 0;
+    if(f_open(&fil, SDBENCH_FILE, FA_CREATE_ALWAYS | FA_WRITE) != FR_OK) return 0;
+    if(f_open(&frag, SDBENCH_FRAG_FILE, FA_CREATE_ALWAYS | FA_WRITE) != FR_OK) {
+        f_close(&fil);
+        return 0;
+    }
+
+    cluster = fil.obj.fs->csize * ss;
+    *fragments = SDBENCH_SEEK_BYTES / cluster;
+    for(i = 0; (i < *fragments) && (res == FR_OK); i++) {
+        res = f_write(&fil, port->buf, cluster, &done);
+        if((res == FR_OK) && (done != cluster)) res = FR_DENIED;
+        if(res == FR_OK) res = f_write(&frag, port->buf, cluster, &done);
+        if((res == FR_OK) && (done != cluster)) res = FR_DENIED;
+    }
+
+    if(f_close(&frag) != FR_OK) res = FR_DISK_ERR;
+    if(f_close(&fil) != FR_OK) res = FR_DISK_ERR;
+    f_unlink(SDBENCH_FRAG_FILE);
+    return res == FR_OK;
+}
+
+// Random SDBENCH_MIN_SIZE reads over the fragmented file, following the FAT chain or the cluster link map
+static uint8_t bench_seek(const sdbench_port_t* port, uint8_t clmt, uint32_t* us) {
+    FIL fil;
+    UINT done;
+    FRESULT res = FR_OK;
+    DWORD* tbl = (DWORD*)(port->buf + SDBENCH_MAX_SIZE / 2);
+    uint32_t i, t0, total;
+    uint32_t slots = SDBENCH_SEEK_BYTES / SDBENCH_MIN_SIZE;
+
+    if(f_open(&fil, SDBENCH_FILE, FA_READ) != FR_OK) return 0;
+
+    // The table lives in the upper half of the buffer, reads only use the first SDBENCH_MIN_SIZE bytes
+    if(clmt) {
+        tbl[0] = SDBENCH_MAX_SIZE / 2 / sizeof(DWORD);
+        fil.cltbl = tbl;
+        res = f_lseek(&fil, CREATE_LINKMAP);
+    }
+
+    t0 = port->time_us();
+    for(i = 0; (i < SDBENCH_SEEK_OPS) && (res == FR_OK); i++) {
+        res = f_lseek(&fil, (FSIZE_t)(bench_rand() % slots) * SDBENCH_MIN_SIZE);
+        if(res == FR_OK) res = f_read(&fil, port->buf, SDBENCH_MIN_SIZE, &done);
+        if((res == FR_OK) && (done != SDBENCH_MIN_SIZE)) res = FR_DENIED;
+    }
+    total = port->time_us() - t0;
+
+    if(f_close(&fil) != FR_OK) res = FR_DISK_ERR;
+    if(res != FR_OK) return 0;
+
+    *us = total / SDBENCH_SEEK_OPS;
+    return 1;
+}
+
+static uint8_t bench_seek_table(const sdbench_port_t* port) {
+    char line[80];
+    char* out;
+    uint32_t fragments, us;
+    uint8_t clmt, ok = 1;
+
+    port->puts("f_lseek+f_read, fragmented file\r\n");
+    port->puts("  fragments     chain      clmt  (us/op)\r\n");
+
+    out = line;
+    if(bench_fragment(port, &fragments)) {
+        out = bench_fmt_u32(out, fragments, 11);
+        for(clmt = 0; clmt < 2; clmt++) {
+            bench_rand_state = SDBENCH_SEED;
+            if(bench_seek(port, clmt, &us)) {
+                out = bench_fmt_u32(out, us, 10);
+            } else {
+                out = bench_fmt_str(out, "err", 10);
+                ok = 0;
+            }
+        }
+    } else {
+        out = bench_fmt_str(out, "err", 11);
+        ok = 0;
+    }
+    out = bench_fmt_str(out, "\r\n", 2);
+    *out = 0;
+    port->puts(line);
+    return ok;
+}
+
+uint8_t sdbench_run(const sdbench_port_t* port) {
+    uint8_t ok;
+
+    ok = bench_table(port, "disk_read/disk_write\r\n", bench_raw);
+    ok &= bench_table(port, "f_read/f_write\r\n", bench_file);
+    ok &= bench_seek_table(port);
+    f_unlink(SDBENCH_FILE);
+    return ok;
+}
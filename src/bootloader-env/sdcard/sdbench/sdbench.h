@@ -0,0 +1,32 @@
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+#define SDBENCH_MIN_SIZE   (512)
+#define SDBENCH_MAX_SIZE   (1024 * 1024)
+#define SDBENCH_TEST_BYTES (4 * 1024 * 1024)  // Bytes moved per test and request size
+#define SDBENCH_REGION     (16 * 1024 * 1024) // Raw tests stay inside the last SDBENCH_REGION bytes of drive 0
+#define SDBENCH_FILE       "sdbench.tmp"
+#define SDBENCH_FRAG_FILE  "sdbench.frg"      // Interleaved with SDBENCH_FILE to fragment it, deleted afterwards
+#define SDBENCH_SEEK_BYTES (16 * 1024 * 1024) // Size of the fragmented file for the seek test
+#define SDBENCH_SEEK_OPS   (1000)             // Random seek+read pairs per seek test
+
+// Everything the benchmark needs from the platform, the storage itself is reached through FatFs (diskio.h/ff.h)
+typedef struct {
+    uint32_t (*time_us)(void); // Free running, may wrap, differences have to be exact below 1 ms
+    void (*puts)(const char* str);
+    uint8_t* buf; // At least SDBENCH_MAX_SIZE bytes, 32 byte aligned so transfers can use DMA directly
+} sdbench_port_t;
+
+// Runs the raw disk_read/disk_write tests, the f_read/f_write tests and the fast-seek test and prints the tables.
+// Raw writes put back what was read from the same blocks, the file tests create and delete SDBENCH_FILE
+// and SDBENCH_FRAG_FILE, so the volume must already be mounted. Returns 0 if any test failed.
+uint8_t sdbench_run(const sdbench_port_t* port);
+
+#ifdef __cplusplus
+}
+#endif
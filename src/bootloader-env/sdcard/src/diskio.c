@@ -1,113 +1,63 @@
 /*-----------------------------------------------------------------------*/
 /* Low level disk I/O module SKELETON for FatFs     (C)ChaN, 2019        */
 /*-----------------------------------------------------------------------*/
-/* If a working storage control module is available, it should be        */
-/* attached to the FatFs via a glue function rather than modifying it.   */
-/* This is an example of glue functions to attach various exsisting      */
-/* storage control modules to the FatFs module with a defined API.       */
-/*-----------------------------------------------------------------------*/
 
-#include "ff.h"			/* Obtains integer types */
-#include "diskio.h"		/* Declarations of disk functions */
+#include "ff.h" /* Obtains integer types */
+#include "diskio.h" /* Declarations of disk functions */
 #include "sdcard.h"
+#include "f1c100s_gpio.h"
+#include "f1c100s_clock.h"
 #include "f1c100s_sdc.h"
-#include "print.h"
 
 /* Definitions of physical drive number for each drive */
-#define DEV_SD 0
+#define DEV_MMC 0 /* Map MMC/SD card to physical drive 0 */
 
-static sdcard_info card = 
-{
-    .version = SD_VERSION_UNKNOWN,
-};
+static sdcard_t sdcard;
+static uint8_t sdcard_ready = 0;
 
 /*-----------------------------------------------------------------------*/
 /* Get Drive Status                                                      */
 /*-----------------------------------------------------------------------*/
-DSTATUS disk_status (
-	BYTE pdrv		/* Physical drive nmuber to identify the drive */
-)
-{
-    if (pdrv != DEV_SD)
-    {
-        return STA_NOINIT;
-    }
-
-    if (card.version == SD_VERSION_UNKNOWN)
-    {
-        return STA_NOINIT;
+DSTATUS disk_status(BYTE pdrv) {
+    switch(pdrv) {
+    case DEV_MMC:
+        return sdcard_ready ? 0 : STA_NOINIT;
     }
-
-	return 0;
+    return STA_NOINIT;
 }
 
 /*-----------------------------------------------------------------------*/
 /* Inidialize a Drive                                                    */
 /*-----------------------------------------------------------------------*/
-DSTATUS disk_initialize (
-	BYTE pdrv				/* Physical drive nmuber to identify the drive */
-)
-{
-	if (pdrv != DEV_SD)
-    {
-        return STA_NOINIT;
-    }
-
-    printf("Diskio init drv=%d1\n", pdrv);
-
-    SD_T* sd = (SD_T*)SDC0_BASE;
-    if (sdcard_detect(sd, &card))
-    {
-        return 0;
+DSTATUS disk_initialize(BYTE pdrv) {
+    switch(pdrv) {
+    case DEV_MMC:
+        clk_reset_set(CCU_BUS_SOFT_RST0, 8);
+        clk_enable(CCU_BUS_CLK_GATE0, 8);
+        clk_reset_clear(CCU_BUS_SOFT_RST0, 8);
+
+        gpio_init(GPIOF, PIN0 | PIN1 | PIN2 | PIN3 | PIN4 | PIN5, GPIO_MODE_AF2, GPIO_PULL_NONE, GPIO_DRV_3);
+
+        sdcard.sdc_base = SDC0_BASE;
+        sdcard.voltage  = MMC_VDD_27_36;
+        sdcard.width    = MMC_BUS_WIDTH_4;
+        sdcard.clock    = 50000000;
+
+        sdcard_ready = sdcard_detect(&sdcard);
+        if(sdcard_ready) return 0;
     }
-
-	return STA_NOINIT;
+    return STA_NOINIT;
 }
 
-
-
 /*-----------------------------------------------------------------------*/
 /* Read Sector(s)                                                        */
 /*-----------------------------------------------------------------------*/
-
-DRESULT disk_read (
-	BYTE pdrv,		/* Physical drive nmuber to identify the drive */
-	BYTE *buff,		/* Data buffer to store read data */
-	LBA_t sector,	/* Start sector in LBA */
-	UINT count		/* Number of sectors to read */
-)
-{
-	if (pdrv != DEV_SD)
-    {
-        return RES_PARERR;
+DRESULT disk_read(BYTE pdrv, BYTE* buff, LBA_t sector, UINT count) {
+    switch(pdrv) {
+    case DEV_MMC:
+        return (sdcard_read(&sdcard, buff, sector, count) == count) ? RES_OK : RES_ERROR;
     }
-
-    SD_T* sd = (SD_T*)SDC0_BASE;
-
-    printf("Diskio read drv=%d1, sector=0x%x4, count=0x%x4\n", pdrv, sector, count);
-    for (UINT currentSector = 0; currentSector < count; currentSector++)
-    {
-        uint8_t *buffer = (uint8_t*)(buff + (currentSector * card.blockLength));
-        uint64_t sectorAddress = (sector + currentSector) * card.blockLength;
-        if (!sdcard_read_sector(sd, &card, buffer, sectorAddress, card.blockLength))
-        {
-            return RES_ERROR;
-        }
-
-        /*printStr("DATA:\n");
-        for (int x = 0; x < 512; x++)
-        {
-            print8(buffer[x]);
-            printChar(' ');
-
-            if ((x + 1) % 16 == 0)
-            {
-                printChar('\n');
-            }
-        }*/
-    }
-
-	return RES_OK;
+    return RES_PARERR;
 }
 
 /*-----------------------------------------------------------------------*/
@@ -115,59 +65,36 @@ DRESULT disk_read (
 /*-----------------------------------------------------------------------*/
 #if FF_FS_READONLY == 0
 
-DRESULT disk_write (
-	BYTE pdrv,			/* Physical drive nmuber to identify the drive */
-	const BYTE *buff,	/* Data to be written */
-	LBA_t sector,		/* Start sector in LBA */
-	UINT count			/* Number of sectors to write */
-)
-{
-	if (pdrv != DEV_SD)
-    {
-        return RES_PARERR;
+DRESULT disk_write(BYTE pdrv, const BYTE* buff, LBA_t sector, UINT count) {
+    switch(pdrv) {
+    case DEV_MMC:
+        return (sdcard_write(&sdcard, (uint8_t*)buff, sector, count) == count) ? RES_OK : RES_ERROR;
     }
-
-	return 0;
+    return RES_PARERR;
 }
-
 #endif
 
-
 /*-----------------------------------------------------------------------*/
 /* Miscellaneous Functions                                               */
 /*-----------------------------------------------------------------------*/
-
-DRESULT disk_ioctl (
-	BYTE pdrv,		/* Physical drive nmuber (0..) */
-	BYTE cmd,		/* Control code */
-	void *buff		/* Buffer to send/receive control data */
-)
-{
-	if (pdrv != DEV_SD)
-    {
-        return RES_PARERR;
-    }
+DRESULT disk_ioctl(BYTE pdrv, BYTE cmd, void* buff) {
+    if(pdrv != DEV_MMC) return RES_PARERR;
 
     switch(cmd) {
-        case CTRL_SYNC:
-            return RES_OK;
-            break;
-        case GET_SECTOR_COUNT:
-            *(DWORD*)buff = card.blockCount;
-            return RES_OK;
-            break;
-        case GET_SECTOR_SIZE:
-            *(WORD*)buff = card.blockLength;
-            return RES_OK;
-            break;
-        case GET_BLOCK_SIZE: // Get erase block size
-            *(DWORD*)buff = 1;
-            return RES_OK;
-            break;
-        default:
-            break;
+    case CTRL_SYNC:
+        return RES_OK;
+    case GET_SECTOR_COUNT:
+        *(LBA_t*)buff = sdcard.blk_cnt;
+        return RES_OK;
+    case GET_SECTOR_SIZE:
+        *(WORD*)buff = sdcard.read_bl_len;
+        return RES_OK;
+    case GET_BLOCK_SIZE:
+        *(DWORD*)buff = sdcard.write_bl_len / sdcard.read_bl_len;
+        return RES_OK;
+    default:
+        break;
     }
 
-	return 0;
+    return RES_PARERR;
 }
-
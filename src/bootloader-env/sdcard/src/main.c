@@ -14,11 +14,18 @@
 #include "ff.h"
 #include <stdarg.h>
 
+static void timer_init(void);
+static void timer_irq_handler(void);
+
+volatile uint32_t systime = 0;
+
 int main(void)
 {
     system_init();
     arm32_interrupt_enable(); // Enable interrupts
 
+    timer_init(); // 1ms tick, also the time base of the SD driver
+
     FATFS fs;
     uint8_t state = f_mount(&fs, "", 1);
     printf("Mount %d1\n", state);
@@ -33,3 +40,22 @@ int main(void)
 
     return 0;
 }
+
+static void timer_init(void)
+{
+    // Configure timer to generate update event every 1ms
+    tim_init(TIM0, TIM_MODE_CONT, TIM_SRC_HOSC, TIM_PSC_1);
+    tim_set_period(TIM0, 24000000UL / 1000UL);
+    tim_int_enable(TIM0);
+    // IRQ configuration
+    intc_set_irq_handler(IRQ_TIMER0, timer_irq_handler);
+    intc_enable_irq(IRQ_TIMER0);
+
+    tim_start(TIM0);
+}
+
+static void timer_irq_handler(void)
+{
+    systime++;
+    tim_clear_irq(TIM0);
+}
@@ -1,768 +1,653 @@
-#include "sdcard.h"
-#include "f1c100s_clock.h"
-#include "f1c100s_gpio.h"
-#include "print.h"
-#include "system.h"
 #include <stdint.h>
-#include <stdbool.h>
-
-#define SD_TRY(strAction, sdFuncCall) { \
-    printStr(strAction);                \
-    if (!(sdFuncCall))                  \
-    {                                   \
-        printStr("fail\n");             \
-        return 0;                       \
-    }                                   \
-    printStr("OK\n");                   \
-}
-
-// Resets the SD controller (FIFO, DMA) and enables the debounce on card detect
-static void sd_reset_full(SD_T* sd)
-{
-    sd->SD_GCTL_REG = SD_GCTL_REG_SOFT_RST | SD_GCTL_REG_FIFO_RST | SD_GCTL_REG_DMA_RST | SD_GCTL_REG_CD_DBC_ENB;
-    while ((sd->SD_GCTL_REG & SD_GCTL_REG_SOFT_RST) || (sd->SD_GCTL_REG & SD_GCTL_REG_FIFO_RST))
-    {
-        // Wait until soft reset and fifo reset clears
-    }
-}
-
-// Sets the SD controller clock, but does not update the SD card.
-static int sd_set_controller_clock(SD_T* sd, uint32_t hz)
-{
-    uint32_t sdBase = (uint32_t)sd;
-    switch (sdBase)
-    {
-        case SDC0_BASE:
-            clk_sdc_config(CCU_SDMMC0_CLK, hz);
-            break;
-        case SDC1_BASE:
-            clk_sdc_config(CCU_SDMMC1_CLK, hz);
-            break;
-
-        default:
-            return 0;
-    }
-
-    // Reset the clock
-    sd->SD_CKCR_REG = 0;
-    sd->SD_CMDR_REG = SD_CMD_REG_CMD_LOAD | SD_CMD_REG_PRG_CLK | SD_CMD_REG_WAIT_PRE_OVER;
-    while (sd -> SD_CMDR_REG & SD_CMD_REG_CMD_LOAD)
-    {
-        // Wait for the command to be sent
-    }
+#include <stddef.h>
+#include "f1c100s_sdc.h"
+#include "f1c100s_timer.h"
+#include "sdcard.h"
 
-    // Set the clock enable and commit
-    sd->SD_CKCR_REG = sd->SD_CKCR_REG | SD_CKCR_REG_CCLK_ENB;
-    sd->SD_CMDR_REG = SD_CMD_REG_CMD_LOAD | SD_CMD_REG_PRG_CLK | SD_CMD_REG_WAIT_PRE_OVER;
-    while (sd -> SD_CMDR_REG & SD_CMD_REG_CMD_LOAD)
-    {
-        // Wait for the command to be sent
-    }
+#define SD_TIMER_TICKS_US (24) // TIM0 runs from the 24MHz HOSC without prescaler
+#define SD_WRITE_TIMEOUT_US (500000)
+#define SD_RETRIES (1) // Extra attempts for a failed block transfer after recovery
 
-    return 1;
-}
+static uint32_t sd_timer_elapsed(uint32_t* last);
+static void sd_delay_us(uint32_t us);
+static uint8_t sd_wait_ready(sdcard_t* card, uint32_t timeout_us);
+static uint8_t sd_set_write_count(sdcard_t* card, sdc_data_t* dat);
+static int mmc_status(sdcard_t* card);
+static void mmc_recover(sdcard_t* card);
+static uint64_t mmc_read_blocks(sdcard_t* card, uint8_t* buf, uint64_t start, uint64_t blkcnt);
+static uint64_t mmc_write_blocks(sdcard_t* card, uint8_t* buf, uint64_t start, uint64_t blkcnt);
 
-// Transfers a command to the SD card
-#define SD_OK (0)
-static uint32_t sd_transfer_command(SD_T* sd, uint32_t commandRegister, uint32_t argument)
-{
-    sd->SD_CAGR_REG = argument;
-    sd->SD_CMDR_REG = SD_CMD_REG_CMD_LOAD | commandRegister;
+static const unsigned tran_speed_unit[] = {10000, 100000, 1000000, 10000000};
 
-    while (sd -> SD_CMDR_REG & SD_CMD_REG_CMD_LOAD)
-    {
-        // Wait for the command to be sent
-    }
+static const unsigned char tran_speed_time[] =
+    {0, 10, 12, 13, 15, 20, 25, 30, 35, 40, 45, 50, 55, 60, 70, 80};
 
-    uint32_t irq;
-    do
-    {
-        // Wait until either the command completes or fails
-        irq = sd->SD_RISR_REG;
-    } while (!(irq & SD_RISR_REG_COMMAND_COMPLETE) && !(irq & SD_RISR_REG_ERROR_MASK));
-    
-    // Clear all interrupts
-    sd->SD_RISR_REG = 0xFFFFFFFF;
-
-    if (irq & SD_RISR_REG_COMMAND_COMPLETE)
-    {
-        return SD_OK;
-    }
+// Scratch buffer for SCR / SWITCH_FUNC status reads, cache line aligned for the IDMAC
+static uint32_t sd_data_buf[16] __attribute__((aligned(32)));
 
-    uint32_t error = irq & SD_RISR_REG_ERROR_MASK;
-    printf("(error %x4)", error);
+static uint8_t go_idle_state(sdcard_t* card) {
+    sdc_cmd_t cmd = {0};
 
-    return error;
-}
+    cmd.cmdidx = MMC_GO_IDLE_STATE;
+    cmd.cmdarg = 0;
+    cmd.resptype = MMC_RESP_NONE;
 
-// Resets the card usind CMD0
-static int sd_go_idle(SD_T* sd)
-{
-    return sd_transfer_command(sd, SD_CMD_REG_SENT_INIT_SEQ, 0) == SD_OK;
+    if(sdc_transfer(card->sdc_base, &cmd, NULL)) return 1;
+    return sdc_transfer(card->sdc_base, &cmd, NULL);
 }
 
-// Sends the interface conditions to the SD card
-static int sd_send_interface_conditions(SD_T* sd, sdcard_info* card)
-{
-    // SD.pdf page 92, section 4.3.13
-    uint8_t checkPattern = 0xAA;
-    uint32_t argument = (1 << 8) | checkPattern; // 2.7-3.6V, 0xAA = pattern check
-
-    uint32_t cmd8Result;
-    if ((cmd8Result = sd_transfer_command(sd, SD_CMD_REG_CHK_RESP_CRC | SD_CMD_REG_RESP_RCV | 8, argument)) != SD_OK)
-    {
-        if (cmd8Result & SD_RISR_REG_RESPONSE_TIMEOUT)
-        {
-            // Probably no card
-            printStr("(CMD8 fail -> no card?)");
-            return 0;
-        }
-
-        printStr("(CMD8 fail -> probably V1)");
-        card->version = SD_VERSION_SD_V1;
-
-        return 1;
-    }
+static uint8_t sd_send_if_cond(sdcard_t* card) {
+    sdc_cmd_t cmd = {0};
 
-    // CMD8 has 48bits of response (-start bit, -transmission bit, -crc, -stop bit)
-    uint32_t r0 = sd->SD_RESP0_REG;
+    cmd.cmdidx = MMC_SD_SEND_IF_COND;
+    if(card->voltage & MMC_VDD_27_36)
+        cmd.cmdarg = (0x1 << 8);
+    else if(card->voltage & MMC_VDD_165_195)
+        cmd.cmdarg = (0x2 << 8);
+    else
+        cmd.cmdarg = (0x0 << 8);
+    cmd.cmdarg |= 0xaa;
+    cmd.resptype = MMC_RESP_R7;
+    if(!sdc_transfer(card->sdc_base, &cmd, NULL)) return 0;
 
-    if ((r0 & 0xFF) != checkPattern)
-    {
-        printStr("(pattern fail)");
-        return 0;
-    }
+    if((cmd.response[0] & 0xff) != 0xaa) return 0;
+    card->version = MMC_VERSION_SD_2;
+    return 1;
+}
 
-    if ((r0 & (1 << 8)) == 0)
-    {
-        printStr("(voltage fail)");
-        return 0;
-    }
+static uint8_t sd_send_op_cond(sdcard_t* card) {
+    sdc_cmd_t cmd = {0};
+    int retries = 100;
 
-    // If CMD8 works, it's a V2 card
-    card->version = SD_VERSION_SD_V2;
+    do {
+        cmd.cmdidx = MMC_APP_CMD;
+        cmd.cmdarg = 0;
+        cmd.resptype = MMC_RESP_R1;
+        if(!sdc_transfer(card->sdc_base, &cmd, NULL)) continue;
 
-    return 1;
-}
+        cmd.cmdidx = MMC_SD_APP_SEND_OP_COND;
+        if(card->voltage & MMC_VDD_27_36)
+            cmd.cmdarg = 0x00ff8000;
+        else if(card->voltage & MMC_VDD_165_195)
+            cmd.cmdarg = 0x00000080;
+        else
+            cmd.cmdarg = 0;
+        if(card->version == MMC_VERSION_SD_2) cmd.cmdarg |= MMC_OCR_HCS;
+        cmd.resptype = MMC_RESP_R3;
+        if(!sdc_transfer(card->sdc_base, &cmd, NULL) || (cmd.response[0] & MMC_OCR_BUSY)) break;
+    } while(retries--);
 
-static int sd_start_app_cmd(SD_T* sd, uint16_t rca)
-{
-    uint32_t arg = rca << 16;
+    if(retries <= 0) return 0;
 
-    // Send CMD55 because the next command is an app specific command
-    if (sd_transfer_command(sd, SD_CMD_REG_CHK_RESP_CRC | SD_CMD_REG_RESP_RCV | 55, arg) != SD_OK)
-    {
-        printStr("(CMD55 fail)\n");
-        return 0;
-    }
+    if(card->version != MMC_VERSION_SD_2) card->version = MMC_VERSION_SD_1_0;
 
-    uint8_t cardStatus = sd->SD_RESP0_REG;
-    if (!(cardStatus & CARDSTATUS_APPCMD))
-    {
-        printf("(APPCMD status fail %x4)\n", cardStatus);
-        return 0;
-    }
+    card->ocr = cmd.response[0];
+    card->high_capacity = ((card->ocr & MMC_OCR_HCS) == MMC_OCR_HCS);
+    card->rca = 0;
 
     return 1;
 }
 
-// Ask the card to send its operating conditions
-static int sd_send_operating_conditions(SD_T* sd, sdcard_info* card)
-{
-    uint32_t voltageWindow = 0x00ff8000; // All voltages set from 2.7V to 3.6V
-
-    uint32_t ocr = 0;
-    do
-    {
-        // Send CMD55 because the next command is an app specific command
-        if (!sd_start_app_cmd(sd, 0))
-        {
-            printStr("(CMD55 fail)");
-            return 0;
-        }
-
-        uint32_t acmd41Arg = 0x50000000 | voltageWindow; // HCS + XPC + voltage window
-        if (sd_transfer_command(sd, SD_CMD_REG_RESP_RCV | 41, acmd41Arg) != SD_OK)
-        {
-            printStr("(ACMD41 fail)\n");
-            return 0;
-        }
-
-        ocr = sd->SD_RESP0_REG;
+static uint8_t mmc_send_op_cond(sdcard_t* card) {
+    sdc_cmd_t cmd = {0};
+    int retries = 100;
 
-        if (!(ocr & OCR_POWERUP_READY))
-        {
-            sdelay(1000000);
-        }
-    } while (!(ocr & OCR_POWERUP_READY));
+    if(!go_idle_state(card)) return 0;
 
-    if ((ocr & OCR_VDD_MASK) == 0)
-    {
-        printStr("(ACMD41 unsupported voltage range)");
+    cmd.cmdidx = MMC_SEND_OP_COND;
+    cmd.cmdarg = 0;
+    cmd.resptype = MMC_RESP_R3;
+    if(!sdc_transfer(card->sdc_base, &cmd, NULL)) return 0;
 
-        return 0;
-    }
+    do {
+        cmd.cmdidx = MMC_SEND_OP_COND;
+        cmd.cmdarg = (card->ocr & MMC_OCR_VOLTAGE_MASK) | (card->ocr & MMC_OCR_ACCESS_MODE);
+        cmd.cmdarg |= MMC_OCR_HCS;
+        cmd.resptype = MMC_RESP_R3;
+        if(!sdc_transfer(card->sdc_base, &cmd, NULL)) return 0;
+    } while(!(cmd.response[0] & MMC_OCR_BUSY) && retries--);
 
-    if (ocr & OCR_CCS)
-    {
-        card->flags |= SD_FLAG_CCS;
-        printStr("(HC/XC) ");
-    }
+    if(retries <= 0) return 0;
 
+    card->version = MMC_VERSION_UNKNOWN;
+    card->ocr = cmd.response[0];
+    card->high_capacity = ((card->ocr & MMC_OCR_HCS) == MMC_OCR_HCS);
+    card->rca = 0;
     return 1;
 }
 
-static int sd_get_cid(SD_T* sd, sdcard_info* card)
-{
-    // Send CMD2, response is R2 which is 136bits
-    if (sd_transfer_command(sd, SD_CMD_REG_RESP_RCV | SD_CMD_REG_LONG_RESP | SD_CMD_REG_CHK_RESP_CRC | 2, 0) != SD_OK)
-    {
-        printStr("(CMD2 fail)");
-        
-        return 0;
-    }
-
-    uint32_t cid0 = sd->SD_RESP0_REG;
-    uint32_t cid1 = sd->SD_RESP1_REG;
-    uint32_t cid2 = sd->SD_RESP2_REG;
-    uint32_t cid3 = sd->SD_RESP3_REG;
-
-    printf("%x4 %x4 %x4 %x4 ", cid0, cid1, cid2, cid3);
+static uint8_t sd_app_cmd(sdcard_t* card) {
+    sdc_cmd_t cmd = {0};
 
-    // Whatever, SD.pdf page 180, section 5.12
+    cmd.cmdidx = MMC_APP_CMD;
+    cmd.cmdarg = card->rca << 16;
+    cmd.resptype = MMC_RESP_R1;
+    return sdc_transfer(card->sdc_base, &cmd, NULL);
+}
 
+static uint8_t sd_send_scr(sdcard_t* card) {
+    sdc_cmd_t cmd = {0};
+    sdc_data_t dat = {0};
+    int status;
+
+    if(!sd_app_cmd(card)) return 0;
+
+    cmd.cmdidx = MMC_SD_APP_SEND_SCR;
+    cmd.cmdarg = 0;
+    cmd.resptype = MMC_RESP_R1;
+    dat.buf = (uint8_t*)sd_data_buf;
+    dat.flag = MMC_DATA_READ;
+    dat.blksz = 8;
+    dat.blkcnt = 1;
+    if(!sdc_transfer(card->sdc_base, &cmd, &dat)) return 0;
+
+    do {
+        status = mmc_status(card);
+        if(status < 0) return 0;
+    } while(status != MMC_STATUS_TRAN);
+
+    // The SCR is sent MSB first
+    card->scr[0] = __builtin_bswap32(sd_data_buf[0]);
+    card->scr[1] = __builtin_bswap32(sd_data_buf[1]);
     return 1;
 }
 
-// Ask the card to publish a new relative address which is unsed in addressed commands
-static int sd_get_rca(SD_T* sd, sdcard_info* card)
-{
-    // Send CMD3, response is R6
-    if (sd_transfer_command(sd, SD_CMD_REG_RESP_RCV | SD_CMD_REG_CHK_RESP_CRC | 3, 0) != SD_OK)
-    {
-        printStr("(CMD3 fail)");
-        
-        return 0;
-    }
+static uint8_t sd_switch_func(sdcard_t* card, uint32_t mode, uint32_t group, uint32_t value) {
+    sdc_cmd_t cmd = {0};
+    sdc_data_t dat = {0};
+    int status;
+
+    cmd.cmdidx = MMC_SD_SWITCH_FUNC;
+    cmd.cmdarg = (mode << 31) | 0x00ffffff;
+    cmd.cmdarg &= ~(0xf << (group * 4));
+    cmd.cmdarg |= value << (group * 4);
+    cmd.resptype = MMC_RESP_R1;
+    dat.buf = (uint8_t*)sd_data_buf;
+    dat.flag = MMC_DATA_READ;
+    dat.blksz = 64;
+    dat.blkcnt = 1;
+    if(!sdc_transfer(card->sdc_base, &cmd, &dat)) return 0;
+
+    do {
+        status = mmc_status(card);
+        if(status < 0) return 0;
+    } while(status != MMC_STATUS_TRAN);
+    return 1;
+}
 
-    uint32_t resp = sd->SD_RESP0_REG;
-    card->rca = (resp >> 16) & 0xFFFF;
+static uint8_t sd_switch_high_speed(sdcard_t* card) {
+    uint8_t* sw = (uint8_t*)sd_data_buf;
 
-    printf("(RCA %d2)", card->rca);
+    // CMD6 is only there from SD 1.10 on
+    if(SD_SCR_SPEC(card->scr) < 1) return 0;
 
+    // Check function group 1 for high speed support, then switch to it
+    if(!sd_switch_func(card, 0, 0, 1)) return 0;
+    if(!(sw[13] & (1 << 1))) return 0;
+    if(!sd_switch_func(card, 1, 0, 1)) return 0;
+    if((sw[16] & 0xf) != 1) return 0;
     return 1;
 }
 
-static int decode_csd_v2(sdcard_info* card, uint32_t d0, uint32_t d1, uint32_t d2, uint32_t d3)
-{
-    // SD.pdf page 182, section 5.3.2
-    uint16_t read_bl_len = 1 << ((d2 >> 16) & 0x0F);
-    printf("\n\t\tRead block length %d2", read_bl_len);
-    if (read_bl_len != 512)
-    {
-        // CSD v2 only support 512 block sizes
-        printStr("\n\t\tUnexpected block size!");
-        return 0;
-    }
-
-    card->blockLength = read_bl_len; // CSD v2 spec says that read_bl_len = write_bl_len;
-
-    uint32_t c_size1 = (d1 >> 16) & 0xFFFF;
-    uint32_t c_size2 = (d2 & 0x3F);
-    uint32_t c_size = c_size1 | (c_size2 << 16);
+static uint8_t sd_set_bus(sdcard_t* card, uint32_t width, uint32_t clock) {
+    sdc_cmd_t cmd = {0};
 
-    card->blockCount = (c_size + 1) << 10;
-    printf("\n\t\tBlock count 0x%x4", card->blockCount);
+    if(!sd_app_cmd(card)) return 0;
 
-    card->capacity = (uint64_t)card->blockCount * read_bl_len;
-    printf("\n\t\tCapacity 0x%x8", card->capacity);
+    cmd.cmdidx = MMC_SD_APP_SET_BUS_WIDTH;
+    cmd.cmdarg = (width == MMC_BUS_WIDTH_4) ? 2 : 0;
+    cmd.resptype = MMC_RESP_R1;
+    if(!sdc_transfer(card->sdc_base, &cmd, NULL)) return 0;
 
-    return 1;
+    if(!sdc_set_clock(card->sdc_base, clock)) return 0;
+    return sdc_set_bus_width(card->sdc_base, width);
 }
 
-// Get the Card-Specific data, SD.pdf page 181, section 5.3
-static int sd_get_csd(SD_T* sd, sdcard_info* card)
-{
-    uint32_t arg = card->rca << 16;
+static uint8_t sd_setup_bus(sdcard_t* card) {
+    uint32_t width = MMC_BUS_WIDTH_1;
+    uint32_t clock;
 
-    // Send CMD9, response is R6, 148bits
-    if (sd_transfer_command(sd, SD_CMD_REG_RESP_RCV | SD_CMD_REG_LONG_RESP | SD_CMD_REG_CHK_RESP_CRC | 9, arg) != SD_OK)
-    {
-        printStr("(CMD9 fail)");
-        
-        return 0;
+    if(!sd_send_scr(card)) {
+        card->scr[0] = 0;
+        card->scr[1] = 0;
     }
 
-    // CSD_STRUCTURE bits
-    uint32_t d0 = sd->SD_RESP0_REG; // 0-31
-    uint32_t d1 = sd->SD_RESP1_REG; // 32-63
-    uint32_t d2 = sd->SD_RESP2_REG; // 64-95
-    uint32_t d3 = sd->SD_RESP3_REG; // 96-127
-
-    printf("%x4 %x4 %x4 %x4\n", d0, d1, d2, d3);
-
-    // Process CSD
-    if ((d0 & 1) != 1)
-    {
-        printStr("\t\tUnexpected CSD format\n");
-        return 0;
-    }
+    if((card->width & (MMC_BUS_WIDTH_4 | MMC_BUS_WIDTH_8)) && (SD_SCR_BUS_WIDTHS(card->scr) & (1 << 2)))
+        width = MMC_BUS_WIDTH_4;
+    if((card->clock > card->tran_speed) && sd_switch_high_speed(card)) card->tran_speed = 50000000;
 
-    uint8_t csdVersion = (d3 >> 30) & 3;
-    printf("\t\tCSD version %d1", csdVersion);
+    // Fall back from high speed to default speed, then from 4 to 1 bit, until data comes in clean
+    clock = (card->tran_speed < card->clock) ? card->tran_speed : card->clock;
+    while(1) {
+        if(sd_set_bus(card, width, clock) && (sd_send_scr(card) || sd_send_scr(card))) {
+            card->bus_width = width;
+            card->bus_clock = clock;
+            return 1;
+        }
 
-    switch (csdVersion)
-    {
-        case 1:
-            return decode_csd_v2(card, d0, d1, d2, d3);
-        case 0:
-            printStr("\t\tCSD v1 not implemented!\n");
-            return 0;
-        default:
-            printStr("\t\tUnknown CSD version\n");
+        if(clock > 25000000)
+            clock = 25000000;
+        else if(width != MMC_BUS_WIDTH_1)
+            width = MMC_BUS_WIDTH_1;
+        else
             return 0;
     }
-    
-    return 0;
 }
 
-static int sd_select_card(SD_T* sd, sdcard_info* card)
-{
-    uint32_t arg = card->rca << 16;
-
-    // Send CMD7, response is R1b
-    if (sd_transfer_command(sd, SD_CMD_REG_RESP_RCV | SD_CMD_REG_CHK_RESP_CRC | 7, arg) != SD_OK)
-    {
-        printStr("(CMD7 fail)");
-        
-        return 0;
-    }
+// Announces the length of a CMD25 burst: CMD23 if the SCR lists it (the card then ends it by itself),
+// otherwise ACMD23 so the card can pre-erase
+static uint8_t sd_set_write_count(sdcard_t* card, sdc_data_t* dat) {
+    sdc_cmd_t cmd = {0};
 
-    return 1;
-}
+    if(!(card->version & MMC_VERSION_SD) || (dat->blkcnt < 2)) return 1;
 
-static int sd_set_block_length(SD_T* sd, uint32_t blockLength)
-{
-    // Send CMD16
-    if (sd_transfer_command(sd, SD_CMD_REG_RESP_RCV | SD_CMD_REG_CHK_RESP_CRC | 16, blockLength) != SD_OK)
-    {
-        printStr("(CMD16 fail)");
-        
-        return 0;
+    if(SD_SCR_CMD_SUPPORT(card->scr) & SD_SCR_CMD23) {
+        cmd.cmdidx = MMC_SET_BLOCK_COUNT;
+        cmd.cmdarg = dat->blkcnt;
+        cmd.resptype = MMC_RESP_R1;
+        if(!sdc_transfer(card->sdc_base, &cmd, NULL)) return 0;
+        dat->flag |= MMC_DATA_PREDEFINED;
+        return 1;
     }
 
-    return 1;
+    if(!sd_app_cmd(card)) return 0;
+    cmd.cmdidx = MMC_SD_APP_SET_WR_BLK_ERASE_COUNT;
+    cmd.cmdarg = dat->blkcnt & 0x7fffff;
+    cmd.resptype = MMC_RESP_R1;
+    return sdc_transfer(card->sdc_base, &cmd, NULL);
 }
 
-static int sd_get_scr(SD_T* sd, sdcard_info* card)
-{
-    sd->SD_GCTL_REG |= SD_GCTL_REG_FIFO_AC_MOD; // Enable AHB bus data access   
-    sd->SD_RISR_REG = 0xFFFFFFFF; // Clear all IRQs
-
-    // Send CMD55 with RCA
-    if (!sd_start_app_cmd(sd, card->rca))
-    {
-        printStr("(CMD55 fail)");
-        return 0;
-    }
-
-    if (sd_transfer_command(sd, SD_CMD_REG_DATA_TRANS | SD_CMD_REG_WAIT_PRE_OVER | SD_CMD_REG_RESP_RCV | 51, 0) != SD_OK)
-    {
-        printStr("(ACMD51 fail)\n");
-        return 0;
-    }
-
-    // Rec data
-    uint32_t data[2] = {0};
-    uint8_t dataIndex = 0;
-
-    uint32_t status;
-    uint32_t irq;
-
-    // Read the two bytes of the structure
-    volatile uint32_t popFifo;
-    do
-    {
-        status = sd->SD_STAR_REG;
-        irq = sd->SD_RISR_REG;
-
-        uint32_t error = (irq & SD_RISR_REG_ERROR_MASK) & (~SD_RISR_REG_DATA_CRC_ERROR); // Ignore CRC errors
-        if (error)
-        {
-            printf("Data recv error %x4\n", irq);
-            return 0;
-        }
-
-        int fifoEmpty = status & SD_STAR_FIFO_EMPTY;
-        if (fifoEmpty && (irq & SD_RISR_REG_DATA_TRANSFER_COMPLETE))
-        {
-            break;
-        }
+static int mmc_status(sdcard_t* card) {
+    sdc_cmd_t cmd = {0};
+    int retries = 100;
+
+    cmd.cmdidx = MMC_SEND_STATUS;
+    cmd.resptype = MMC_RESP_R1;
+    cmd.cmdarg = card->rca << 16;
+    do {
+        if(!sdc_transfer(card->sdc_base, &cmd, NULL)) continue;
+        if(cmd.response[0] & (1 << 8)) break;
+        sd_delay_us(1000);
+    } while(retries-- > 0);
+    if(retries > 0) return ((cmd.response[0] >> 9) & 0xf);
+    return -1;
+}
 
-        if (!fifoEmpty)
-        {
-            popFifo = sd->SD_FIFO_REG;
-            if (dataIndex < 2)
-            {
-                data[dataIndex] = popFifo;
-            }
+// Gets controller and card back to the transfer state after a failed data command
+static void mmc_recover(sdcard_t* card) {
+    sdc_cmd_t cmd = {0};
+    int status;
 
-            dataIndex += 1;
-        }
-    } while (true);
+    // The driver resets the controller on errors, the card clock has to be reloaded
+    sdc_set_clock(card->sdc_base, card->bus_clock);
 
-    if (!(sd->SD_STAR_REG & SD_STAR_FIFO_EMPTY))
-    {
-        printStr("(FIFO not empty!)");
+    status = mmc_status(card);
+    if((status == MMC_STATUS_DATA) || (status == MMC_STATUS_RCV)) {
+        cmd.cmdidx = MMC_STOP_TRANSMISSION;
+        cmd.cmdarg = 0;
+        cmd.resptype = MMC_RESP_R1B;
+        sdc_transfer(card->sdc_base, &cmd, NULL);
     }
+    sd_wait_ready(card, SD_WRITE_TIMEOUT_US);
+}
 
-    // Clear IRQs
-    sd->SD_RISR_REG = 0xFFFFFFFF;
-
-    // Process SCR
-    uint32_t scr = SWAP_BYTES32(data[0]);
-    printf("0x%x4 ", scr);
-
-    uint8_t scr_structure = (scr >> 28) & 0x0F;
-    uint8_t sd_spec = (scr >> 24) & 0x0F;
-    // uint8_t data_after_erase = (scr >> 23) & 1;
-    // uint8_t sd_security = (scr >> 21) & 7;
-    uint8_t sd_bus_widths = (scr >> 16) & 0x0f;
-    uint8_t sd_spec3 = (scr >> 15) & 1;
-    // uint8_t ex_security = (scr >> 11) & 0x0f;
-    uint8_t sd_spec4 = (scr >> 10) & 1;
-    uint8_t sd_specx = (scr >> 6) & 0x0f;
-
-    if (scr_structure != 0)
-    {
-        printf("(Invalid SCR version %d1)", scr_structure);
-        return 0;
-    }
+static uint64_t mmc_read_blocks(sdcard_t* card, uint8_t* buf, uint64_t start, uint64_t blkcnt) {
+    sdc_cmd_t cmd = {0};
+    sdc_data_t dat = {0};
 
-    if (sd_spec == 0 && sd_spec3 == 0 && sd_spec4 == 0 && sd_specx == 0)
-    {
-        card->version = SD_VERSION_SD_V1;
-    }
-    else if (sd_spec == 1 && sd_spec3 == 0 && sd_spec4 == 0 && sd_specx == 0)
-    {
-        card->version = SD_VERSION_SD_V1_1;
-    }
-    else if (sd_spec == 2 && sd_spec3 == 0 && sd_spec4 == 0 && sd_specx == 0)
-    {
-        card->version = SD_VERSION_SD_V2;
-    }
-    else if (sd_spec == 2 && sd_spec3 == 1 && sd_spec4 == 0 && sd_specx == 0)
-    {
-        card->version = SD_VERSION_SD_V3;
-    }
-    else if (sd_spec == 2 && sd_spec3 == 1 && sd_spec4 == 1 && sd_specx == 0)
-    {
-        card->version = SD_VERSION_SD_V4;
-    }
-    else if (sd_spec == 2 && sd_spec3 == 1 && sd_specx == 1)
-    {
-        card->version = SD_VERSION_SD_V5;
-    }
-    else if (sd_spec == 2 && sd_spec3 == 1 && sd_specx == 2)
-    {
-        card->version = SD_VERSION_SD_V6;
-    }
+    if(blkcnt > 1)
+        cmd.cmdidx = MMC_READ_MULTIPLE_BLOCK;
     else
-    {
-        printf("(Unknown SD version %d1, %d1, %d1, %d1)", sd_spec, sd_spec3, sd_spec4, sd_specx);
-        return 0;
-    }
-
-    printf("(SD ver %d2)", card->version);
-    if (!(sd_bus_widths & 1))
-    {
-        printStr("(BUS1 mode not supported - invalid card)");
+        cmd.cmdidx = MMC_READ_SINGLE_BLOCK;
+    if(card->high_capacity)
+        cmd.cmdarg = start;
+    else
+        cmd.cmdarg = start * card->read_bl_len;
+    cmd.resptype = MMC_RESP_R1;
+    dat.buf = buf;
+    dat.flag = MMC_DATA_READ;
+    dat.blksz = card->read_bl_len;
+    dat.blkcnt = blkcnt;
+    // Multi-block reads are ended by the controller auto-stop, CMD13 is only needed to resync after an error
+    if(!sdc_transfer(card->sdc_base, &cmd, &dat)) {
+        mmc_recover(card);
         return 0;
     }
-
-    if (sd_bus_widths & 4)
-    {
-        card->flags |= SD_FLAG_BUS4;
-        printStr("(BUS4 supported)");
-    }
-
-    return 1;
+    return blkcnt;
 }
 
-// Switch card between 1 bit and 4 bit bus
-static int sd_set_bus_width(SD_T* sd, sdcard_info* card, int bus4)
-{
-    // Send CMD55 with RCA
-    if (!sd_start_app_cmd(sd, card->rca))
-    {
-        printStr("(CMD55 fail) ");
+static uint64_t mmc_write_blocks(sdcard_t* card, uint8_t* buf, uint64_t start, uint64_t blkcnt) {
+    sdc_cmd_t cmd = {0};
+    sdc_data_t dat = {0};
+
+    if(blkcnt > 1)
+        cmd.cmdidx = MMC_WRITE_MULTIPLE_BLOCK;
+    else
+        cmd.cmdidx = MMC_WRITE_SINGLE_BLOCK;
+    if(card->high_capacity)
+        cmd.cmdarg = start;
+    else
+        cmd.cmdarg = start * card->write_bl_len;
+    cmd.resptype = MMC_RESP_R1;
+    dat.buf = buf;
+    dat.flag = MMC_DATA_WRITE;
+    dat.blksz = card->write_bl_len;
+    dat.blkcnt = blkcnt;
+    if(!sd_set_write_count(card, &dat)) {
+        mmc_recover(card);
         return 0;
     }
-
-    uint32_t resp = sd->SD_RESP0_REG;
-
-    uint32_t arg = (bus4 ? 2 : 0);
-    if (sd_transfer_command(sd, SD_CMD_REG_RESP_RCV | 6, arg) != SD_OK)
-    {
-        printStr("(ACMD6 fail) ");
+    if(!sdc_transfer(card->sdc_base, &cmd, &dat)) {
+        mmc_recover(card);
         return 0;
     }
 
-    resp = sd->SD_RESP0_REG;
-    
-    printf("0x%x4 ", resp);
-
-    return 1;
+    // Data and auto-stop are done, the card signals programming by holding DAT0 low
+    if(!sd_wait_ready(card, SD_WRITE_TIMEOUT_US)) return 0;
+    return blkcnt;
 }
 
-// Continues SD card detection assuming the card is V2.0 or later
-static int detect_sd_v2(SD_T* sd, sdcard_info* card)
-{
-    printStr("\tAssuming SD V2\n");
-
-    SD_TRY("\tSending operating conditions ", sd_send_operating_conditions(sd, card));
-    SD_TRY("\tGet card identification ", sd_get_cid(sd, card));
-    SD_TRY("\tGet card RCA ", sd_get_rca(sd, card));
-    SD_TRY("\tGet card info ", sd_get_csd(sd, card));
-    SD_TRY("\tSelect card ", sd_select_card(sd, card));
-    SD_TRY("\tGet SCR ", sd_get_scr(sd, card));
-
-    // Standard capacity card?
-    if (!(card->flags & SD_FLAG_CCS))
-    {
-        sd->SD_BKSR_REG = 512;
-
-        SD_TRY("\tSet block length to 512 bytes ", sd_set_block_length(sd, 512));
+uint8_t sdcard_detect(sdcard_t* card) {
+    sdc_cmd_t cmd = {0};
+    sdc_data_t dat = {0};
+    uint64_t csize, cmult;
+    uint32_t unit, time;
+    int width;
+    int status;
+
+    card->recover = 0; // Initialisation starts the card over anyway
+    sdc_reset(card->sdc_base);
+    sdc_set_clock(card->sdc_base, 400 * 1000);
+    sdc_set_bus_width(card->sdc_base, MMC_BUS_WIDTH_1);
+
+    if(!go_idle_state(card)) return 0;
+
+    sd_send_if_cond(card);
+    if(!sd_send_op_cond(card)) {
+        if(!mmc_send_op_cond(card)) return 0;
+    }
+
+    cmd.cmdidx = MMC_ALL_SEND_CID;
+    cmd.cmdarg = 0;
+    cmd.resptype = MMC_RESP_R2;
+    if(!sdc_transfer(card->sdc_base, &cmd, NULL)) return 0;
+    //    card->cid[0] = cmd.response[0];
+    //    card->cid[1] = cmd.response[1];
+    //    card->cid[2] = cmd.response[2];
+    //    card->cid[3] = cmd.response[3];
+
+    cmd.cmdidx = MMC_SD_SEND_RELATIVE_ADDR;
+    cmd.cmdarg = card->rca << 16;
+    cmd.resptype = MMC_RESP_R6;
+    if(!sdc_transfer(card->sdc_base, &cmd, NULL)) return 0;
+    if(card->version & MMC_VERSION_SD) card->rca = (cmd.response[0] >> 16) & 0xffff;
+
+    cmd.cmdidx = MMC_SEND_CSD;
+    cmd.cmdarg = card->rca << 16;
+    cmd.resptype = MMC_RESP_R2;
+    if(!sdc_transfer(card->sdc_base, &cmd, NULL)) return 0;
+    card->csd[0] = cmd.response[0];
+    card->csd[1] = cmd.response[1];
+    card->csd[2] = cmd.response[2];
+    card->csd[3] = cmd.response[3];
+
+    cmd.cmdidx = MMC_SELECT_CARD;
+    cmd.cmdarg = card->rca << 16;
+    cmd.resptype = MMC_RESP_R1;
+    if(!sdc_transfer(card->sdc_base, &cmd, NULL)) return 0;
+    do {
+        status = mmc_status(card);
+        if(status < 0) return 0;
+    } while(status != MMC_STATUS_TRAN);
+
+    if(card->version == MMC_VERSION_UNKNOWN) {
+        switch((card->csd[0] >> 26) & 0xf) {
+        case 0:
+            card->version = MMC_VERSION_1_2;
+            break;
+        case 1:
+            card->version = MMC_VERSION_1_4;
+            break;
+        case 2:
+            card->version = MMC_VERSION_2_2;
+            break;
+        case 3:
+            card->version = MMC_VERSION_3;
+            break;
+        case 4:
+            card->version = MMC_VERSION_4;
+            break;
+        default:
+            card->version = MMC_VERSION_1_2;
+            break;
+        };
     }
 
-    // Switch clock
-    // NOTE: sd.pdf page 33, section 3.9 says that UHS-I cards in 3.3V signaling can go up to 50MHz
-    if (card->version >= SD_VERSION_SD_V2)
-    {
-        SD_TRY("\tSetting clock to 50MHz ", sd_set_controller_clock(sd, 50000000));
-    }
+    unit = tran_speed_unit[(card->csd[0] & 0x7)];
+    time = tran_speed_time[((card->csd[0] >> 3) & 0xf)];
+    card->tran_speed = time * unit;
 
-    // Switch bus width
-    if (card->flags & SD_FLAG_BUS4)
-    {
-        SD_TRY("\tSwitching bus width to 4bit ", sd_set_bus_width(sd, card, true));
-        sd->SD_BWDR_REG = SD_BWDR_REG_4; // Tell the controller to use 4bits as well
+    card->read_bl_len = 1 << ((card->csd[1] >> 16) & 0xf);
 
-        sdelay(1000000); // Sometimes the first data transfer after the bus width change fails
+    if(card->version & MMC_VERSION_SD)
+        card->write_bl_len = card->read_bl_len;
+    else
+        card->write_bl_len = 1 << ((card->csd[3] >> 22) & 0xf);
+    if(card->read_bl_len > 512) card->read_bl_len = 512;
+    if(card->write_bl_len > 512) card->write_bl_len = 512;
+
+    if((card->version & MMC_VERSION_MMC) && (card->version >= MMC_VERSION_4)) {
+        cmd.cmdidx = MMC_SEND_EXT_CSD;
+        cmd.cmdarg = 0;
+        cmd.resptype = MMC_RESP_R1;
+        dat.buf = card->extcsd;
+        dat.flag = MMC_DATA_READ;
+        dat.blksz = 512;
+        dat.blkcnt = 1;
+        if(!sdc_transfer(card->sdc_base, &cmd, &dat)) return 0;
+
+        do {
+            status = mmc_status(card);
+            if(status < 0) return 0;
+        } while(status != MMC_STATUS_TRAN);
+
+        switch(card->extcsd[192]) {
+        case 1:
+            card->version = MMC_VERSION_4_1;
+            break;
+        case 2:
+            card->version = MMC_VERSION_4_2;
+            break;
+        case 3:
+            card->version = MMC_VERSION_4_3;
+            break;
+        case 5:
+            card->version = MMC_VERSION_4_41;
+            break;
+        case 6:
+            card->version = MMC_VERSION_4_5;
+            break;
+        case 7:
+            card->version = MMC_VERSION_5_0;
+            break;
+        case 8:
+            card->version = MMC_VERSION_5_1;
+            break;
+        default:
+            break;
+        }
     }
 
+    if(card->high_capacity) {
+        if(card->version & MMC_VERSION_SD) {
+            csize = (card->csd[1] & 0x3f) << 16 | (card->csd[2] & 0xffff0000) >> 16;
+            card->blk_cnt = (1 + csize) << 10;
+        } else {
+            card->blk_cnt = card->extcsd[212] << 0 | card->extcsd[212 + 1] << 8 |
+                            card->extcsd[212 + 2] << 16 | card->extcsd[212 + 3] << 24;
+        }
+    } else {
+        csize = (card->csd[1] & 0x3ff) << 2 | (card->csd[2] & 0xc0000000) >> 30;
+        cmult = (card->csd[2] & 0x00038000) >> 15;
+
+        card->blk_cnt = (csize + 1) << (cmult + 2);
+    }
+    card->capacity = card->blk_cnt * card->read_bl_len;
+
+    if(card->version & MMC_VERSION_SD) {
+        if(!sd_setup_bus(card)) return 0;
+    } else if(card->version & MMC_VERSION_MMC) {
+        if(card->width & MMC_BUS_WIDTH_8)
+            width = 2;
+        else if(card->width & MMC_BUS_WIDTH_4)
+            width = 1;
+        else
+            width = 0;
+
+        cmd.cmdidx = MMC_APP_CMD;
+        cmd.cmdarg = card->rca << 16;
+        cmd.resptype = MMC_RESP_R5;
+        if(!sdc_transfer(card->sdc_base, &cmd, NULL)) return 0;
+
+        cmd.cmdidx = MMC_SD_SWITCH_FUNC;
+        cmd.cmdarg = width;
+        cmd.resptype = MMC_RESP_R1;
+        if(!sdc_transfer(card->sdc_base, &cmd, NULL)) return 0;
+
+        if(card->tran_speed < card->clock)
+            card->bus_clock = card->tran_speed;
+        else
+            card->bus_clock = card->clock;
+        sdc_set_clock(card->sdc_base, card->bus_clock);
+        if(card->width & MMC_BUS_WIDTH_8)
+            card->bus_width = MMC_BUS_WIDTH_8;
+        else if(card->width & MMC_BUS_WIDTH_4)
+            card->bus_width = MMC_BUS_WIDTH_4;
+        else
+            card->bus_width = MMC_BUS_WIDTH_1;
+        sdc_set_bus_width(card->sdc_base, card->bus_width);
+    }
+
+    cmd.cmdidx = MMC_SET_BLOCKLEN;
+    cmd.cmdarg = card->read_bl_len;
+    cmd.resptype = MMC_RESP_R1;
+    if(!sdc_transfer(card->sdc_base, &cmd, NULL)) return 0;
     return 1;
 }
 
-// Tries to detect the SD/MMC card, the type, the size and everything else
-int sdcard_detect(SD_T* sd, sdcard_info* card)
-{
-    printStr("SD reset & io setup\n");
-    clk_reset_set(CCU_BUS_SOFT_RST0, 8);
-    clk_enable(CCU_BUS_CLK_GATE0, 8);
-    clk_reset_clear(CCU_BUS_SOFT_RST0, 8);
-
-    gpio_init(GPIOF, PIN1 | PIN2 | PIN3, GPIO_MODE_AF2, GPIO_PULL_NONE, GPIO_DRV_3);
-
-    // Reset controller
-    printStr("Reset SD controller ");
-    sd_reset_full(sd);
-    printStr("OK\n");
-
-    // Set clock
-    SD_TRY("Setting clock ", sd_set_controller_clock(sd, 400000)); // In the identification phase it is advised to use 100k-400kHz clocks
-
-    // Set bus width
-    printStr("Set bus width ");
-    sd->SD_BWDR_REG = SD_BWDR_REG_1; // In the identification phase 1 bit bus width must be used
-    printStr("OK\n");
-
-    // Clear all interrupts
-    sd->SD_RISR_REG = 0xFFFFFFFF;
-
-    // Wait a bit for the card
-    sdelay(1000000);
-
-    // Do the SD card identification process
-    // SD.pdf page 48
-    printStr("Card identification...\n");
-    {
-        // Go IDLE - CMD0
-        SD_TRY("\tReset card ", sd_go_idle(sd));
-
-        // CMD8 - interface conditions
-        SD_TRY("\tSend interface params ", sd_send_interface_conditions(sd, card));
-
-        switch (card->version)
-        {
-            case SD_VERSION_SD_V1:
-                printStr("SD V1 not supported");
-                return 0;
-            case SD_VERSION_SD_V2:
-                return detect_sd_v2(sd, card);
-            default:
-                printStr("Unknown SD version");
-                return 0;
-        }
-    }
-
-    printStr("SDcard detected OK\n");
-    return 0;
+uint64_t sdcard_read(sdcard_t* card, uint8_t* buf, uint64_t blkno, uint64_t blkcnt) {
+    uint64_t cnt, blks = blkcnt;
+    int retries;
+
+    sdcard_recover(card);
+    while(blks > 0) {
+        cnt = (blks > SDCARD_MAX_TRANSFER_BLOCKS) ? SDCARD_MAX_TRANSFER_BLOCKS : blks;
+        retries = SD_RETRIES;
+        while(mmc_read_blocks(card, buf, blkno, cnt) != cnt)
+            if(retries-- == 0) return 0;
+        blks -= cnt;
+        blkno += cnt;
+        buf += cnt * card->read_bl_len;
+    }
+    return blkcnt;
 }
 
-int sdcard_read_sector(SD_T* sd, sdcard_info* card, uint8_t* buffer, uint64_t address, uint32_t numBytes)
-{
-    if (numBytes != card->blockLength)
-    {
-        printStr("Unable to read non sector sizes!");
-        return 0;
-    }
-
-    if (address % card->blockLength != 0)
-    {
-        printStr("(Unaligned read!)");
-        return 0;
-    }
-
-    sd->SD_GCTL_REG |= SD_GCTL_REG_FIFO_AC_MOD; // Enable AHB bus data access
-
-    // Clear all IRQs
-    sd->SD_RISR_REG = 0xFFFFFFFF;
+uint64_t sdcard_write(sdcard_t* card, uint8_t* buf, uint64_t blkno, uint64_t blkcnt) {
+    uint64_t cnt, blks = blkcnt;
+    int retries;
+
+    sdcard_recover(card);
+    while(blks > 0) {
+        cnt = (blks > SDCARD_MAX_TRANSFER_BLOCKS) ? SDCARD_MAX_TRANSFER_BLOCKS : blks;
+        retries = SD_RETRIES;
+        while(mmc_write_blocks(card, buf, blkno, cnt) != cnt)
+            if(retries-- == 0) return 0;
+        blks -= cnt;
+        blkno += cnt;
+        buf += cnt * card->write_bl_len;
+    }
+    return blkcnt;
+}
 
-    sd->SD_BKSR_REG = card->blockLength;
-    sd->SD_BYCR_REG = numBytes;
+uint8_t sdcard_transfer_start(sdcard_t* card, uint8_t* buf, uint64_t blkno, uint64_t blkcnt, uint8_t write) {
+    sdc_cmd_t cmd = {0};
+    sdc_data_t* dat = &card->xfer;
+    uint32_t bl_len = write ? card->write_bl_len : card->read_bl_len;
 
-    // SD.pdf page 106, footnote 2 - High capacity cards use sector adressing instead of byte addressing
-    uint32_t arg = ((card->flags & SD_FLAG_CCS) ? (address / card->blockLength) : address);
+    if(card->recover || (blkcnt == 0) || (blkcnt > SDCARD_MAX_TRANSFER_BLOCKS)) return 0;
 
-    if (sd_transfer_command(sd, SD_CMD_REG_DATA_TRANS | SD_CMD_REG_WAIT_PRE_OVER | SD_CMD_REG_CHK_RESP_CRC | SD_CMD_REG_RESP_RCV | 17, arg) != SD_OK)
-    {
-        printStr("(CMD17 fail)\n");
+    if(write)
+        cmd.cmdidx = (blkcnt > 1) ? MMC_WRITE_MULTIPLE_BLOCK : MMC_WRITE_SINGLE_BLOCK;
+    else
+        cmd.cmdidx = (blkcnt > 1) ? MMC_READ_MULTIPLE_BLOCK : MMC_READ_SINGLE_BLOCK;
+    if(card->high_capacity)
+        cmd.cmdarg = blkno;
+    else
+        cmd.cmdarg = blkno * bl_len;
+    cmd.resptype = MMC_RESP_R1;
+    dat->buf = buf;
+    dat->flag = write ? MMC_DATA_WRITE : MMC_DATA_READ;
+    dat->blksz = bl_len;
+    dat->blkcnt = blkcnt;
+    if((write && !sd_set_write_count(card, dat)) || !sdc_transfer_start(card->sdc_base, &cmd, dat)) {
+        card->recover = 1;
         return 0;
     }
-
-     // Rec data
-    uint32_t *data = (uint32_t*)buffer;
-    uint8_t dataIndex = 0;
-
-    uint32_t status;
-    uint32_t irq;
-
-    // Receive bytes
-    volatile uint32_t popFifo;
-    do
-    {
-        status = sd->SD_STAR_REG;
-        irq = sd->SD_RISR_REG;
-
-        uint32_t error = (irq & SD_RISR_REG_ERROR_MASK) & (~SD_RISR_REG_DATA_CRC_ERROR); // Ignore CRC errors
-        if (error)
-        {
-            printf("Data recv error %x4\n", irq);
-            return 0;
-        }
-
-        int fifoEmpty = status & SD_STAR_FIFO_EMPTY;
-        if (fifoEmpty && (irq & SD_RISR_REG_DATA_TRANSFER_COMPLETE))
-        {
-            break;
-        }
-
-        if (!fifoEmpty)
-        {
-            popFifo = sd->SD_FIFO_REG;
-            if (dataIndex < 128)
-            {
-                data[dataIndex] = popFifo;
-            }
-
-            dataIndex += 1;
-        }
-    } while (true);
-
-    if (!(sd->SD_STAR_REG & SD_STAR_FIFO_EMPTY))
-    {
-        printStr("(FIFO not empty!)");
-    }
-
-    // Clear IRQs
-    sd->SD_RISR_REG = 0xFFFFFFFF;
-
     return 1;
 }
 
-int sdcard_write_sector(SD_T* sd, sdcard_info* card, uint8_t* buffer, uint64_t address, uint32_t numBytes)
-{
-    if (numBytes != card->blockLength)
-    {
-        printStr("Unable to write non sector sizes!");
-        return 0;
-    }
+int8_t sdcard_transfer_poll(sdcard_t* card) {
+    int8_t ret = sdc_transfer_poll(card->sdc_base, &card->xfer);
 
-    if (address % card->blockLength != 0)
-    {
-        printStr("(Unaligned write!)");
-        return 0;
-    }
-
-    sd->SD_GCTL_REG |= SD_GCTL_REG_FIFO_AC_MOD; // Enable AHB bus data access
+    if(ret < 0) card->recover = 1;
+    return ret;
+}
 
-    // Clear all IRQs
-    sd->SD_RISR_REG = 0xFFFFFFFF;
+void sdcard_transfer_abort(sdcard_t* card) {
+    sdc_transfer_abort(card->sdc_base, &card->xfer);
+    card->recover = 1;
+}
 
-    // TODO: Implement write command
-    if (sd_transfer_command(sd, SD_CMD_REG_DATA_TRANS | SD_CMD_REG_WAIT_PRE_OVER | SD_CMD_REG_CHK_RESP_CRC | SD_CMD_REG_RESP_RCV | 17, address) != SD_OK)
-    {
-        printStr("(CMD17 fail)\n");
-        return 0;
-    }
+void sdcard_recover(sdcard_t* card) {
+    if(!card->recover) return;
+    mmc_recover(card);
+    card->recover = 0;
+}
 
-    // Rec data
-    uint32_t *data = (uint32_t*)buffer;
-    uint8_t dataIndex = 0;
+int sdcard_status(sdcard_t* card) {
+    int status = mmc_status(card);
+    return status >= 0;
+}
 
-    uint32_t status;
-    uint32_t irq;
+uint8_t sdcard_busy(sdcard_t* card) {
+    return sdc_card_busy(card->sdc_base);
+}
 
-    // Receive bytes
-    volatile uint32_t popFifo;
-    do
-    {
-        status = sd->SD_STAR_REG;
-        irq = sd->SD_RISR_REG;
+// TIM0 ticks since *last, has to be called at least once per TIM0 reload period
+static uint32_t sd_timer_elapsed(uint32_t* last) {
+    uint32_t now = tim_get_cnt(TIM0);
+    uint32_t ticks = (*last >= now) ? (*last - now) : (*last + tim_get_period(TIM0) - now);
 
-        uint32_t error = (irq & SD_RISR_REG_ERROR_MASK) & (~SD_RISR_REG_DATA_CRC_ERROR); // Ignore CRC errors
-        if (error)
-        {
-            printf("Data recv error %x4\n", irq);
-            return 0;
-        }
+    *last = now;
+    return ticks;
+}
 
-        int fifoEmpty = status & SD_STAR_FIFO_EMPTY;
-        if (fifoEmpty && (irq & SD_RISR_REG_DATA_TRANSFER_COMPLETE))
-        {
-            break;
-        }
+static void sd_delay_us(uint32_t us) {
+    uint32_t last = tim_get_cnt(TIM0);
+    uint32_t ticks = 0;
 
-        if (!fifoEmpty)
-        {
-            popFifo = sd->SD_FIFO_REG;
-            if (dataIndex < 128)
-            {
-                data[dataIndex] = popFifo;
-            }
+    while(ticks < us * SD_TIMER_TICKS_US)
+        ticks += sd_timer_elapsed(&last);
+}
 
-            dataIndex += 1;
-        }
-    } while (true);
+// Waits for the card to release DAT0 after a write
+static uint8_t sd_wait_ready(sdcard_t* card, uint32_t timeout_us) {
+    uint32_t last = tim_get_cnt(TIM0);
+    uint32_t ticks = 0;
 
-    if (!(sd->SD_STAR_REG & SD_STAR_FIFO_EMPTY))
-    {
-        printStr("(FIFO not empty!)");
+    while(sdc_card_busy(card->sdc_base)) {
+        ticks += sd_timer_elapsed(&last);
+        if(ticks >= timeout_us * SD_TIMER_TICKS_US) return 0;
     }
-
-    // Clear IRQs
-    sd->SD_RISR_REG = 0xFFFFFFFF;
-
     return 1;
 }
@@ -0,0 +1,211 @@
+// CDC ACM of usb-cdc against the simulated MUSB
+//
+// The test is the host: it enumerates the device, sets the line coding and moves bytes through the
+// bulk endpoints, running the IRQ handler and the main loop handler in between as the firmware does.
+
+#include <string.h>
+#include "test.h"
+#include "musb.h"
+
+#include "usb_cdc.c"
+#include "ringbuffer.c"
+
+void clk_enable(uint32_t reg, uint8_t bit)
+{
+    (void)reg;
+    (void)bit;
+}
+
+void clk_disable(uint32_t reg, uint8_t bit)
+{
+    (void)reg;
+    (void)bit;
+}
+
+void clk_reset_set(uint32_t reg, uint8_t bit)
+{
+    (void)reg;
+    (void)bit;
+}
+
+void clk_reset_clear(uint32_t reg, uint8_t bit)
+{
+    (void)reg;
+    (void)bit;
+}
+
+void clk_usb_config(uint8_t clock, uint8_t reset)
+{
+    (void)clock;
+    (void)reset;
+}
+
+#define EP_DATA_IN 2
+#define EP_DATA_OUT 3
+
+// Lets the device handle everything the host did, as the IRQ and main loop would
+static void usb_run(void)
+{
+    do
+        cdc_irq_handler();
+    while (cdc_handler());
+    CHECK(!cdc_pending());
+}
+
+// One control transfer, data goes out when the request is host to device, returns the length of the
+// data stage from the device
+static int host_control(uint8_t type, uint8_t request, uint16_t value, uint16_t index, uint16_t length,
+                        uint8_t *data)
+{
+    uint8_t setup[8] = {type, request, value, value >> 8, index, index >> 8, length, length >> 8};
+    unsigned status = musb_ep0_status_count;
+    int total = 0, n;
+
+    CHECK(musb_setup(setup));
+    if (!(type & 0x80) && length)
+        CHECK(musb_out(0, data, length));
+    usb_run();
+    CHECK_EQ(musb_out_pending(0), 0);
+    if (type & 0x80)
+    {
+        while ((n = musb_in(0, data + total, 64)) >= 0)
+        {
+            total += n;
+            if (n < 64)
+                break;
+        }
+    }
+    CHECK(total <= length);
+    CHECK_EQ(musb_ep0_status_count, status + 1);
+    return total;
+}
+
+static void host_enumerate(void)
+{
+    uint8_t data[256];
+    unsigned i, len, in_resets = musb_toggle_resets[EP_DATA_IN][1], out_resets = musb_toggle_resets[EP_DATA_OUT][0];
+
+    musb_bus_reset(1);
+    usb_run();
+    CHECK_EQ(host_control(0x80, 0x06, 0x0100, 0, 64, data), 18);
+    CHECK_EQ(data[1], 1);
+    host_control(0x00, 0x05, 5, 0, 0, data); // SET_ADDRESS
+    CHECK_EQ(musb_address(), 5);
+    CHECK_EQ(host_control(0x80, 0x06, 0x0200, 0, 9, data), 9);
+    len = data[2] | data[3] << 8;
+    CHECK_EQ(host_control(0x80, 0x06, 0x0200, 0, 255, data), len);
+
+    // Interrupt EP1 in, bulk EP2 in and EP3 out
+    for (i = 0; i < len; i += data[i])
+        if (data[i + 1] == 5)
+            CHECK(data[i + 2] == 0x81 || data[i + 2] == (0x80 | EP_DATA_IN) || data[i + 2] == EP_DATA_OUT);
+
+    CHECK_EQ(host_control(0x80, 0x06, 0x0300, 0, 255, data), 4);
+    CHECK_EQ(host_control(0x80, 0x06, 0x0302, 0x0409, 255, data), 2 + 2 * 11);
+    CHECK(memcmp(&data[2], "F\0001\000C\0002\0000\0000\000s\000 \000C\000D\000C\000", 22) == 0);
+    CHECK_EQ(host_control(0x80, 0x06, 0x0600, 0, 10, data), 10);
+    host_control(0x00, 0x09, 1, 0, 0, data); // SET_CONFIGURATION
+    CHECK_EQ(musb_toggle_resets[EP_DATA_IN][1], in_resets + 1);
+    CHECK_EQ(musb_toggle_resets[EP_DATA_OUT][0], out_resets + 1);
+}
+
+static void test_enumeration(void)
+{
+    static const uint8_t coding[7] = {0x00, 0xC2, 0x01, 0x00, 0, 0, 8}; // 115200 8N1
+    uint8_t data[16];
+
+    host_enumerate();
+
+    // SET_LINE_CODING has a data stage to the device, GET_LINE_CODING returns it
+    memcpy(data, coding, 7);
+    CHECK_EQ(sizeof(CDC_LINECODING), 7);
+    CHECK_EQ(host_control(0x21, 0x20, 0, 0, 7, data), 0);
+    CHECK_EQ(lineCoding.dwDTERate, 115200);
+    memset(data, 0, sizeof(data));
+    CHECK_EQ(host_control(0xA1, 0x21, 0, 0, 7, data), 7);
+    CHECK(memcmp(data, coding, 7) == 0);
+    CHECK_EQ(host_control(0x21, 0x22, 3, 0, 0, data), 0); // SET_CONTROL_LINE_STATE DTR RTS
+}
+
+static uint32_t host_read(uint8_t *data, uint32_t max)
+{
+    uint32_t total = 0;
+    int n;
+
+    while ((n = musb_in(EP_DATA_IN, data + total, max - total)) >= 0)
+    {
+        CHECK(n > 0 && n <= 64);
+        total += n;
+    }
+    return total;
+}
+
+static void test_bulk(void)
+{
+    static const char text[] = "hello, f1c100s";
+    uint8_t data[64];
+    unsigned i;
+
+    // Nothing to do and nothing pending while the bus is idle
+    CHECK(!cdc_handler());
+    CHECK(!cdc_pending());
+
+    // Host to device, the packet waits for the IRQ
+    CHECK(musb_out(EP_DATA_OUT, text, sizeof(text) - 1));
+    CHECK(!cdc_pending());
+    cdc_irq_handler();
+    CHECK(cdc_pending());
+    CHECK_EQ(cdc_bytes_in(), 0);
+    usb_run();
+    CHECK_EQ(cdc_bytes_in(), sizeof(text) - 1);
+    for (i = 0; i < sizeof(text) - 1; i++)
+        CHECK_EQ(cdc_read_byte(), (uint8_t)text[i]);
+    CHECK_EQ(cdc_read_byte(), -1);
+    CHECK_EQ(musb_out_pending(EP_DATA_OUT), 0);
+
+    // Device to host, the first byte goes out at once, the rest once the IN packet is done
+    for (i = 0; i < sizeof(text) - 1; i++)
+        cdc_write_byte(text[i]);
+    CHECK_EQ(musb_in(EP_DATA_IN, data, sizeof(data)), 1);
+    CHECK_EQ(data[0], text[0]);
+    usb_run();
+    CHECK_EQ(host_read(data, sizeof(data)), sizeof(text) - 2);
+    CHECK(memcmp(data, &text[1], sizeof(text) - 2) == 0);
+    usb_run();
+    CHECK(!txInProgress);
+
+    // Echo as the main loop does it
+    CHECK(musb_out(EP_DATA_OUT, "xyz", 3));
+    usb_run();
+    while (cdc_bytes_in() > 0)
+        cdc_write_byte(cdc_read_byte());
+    usb_run();
+    CHECK_EQ(host_read(data, sizeof(data)), 3);
+    CHECK(memcmp(data, "xyz", 3) == 0);
+}
+
+// A bus reset drops the end of a transfer that was still latched, sending must not stay blocked
+static void test_reset_during_transfer(void)
+{
+    uint8_t data[64];
+
+    cdc_write_byte('a');
+    cdc_irq_handler();
+    CHECK(txInProgress);
+    CHECK_EQ(musb_in(EP_DATA_IN, data, sizeof(data)), 1);
+    host_enumerate();
+    CHECK(!txInProgress);
+    cdc_write_byte('b');
+    CHECK_EQ(host_read(data, sizeof(data)), 1);
+    CHECK_EQ(data[0], 'b');
+}
+
+int main(void)
+{
+    musb_init();
+    cdc_init();
+    test_enumeration();
+    test_bulk();
+    test_reset_during_transfer();
+    return TEST_RESULT();
+}
@@ -0,0 +1,265 @@
+// Crash consistency of the diskio.c write-back cache on a file-backed card
+//
+// Every sector carries a stamp of its number and a version. The card checks each write as it
+// lands, so any prefix of the write stream is a possible crash state: it must only hold whole
+// sectors of versions the application wrote, never go back to an older version, and after
+// CTRL_SYNC or the idle flush it must match what the application wrote.
+
+#include <unistd.h>
+#include "test.h"
+#include "diskio.c"
+
+#define CARD_SECTORS 8192
+#define AREA_SECTORS 6144 // Three times the cache, so dirty pages get evicted
+#define OPS 6000
+
+volatile uint32_t systime;
+
+static int card_fd;
+static uint32_t model_ver[CARD_SECTORS];   // Last version the application wrote
+static uint32_t durable_ver[CARD_SECTORS]; // Version on the card
+static uint32_t model_op[CARD_SECTORS];    // Operation that wrote model_ver
+static uint32_t card_writes;
+static uint32_t last_write_end; // Sectors written by the current operation go out in LBA order
+static uint8_t io_buf[128 * SECTOR_SIZE];
+
+static uint32_t stamp_word(uint32_t sector, uint32_t ver, uint32_t i)
+{
+    uint32_t x = sector * 0x9E3779B1u ^ ver * 0x85EBCA77u ^ i * 0xC2B2AE3Du;
+    return x ^ (x >> 15);
+}
+
+static void stamp(uint8_t *buf, uint32_t sector, uint32_t ver)
+{
+    uint32_t *w = (uint32_t *)buf;
+
+    w[0] = sector;
+    w[1] = ver;
+    for (uint32_t i = 2; i < SECTOR_SIZE / 4; i++)
+        w[i] = stamp_word(sector, ver, i);
+}
+
+// Returns the version of a whole, correctly placed sector, or -1
+static int64_t stamp_version(const uint8_t *buf, uint32_t sector)
+{
+    const uint32_t *w = (const uint32_t *)buf;
+
+    if (w[0] != sector)
+        return -1;
+    for (uint32_t i = 2; i < SECTOR_SIZE / 4; i++)
+        if (w[i] != stamp_word(sector, w[1], i))
+            return -1;
+    return w[1];
+}
+
+/* File-backed card under the real request queue */
+
+static uint8_t card_busy(void *ctx)
+{
+    (void)ctx;
+    return 0;
+}
+
+static uint8_t card_start(void *ctx, uint8_t *buf, uint32_t blkno, uint32_t blkcnt, uint8_t write)
+{
+    (void)ctx;
+    CHECK(blkno + blkcnt <= CARD_SECTORS);
+    if (!write)
+        return pread(card_fd, buf, blkcnt * SECTOR_SIZE, (off_t)blkno * SECTOR_SIZE) == blkcnt * SECTOR_SIZE;
+
+    CHECK(blkno >= last_write_end);
+    last_write_end = blkno + blkcnt;
+    card_writes++;
+    for (uint32_t i = 0; i < blkcnt; i++)
+    {
+        uint32_t s = blkno + i;
+        int64_t ver = stamp_version(buf + i * SECTOR_SIZE, s);
+
+        // A crash after this sector must leave something the application wrote, no older than before
+        CHECK(ver >= 0);
+        if (ver < 0)
+            continue;
+        CHECK(ver <= model_ver[s]);
+        CHECK(ver >= durable_ver[s]);
+        durable_ver[s] = ver;
+    }
+    return pwrite(card_fd, buf, blkcnt * SECTOR_SIZE, (off_t)blkno * SECTOR_SIZE) == blkcnt * SECTOR_SIZE;
+}
+
+static int8_t card_poll(void *ctx)
+{
+    (void)ctx;
+    return 1;
+}
+
+static void card_abort(void *ctx)
+{
+    (void)ctx;
+}
+
+static const sdq_backend_t card_backend = {card_busy, card_start, card_poll, card_abort, NULL, SECTOR_SIZE, SECTOR_SIZE, 127};
+
+/* What disk_initialize needs besides the queue */
+
+void sdq_init(sdcard_t *card)
+{
+    sdq_init_backend(&card_backend, card);
+}
+
+uint8_t sdcard_detect(sdcard_t *card)
+{
+    card->read_bl_len = SECTOR_SIZE;
+    card->write_bl_len = SECTOR_SIZE;
+    card->blk_cnt = CARD_SECTORS;
+    return 1;
+}
+
+void clk_enable(uint32_t reg, uint8_t bit) {}
+void clk_reset_set(uint32_t reg, uint8_t bit) {}
+void clk_reset_clear(uint32_t reg, uint8_t bit) {}
+void gpio_init(uint32_t port, uint32_t pin_mask, gpio_mode_e mode, gpio_pull_e pull, gpio_drv_e drv) {}
+
+/* Workload */
+
+static uint32_t rnd_state = 12345;
+
+static uint32_t rnd(uint32_t n)
+{
+    rnd_state = rnd_state * 1103515245u + 12345u;
+    return (rnd_state >> 8) % n;
+}
+
+static void check_durable(const char *when)
+{
+    uint32_t bad = 0;
+
+    for (uint32_t s = 0; s < CARD_SECTORS; s++)
+    {
+        if (pread(card_fd, io_buf, SECTOR_SIZE, (off_t)s * SECTOR_SIZE) != SECTOR_SIZE ||
+            stamp_version(io_buf, s) != model_ver[s])
+            bad++;
+    }
+    if (bad)
+        printf("%s: %u sectors not on the card\n", when, bad);
+    CHECK_EQ(bad, 0);
+}
+
+static void app_write(uint32_t sector, uint32_t count, uint32_t op)
+{
+    for (uint32_t i = 0; i < count; i++)
+    {
+        model_ver[sector + i]++;
+        model_op[sector + i] = op;
+        stamp(io_buf + i * SECTOR_SIZE, sector + i, model_ver[sector + i]);
+    }
+    CHECK_EQ(disk_write(DEV_MMC, io_buf, sector, count), RES_OK);
+}
+
+static void app_read(uint32_t sector, uint32_t count)
+{
+    CHECK_EQ(disk_read(DEV_MMC, io_buf, sector, count), RES_OK);
+    for (uint32_t i = 0; i < count; i++)
+        CHECK_EQ(stamp_version(io_buf + i * SECTOR_SIZE, sector + i), model_ver[sector + i]);
+}
+
+static void test_setup(void)
+{
+    card_fd = fileno(tmpfile());
+    for (uint32_t s = 0; s < CARD_SECTORS; s++)
+    {
+        stamp(io_buf, s, 0);
+        CHECK_EQ(pwrite(card_fd, io_buf, SECTOR_SIZE, (off_t)s * SECTOR_SIZE), SECTOR_SIZE);
+    }
+    host_interrupt = sdq_irq;
+    CHECK_EQ(disk_initialize(DEV_MMC), 0);
+    CHECK(cache_enabled);
+}
+
+static void test_workload(void)
+{
+    uint32_t evictions = 0, syncs = 0;
+
+    for (uint32_t op = 1; op <= OPS; op++)
+    {
+        uint32_t kind = rnd(100), count, sector;
+        uint32_t written = cache_written;
+
+        last_write_end = 0;
+        if (kind < 55)
+        {
+            count = 1 + rnd(16);
+            sector = rnd(AREA_SECTORS - count);
+            app_write(sector, count, op);
+        }
+        else if (kind < 60)
+        {
+            count = DISKIO_CACHE_BYPASS + rnd(16);
+            sector = rnd(AREA_SECTORS - count);
+            app_write(sector, count, op);
+        }
+        else if (kind < 98)
+        {
+            count = 1 + rnd(100);
+            sector = rnd(AREA_SECTORS - count);
+            app_read(sector, count);
+        }
+        else
+        {
+            CHECK_EQ(disk_ioctl(DEV_MMC, CTRL_SYNC, NULL), RES_OK);
+            check_durable("CTRL_SYNC");
+            syncs++;
+            continue;
+        }
+
+        // An eviction writes every dirty page back, all earlier writes are safe from then on
+        if (cache_written != written)
+        {
+            evictions++;
+            for (uint32_t s = 0; s < AREA_SECTORS; s++)
+                if (model_op[s] < op && durable_ver[s] != model_ver[s])
+                {
+                    printf("sector %u lost across the eviction in op %u\n", s, op);
+                    CHECK(0);
+                    break;
+                }
+        }
+    }
+    printf("%u ops, %u evicting flushes, %u syncs, %u card writes\n", OPS, evictions, syncs, card_writes);
+    CHECK(evictions > 10);
+    CHECK(syncs > 10);
+
+    CHECK_EQ(disk_ioctl(DEV_MMC, CTRL_SYNC, NULL), RES_OK);
+    check_durable("final CTRL_SYNC");
+}
+
+static void test_idle_flush(void)
+{
+    uint32_t writes;
+
+    systime = 100000;
+    last_write_end = 0;
+    app_write(10, 3, OPS + 1);
+    app_write(4000, 8, OPS + 2);
+    writes = card_writes;
+
+    // Still fresh, the pages stay in the cache
+    systime += DISKIO_CACHE_FLUSH_MS - 1;
+    disk_cache_poll();
+    CHECK_EQ(card_writes, writes);
+    CHECK(durable_ver[10] != model_ver[10]);
+
+    systime += 1;
+    last_write_end = 0;
+    disk_cache_poll();
+    CHECK_EQ(card_writes, writes + 2);
+    CHECK_EQ(cache_dirty_count, 0);
+    check_durable("idle flush");
+}
+
+int main(void)
+{
+    test_setup();
+    test_workload();
+    test_idle_flush();
+    return TEST_RESULT();
+}
@@ -0,0 +1,401 @@
+// Priority masks, nested dispatch and statistics of the usb-sdcard f1c100s_intc.c on a simulated INTC
+//
+// The model keeps the pending sources and answers INTC_VECTOR with the highest priority source that is
+// pending, enabled and not masked, the lowest number first within a level. Handlers clear their own
+// source and may raise others, calling irq_handler() again from a handler is a preemption.
+
+#include <string.h>
+#include "test.h"
+#include "mmio.h"
+
+#include "f1c100s_intc.c"
+
+static struct
+{
+    uint32_t pend[2];
+    uint32_t clock;
+    uint32_t nested_calls;
+} intc_model;
+
+static uint8_t model_prio(uint32_t irq)
+{
+    return (mmio_peek(INTC_BASE + INTC_PRIORITY0 + irq / 16 * 4, 4) >> ((irq % 16) * 2)) & 3;
+}
+
+// The source the INTC would signal now, -1 for none
+static int model_active(void)
+{
+    int best = -1;
+
+    for (uint32_t irq = 0; irq < IRQ_COUNT; irq++)
+    {
+        uint32_t r = irq / 32, bit = 1u << (irq % 32);
+
+        if (!(intc_model.pend[r] & bit) || !(mmio_peek(INTC_BASE + INTC_ENABLE0 + r * 4, 4) & bit) ||
+            (mmio_peek(INTC_BASE + INTC_MASK0 + r * 4, 4) & bit))
+            continue;
+        if (best < 0 || model_prio(irq) > model_prio(best))
+            best = irq;
+    }
+    return best;
+}
+
+static uint32_t intc_read(void *ctx, uint32_t offset, unsigned size)
+{
+    (void)ctx;
+    if (offset == INTC_VECTOR)
+        return model_active() << 2;
+    if (offset == INTC_PEND0 || offset == INTC_PEND1)
+        return intc_model.pend[(offset - INTC_PEND0) / 4];
+    return mmio_peek(INTC_BASE + offset, size);
+}
+
+static void model_raise(uint32_t irq)
+{
+    intc_model.pend[irq / 32] |= 1u << (irq % 32);
+}
+
+static void model_clear(uint32_t irq)
+{
+    intc_model.pend[irq / 32] &= ~(1u << (irq % 32));
+}
+
+// What the IRQ entry of vectors.S does for the active source
+static void model_take_irq(void)
+{
+    CHECK(model_active() >= 0);
+    irq_handler();
+}
+
+// Stand-in for the mode switch in vectors.S
+void intc_call_nested(intc_irq_handler handler)
+{
+    intc_model.nested_calls++;
+    handler();
+}
+
+static uint32_t model_clock(void)
+{
+    return intc_model.clock;
+}
+
+static void model_reset(void)
+{
+    mmio_reset();
+    mmio_map(INTC_BASE, 0x100, intc_read, NULL, NULL);
+    memset(&intc_model, 0, sizeof(intc_model));
+    intc_init();
+    intc_set_stats_clock(NULL);
+    irq_depth = 0;
+}
+
+static uint32_t mask0(void)
+{
+    return mmio_peek(INTC_BASE + INTC_MASK0, 4);
+}
+
+static uint32_t mask1(void)
+{
+    return mmio_peek(INTC_BASE + INTC_MASK1, 4);
+}
+
+#define BIT(irq) (1u << ((irq) % 32))
+#define ALL0 0xFFFFFFFFu
+#define ALL1 ((1u << (IRQ_COUNT - 32)) - 1)
+
+static void test_masks(void)
+{
+    uint8_t p;
+
+    model_reset();
+    for (p = 0; p < INTC_PRIO_LEVELS; p++)
+    {
+        CHECK_EQ(prio_preempt[p], 0);
+        CHECK_EQ(prio_masked[p][0], ALL0);
+        CHECK_EQ(prio_masked[p][1], ALL1);
+    }
+    for (p = 0; p < 4; p++)
+        CHECK_EQ(mmio_peek(INTC_BASE + INTC_PRIORITY0 + p * 4, 4), 0);
+
+    intc_set_priority(IRQ_TIMER0, 3);
+    intc_set_priority(IRQ_MMC0, 1);
+    intc_set_priority(IRQ_GPIOE, 1);
+    CHECK_EQ(model_prio(IRQ_TIMER0), 3);
+    CHECK_EQ(model_prio(IRQ_MMC0), 1);
+    CHECK_EQ(model_prio(IRQ_GPIOE), 1);
+    CHECK_EQ(model_prio(IRQ_TIMER1), 0);
+    CHECK_EQ(model_prio(IRQ_MMC1), 0);
+
+    // Each level masks itself and everything below, a level preempts when one above has sources
+    CHECK_EQ(prio_masked[0][0], ALL0 & ~BIT(IRQ_TIMER0) & ~BIT(IRQ_MMC0));
+    CHECK_EQ(prio_masked[0][1], ALL1 & ~BIT(IRQ_GPIOE));
+    CHECK_EQ(prio_masked[1][0], ALL0 & ~BIT(IRQ_TIMER0));
+    CHECK_EQ(prio_masked[1][1], ALL1);
+    CHECK_EQ(prio_masked[2][0], prio_masked[1][0]);
+    CHECK_EQ(prio_masked[2][1], ALL1);
+    CHECK_EQ(prio_masked[3][0], ALL0);
+    CHECK_EQ(prio_masked[3][1], ALL1);
+    CHECK_EQ(prio_preempt[0], 1);
+    CHECK_EQ(prio_preempt[1], 1);
+    CHECK_EQ(prio_preempt[2], 1);
+    CHECK_EQ(prio_preempt[3], 0);
+
+    // Moving the only top level source down leaves nothing above level 1
+    intc_set_priority(IRQ_TIMER0, 1);
+    CHECK_EQ(model_prio(IRQ_TIMER0), 1);
+    CHECK_EQ(prio_preempt[0], 1);
+    CHECK_EQ(prio_preempt[1], 0);
+    CHECK_EQ(prio_preempt[3], 0);
+    CHECK_EQ(prio_masked[0][0], ALL0 & ~BIT(IRQ_TIMER0) & ~BIT(IRQ_MMC0));
+    CHECK_EQ(prio_masked[1][0], ALL0);
+
+    // Back to level 0 for all, as after intc_init()
+    intc_set_priority(IRQ_TIMER0, 0);
+    intc_set_priority(IRQ_MMC0, 0);
+    intc_set_priority(IRQ_GPIOE, 0);
+    for (p = 0; p < INTC_PRIO_LEVELS; p++)
+    {
+        CHECK_EQ(prio_preempt[p], 0);
+        CHECK_EQ(prio_masked[p][0], ALL0);
+        CHECK_EQ(prio_masked[p][1], ALL1);
+    }
+}
+
+// Masks seen by each handler and what the scenario of test_nesting() raises from them
+static uint32_t seen_mask[IRQ_COUNT][2];
+static uint32_t seen_depth[IRQ_COUNT];
+static uint32_t handler_order[8];
+static unsigned handler_count;
+
+static void record(uint32_t irq)
+{
+    seen_mask[irq][0] = mask0();
+    seen_mask[irq][1] = mask1();
+    seen_depth[irq] = irq_depth;
+    if (handler_count < 8)
+        handler_order[handler_count] = irq;
+    handler_count++;
+    model_clear(irq);
+}
+
+static void timer0_handler(void)
+{
+    record(IRQ_TIMER0);
+    intc_model.clock += 5;
+}
+
+static void mmc0_handler(void)
+{
+    record(IRQ_MMC0);
+    intc_model.clock += 10;
+    // The tick fires in the middle, a level 0 source stays queued behind
+    model_raise(IRQ_TIMER0);
+    model_raise(IRQ_UART0);
+    CHECK_EQ(model_active(), IRQ_TIMER0);
+    model_take_irq();
+    CHECK_EQ(model_active(), -1);
+    intc_model.clock += 10;
+}
+
+static void usbotg_handler(void)
+{
+    record(IRQ_USBOTG);
+    intc_model.clock += 100;
+    // Level 1 preempts, and another level 0 source waits
+    model_raise(IRQ_GPIOE);
+    model_raise(IRQ_MMC0);
+    CHECK_EQ(model_active(), IRQ_MMC0);
+    model_take_irq();
+    CHECK_EQ(model_active(), -1);
+    intc_model.clock += 100;
+}
+
+static void uart0_handler(void)
+{
+    record(IRQ_UART0);
+    intc_model.clock += 7;
+}
+
+static void gpioe_handler(void)
+{
+    record(IRQ_GPIOE);
+    intc_model.clock += 3;
+}
+
+static void setup_nesting(void)
+{
+    static const uint32_t irqs[] = {IRQ_TIMER0, IRQ_MMC0, IRQ_USBOTG, IRQ_UART0, IRQ_GPIOE};
+    static const intc_irq_handler handlers[] = {timer0_handler, mmc0_handler, usbotg_handler, uart0_handler,
+                                                gpioe_handler};
+
+    model_reset();
+    for (unsigned i = 0; i < sizeof(irqs) / sizeof(irqs[0]); i++)
+    {
+        intc_set_irq_handler(irqs[i], handlers[i]);
+        intc_enable_irq(irqs[i]);
+    }
+    intc_set_priority(IRQ_TIMER0, INTC_PRIO_LEVELS - 1);
+    intc_set_priority(IRQ_MMC0, 1);
+    memset(seen_mask, 0, sizeof(seen_mask));
+    memset(seen_depth, 0, sizeof(seen_depth));
+    handler_count = 0;
+}
+
+static void test_nesting(void)
+{
+    // Masks set by someone else survive the dispatch
+    const uint32_t outer0 = BIT(IRQ_SPI1), outer1 = BIT(IRQ_VE);
+
+    setup_nesting();
+    mmio_poke(INTC_BASE + INTC_MASK0, outer0, 4);
+    mmio_poke(INTC_BASE + INTC_MASK1, outer1, 4);
+
+    model_raise(IRQ_USBOTG);
+    model_take_irq();
+
+    // USBOTG, preempted by MMC0, preempted by the tick
+    CHECK_EQ(handler_count, 3);
+    CHECK_EQ(handler_order[0], IRQ_USBOTG);
+    CHECK_EQ(handler_order[1], IRQ_MMC0);
+    CHECK_EQ(handler_order[2], IRQ_TIMER0);
+    CHECK_EQ(seen_depth[IRQ_USBOTG], 1);
+    CHECK_EQ(seen_depth[IRQ_MMC0], 2);
+    CHECK_EQ(seen_depth[IRQ_TIMER0], 3);
+    // Levels 0 and 1 run nested, the top level is a direct call
+    CHECK_EQ(intc_model.nested_calls, 2);
+
+    CHECK_EQ(seen_mask[IRQ_USBOTG][0], outer0 | prio_masked[0][0]);
+    CHECK_EQ(seen_mask[IRQ_USBOTG][1], outer1 | prio_masked[0][1]);
+    CHECK(!(seen_mask[IRQ_USBOTG][0] & BIT(IRQ_MMC0)));
+    CHECK(!(seen_mask[IRQ_USBOTG][0] & BIT(IRQ_TIMER0)));
+    CHECK(seen_mask[IRQ_USBOTG][0] & BIT(IRQ_UART0));
+    CHECK(seen_mask[IRQ_USBOTG][1] & BIT(IRQ_GPIOE));
+    CHECK_EQ(seen_mask[IRQ_MMC0][0], outer0 | prio_masked[1][0]);
+    CHECK_EQ(seen_mask[IRQ_MMC0][1], outer1 | prio_masked[1][1]);
+    CHECK(!(seen_mask[IRQ_MMC0][0] & BIT(IRQ_TIMER0)));
+    // The tick runs with the masks of the handler it preempted
+    CHECK_EQ(seen_mask[IRQ_TIMER0][0], seen_mask[IRQ_MMC0][0]);
+    CHECK_EQ(seen_mask[IRQ_TIMER0][1], seen_mask[IRQ_MMC0][1]);
+
+    // Unwound to what was there before, the level 0 sources that waited come next
+    CHECK_EQ(mask0(), outer0);
+    CHECK_EQ(mask1(), outer1);
+    CHECK_EQ(irq_depth, 0);
+    CHECK_EQ(model_active(), IRQ_UART0);
+    model_take_irq();
+    CHECK_EQ(model_active(), IRQ_GPIOE);
+    model_take_irq();
+    CHECK_EQ(model_active(), -1);
+    CHECK_EQ(seen_depth[IRQ_UART0], 1);
+    CHECK_EQ(seen_mask[IRQ_UART0][0], outer0 | prio_masked[0][0]);
+    CHECK_EQ(mask0(), outer0);
+    CHECK_EQ(mask1(), outer1);
+}
+
+static void test_flat(void)
+{
+    // Everything at one level, no masking and no mode switch
+    model_reset();
+    intc_set_irq_handler(IRQ_UART0, uart0_handler);
+    intc_enable_irq(IRQ_UART0);
+    handler_count = 0;
+
+    model_raise(IRQ_UART0);
+    model_take_irq();
+    CHECK_EQ(handler_count, 1);
+    CHECK_EQ(intc_model.nested_calls, 0);
+    CHECK_EQ(seen_mask[IRQ_UART0][0], 0);
+    CHECK_EQ(seen_mask[IRQ_UART0][1], 0);
+    CHECK_EQ(mask0(), 0);
+}
+
+static void test_undefined(void)
+{
+    model_reset();
+    intc_enable_irq(IRQ_SPI0);
+    intc_enable_irq(IRQ_I2S);
+    model_raise(IRQ_SPI0);
+    model_take_irq();
+    CHECK(!(mmio_peek(INTC_BASE + INTC_ENABLE0, 4) & BIT(IRQ_SPI0)));
+    model_raise(IRQ_I2S);
+    model_take_irq();
+    CHECK(!(mmio_peek(INTC_BASE + INTC_ENABLE1, 4) & BIT(IRQ_I2S)));
+    CHECK_EQ(model_active(), -1);
+    CHECK_EQ(intc_get_stats(IRQ_SPI0)->count, 0);
+}
+
+static void test_stats(void)
+{
+    const intc_stats_t *usb, *mmc, *tick, *uart, *gpio;
+
+    // Counts without a clock
+    setup_nesting();
+    model_raise(IRQ_USBOTG);
+    model_take_irq();
+    CHECK_EQ(intc_get_stats(IRQ_USBOTG)->count, 1);
+    CHECK_EQ(intc_get_stats(IRQ_USBOTG)->nested, 0);
+    CHECK_EQ(intc_get_stats(IRQ_MMC0)->nested, 1);
+    CHECK_EQ(intc_get_stats(IRQ_TIMER0)->nested, 1);
+    CHECK_EQ(intc_get_stats(IRQ_USBOTG)->run_total, 0);
+    CHECK_EQ(intc_get_stats(IRQ_UART0)->latency_max, 0);
+
+    // Timed: USBOTG 0..225, MMC0 100..125 with the tick at 110..115
+    setup_nesting();
+    intc_model.clock = 1000;
+    intc_set_stats_clock(model_clock);
+    model_raise(IRQ_USBOTG);
+    model_take_irq();
+    usb = intc_get_stats(IRQ_USBOTG);
+    mmc = intc_get_stats(IRQ_MMC0);
+    tick = intc_get_stats(IRQ_TIMER0);
+    CHECK_EQ(usb->count, 1);
+    CHECK_EQ(usb->run_max, 225);
+    CHECK_EQ(usb->run_total, 225);
+    CHECK_EQ(mmc->run_max, 25);
+    CHECK_EQ(tick->run_max, 5);
+    CHECK_EQ(tick->run_total, 5);
+
+    // UART0 and GPIOE were first seen pending when the tick returned
+    intc_model.clock += 40;
+    model_take_irq();
+    intc_model.clock += 2;
+    model_take_irq();
+    uart = intc_get_stats(IRQ_UART0);
+    gpio = intc_get_stats(IRQ_GPIOE);
+    CHECK_EQ(uart->latency_max, 1225 + 40 - 1115);
+    CHECK_EQ(gpio->latency_max, 1225 + 40 + 7 + 2 - 1115);
+    CHECK_EQ(uart->run_max, 7);
+    CHECK_EQ(gpio->run_max, 3);
+    // Nothing left stamped, a direct hit has no latency
+    CHECK_EQ(irq_pend_seen[0], 0);
+    CHECK_EQ(irq_pend_seen[1], 0);
+    model_raise(IRQ_UART0);
+    model_take_irq();
+    CHECK_EQ(uart->count, 2);
+    CHECK_EQ(uart->latency_max, 150);
+    CHECK_EQ(uart->run_total, 14);
+
+    // Maxima keep the worst, totals add up
+    model_raise(IRQ_USBOTG);
+    model_take_irq();
+    CHECK_EQ(usb->count, 2);
+    CHECK_EQ(usb->run_max, 225);
+    CHECK_EQ(usb->run_total, 450);
+    CHECK_EQ(tick->count, 2);
+    CHECK_EQ(tick->nested, 2);
+
+    intc_reset_stats();
+    CHECK_EQ(usb->count, 0);
+    CHECK_EQ(usb->run_total, 0);
+    CHECK_EQ(uart->latency_max, 0);
+}
+
+int main(void)
+{
+    test_masks();
+    test_nesting();
+    test_flat();
+    test_undefined();
+    test_stats();
+    return TEST_RESULT();
+}
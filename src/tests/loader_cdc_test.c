@@ -0,0 +1,348 @@
+// CDC upload loader of bootloader-cdc2 against the simulated MUSB
+//
+// The test is the host: it enumerates the device and uploads an image through the EP3 command
+// protocol, running the IRQ handler and usb_handler() in between as the loader's main loop does. The
+// NDMA channel that moves the EP3 packets to RAM is a struct pointer as well, it is trapped with
+// musb_trap_bus() and modelled here.
+
+#include <string.h>
+#include <sys/mman.h>
+#include "test.h"
+#include "mmio.h"
+#include "musb.h"
+
+#define main loader_main
+#include "main.c"
+#undef main
+
+void system_init(void) {}
+void v5_cache_inv_range(unsigned long start, unsigned long end)
+{
+    (void)start;
+    (void)end;
+}
+
+void printChar(char chr)
+{
+    (void)chr;
+}
+
+void printStr(const char *str)
+{
+    (void)str;
+}
+
+void print8(uint8_t u8)
+{
+    (void)u8;
+}
+
+void print16(uint16_t u16)
+{
+    (void)u16;
+}
+
+void print32(uint32_t u32)
+{
+    (void)u32;
+}
+
+void printDec8(uint8_t u8)
+{
+    (void)u8;
+}
+
+void printDec16(uint16_t u16)
+{
+    (void)u16;
+}
+
+void intc_enable_irq(intc_irq_vector_e irq)
+{
+    (void)irq;
+}
+
+void intc_disable_irq(intc_irq_vector_e irq)
+{
+    (void)irq;
+}
+
+void intc_set_irq_handler(intc_irq_vector_e irq, intc_irq_handler handler)
+{
+    (void)irq;
+    (void)handler;
+}
+
+void intc_set_irq_base(uint32_t vectorBaseAddress)
+{
+    (void)vectorBaseAddress;
+}
+
+void clk_enable(uint32_t reg, uint8_t bit)
+{
+    (void)reg;
+    (void)bit;
+}
+
+void clk_disable(uint32_t reg, uint8_t bit)
+{
+    (void)reg;
+    (void)bit;
+}
+
+void clk_reset_set(uint32_t reg, uint8_t bit)
+{
+    (void)reg;
+    (void)bit;
+}
+
+void clk_reset_clear(uint32_t reg, uint8_t bit)
+{
+    (void)reg;
+    (void)bit;
+}
+
+void clk_usb_config(uint8_t clock, uint8_t reset)
+{
+    (void)clock;
+    (void)reset;
+}
+
+#define EP_DATA_OUT 3
+#define LOAD_SIZE 0x10000
+
+#define NDMA0 (NDMA_ADR(0) - DMA_BASE)
+#define NDMA_LOAD (1u << 31)
+#define NDMA_BUSY (1u << 30)
+
+// NDMA channel 0, a load starts the transfer and it stays busy until ndma_finish()
+static struct
+{
+    unsigned started, errors;
+} ndma;
+
+static void ndma_write(void *ctx, uint32_t offset, uint32_t value, unsigned size)
+{
+    (void)ctx;
+    if (offset == NDMA0 && (value & NDMA_LOAD))
+    {
+        uint32_t src = mmio_peek(NDMA_ADR(0) + 4, 4);
+        uint32_t dst = mmio_peek(NDMA_ADR(0) + 8, 4);
+        uint32_t len = mmio_peek(NDMA_ADR(0) + 12, 4);
+
+        // EP3 FIFO in IO mode to RAM, bytes, inside what the test mapped
+        if (src != USB_BASE + 0x0C || ((value >> 5) & 3) != 1 || ((value >> 21) & 3) != 0 ||
+            dst < LOAD_ADDR || dst + len > LOAD_ADDR + LOAD_SIZE || len > musb_out_pending(EP_DATA_OUT) * 512)
+            ndma.errors++;
+        ndma.started++;
+        value = (value & ~NDMA_LOAD) | NDMA_BUSY;
+    }
+    mmio_poke(DMA_BASE + offset, value, size);
+}
+
+// The channel moves the packet RxPktRdy still holds
+static void ndma_finish(void)
+{
+    uint32_t cfg = mmio_peek(NDMA_ADR(0), 4);
+    uint32_t dst = mmio_peek(NDMA_ADR(0) + 8, 4);
+    uint32_t len = mmio_peek(NDMA_ADR(0) + 12, 4);
+
+    CHECK(cfg & NDMA_BUSY);
+    for (uint32_t i = 0; i < len; i++)
+        ((uint8_t *)(uintptr_t)dst)[i] = musb_fifo_read(EP_DATA_OUT, 1);
+    mmio_poke(NDMA_ADR(0), cfg & ~NDMA_BUSY, 4);
+}
+
+// Lets the device handle everything the host did, as the IRQ and main loop would
+static void usb_run(void)
+{
+    do
+        usb_irq_handler();
+    while (usb_handler());
+    CHECK(!(pendingBus | pendingEp));
+}
+
+// One control transfer, data goes out when the request is host to device, returns the length of the
+// data stage from the device
+static int host_control(uint8_t type, uint8_t request, uint16_t value, uint16_t index, uint16_t length,
+                        uint8_t *data)
+{
+    uint8_t setup[8] = {type, request, value, value >> 8, index, index >> 8, length, length >> 8};
+    unsigned status = musb_ep0_status_count;
+    int total = 0, n;
+
+    CHECK(musb_setup(setup));
+    usb_run();
+    if (!(type & 0x80) && length)
+    {
+        // The loader takes the data stage as the next EP0 interrupt
+        CHECK(musb_out(0, data, length));
+        usb_run();
+    }
+    CHECK_EQ(musb_out_pending(0), 0);
+    if (type & 0x80)
+    {
+        while ((n = musb_in(0, data + total, 64)) >= 0)
+        {
+            total += n;
+            if (n < 64)
+                break;
+        }
+    }
+    CHECK(total <= length);
+    CHECK_EQ(musb_ep0_status_count, status + 1);
+    return total;
+}
+
+static void host_enumerate(void)
+{
+    uint8_t data[256];
+    unsigned i, len, out_resets = musb_toggle_resets[EP_DATA_OUT][0];
+
+    musb_bus_reset(1);
+    usb_run();
+    CHECK_EQ(host_control(0x80, 0x06, 0x0100, 0, 64, data), 18);
+    CHECK_EQ(data[1], 1);
+    host_control(0x00, 0x05, 6, 0, 0, data); // SET_ADDRESS
+    CHECK_EQ(musb_address(), 6);
+    CHECK_EQ(host_control(0x80, 0x06, 0x0200, 0, 9, data), 9);
+    len = data[2] | data[3] << 8;
+    CHECK_EQ(host_control(0x80, 0x06, 0x0200, 0, 255, data), len);
+
+    // Interrupt EP1 in, bulk EP2 in and EP3 out
+    for (i = 0; i < len; i += data[i])
+        if (data[i + 1] == 5)
+            CHECK(data[i + 2] == 0x81 || data[i + 2] == 0x82 || data[i + 2] == EP_DATA_OUT);
+
+    CHECK_EQ(host_control(0x80, 0x06, 0x0300, 0, 255, data), 4);
+    CHECK_EQ(host_control(0x80, 0x06, 0x0302, 0x0409, 255, data), 2 + 2 * 11);
+    CHECK(memcmp(&data[2], "F\0001\000C\0002\0000\0000\000s\000 \000C\000D\000C\000", 22) == 0);
+    host_control(0x00, 0x09, 1, 0, 0, data); // SET_CONFIGURATION
+    CHECK_EQ(musb_toggle_resets[EP_DATA_OUT][0], out_resets + 1);
+}
+
+static void test_enumeration(void)
+{
+    static const uint8_t coding[7] = {0x00, 0xC2, 0x01, 0x00, 0, 0, 8}; // 115200 8N1
+    uint8_t data[16];
+
+    host_enumerate();
+
+    memcpy(data, coding, 7);
+    CHECK_EQ(sizeof(CDC_LINECODING), 7);
+    CHECK_EQ(host_control(0x21, 0x20, 0, 0, 7, data), 0);
+    CHECK_EQ(lineCoding.dwDTERate, 115200);
+    CHECK_EQ(ep0State, EP0STATE_CONTROL_PACKET);
+    memset(data, 0, sizeof(data));
+    CHECK_EQ(host_control(0xA1, 0x21, 0, 0, 7, data), 7);
+    CHECK(memcmp(data, coding, 7) == 0);
+    CHECK_EQ(host_control(0x21, 0x22, 3, 0, 0, data), 0); // SET_CONTROL_LINE_STATE DTR RTS
+}
+
+static void host_upload_command(uint32_t len)
+{
+    uint8_t cmd[5] = {EP3COMMAND_UPLOAD_TO_RAM, len, len >> 8, len >> 16, len >> 24};
+
+    CHECK(musb_out(EP_DATA_OUT, cmd, sizeof(cmd)));
+    usb_run();
+    CHECK_EQ(ep3State, EP3STATE_WAIT_DATA);
+    CHECK_EQ(ep3DataLength, len);
+    CHECK_EQ(musb_out_pending(EP_DATA_OUT), 0);
+}
+
+static uint8_t image[LOAD_SIZE];
+
+static void test_upload(void)
+{
+    static const uint32_t sizes[] = {512, 4096, 1000, 33};
+    uint8_t *ram = (uint8_t *)LOAD_ADDR;
+    uint32_t i, j, offset = 0;
+
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+    {
+        uint32_t len = sizes[i], sent = 0;
+
+        for (j = 0; j < len; j++)
+            image[offset + j] = (i + j) * 29 >> 1;
+        host_upload_command(len);
+        while (sent < len)
+        {
+            uint32_t n = len - sent < 512 ? len - sent : 512, started = ndma.started;
+
+            CHECK(musb_out(EP_DATA_OUT, &image[offset + sent], n));
+            usb_irq_handler();
+            CHECK(usb_handler());
+            CHECK_EQ(ndma.started, started + 1);
+            CHECK_EQ(ep3State, EP3STATE_WAIT_DMA);
+
+            // The main loop does not sleep while the DMA runs, the packet stays in the FIFO
+            CHECK(usb_handler());
+            CHECK_EQ(musb_out_pending(EP_DATA_OUT), 1);
+            ndma_finish();
+            CHECK(usb_handler());
+            CHECK_EQ(musb_out_pending(EP_DATA_OUT), 0);
+            sent += n;
+        }
+        CHECK(!usb_handler());
+        CHECK_EQ(ep3State, EP3STATE_WAIT_COMMAND);
+        offset += len;
+        CHECK_EQ(loadAddress, LOAD_ADDR + offset);
+    }
+    CHECK(memcmp(ram, image, offset) == 0);
+    CHECK_EQ(ndma.errors, 0);
+}
+
+// Only latched events do something, the main loop sleeps in between
+static void test_idle(void)
+{
+    uint8_t data[8];
+    unsigned started = ndma.started;
+
+    CHECK(!usb_handler());
+    CHECK(!(pendingBus | pendingEp));
+
+    host_upload_command(4);
+    CHECK(musb_out(EP_DATA_OUT, "abcd", 4));
+    CHECK(!usb_handler()); // Not latched by the IRQ yet
+    CHECK_EQ(ndma.started, started);
+    usb_irq_handler();
+    CHECK(pendingEp & 1 << 19);
+    CHECK(usb_handler());
+    CHECK_EQ(ep3State, EP3STATE_WAIT_DMA);
+    CHECK_EQ(ndma.started, started + 1);
+    ndma_finish();
+    usb_run();
+    CHECK_EQ(ep3State, EP3STATE_WAIT_COMMAND);
+    CHECK(memcmp((uint8_t *)loadAddress - 4, "abcd", 4) == 0);
+
+    // Suspend is not a reset, the address stays
+    musb_suspend();
+    usb_run();
+    CHECK_EQ(musb_address(), 6);
+
+    // A reset drops the EP0 event latched before it, the SETUP packet went with the flushed FIFO
+    CHECK(musb_setup((const uint8_t[8]){0x80, 0x06, 0x00, 0x01, 0, 0, 18, 0}));
+    usb_irq_handler();
+    musb_bus_reset(1);
+    usb_run();
+    CHECK_EQ(musb_in(0, data, sizeof(data)), -1);
+    CHECK_EQ(musb_address(), 0);
+}
+
+int main(void)
+{
+    musb_init();
+    musb_trap_bus(DMA_BASE, 0x1000);
+    mmio_map(DMA_BASE, 0x1000, NULL, ndma_write, NULL);
+    if (mmap((void *)LOAD_ADDR, LOAD_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE,
+             -1, 0) != (void *)LOAD_ADDR)
+    {
+        perror("mapping the load address");
+        return 1;
+    }
+    usb_init();
+    test_enumeration();
+    test_upload();
+    test_idle();
+    return TEST_RESULT();
+}
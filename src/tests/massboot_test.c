@@ -0,0 +1,295 @@
+// Bulk-Only mass storage of the usb-massboot f1c100s_usbm.c against the simulated MUSB
+//
+// The test is the host: it enumerates the device, sends CBWs and data packets and takes the data and
+// CSW packets, running the IRQ handler and usbd_handler() in between as the firmware's main loop does.
+
+#include <string.h>
+#include "test.h"
+#include "musb.h"
+
+// sdelay() of the driver is ARM assembly, on the host its statement becomes (void) 0
+#define __asm__ (void)
+#define __volatile__(...) 0
+#include "f1c100s_usbm.c"
+#undef __asm__
+#undef __volatile__
+
+void clk_enable(uint32_t reg, uint8_t bit)
+{
+    (void)reg;
+    (void)bit;
+}
+
+void clk_disable(uint32_t reg, uint8_t bit)
+{
+    (void)reg;
+    (void)bit;
+}
+
+void clk_reset_set(uint32_t reg, uint8_t bit)
+{
+    (void)reg;
+    (void)bit;
+}
+
+void clk_reset_clear(uint32_t reg, uint8_t bit)
+{
+    (void)reg;
+    (void)bit;
+}
+
+void clk_usb_config(uint8_t clock, uint8_t reset)
+{
+    (void)clock;
+    (void)reset;
+}
+
+#define CARD_BLOCKS 1024
+
+static uint8_t card[CARD_BLOCKS * 512];
+
+static void card_read(uint8_t *buffer, uint32_t blockIndex, uint32_t numBlocks)
+{
+    CHECK(blockIndex + numBlocks <= CARD_BLOCKS);
+    memcpy(buffer, &card[blockIndex * 512], numBlocks * 512);
+}
+
+static void card_write(uint8_t *buffer, uint32_t blockIndex, uint32_t numBlocks)
+{
+    CHECK(blockIndex + numBlocks <= CARD_BLOCKS);
+    memcpy(&card[blockIndex * 512], buffer, numBlocks * 512);
+}
+
+// Lets the device handle everything the host did, as the IRQ and main loop would
+static void usb_run(void)
+{
+    do
+        usbd_irq_handler();
+    while (usbd_handler());
+    CHECK(!usbd_pending());
+}
+
+// One control transfer from the device, returns the length of its data stage
+static int host_control(uint8_t type, uint8_t request, uint16_t value, uint16_t index, uint16_t length,
+                        uint8_t *data)
+{
+    uint8_t setup[8] = {type, request, value, value >> 8, index, index >> 8, length, length >> 8};
+    unsigned status = musb_ep0_status_count;
+    int total = 0, n;
+
+    CHECK(musb_setup(setup));
+    usb_run();
+    while ((n = musb_in(0, data + total, 64)) >= 0)
+    {
+        total += n;
+        if (n < 64)
+            break;
+    }
+    CHECK(total <= length);
+    CHECK_EQ(musb_ep0_status_count, status + 1);
+    return total;
+}
+
+static uint16_t maxp;
+
+static void host_enumerate(uint8_t high_speed)
+{
+    uint8_t data[256];
+
+    musb_reset();
+    usbd_init(CARD_BLOCKS, card_read, card_write);
+    musb_bus_reset(high_speed);
+    usb_run();
+    CHECK_EQ(host_control(0x80, 0x06, 0x0100, 0, 64, data), 18);
+    CHECK_EQ(data[7], 64);
+    CHECK_EQ(host_control(0x00, 0x05, 4, 0, 0, data), 0);
+    CHECK_EQ(musb_address(), 4);
+    CHECK_EQ(host_control(0x80, 0x06, 0x0200, 0, 9, data), 9);
+    CHECK_EQ(host_control(0x80, 0x06, 0x0200, 0, 255, data), 32);
+    maxp = data[9 + 9 + 4] | data[9 + 9 + 5] << 8;
+    CHECK_EQ(maxp, high_speed ? 512 : 64);
+    CHECK_EQ(host_control(0x80, 0x06, 0x0300, 0, 255, data), 4);
+    CHECK_EQ(host_control(0x80, 0x06, 0x0302, 0x0409, 255, data), 48);
+    CHECK_EQ(host_control(0x00, 0x09, 1, 0, 0, data), 0);
+    CHECK_EQ(musb_toggle_resets[EP_BULK_IN][1], 1);
+    CHECK_EQ(musb_toggle_resets[EP_BULK_OUT][0], 1);
+    CHECK_EQ(host_control(0xA1, 0xFE, 0, 0, 1, data), 1); // Get Max LUN
+    CHECK_EQ(data[0], 0);
+}
+
+static uint32_t tag = 0x2000;
+
+static void host_cbw(uint32_t len, uint8_t in, const uint8_t *cb, uint8_t cb_len)
+{
+    uint8_t cbw[31] = {0x55, 0x53, 0x42, 0x43};
+
+    tag++;
+    memcpy(&cbw[4], &tag, 4);
+    memcpy(&cbw[8], &len, 4);
+    cbw[12] = in ? 0x80 : 0;
+    cbw[14] = cb_len;
+    memcpy(&cbw[15], cb, cb_len);
+    CHECK(musb_out(EP_BULK_OUT, cbw, sizeof(cbw)));
+    usb_run();
+}
+
+static void host_data_out(const uint8_t *data, uint32_t len)
+{
+    while (len)
+    {
+        uint32_t n = len < maxp ? len : maxp;
+
+        if (!musb_out(EP_BULK_OUT, data, n))
+        {
+            usb_run();
+            continue;
+        }
+        data += n;
+        len -= n;
+    }
+    usb_run();
+}
+
+// Data stage from the device, ends with a short packet or when len bytes came in
+static uint32_t host_data_in(uint8_t *data, uint32_t len)
+{
+    uint32_t total = 0;
+    int n;
+
+    while (total < len && (n = musb_in(EP_BULK_IN, data + total, len - total)) >= 0)
+    {
+        CHECK(n <= maxp);
+        total += n;
+        if (n < maxp)
+            break;
+    }
+    return total;
+}
+
+static void host_csw(uint32_t residue)
+{
+    uint8_t csw[16];
+    uint32_t v;
+
+    CHECK_EQ(musb_in(EP_BULK_IN, csw, sizeof(csw)), 13);
+    memcpy(&v, &csw[0], 4);
+    CHECK_EQ(v, CSW_SIGNATURE);
+    memcpy(&v, &csw[4], 4);
+    CHECK_EQ(v, tag);
+    memcpy(&v, &csw[8], 4);
+    CHECK_EQ(v, residue);
+    CHECK_EQ(csw[12], 0);
+    CHECK_EQ(musb_in(EP_BULK_IN, csw, sizeof(csw)), -1);
+}
+
+static void rw10(uint8_t *cb, uint8_t op, uint32_t lba, uint16_t blocks)
+{
+    memset(cb, 0, 10);
+    cb[0] = op;
+    cb[2] = lba >> 24;
+    cb[3] = lba >> 16;
+    cb[4] = lba >> 8;
+    cb[5] = lba;
+    cb[7] = blocks >> 8;
+    cb[8] = blocks;
+}
+
+static uint8_t host_buf[256 * 512];
+
+static void test_commands(void)
+{
+    static const uint8_t tur[6] = {TEST_UNIT_READY};
+    static const uint8_t inquiry[6] = {INQUIRY, 0, 0, 0, 36, 0};
+    static const uint8_t capacity[10] = {RD_CAPACITY};
+    uint32_t v;
+
+    host_cbw(0, 0, tur, 6);
+    host_csw(0);
+
+    host_cbw(36, 1, inquiry, 6);
+    CHECK_EQ(host_data_in(host_buf, 36), 36);
+    CHECK(memcmp(&host_buf[8], "F1C100S ", 8) == 0);
+    host_csw(0);
+
+    host_cbw(8, 1, capacity, 10);
+    CHECK_EQ(host_data_in(host_buf, 8), 8);
+    memcpy(&v, &host_buf[0], 4);
+    CHECK_EQ(__builtin_bswap32(v), CARD_BLOCKS - 1);
+    host_csw(0);
+}
+
+static void test_read_write(void)
+{
+    static const uint16_t sizes[] = {1, 8, 127, 128, 200};
+    uint8_t cb[10];
+    unsigned i, j;
+
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+    {
+        uint32_t lba = 10 + i * 150, len = sizes[i] * 512;
+
+        for (j = 0; j < len; j++)
+            host_buf[j] = (i + j) * 37 >> 2;
+        rw10(cb, WR10, lba, sizes[i]);
+        host_cbw(len, 0, cb, 10);
+        host_data_out(host_buf, len);
+        host_csw(0);
+        CHECK(memcmp(&card[lba * 512], host_buf, len) == 0);
+
+        memset(host_buf, 0, len);
+        rw10(cb, RD10, lba, sizes[i]);
+        host_cbw(len, 1, cb, 10);
+        CHECK_EQ(host_data_in(host_buf, len), len);
+        CHECK(memcmp(&card[lba * 512], host_buf, len) == 0);
+        host_csw(0);
+    }
+}
+
+// Only latched events do something, the main loop sleeps in between
+static void test_idle(void)
+{
+    static const uint8_t tur[6] = {TEST_UNIT_READY};
+    uint8_t cbw[31] = {0x55, 0x53, 0x42, 0x43};
+
+    CHECK(!usbd_handler());
+    CHECK(!usbd_pending());
+
+    tag++;
+    memcpy(&cbw[4], &tag, 4);
+    cbw[14] = 6;
+    memcpy(&cbw[15], tur, 6);
+    CHECK(musb_out(EP_BULK_OUT, cbw, sizeof(cbw)));
+    CHECK(!usbd_handler()); // Not latched by the IRQ yet
+    CHECK_EQ(musb_out_pending(EP_BULK_OUT), 1);
+    usbd_irq_handler();
+    CHECK(usbd_pending());
+    CHECK(usbd_handler());
+    host_csw(0);
+
+    // A reset drops what was latched before it, the FIFO the CBW was in is flushed and reading it
+    // would end in the invalid CBW loop
+    CHECK(musb_out(EP_BULK_OUT, cbw, sizeof(cbw)));
+    usbd_irq_handler();
+    musb_bus_reset(0);
+    usb_run();
+    CHECK_EQ(musb_in(EP_BULK_IN, cbw, sizeof(cbw)), -1);
+}
+
+int main(void)
+{
+    uint32_t i;
+
+    musb_init();
+    for (i = 0; i < sizeof(card); i++)
+        card[i] = i * 3 + (i >> 9);
+
+    // High-speed, then full-speed with 64 byte packets
+    for (int hs = 1; hs >= 0; hs--)
+    {
+        host_enumerate(hs);
+        test_commands();
+        test_read_write();
+        test_idle();
+    }
+    return TEST_RESULT();
+}
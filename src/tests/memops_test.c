@@ -0,0 +1,182 @@
+// The C memcpy/memmove/memset of arm926/src/memops.c against byte loops
+//
+// The matrix of membench_libc(): every size below MEMBENCH_CHECK, every 4x4 alignment of destination
+// and source, memmove overlapping by n - 1 to n - 4 bytes in both directions, with guard bytes
+// around the destination. On top of that sizes up to a few KiB with overlaps of 1 to 64 bytes, and
+// sources that end or start at an inaccessible page, so loading a word without source bytes faults.
+
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "test.h"
+#include "membench.h"
+
+#define memcpy memops_memcpy
+#define memmove memops_memmove
+#define memset memops_memset
+#include "memops.c"
+#undef memcpy
+#undef memmove
+#undef memset
+
+typedef enum
+{
+    LIBC_MEMCPY = 0,
+    LIBC_MEMMOVE,
+    LIBC_MEMSET,
+    LIBC_COUNT,
+} libc_test_e;
+
+#define BUF_SIZE (3 * 4096 + 128)
+
+static uint8_t buf[BUF_SIZE], ref[BUF_SIZE];
+
+static void fill(uint8_t *p, uint32_t n, uint32_t seed)
+{
+    while (n--)
+    {
+        seed = seed * 1103515245 + 12345;
+        *p++ = seed >> 16;
+    }
+}
+
+// One call, compared against the same work done bytewise over the whole buffer
+static uint8_t check(libc_test_e test, uint32_t dst, uint32_t src, uint32_t n)
+{
+    uint32_t i;
+
+    fill(buf, BUF_SIZE, dst * 977 + src * 31 + n);
+    memcpy(ref, buf, BUF_SIZE);
+
+    switch (test)
+    {
+    case LIBC_MEMCPY:
+        if (memops_memcpy(buf + dst, buf + src, n) != buf + dst)
+            return 0;
+        for (i = 0; i < n; i++)
+            ref[dst + i] = ref[src + i];
+        break;
+    case LIBC_MEMMOVE:
+        if (memops_memmove(buf + dst, buf + src, n) != buf + dst)
+            return 0;
+        if (dst < src)
+            for (i = 0; i < n; i++)
+                ref[dst + i] = ref[src + i];
+        else
+            for (i = n; i > 0; i--)
+                ref[dst + i - 1] = ref[src + i - 1];
+        break;
+    default:
+        if (memops_memset(buf + dst, 0x100 | src, n) != buf + dst)
+            return 0;
+        for (i = 0; i < n; i++)
+            ref[dst + i] = src;
+        break;
+    }
+
+    return memcmp(buf, ref, BUF_SIZE) == 0;
+}
+
+static void check_one(libc_test_e test, uint32_t dst, uint32_t src, uint32_t n)
+{
+    if (!check(test, dst, src, n))
+    {
+        printf("test %d size %u dst %u src %u wrong\n", test, n, dst, src);
+        test_failures++;
+    }
+}
+
+static void test_membench_matrix(void)
+{
+    uint32_t n, dst, src;
+    libc_test_e test;
+
+    for (test = LIBC_MEMCPY; test < LIBC_COUNT; test++)
+    {
+        for (n = 0; n < MEMBENCH_CHECK; n++)
+        {
+            for (dst = 0; dst < 4; dst++)
+            {
+                for (src = 0; src < 4; src++)
+                {
+                    if (test == LIBC_MEMMOVE)
+                    {
+                        check_one(test, MEMBENCH_CHECK + dst, MEMBENCH_CHECK + 4 + src, n);
+                        check_one(test, MEMBENCH_CHECK + 4 + dst, MEMBENCH_CHECK + src, n);
+                    }
+                    else if (test == LIBC_MEMCPY)
+                    {
+                        check_one(test, dst, MEMBENCH_CHECK * 2 + src, n);
+                    }
+                    else
+                    {
+                        check_one(test, dst, src, n);
+                    }
+                }
+            }
+        }
+    }
+}
+
+static void test_large(void)
+{
+    static const uint32_t sizes[] = {96, 127, 128, 255, 256, 511, 1000, 1024, 4096 - 3, 4096 + 5};
+    uint32_t i, dst, src, gap;
+
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+    {
+        for (dst = 0; dst < 4; dst++)
+        {
+            for (src = 0; src < 4; src++)
+            {
+                check_one(LIBC_MEMCPY, 64 + dst, 64 + 2 * 4096 + src, sizes[i]);
+                check_one(LIBC_MEMSET, dst, src, sizes[i]);
+                for (gap = 1; gap <= 64; gap += gap < 8 ? 1 : 7)
+                {
+                    check_one(LIBC_MEMMOVE, 64 + dst, 64 + dst + gap + src, sizes[i]);
+                    check_one(LIBC_MEMMOVE, 64 + dst + gap + src, 64 + dst, sizes[i]);
+                }
+            }
+        }
+    }
+}
+
+// Copies out of a page with no access on either side
+static void test_page_edges(void)
+{
+    long page = sysconf(_SC_PAGESIZE);
+    uint8_t *map = mmap(NULL, page * 3, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    uint8_t *mid, out[256];
+    uint32_t off, n;
+
+    CHECK(map != MAP_FAILED);
+    if (map == MAP_FAILED)
+        return;
+    mid = map + page;
+    mprotect(map, page, PROT_NONE);
+    mprotect(mid + page, page, PROT_NONE);
+    fill(mid, page, 5);
+
+    for (n = 1; n <= 200; n++)
+    {
+        for (off = 0; off < 4; off++)
+        {
+            memops_memcpy(out + off, mid + page - n, n);
+            CHECK(memcmp(out + off, mid + page - n, n) == 0);
+            memops_memcpy(out + off, mid + off, n);
+            CHECK(memcmp(out + off, mid + off, n) == 0);
+            memops_memmove(mid + off + 1, mid + off, n);
+            memops_memmove(mid + page - n - 1 - off, mid + page - n - off, n);
+        }
+    }
+    munmap(map, page * 3);
+}
+
+int main(void)
+{
+    test_membench_matrix();
+    test_large();
+    test_page_edges();
+    return TEST_RESULT();
+}
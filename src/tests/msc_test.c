@@ -0,0 +1,669 @@
+// Bulk-Only mass storage of the usb-sdcard f1c100s_usbm.c against the simulated MUSB and NDMA
+//
+// The test is the host: it sends CBWs and data packets, takes the data and CSW packets the device sends
+// and clears halts, then checks the transport and the data that reached the card.
+
+#include <string.h>
+#include "test.h"
+#include "cache.h"
+#include "mmio.h"
+#include "musb.h"
+
+// sdelay() of the driver is ARM assembly, on the host its statement becomes (void) 0
+#define __asm__ (void)
+#define __volatile__(...) 0
+#include "f1c100s_usbm.c"
+#undef __asm__
+#undef __volatile__
+#include "f1c100s_dma.c"
+
+void clk_enable(uint32_t reg, uint8_t bit)
+{
+    (void)reg;
+    (void)bit;
+}
+
+void clk_disable(uint32_t reg, uint8_t bit)
+{
+    (void)reg;
+    (void)bit;
+}
+
+void clk_reset_set(uint32_t reg, uint8_t bit)
+{
+    (void)reg;
+    (void)bit;
+}
+
+void clk_reset_clear(uint32_t reg, uint8_t bit)
+{
+    (void)reg;
+    (void)bit;
+}
+
+void clk_usb_config(uint8_t clock, uint8_t reset)
+{
+    (void)clock;
+    (void)reset;
+}
+
+#define CARD_BLOCKS 8192
+
+static struct
+{
+    uint8_t data[CARD_BLOCKS * 512];
+    uint64_t fail_lba; // A read or write touching it fails, 0 for none
+    unsigned reads, writes, dma_errors;
+} card;
+
+static uint8_t card_read(uint8_t *buffer, uint64_t lba, uint32_t blocks)
+{
+    card.reads++;
+    CHECK(lba + blocks <= CARD_BLOCKS);
+    if (card.fail_lba && card.fail_lba >= lba && card.fail_lba < lba + blocks)
+        return 0;
+    memcpy(buffer, &card.data[lba * 512], blocks * 512);
+    return 1;
+}
+
+static uint8_t card_write(uint8_t *buffer, uint64_t lba, uint32_t blocks)
+{
+    card.writes++;
+    CHECK(lba + blocks <= CARD_BLOCKS);
+    // The NDMA wrote the buffer behind the cache
+    CHECK(cache_find('i', (uintptr_t)buffer, (uintptr_t)buffer + blocks * 512));
+    if (card.fail_lba && card.fail_lba >= lba && card.fail_lba < lba + blocks)
+        return 0;
+    memcpy(&card.data[lba * 512], buffer, blocks * 512);
+    return 1;
+}
+
+// Card reads in the background for the pipelined READ, poll finishes one after a few calls
+static struct
+{
+    uint8_t *buffer;
+    uint64_t lba;
+    uint32_t blocks;
+    uint8_t busy, refuse;
+    uint64_t fail_lba;
+    unsigned polls, starts;
+    uint32_t sent_at_start[8]; // Bytes of the READ on the wire when each chunk was started
+} async;
+
+static uint8_t card_read_start(uint8_t *buffer, uint64_t lba, uint32_t blocks)
+{
+    CHECK(!async.busy);
+    CHECK(lba + blocks <= CARD_BLOCKS);
+    if (async.refuse)
+        return 0;
+    if (async.starts < 8)
+        async.sent_at_start[async.starts] = musb_in_pending(EP_BULK_IN) * bulk_maxp;
+    async.starts++;
+    async.buffer = buffer;
+    async.lba = lba;
+    async.blocks = blocks;
+    async.busy = 1;
+    return 1;
+}
+
+static int8_t card_read_poll(void)
+{
+    CHECK(async.busy);
+    if (++async.polls % 3)
+        return 0;
+    async.busy = 0;
+    if (async.fail_lba && async.fail_lba >= async.lba && async.fail_lba < async.lba + async.blocks)
+        return -1;
+    memcpy(async.buffer, &card.data[async.lba * 512], async.blocks * 512);
+    return 1;
+}
+
+// NDMA in memory-to-memory mode, a transfer runs to completion as soon as it is loaded
+static void ndma_write(void *ctx, uint32_t offset, uint32_t value, unsigned size)
+{
+    uint32_t base = DMA_BASE + offset - NDMA_CFG; // Of the channel
+
+    (void)ctx;
+    if (offset >= NDMA_CFG && (offset - NDMA_CFG) % NDMA_CH_SIZE == 0 && (value & NDMA_LOAD))
+    {
+        uint32_t src = mmio_peek(base + NDMA_SRC, 4);
+        uint32_t dst = mmio_peek(base + NDMA_DST, 4);
+        uint32_t len = mmio_peek(base + NDMA_BCNT, 4);
+        uint8_t src_io = (value >> 5) & 3, dst_io = (value >> 21) & 3;
+
+        // A side in IO mode is a FIFO of the USB controller, the memory side has to be coherent
+        if ((src_io && (src < MUSB_BASE || src >= MUSB_BASE + 0x40)) ||
+            (dst_io && (dst < MUSB_BASE || dst >= MUSB_BASE + 0x40)) || len % 4 ||
+            ((value >> 8) & 3) != DMA_WIDTH_32 || ((value >> 24) & 3) != DMA_WIDTH_32)
+            card.dma_errors++;
+        else if (!src_io && !cache_find('c', src, src + len))
+            card.dma_errors++;
+        else if (!dst_io && !cache_find('f', dst, dst + len))
+            card.dma_errors++;
+        // Nothing goes out of the half the card is still reading into
+        else if (async.busy && src < (uintptr_t)async.buffer + async.blocks * 512 && src + len > (uintptr_t)async.buffer)
+            card.dma_errors++;
+        for (uint32_t i = 0; i < len; i += 4)
+        {
+            uint32_t word = src_io ? musb_fifo_read((src - MUSB_BASE) / 4, 4) : *(uint32_t *)(uintptr_t)(src + i);
+
+            if (dst_io)
+                musb_fifo_write((dst - MUSB_BASE) / 4, word, 4);
+            else
+                *(uint32_t *)(uintptr_t)(dst + i) = word;
+        }
+        // Cleans logged from here on belong to the next packet
+        if (!src_io)
+            cache_op_count = 0;
+        value &= ~NDMA_LOAD;
+    }
+    mmio_poke(DMA_BASE + offset, value, size);
+}
+
+// Lets the device handle everything the host did, as the IRQ and main loop would
+static void usb_run(void)
+{
+    do
+        usbd_irq_handler();
+    while (usbd_handler());
+}
+
+static void host_setup(uint8_t type, uint8_t request, uint16_t value, uint16_t index, uint16_t length)
+{
+    uint8_t setup[8] = {type, request, value, value >> 8, index, index >> 8, length, length >> 8};
+
+    CHECK(musb_setup(setup));
+    usb_run();
+}
+
+static uint16_t maxp;
+
+static void host_enumerate(uint8_t high_speed)
+{
+    musb_reset();
+    mmio_reset();
+    mmio_map(DMA_BASE, 0x1000, NULL, ndma_write, NULL);
+    usbd_init(CARD_BLOCKS, card_read, card_write);
+    musb_bus_reset(high_speed);
+    usb_run();
+    host_setup(0x00, 0x05, 7, 0, 0); // SET_ADDRESS
+    host_setup(0x00, 0x09, 1, 0, 0); // SET_CONFIGURATION
+    CHECK_EQ(musb_address(), 7);
+    CHECK_EQ(musb_toggle_resets[EP_BULK_IN][1], 1);
+    CHECK_EQ(musb_toggle_resets[EP_BULK_OUT][0], 1);
+    while (musb_in(0, NULL, 0) >= 0)
+        ;
+    maxp = high_speed ? 512 : 64;
+}
+
+static uint32_t tag = 0x1000;
+
+static void host_cbw(uint32_t len, uint8_t in, uint8_t lun, const uint8_t *cb, uint8_t cb_len)
+{
+    uint8_t cbw[31] = {0x55, 0x53, 0x42, 0x43};
+
+    tag++;
+    memcpy(&cbw[4], &tag, 4);
+    memcpy(&cbw[8], &len, 4);
+    cbw[12] = in ? 0x80 : 0;
+    cbw[13] = lun;
+    cbw[14] = cb_len;
+    memcpy(&cbw[15], cb, cb_len);
+    CHECK(musb_out(EP_BULK_OUT, cbw, sizeof(cbw)));
+    usb_run();
+}
+
+// Data stage to the device, packet by packet as the FIFO takes them
+static void host_data_out(const uint8_t *data, uint32_t len)
+{
+    unsigned stuck = 0;
+
+    while (len && stuck < 4)
+    {
+        uint32_t n = len < maxp ? len : maxp;
+
+        if (!musb_out(EP_BULK_OUT, data, n))
+        {
+            usb_run();
+            stuck++;
+            continue;
+        }
+        stuck = 0;
+        data += n;
+        len -= n;
+    }
+    CHECK_EQ(len, 0);
+    usb_run();
+}
+
+// Data stage from the device, ends with a short packet or when len bytes came in
+static uint32_t host_data_in(uint8_t *data, uint32_t len)
+{
+    uint32_t total = 0;
+    int n;
+
+    while (total < len && (n = musb_in(EP_BULK_IN, data + total, len - total)) >= 0)
+    {
+        CHECK(n <= maxp);
+        total += n;
+        if (n < maxp)
+            break;
+    }
+    return total;
+}
+
+// Takes the CSW, clearing the halt of the IN pipe first when it is stalled
+static uint8_t host_csw(uint32_t *residue)
+{
+    uint8_t csw[32];
+    uint32_t sig, csw_tag;
+    int n;
+
+    if (musb_stalled(EP_BULK_IN, 1))
+    {
+        CHECK_EQ(musb_in(EP_BULK_IN, csw, sizeof(csw)), -1);
+        host_setup(0x02, 0x01, 0, 0x80 | EP_BULK_IN, 0); // CLEAR_FEATURE ENDPOINT_HALT
+        CHECK(!musb_stalled(EP_BULK_IN, 1));
+    }
+    n = musb_in(EP_BULK_IN, csw, sizeof(csw));
+    CHECK_EQ(n, 13);
+    memcpy(&sig, &csw[0], 4);
+    memcpy(&csw_tag, &csw[4], 4);
+    memcpy(residue, &csw[8], 4);
+    CHECK_EQ(sig, CSW_SIGNATURE);
+    CHECK_EQ(csw_tag, tag);
+    // Nothing after the CSW
+    CHECK_EQ(musb_in(EP_BULK_IN, csw, sizeof(csw)), -1);
+    return csw[12];
+}
+
+static void host_sense(uint8_t key, uint8_t asc)
+{
+    static const uint8_t cb[6] = {REQUEST_SENSE, 0, 0, 0, 18, 0};
+    uint8_t sense[18];
+    uint32_t residue;
+
+    host_cbw(18, 1, 0, cb, 6);
+    CHECK_EQ(host_data_in(sense, 18), 18);
+    CHECK_EQ(host_csw(&residue), CSW_PASSED);
+    CHECK_EQ(residue, 0);
+    CHECK_EQ(sense[0], 0x70);
+    CHECK_EQ(sense[2], key);
+    CHECK_EQ(sense[12], asc);
+}
+
+static void rw10(uint8_t *cb, uint8_t op, uint32_t lba, uint16_t blocks)
+{
+    memset(cb, 0, 10);
+    cb[0] = op;
+    cb[2] = lba >> 24;
+    cb[3] = lba >> 16;
+    cb[4] = lba >> 8;
+    cb[5] = lba;
+    cb[7] = blocks >> 8;
+    cb[8] = blocks;
+}
+
+static uint8_t host_buf[256 * 512];
+
+static void test_no_data(void)
+{
+    static const uint8_t tur[6] = {TEST_UNIT_READY};
+    static const uint8_t bad[6] = {0xE7};
+    uint32_t residue;
+
+    host_cbw(0, 0, 0, tur, 6);
+    CHECK_EQ(host_csw(&residue), CSW_PASSED);
+    CHECK_EQ(residue, 0);
+
+    // Unknown command, the failure shows in the sense data
+    host_cbw(0, 0, 0, bad, 6);
+    CHECK_EQ(host_csw(&residue), CSW_FAILED);
+    host_sense(SENSE_ILLEGAL_REQUEST, ASC_INVALID_OPCODE);
+
+    // A LUN that is not there
+    host_cbw(0, 0, 3, tur, 6);
+    CHECK_EQ(host_csw(&residue), CSW_FAILED);
+    host_sense(SENSE_ILLEGAL_REQUEST, ASC_LUN_NOT_SUPPORTED);
+}
+
+static void test_short_responses(void)
+{
+    static const uint8_t inquiry[6] = {INQUIRY, 0, 0, 0, 255, 0};
+    static const uint8_t capacity[10] = {RD_CAPACITY};
+    uint32_t residue, v;
+
+    // Less data than asked for ends with a short packet and the residue in the CSW
+    host_cbw(255, 1, 0, inquiry, 6);
+    CHECK_EQ(host_data_in(host_buf, 255), 36);
+    CHECK(memcmp(&host_buf[8], "F1C100S ", 8) == 0);
+    CHECK_EQ(host_csw(&residue), CSW_PASSED);
+    CHECK_EQ(residue, 255 - 36);
+
+    host_cbw(8, 1, 0, capacity, 10);
+    CHECK_EQ(host_data_in(host_buf, 8), 8);
+    memcpy(&v, &host_buf[0], 4);
+    CHECK_EQ(__builtin_bswap32(v), CARD_BLOCKS - 1);
+    memcpy(&v, &host_buf[4], 4);
+    CHECK_EQ(__builtin_bswap32(v), 512);
+    CHECK_EQ(host_csw(&residue), CSW_PASSED);
+    CHECK_EQ(residue, 0);
+}
+
+static void check_read(uint32_t lba, uint16_t blocks)
+{
+    uint8_t cb[10];
+    uint32_t residue;
+
+    rw10(cb, RD10, lba, blocks);
+    card.dma_errors = 0;
+    host_cbw(blocks * 512, 1, 0, cb, 10);
+    CHECK_EQ(host_data_in(host_buf, blocks * 512), blocks * 512);
+    CHECK(memcmp(host_buf, &card.data[lba * 512], blocks * 512) == 0);
+    CHECK_EQ(host_csw(&residue), CSW_PASSED);
+    CHECK_EQ(residue, 0);
+    CHECK_EQ(card.dma_errors, 0);
+}
+
+static void check_write(uint32_t lba, uint16_t blocks, uint32_t seed)
+{
+    uint8_t cb[10];
+    uint32_t residue, i;
+
+    for (i = 0; i < blocks * 512; i++)
+        host_buf[i] = (seed + i) * 131 >> 3;
+    rw10(cb, WR10, lba, blocks);
+    card.dma_errors = 0;
+    host_cbw(blocks * 512, 0, 0, cb, 10);
+    host_data_out(host_buf, blocks * 512);
+    CHECK_EQ(host_csw(&residue), CSW_PASSED);
+    CHECK_EQ(residue, 0);
+    CHECK_EQ(card.dma_errors, 0);
+    CHECK(memcmp(host_buf, &card.data[lba * 512], blocks * 512) == 0);
+}
+
+static void test_read_write(void)
+{
+    static const uint16_t sizes[] = {1, 7, 64, 65, 128, 200, 256};
+    unsigned i;
+
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+    {
+        check_read(CARD_BLOCKS - sizes[i], sizes[i]);
+        check_write(100 + i * 300, sizes[i], i);
+        check_read(100 + i * 300, sizes[i]);
+    }
+}
+
+static void test_errors(void)
+{
+    uint8_t cb[10];
+    uint32_t residue;
+
+    // A card error still sends the data stage, the CSW reports it
+    card.fail_lba = 50;
+    rw10(cb, RD10, 40, 16);
+    host_cbw(16 * 512, 1, 0, cb, 10);
+    CHECK_EQ(host_data_in(host_buf, 16 * 512), 16 * 512);
+    CHECK_EQ(host_csw(&residue), CSW_FAILED);
+    host_sense(SENSE_MEDIUM_ERROR, ASC_UNRECOVERED_READ_ERROR);
+
+    rw10(cb, WR10, 48, 4);
+    host_cbw(4 * 512, 0, 0, cb, 10);
+    host_data_out(host_buf, 4 * 512);
+    CHECK_EQ(host_csw(&residue), CSW_FAILED);
+    host_sense(SENSE_MEDIUM_ERROR, ASC_WRITE_ERROR);
+    card.fail_lba = 0;
+
+    // Still in step with the host afterwards
+    check_read(0, 8);
+}
+
+// READ in 32 KiB chunks, the card reads the next one while the current one goes out
+static void test_pipelined_read(void)
+{
+    const uint32_t chunk = RD_CHUNK;
+    const uint32_t blocks = 4 * chunk / 512 - 16;
+    static uint8_t data[4 * RD_CHUNK];
+    uint8_t cb[10];
+    uint32_t residue, i;
+
+    usbd_set_async_read(card_read_start, card_read_poll);
+    memset(&async, 0, sizeof(async));
+    card.reads = 0;
+    card.dma_errors = 0;
+    rw10(cb, RD10, 300, blocks);
+    host_cbw(blocks * 512, 1, 0, cb, 10);
+    CHECK_EQ(host_data_in(data, blocks * 512), blocks * 512);
+    CHECK(memcmp(data, &card.data[300 * 512], blocks * 512) == 0);
+    CHECK_EQ(host_csw(&residue), CSW_PASSED);
+    CHECK_EQ(residue, 0);
+    CHECK_EQ(card.dma_errors, 0);
+    CHECK_EQ(card.reads, 0);
+    CHECK(!async.busy);
+    // The first two chunks are started before anything is sent, every later one while the chunk
+    // before the last is out and the last one is not
+    CHECK_EQ(async.starts, 4);
+    CHECK_EQ(async.sent_at_start[0], 0);
+    for (i = 1; i < 4; i++)
+        CHECK_EQ(async.sent_at_start[i], (i - 1) * chunk);
+
+    // A failed chunk is read again the blocking way
+    memset(&async, 0, sizeof(async));
+    async.fail_lba = 300 + chunk / 512 + 5;
+    host_cbw(blocks * 512, 1, 0, cb, 10);
+    CHECK_EQ(host_data_in(data, blocks * 512), blocks * 512);
+    CHECK(memcmp(data, &card.data[300 * 512], blocks * 512) == 0);
+    CHECK_EQ(host_csw(&residue), CSW_PASSED);
+    CHECK_EQ(card.reads, 1);
+
+    // The same when the card does not take background reads
+    memset(&async, 0, sizeof(async));
+    async.refuse = 1;
+    card.reads = 0;
+    host_cbw(blocks * 512, 1, 0, cb, 10);
+    CHECK_EQ(host_data_in(data, blocks * 512), blocks * 512);
+    CHECK(memcmp(data, &card.data[300 * 512], blocks * 512) == 0);
+    CHECK_EQ(host_csw(&residue), CSW_PASSED);
+    CHECK_EQ(card.reads, 4);
+    CHECK_EQ(card.dma_errors, 0);
+
+    usbd_set_async_read(NULL, NULL);
+}
+
+// Data stage of a stall, the CSW follows the CLEAR_FEATURE of the IN pipe
+static void test_stalls(void)
+{
+    static const uint8_t bad[6] = {0xE7};
+    uint8_t cb[10];
+    uint32_t residue;
+
+    // Unknown command with data expected, nothing comes and the pipe stalls
+    host_cbw(64, 1, 0, bad, 6);
+    CHECK(musb_stalled(EP_BULK_IN, 1));
+    CHECK_EQ(host_data_in(host_buf, 64), 0);
+    CHECK_EQ(host_csw(&residue), CSW_FAILED);
+    CHECK_EQ(residue, 64);
+    host_sense(SENSE_ILLEGAL_REQUEST, ASC_INVALID_OPCODE);
+
+    // Past the end of the card, the card is not touched
+    card.reads = 0;
+    rw10(cb, RD10, CARD_BLOCKS - 1, 2);
+    host_cbw(2 * 512, 1, 0, cb, 10);
+    CHECK_EQ(host_data_in(host_buf, 2 * 512), 0);
+    CHECK_EQ(host_csw(&residue), CSW_FAILED);
+    CHECK_EQ(residue, 2 * 512);
+    CHECK_EQ(card.reads, 0);
+    host_sense(SENSE_ILLEGAL_REQUEST, ASC_LBA_OUT_OF_RANGE);
+
+    // The host expects less than the command moves
+    rw10(cb, RD10, 0, 2);
+    host_cbw(512, 1, 0, cb, 10);
+    host_data_in(host_buf, 512);
+    CHECK_EQ(host_csw(&residue), CSW_PHASE_ERROR);
+
+    check_read(0, 8);
+}
+
+// One control transfer, returns the length of the data stage or -1 when the device stalled
+static int host_control(uint8_t type, uint8_t request, uint16_t value, uint16_t index, uint16_t length, uint8_t *data)
+{
+    unsigned status = musb_ep0_status_count;
+    int total = 0, n;
+
+    host_setup(type, request, value, index, length);
+    if (musb_stalled(0, 0))
+    {
+        CHECK_EQ(musb_in(0, NULL, 0), -1);
+        CHECK_EQ(musb_ep0_status_count, status);
+        return -1;
+    }
+    while ((n = musb_in(0, data + total, 64)) >= 0)
+    {
+        total += n;
+        if (n < 64)
+            break;
+    }
+    CHECK(total <= length);
+    CHECK_EQ(musb_ep0_status_count, status + 1);
+    return total;
+}
+
+// Control transfers of an enumeration, length is that of the data stage or -1 for a stall
+typedef struct
+{
+    uint8_t type, request;
+    uint16_t value, index, length;
+    int16_t result;
+} ep0_step_t;
+
+#define STEP_RESET 0xFF // type of a bus reset between transfers
+
+// Linux 6.x (usbmon): device descriptor for bMaxPacketSize0, reset, address, descriptors, strings with
+// the full 255 bytes, configuration, Get Max LUN
+static const ep0_step_t linux_enum[] = {
+    {0x80, 0x06, 0x0100, 0x0000, 64, 18},     //
+    {STEP_RESET},                             //
+    {0x00, 0x05, 0x0003, 0x0000, 0, 0},       // SET_ADDRESS 3
+    {0x80, 0x06, 0x0100, 0x0000, 18, 18},     //
+    {0x80, 0x06, 0x0200, 0x0000, 9, 9},       //
+    {0x80, 0x06, 0x0200, 0x0000, 32, 32},     //
+    {0x80, 0x06, 0x0300, 0x0000, 255, 4},     //
+    {0x80, 0x06, 0x0302, 0x0409, 255, 48},    //
+    {0x80, 0x06, 0x0301, 0x0409, 255, 14},    //
+    {0x80, 0x06, 0x0303, 0x0409, 255, 26},    //
+    {0x00, 0x09, 0x0001, 0x0000, 0, 0},       // SET_CONFIGURATION 1
+    {0xA1, 0xFE, 0x0000, 0x0000, 1, 1},       // Get Max LUN
+};
+
+// Windows 10 (USBPcap): the same start, then the configuration in one go, the Microsoft OS string the
+// device does not have, the qualifier
+static const ep0_step_t windows_enum[] = {
+    {0x80, 0x06, 0x0100, 0x0000, 64, 18},     //
+    {STEP_RESET},                             //
+    {0x00, 0x05, 0x0009, 0x0000, 0, 0},       // SET_ADDRESS 9
+    {0x80, 0x06, 0x0100, 0x0000, 18, 18},     //
+    {0x80, 0x06, 0x0200, 0x0000, 255, 32},    //
+    {0x80, 0x06, 0x03EE, 0x0000, 18, -1},     // Microsoft OS string descriptor
+    {0x80, 0x06, 0x0300, 0x0000, 255, 4},     //
+    {0x80, 0x06, 0x0302, 0x0409, 255, 48},    //
+    {0x80, 0x06, 0x0303, 0x0409, 255, 26},    //
+    {0x80, 0x06, 0x0600, 0x0000, 10, 10},     // Device qualifier
+    {0x80, 0x06, 0x0200, 0x0000, 9, 9},       //
+    {0x80, 0x06, 0x0200, 0x0000, 32, 32},     //
+    {0x00, 0x09, 0x0001, 0x0000, 0, 0},       // SET_CONFIGURATION 1
+    {0xA1, 0xFE, 0x0000, 0x0000, 1, 1},       // Get Max LUN
+};
+
+static void replay(const ep0_step_t *steps, unsigned count, uint8_t high_speed)
+{
+    uint8_t data[256];
+    unsigned i;
+
+    musb_reset();
+    mmio_reset();
+    mmio_map(DMA_BASE, 0x1000, NULL, ndma_write, NULL);
+    usbd_init(CARD_BLOCKS, card_read, card_write);
+    for (i = 0; i < count; i++)
+    {
+        if (steps[i].type == STEP_RESET || !i)
+        {
+            musb_bus_reset(high_speed);
+            usb_run();
+            if (steps[i].type == STEP_RESET)
+                continue;
+        }
+        CHECK_EQ(host_control(steps[i].type, steps[i].request, steps[i].value, steps[i].index, steps[i].length, data),
+                 steps[i].result);
+        if (steps[i].request == 0x06 && steps[i].result > 1)
+        {
+            CHECK_EQ(data[1], steps[i].value >> 8);
+            if (data[1] == 2)
+                CHECK_EQ(data[2] | data[3] << 8, 32); // wTotalLength
+        }
+    }
+}
+
+static void test_enumeration(uint8_t high_speed)
+{
+    uint8_t data[256];
+    uint32_t residue;
+
+    replay(linux_enum, sizeof(linux_enum) / sizeof(linux_enum[0]), high_speed);
+    CHECK_EQ(musb_address(), 3);
+    replay(windows_enum, sizeof(windows_enum) / sizeof(windows_enum[0]), high_speed);
+    CHECK_EQ(musb_address(), 9);
+    CHECK_EQ(bulk_maxp, maxp);
+
+    CHECK_EQ(host_control(0x80, 0x06, 0x0100, 0, 18, data), 18);
+    CHECK_EQ(data[7], 64); // bMaxPacketSize0
+    CHECK_EQ(host_control(0x80, 0x06, 0x0301, 0x0409, 255, data), 14);
+    CHECK(memcmp(&data[2], "V\0e\0n\0d\0o\0r\0", 12) == 0);
+    CHECK_EQ(host_control(0xA1, 0xFE, 0, 0, 1, data), 1);
+    CHECK_EQ(data[0], 0);
+    CHECK_EQ(host_control(0x80, 0x08, 0, 0, 1, data), 1); // GET_CONFIGURATION
+    CHECK_EQ(data[0], 1);
+
+    // Bulk endpoints of the speed in use, those of the other one in the Other Speed Configuration
+    CHECK_EQ(host_control(0x80, 0x06, 0x0200, 0, 32, data), 32);
+    CHECK_EQ(data[18 + 4] | data[18 + 5] << 8, maxp);
+    CHECK_EQ(host_control(0x80, 0x06, 0x0700, 0, 255, data), 32);
+    CHECK_EQ(data[1], 7);
+    CHECK_EQ(data[18 + 4] | data[18 + 5] << 8, high_speed ? 64 : 512);
+
+    // A vendor request stalls EP0, the next setup goes through
+    CHECK_EQ(host_control(0x40, 0x01, 0, 0, 0, data), -1);
+    CHECK_EQ(host_control(0x80, 0x06, 0x0600, 0, 10, data), 10);
+
+    // Bulk-Only Mass Storage Reset and the halts the host clears after it, then a command
+    CHECK_EQ(host_control(0x21, 0xFF, 0, 0, 0, data), 0);
+    CHECK_EQ(host_control(0x02, 0x01, 0, 0x80 | EP_BULK_IN, 0, data), 0);
+    CHECK_EQ(host_control(0x02, 0x01, 0, EP_BULK_OUT, 0, data), 0);
+    CHECK_EQ(musb_in(EP_BULK_IN, data, sizeof(data)), -1);
+    host_cbw(0, 0, 0, (const uint8_t[6]){TEST_UNIT_READY}, 6);
+    CHECK_EQ(host_csw(&residue), CSW_PASSED);
+}
+
+int main(void)
+{
+    uint32_t i;
+
+    musb_init();
+    for (i = 0; i < sizeof(card.data); i++)
+        card.data[i] = i * 7 + (i >> 9);
+
+    // High-speed, then full-speed with 64 byte packets
+    for (int hs = 1; hs >= 0; hs--)
+    {
+        host_enumerate(hs);
+        CHECK_EQ(bulk_maxp, maxp);
+        test_enumeration(hs);
+        test_no_data();
+        test_short_responses();
+        test_read_write();
+        test_errors();
+        test_stalls();
+        test_pipelined_read();
+    }
+    return TEST_RESULT();
+}
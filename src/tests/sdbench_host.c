@@ -0,0 +1,71 @@
+// sdbench on the host, against a file-backed card instead of the SDC driver
+//
+// sdbench_host [image]
+//
+// Without an image it formats a temporary 4 GiB FAT32 card with 32 KiB clusters. The tables are the
+// ones the board prints over UART, timed by the filecard timing model.
+
+#include <stdio.h>
+#include <string.h>
+#include "ff.h"
+#include "filecard.h"
+#include "sdbench.h"
+
+#define CARD_SECTORS (8u * 1024 * 1024)
+#define CARD_CLUSTER 64
+
+static uint8_t bench_buf[SDBENCH_MAX_SIZE] __attribute__((aligned(32)));
+
+static uint32_t bench_time_us(void)
+{
+    return filecard_time_us();
+}
+
+static void bench_puts(const char *str)
+{
+    for (; *str; str++)
+        if (*str != '\r')
+            putchar(*str);
+}
+
+int main(int argc, char **argv)
+{
+    FATFS fs;
+    const filecard_stats_t *stats;
+    uint8_t ok;
+
+    if (argc > 1)
+    {
+        if (!filecard_open(argv[1], 0))
+        {
+            fprintf(stderr, "cannot open %s\n", argv[1]);
+            return 1;
+        }
+    }
+    else if (!filecard_open(NULL, CARD_SECTORS) || !filecard_format_fat32(CARD_CLUSTER))
+    {
+        fprintf(stderr, "cannot create the card image\n");
+        return 1;
+    }
+
+    if (f_mount(&fs, "", 1) != FR_OK)
+    {
+        fprintf(stderr, "mount failed\n");
+        return 1;
+    }
+
+    sdbench_port_t port = {
+        .time_us = bench_time_us,
+        .puts = bench_puts,
+        .buf = bench_buf,
+    };
+    ok = sdbench_run(&port);
+    f_mount(NULL, "", 0);
+
+    stats = filecard_stats();
+    printf("%s, %u reads of %llu sectors, %u writes of %llu sectors\n", ok ? "sdbench done" : "sdbench failed",
+           stats->reads, (unsigned long long)stats->read_sectors, stats->writes,
+           (unsigned long long)stats->written_sectors);
+    filecard_close();
+    return !ok;
+}
@@ -0,0 +1,183 @@
+// IDMA descriptor chains of f1c100s_sdc.c against the simulated SDC registers
+
+#include <string.h>
+#include "test.h"
+#include "cache.h"
+#include "dmamem.h"
+#include "mmio.h"
+
+#include "f1c100s_sdc.c"
+
+uint32_t clk_sdc_config(uint32_t reg, uint32_t freq)
+{
+    (void)reg;
+    return freq;
+}
+
+// Whether the write buffer had been drained when the IDMAC was last switched on
+static int synced_at_start;
+
+// Interrupt and IDMAC status are write-1-to-clear, everything else is plain storage
+static void sdc_write(void *ctx, uint32_t offset, uint32_t value, unsigned size)
+{
+    (void)ctx;
+    if (offset == SDC_DMAC && (value & SDC_IDMAC_IDMA_ON))
+        synced_at_start = cache_find('s', 0, 0) != NULL;
+    if (offset == SDC_RISR || offset == SDC_IDST)
+        value = mmio_peek(SDC0_BASE + offset, size) & ~value;
+    mmio_poke(SDC0_BASE + offset, value, size);
+}
+
+static void sdc_model_reset(void)
+{
+    mmio_reset();
+    mmio_map(SDC0_BASE, 0x1000, NULL, sdc_write, NULL);
+}
+
+#define MAX_LEN (SDC_IDMA_DES_COUNT * SDC_IDMA_DES_MAX_SIZE)
+
+static uint8_t data[MAX_LEN + 64] __attribute__((aligned(32)));
+
+static void check_chain(uint8_t *buf, uint32_t len)
+{
+    sdc_idma_des_t des[SDC_IDMA_DES_COUNT + 1];
+    uint32_t count, i, total = 0;
+
+    memset(des, 0xA5, sizeof(des));
+    count = sdc_idma_build_chain(des, SDC_IDMA_DES_COUNT, buf, len);
+    if (len > MAX_LEN)
+    {
+        CHECK_EQ(count, 0);
+        return;
+    }
+    CHECK_EQ(count, (len + SDC_IDMA_DES_MAX_SIZE - 1) / SDC_IDMA_DES_MAX_SIZE);
+
+    for (i = 0; i < count; i++)
+    {
+        uint32_t config = des[i].config;
+
+        CHECK(config & SDC_IDMA_DES_OWN);
+        CHECK(config & SDC_IDMA_DES_CHAIN);
+        CHECK_EQ(!!(config & SDC_IDMA_DES_FIRST), i == 0);
+        CHECK_EQ(!!(config & SDC_IDMA_DES_LAST), i == count - 1);
+        CHECK_EQ(!!(config & SDC_IDMA_DES_DIC), i != count - 1);
+        CHECK_EQ(des[i].buf_addr, (uint32_t)(uintptr_t)buf + total);
+        CHECK(des[i].buf_size > 0 && des[i].buf_size <= SDC_IDMA_DES_MAX_SIZE);
+        CHECK_EQ(des[i].next_desc, i == count - 1 ? 0 : (uint32_t)(uintptr_t)&des[i + 1]);
+        total += des[i].buf_size;
+    }
+    CHECK_EQ(total, len);
+    // Nothing past the chain was touched
+    CHECK_EQ(des[count].config, 0xA5A5A5A5);
+}
+
+static void test_build_chain(void)
+{
+    static const uint32_t offsets[] = {0, 4, 32, 60};
+    uint32_t blocks, o;
+
+    CHECK_EQ(sdc_idma_build_chain(NULL, SDC_IDMA_DES_COUNT, data, 0), 0);
+    for (o = 0; o < sizeof(offsets) / sizeof(offsets[0]); o++)
+    {
+        for (blocks = 1; blocks <= MAX_LEN / 512 + 2; blocks++)
+            check_chain(data + offsets[o], blocks * 512);
+        // Odd sizes as used by CMD6 and ACMD51
+        check_chain(data + offsets[o], 8);
+        check_chain(data + offsets[o], 64);
+        check_chain(data + offsets[o], SDC_IDMA_DES_MAX_SIZE + 8);
+    }
+}
+
+static void start(uint8_t *buf, uint32_t blocks, uint32_t flag)
+{
+    sdc_data_t dat = {0};
+
+    dat.buf = buf;
+    dat.flag = flag;
+    dat.blksz = 512;
+    dat.blkcnt = blocks;
+    cache_op_count = 0;
+    synced_at_start = 0;
+    CHECK(sdc_dma_start(SDC0_BASE, &dat));
+}
+
+static void test_dma_start(void)
+{
+    uint32_t len = 8 * 512;
+    sdc_idma_des_t *des;
+
+    sdc_model_reset();
+
+    // Cache line aligned read straight into the caller's buffer
+    start(data, 8, MMC_DATA_READ);
+    des = (sdc_idma_des_t *)(uintptr_t)mmio_peek(SDC0_BASE + SDC_DLBA, 4);
+    CHECK_EQ(des[0].buf_addr, (uint32_t)(uintptr_t)data);
+    CHECK(cache_find('f', (uintptr_t)data, (uintptr_t)data + len));
+    // The chain is in uncached DMA memory, written out by draining the write buffer
+    CHECK(dma_mem_contains(des, SDC_IDMA_DES_COUNT * sizeof(*des)));
+    CHECK(!cache_find('c', (uintptr_t)des, (uintptr_t)&des[1]));
+    CHECK(!cache_find('f', (uintptr_t)des, (uintptr_t)&des[1]));
+    CHECK(synced_at_start);
+    CHECK(mmio_peek(SDC0_BASE + SDC_DMAC, 4) & SDC_IDMAC_IDMA_ON);
+    CHECK(mmio_peek(SDC0_BASE + SDC_GCTL, 4) & SDC_DMA_ENABLE_BIT);
+
+    // Misaligned write goes through the bounce buffer, which gets the data first
+    memset(data, 0x5A, len + 8);
+    start(data + 4, 8, MMC_DATA_WRITE);
+    CHECK_EQ(mmio_peek(SDC0_BASE + SDC_DLBA, 4), (uint32_t)(uintptr_t)des);
+    CHECK(synced_at_start);
+    CHECK_EQ(des[0].buf_addr, (uint32_t)(uintptr_t)sdc_idma_bounce);
+    CHECK(memcmp(sdc_idma_bounce, data + 4, len) == 0);
+    CHECK(cache_find('c', (uintptr_t)sdc_idma_bounce, (uintptr_t)sdc_idma_bounce + len));
+
+    // Misaligned read is copied out of the bounce buffer when it completes
+    start(data + 4, 8, MMC_DATA_READ);
+    memset(sdc_idma_bounce, 0x3C, len);
+    {
+        sdc_data_t dat = {0};
+        dat.buf = data + 4;
+        dat.flag = MMC_DATA_READ;
+        dat.blksz = 512;
+        dat.blkcnt = 8;
+        CHECK(sdc_dma_finish(SDC0_BASE, &dat));
+        CHECK(cache_find('i', (uintptr_t)sdc_idma_bounce, (uintptr_t)sdc_idma_bounce + len));
+    }
+    CHECK(data[4] == 0x3C && data[4 + len - 1] == 0x3C && data[4 + len] == 0x5A);
+
+    // The bounce buffer holds the largest chain
+    start(data + 4, MAX_LEN / 512, MMC_DATA_WRITE);
+    CHECK_EQ(des[SDC_IDMA_DES_COUNT - 1].buf_addr + des[SDC_IDMA_DES_COUNT - 1].buf_size,
+             (uint32_t)(uintptr_t)sdc_idma_bounce + sizeof(sdc_idma_bounce));
+    CHECK(des[SDC_IDMA_DES_COUNT - 1].config & SDC_IDMA_DES_LAST);
+}
+
+static void test_transfer_limits(void)
+{
+    sdc_cmd_t cmd = {0};
+    sdc_data_t dat = {0};
+
+    sdc_model_reset();
+    cmd.cmdidx = MMC_READ_MULTIPLE_BLOCK;
+    dat.buf = data;
+    dat.flag = MMC_DATA_READ;
+    dat.blksz = 512;
+
+    // One block past the 32 descriptors can not be started asynchronously
+    dat.blkcnt = MAX_LEN / 512 + 1;
+    CHECK_EQ(sdc_transfer_start(SDC0_BASE, &cmd, &dat), 0);
+    CHECK_EQ(mmio_peek(SDC0_BASE + SDC_DMAC, 4), 0);
+
+    // The full chain can, the command fails here as nothing answers it
+    dat.blkcnt = MAX_LEN / 512;
+    mmio_poke(SDC0_BASE + SDC_RISR, SDC_INTERRUPT_ERROR_BIT, 4);
+    CHECK_EQ(sdc_transfer_start(SDC0_BASE, &cmd, &dat), 0);
+    CHECK_EQ(mmio_peek(SDC0_BASE + SDC_BYCR, 4), MAX_LEN);
+}
+
+int main(void)
+{
+    test_build_chain();
+    test_dma_start();
+    test_transfer_limits();
+    return TEST_RESULT();
+}
@@ -0,0 +1,366 @@
+// Command sequences of sdcard.c against a model of the SDC registers and an SD card behind them
+//
+// The model runs every command written to SDC_CMDR, moves data through the IDMAC descriptor chain and
+// finishes the data phase on the first RISR read after the driver cleared the command status, the
+// way a real transfer ends some time after its command.
+
+#include <string.h>
+#include "test.h"
+#include "cache.h"
+#include "mmio.h"
+
+#include "f1c100s_sdc.c"
+#include "sdcard.c"
+
+#define CARD_BLOCKS 1024
+#define RCA 0x1234
+#define MAX_LOG 64
+
+typedef struct
+{
+    uint32_t idx;
+    uint32_t arg;
+    uint32_t flags; // SDC_CMDR bits besides the index
+} logged_cmd_t;
+
+static struct
+{
+    uint8_t data[CARD_BLOCKS * 512];
+    uint32_t state;       // MMC_STATUS_* of the card
+    uint8_t app;          // Last command was CMD55
+    uint32_t busy_reads;  // SDC_STAR reads left with DAT0 held low
+    uint32_t data_cmd;    // SDC_CMDR value of a data command whose data phase is still to come
+    uint8_t fail_data;    // Next data phase ends in a CRC error
+    uint8_t hang_data;    // Next data phase never ends
+    uint32_t resets;      // SDC_HARDWARE_RESET writes
+    logged_cmd_t log[MAX_LOG];
+    uint32_t log_count;
+} sd;
+
+uint32_t clk_sdc_config(uint32_t reg, uint32_t freq)
+{
+    (void)reg;
+    return freq;
+}
+
+// sd_delay_us and sd_wait_ready count TIM0 down, 10us pass per read
+uint32_t tim_get_period(uint8_t ch)
+{
+    (void)ch;
+    return 24000;
+}
+
+uint32_t tim_get_cnt(uint8_t ch)
+{
+    static uint32_t cnt = 24000;
+
+    (void)ch;
+    cnt = (cnt > 240) ? cnt - 240 : 24000;
+    return cnt;
+}
+
+static void sd_reg(uint32_t offset, uint32_t value)
+{
+    mmio_poke(SDC0_BASE + offset, value, 4);
+}
+
+static uint32_t sd_peek(uint32_t offset)
+{
+    return mmio_peek(SDC0_BASE + offset, 4);
+}
+
+static void sd_set_risr(uint32_t bits)
+{
+    sd_reg(SDC_RISR, sd_peek(SDC_RISR) | bits);
+}
+
+// Copies between the card and the buffers of the descriptor chain
+static void sd_data_phase(void)
+{
+    uint32_t cmdval = sd.data_cmd;
+    uint32_t idx = cmdval & 0x3f;
+    uint32_t addr = sd_peek(SDC_CAGR) * 512;
+    uint32_t len = sd_peek(SDC_BYCR);
+    uint32_t done = 0;
+    sdc_idma_des_t *des = (sdc_idma_des_t *)(uintptr_t)sd_peek(SDC_DLBA);
+
+    sd.data_cmd = 0;
+    CHECK(sd_peek(SDC_DMAC) & SDC_IDMAC_IDMA_ON);
+    CHECK(addr + len <= sizeof(sd.data));
+
+    if (sd.fail_data)
+    {
+        // The card stays in the data or receive state until a CMD12
+        sd.fail_data = 0;
+        sd.state = (cmdval & SDC_WRITE) ? MMC_STATUS_RCV : MMC_STATUS_DATA;
+        sd_set_risr(SDC_DATA_CRC_ERROR);
+        return;
+    }
+
+    while (des != NULL && done < len)
+    {
+        uint8_t *buf = (uint8_t *)(uintptr_t)des->buf_addr;
+
+        CHECK(des->config & SDC_IDMA_DES_OWN);
+        if (cmdval & SDC_WRITE)
+            memcpy(&sd.data[addr + done], buf, des->buf_size);
+        else
+            memcpy(buf, &sd.data[addr + done], des->buf_size);
+        done += des->buf_size;
+        des = (des->config & SDC_IDMA_DES_LAST) ? NULL : (sdc_idma_des_t *)(uintptr_t)des->next_desc;
+    }
+    CHECK_EQ(done, len);
+
+    if (cmdval & SDC_WRITE)
+        sd.busy_reads = 3;
+    sd.state = MMC_STATUS_TRAN;
+    sd_set_risr(SDC_DATA_OVER | ((cmdval & SDC_SEND_AUTO_STOP) ? SDC_AUTO_COMMAND_DONE : 0));
+    (void)idx;
+}
+
+static void sd_command(uint32_t cmdval)
+{
+    uint32_t idx = cmdval & 0x3f;
+    uint32_t resp = (1 << 8); // READY_FOR_DATA
+
+    if (sd.log_count < MAX_LOG)
+        sd.log[sd.log_count++] = (logged_cmd_t){idx, sd_peek(SDC_CAGR), cmdval & ~(SDC_START | 0x3f)};
+    CHECK(!sd.data_cmd);
+
+    switch (idx)
+    {
+    case MMC_APP_CMD:
+        resp |= 1 << 5;
+        break;
+    case MMC_STOP_TRANSMISSION:
+        if (sd.state == MMC_STATUS_RCV)
+            sd.busy_reads = 3;
+        sd.state = MMC_STATUS_TRAN;
+        break;
+    case MMC_READ_SINGLE_BLOCK:
+    case MMC_READ_MULTIPLE_BLOCK:
+    case MMC_WRITE_SINGLE_BLOCK:
+    case MMC_WRITE_MULTIPLE_BLOCK:
+        CHECK(cmdval & SDC_DATA_EXPIRE);
+        if (!sd.hang_data)
+            sd.data_cmd = cmdval;
+        sd.hang_data = 0;
+        sd.state = (cmdval & SDC_WRITE) ? MMC_STATUS_RCV : MMC_STATUS_DATA;
+        break;
+    default:
+        break;
+    }
+    sd.app = (idx == MMC_APP_CMD);
+
+    sd_reg(SDC_RESP0, resp | (sd.state << 9));
+    sd_set_risr(SDC_COMMAND_DONE);
+}
+
+static uint32_t sdc_read(void *ctx, uint32_t offset, unsigned size)
+{
+    (void)ctx;
+    if (offset == SDC_STAR)
+    {
+        uint32_t star = sd_peek(SDC_STAR) & ~SDC_CARD_DATA_BUSY;
+
+        if (sd.busy_reads)
+        {
+            sd.busy_reads--;
+            star |= SDC_CARD_DATA_BUSY;
+        }
+        return star;
+    }
+    // The data phase follows once the driver took note of the command
+    if (offset == SDC_RISR && sd.data_cmd && !(sd_peek(SDC_RISR) & SDC_COMMAND_DONE))
+        sd_data_phase();
+    return mmio_peek(SDC0_BASE + offset, size);
+}
+
+static void sdc_write(void *ctx, uint32_t offset, uint32_t value, unsigned size)
+{
+    (void)ctx;
+    switch (offset)
+    {
+    case SDC_RISR:
+    case SDC_IDST:
+        value = sd_peek(offset) & ~value;
+        break;
+    case SDC_GCTL:
+        if ((value & SDC_HARDWARE_RESET) == SDC_HARDWARE_RESET)
+        {
+            sd.resets++;
+            sd.data_cmd = 0;
+        }
+        value &= ~SDC_HARDWARE_RESET;
+        break;
+    case SDC_CMDR:
+        if ((value & SDC_START) && !(value & SDC_UPCLK_ONLY))
+            sd_command(value);
+        value &= ~SDC_START;
+        break;
+    }
+    mmio_poke(SDC0_BASE + offset, value, size);
+}
+
+static sdcard_t card;
+
+static void reset(uint8_t cmd23)
+{
+    mmio_reset();
+    mmio_map(SDC0_BASE, 0x1000, sdc_read, sdc_write, NULL);
+    memset(&sd, 0, sizeof(sd));
+    for (uint32_t i = 0; i < sizeof(sd.data); i++)
+        sd.data[i] = i * 13 + i / 512;
+    sd.state = MMC_STATUS_TRAN;
+
+    memset(&card, 0, sizeof(card));
+    card.sdc_base = SDC0_BASE;
+    card.version = MMC_VERSION_SD_2;
+    card.high_capacity = 1;
+    card.rca = RCA;
+    card.read_bl_len = 512;
+    card.write_bl_len = 512;
+    card.blk_cnt = CARD_BLOCKS;
+    card.bus_clock = 50000000;
+    card.scr[0] = cmd23 ? SD_SCR_CMD23 : 0;
+}
+
+// Compares the logged command indices, -1 ends the list
+static void expect_cmds(const char *what, const int *idx)
+{
+    uint32_t n = 0;
+
+    while (idx[n] >= 0)
+        n++;
+    CHECK_EQ(sd.log_count, n);
+    for (uint32_t i = 0; i < n && i < sd.log_count; i++)
+    {
+        if (sd.log[i].idx != (uint32_t)idx[i])
+        {
+            printf("%s: command %u is CMD%u, expected CMD%d\n", what, i, sd.log[i].idx, idx[i]);
+            test_failures++;
+        }
+    }
+}
+
+static uint8_t buf[200 * 512] __attribute__((aligned(32)));
+
+static void test_reads(void)
+{
+    // CMD17 for one block, no stop
+    reset(0);
+    CHECK_EQ(sdcard_read(&card, buf, 5, 1), 1);
+    expect_cmds("CMD17", (const int[]){17, -1});
+    CHECK_EQ(sd.log[0].arg, 5);
+    CHECK(!(sd.log[0].flags & SDC_SEND_AUTO_STOP));
+    CHECK(memcmp(buf, &sd.data[5 * 512], 512) == 0);
+
+    // CMD18 ended by auto-stop, long reads split at SDCARD_MAX_TRANSFER_BLOCKS
+    reset(0);
+    CHECK_EQ(sdcard_read(&card, buf, 100, 200), 200);
+    expect_cmds("CMD18", (const int[]){18, 18, -1});
+    CHECK_EQ(sd.log[0].arg, 100);
+    CHECK_EQ(sd.log[1].arg, 100 + SDCARD_MAX_TRANSFER_BLOCKS);
+    CHECK(sd.log[0].flags & SDC_SEND_AUTO_STOP);
+    CHECK(!(sd.log[0].flags & SDC_WRITE));
+    CHECK(memcmp(buf, &sd.data[100 * 512], 200 * 512) == 0);
+}
+
+static void test_writes(void)
+{
+    // CMD24, then the card holds DAT0 low while programming
+    reset(0);
+    memset(buf, 0x5A, 512);
+    CHECK_EQ(sdcard_write(&card, buf, 7, 1), 1);
+    expect_cmds("CMD24", (const int[]){24, -1});
+    CHECK(sd.log[0].flags & SDC_WRITE);
+    CHECK_EQ(sd.busy_reads, 0);
+    CHECK(memcmp(buf, &sd.data[7 * 512], 512) == 0);
+
+    // CMD25 after ACMD23 pre-erase, ended by auto-stop
+    reset(0);
+    memset(buf, 0xC3, 8 * 512);
+    CHECK_EQ(sdcard_write(&card, buf, 64, 8), 8);
+    expect_cmds("ACMD23+CMD25", (const int[]){55, 23, 25, -1});
+    CHECK_EQ(sd.log[0].arg, RCA << 16);
+    CHECK_EQ(sd.log[1].arg, 8);
+    CHECK(sd.log[2].flags & SDC_SEND_AUTO_STOP);
+    CHECK(memcmp(buf, &sd.data[64 * 512], 8 * 512) == 0);
+
+    // CMD23 announces the count, the card stops by itself
+    reset(1);
+    CHECK_EQ(sdcard_write(&card, buf, 64, 8), 8);
+    expect_cmds("CMD23+CMD25", (const int[]){23, 25, -1});
+    CHECK(!(sd.log[1].flags & SDC_SEND_AUTO_STOP));
+}
+
+static void test_async(void)
+{
+    // Non-blocking CMD18, completion shows up on the next poll
+    reset(0);
+    CHECK(sdcard_transfer_start(&card, buf, 10, 4, 0));
+    expect_cmds("async CMD18", (const int[]){18, -1});
+    CHECK_EQ(sdcard_transfer_poll(&card), 1);
+    CHECK(memcmp(buf, &sd.data[10 * 512], 4 * 512) == 0);
+    CHECK(!card.recover);
+
+    // Non-blocking CMD25, the IRQ side leaves the busy card to sdq's busy check
+    reset(0);
+    CHECK(sdcard_transfer_start(&card, buf, 20, 4, 1));
+    CHECK_EQ(sdcard_transfer_poll(&card), 1);
+    expect_cmds("async CMD25", (const int[]){55, 23, 25, -1});
+    CHECK(sdcard_busy(&card));
+}
+
+static void test_recovery(void)
+{
+    // A failed CMD18 issues nothing further from the poll, which runs in IRQ context
+    reset(0);
+    sd.fail_data = 1;
+    CHECK(sdcard_transfer_start(&card, buf, 10, 4, 0));
+    CHECK_EQ(sdcard_transfer_poll(&card), -1);
+    expect_cmds("failed CMD18", (const int[]){18, -1});
+    CHECK(card.recover);
+    CHECK_EQ(sd.state, MMC_STATUS_DATA);
+
+    // Nothing starts on the broken card
+    CHECK(!sdcard_transfer_start(&card, buf, 10, 4, 0));
+    CHECK_EQ(sd.log_count, 1);
+
+    // Thread context: CMD13 finds the card sending data, CMD12 stops it
+    sdcard_recover(&card);
+    expect_cmds("recovery", (const int[]){18, 13, 12, -1});
+    CHECK_EQ(sd.log[1].arg, RCA << 16);
+    CHECK_EQ(sd.state, MMC_STATUS_TRAN);
+    CHECK(!card.recover);
+    sdcard_recover(&card);
+    CHECK_EQ(sd.log_count, 3);
+
+    // An aborted CMD25 leaves the recovery to the next blocking call
+    reset(0);
+    sd.hang_data = 1;
+    CHECK(sdcard_transfer_start(&card, buf, 30, 4, 1));
+    CHECK_EQ(sdcard_transfer_poll(&card), 0);
+    sdcard_transfer_abort(&card);
+    CHECK(card.recover);
+    CHECK(sd.resets > 0);
+    expect_cmds("aborted CMD25", (const int[]){55, 23, 25, -1});
+    CHECK_EQ(sdcard_read(&card, buf, 30, 1), 1);
+    expect_cmds("recovery before CMD17", (const int[]){55, 23, 25, 13, 12, 17, -1});
+    CHECK(!card.recover);
+
+    // A failed blocking CMD24 recovers on the spot and retries
+    reset(0);
+    sd.fail_data = 1;
+    CHECK_EQ(sdcard_write(&card, buf, 40, 1), 1);
+    expect_cmds("CMD24 retry", (const int[]){24, 13, 12, 24, -1});
+}
+
+int main(void)
+{
+    test_reads();
+    test_writes();
+    test_async();
+    test_recovery();
+    return TEST_RESULT();
+}
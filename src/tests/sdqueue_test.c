@@ -0,0 +1,258 @@
+// Ordering, error and timeout paths of the SD request queue on a fake controller
+
+#include <string.h>
+#include "test.h"
+#include "sdqueue.h"
+
+#define CARD_BLOCKS 1024
+#define MAX_BLOCKS 127
+
+typedef struct
+{
+    uint8_t *buf;
+    uint32_t blkno;
+    uint32_t blkcnt;
+    uint8_t write;
+} start_t;
+
+static struct
+{
+    uint8_t data[CARD_BLOCKS * 512];
+    uint8_t busy;
+    uint8_t refuse_start;
+    int8_t poll_results[8]; // Consumed one per finished chunk, 0 entries mean success
+    unsigned poll_count;
+    start_t starts[64];
+    unsigned start_count;
+    unsigned abort_count;
+    unsigned recover_count;
+    uint8_t running;
+} fake;
+
+static uint8_t fake_busy(void *ctx)
+{
+    (void)ctx;
+    return fake.busy;
+}
+
+static uint8_t fake_start(void *ctx, uint8_t *buf, uint32_t blkno, uint32_t blkcnt, uint8_t write)
+{
+    (void)ctx;
+    CHECK(!fake.running);
+    CHECK(blkcnt > 0 && blkcnt <= MAX_BLOCKS);
+    fake.starts[fake.start_count++] = (start_t){buf, blkno, blkcnt, write};
+    if (fake.refuse_start)
+        return 0;
+    if (write)
+        memcpy(&fake.data[blkno * 512], buf, blkcnt * 512);
+    else
+        memcpy(buf, &fake.data[blkno * 512], blkcnt * 512);
+    fake.running = 1;
+    return 1;
+}
+
+static int8_t fake_poll(void *ctx)
+{
+    int8_t ret = 1;
+
+    (void)ctx;
+    if (fake.poll_count < sizeof(fake.poll_results) && fake.poll_results[fake.poll_count])
+        ret = fake.poll_results[fake.poll_count];
+    fake.poll_count++;
+    if (ret != 0)
+        fake.running = 0;
+    return ret;
+}
+
+static void fake_abort(void *ctx)
+{
+    (void)ctx;
+    fake.abort_count++;
+    fake.running = 0;
+}
+
+static void fake_recover(void *ctx)
+{
+    (void)ctx;
+    CHECK(!fake.running);
+    fake.recover_count++;
+}
+
+static const sdq_backend_t backend = {fake_busy, fake_start, fake_poll, fake_abort, fake_recover, 512, 512, MAX_BLOCKS};
+
+static sdq_request_t *done_order[8];
+static unsigned done_count;
+
+static void on_done(sdq_request_t *req)
+{
+    done_order[done_count++] = req;
+}
+
+static void reset(void)
+{
+    memset(&fake, 0, sizeof(fake));
+    for (unsigned i = 0; i < sizeof(fake.data); i++)
+        fake.data[i] = i * 7 + i / 512;
+    done_count = 0;
+    sdq_init_backend(&backend, NULL);
+}
+
+static void request(sdq_request_t *req, uint8_t *buf, uint32_t blkno, uint32_t blkcnt, uint8_t write)
+{
+    memset(req, 0, sizeof(*req));
+    req->buf = buf;
+    req->blkno = blkno;
+    req->blkcnt = blkcnt;
+    req->write = write;
+    req->callback = on_done;
+    CHECK(sdq_submit(req));
+}
+
+// Completes chunks until the queue is idle, as the MMC IRQ and a thread calling sdq_poll would
+static void run_irqs(void)
+{
+    for (unsigned i = 0; i < 100 && !sdq_idle(); i++)
+    {
+        sdq_irq();
+        sdq_poll();
+    }
+    CHECK(sdq_idle());
+}
+
+static uint8_t buf_a[300 * 512], buf_b[4 * 512];
+
+static void test_order(void)
+{
+    sdq_request_t a, b;
+
+    reset();
+    request(&a, buf_a, 10, 300, 0);
+    request(&b, buf_b, 500, 4, 1);
+    CHECK_EQ(a.status, SDQ_ACTIVE);
+    CHECK_EQ(b.status, SDQ_QUEUED);
+    run_irqs();
+
+    // A in chunks of at most MAX_BLOCKS, then B
+    CHECK_EQ(fake.start_count, 4);
+    CHECK(fake.starts[0].buf == buf_a && fake.starts[0].blkno == 10 && fake.starts[0].blkcnt == 127);
+    CHECK(fake.starts[1].buf == buf_a + 127 * 512 && fake.starts[1].blkno == 137 && fake.starts[1].blkcnt == 127);
+    CHECK(fake.starts[2].buf == buf_a + 254 * 512 && fake.starts[2].blkno == 264 && fake.starts[2].blkcnt == 46);
+    CHECK(fake.starts[3].buf == buf_b && fake.starts[3].blkno == 500 && fake.starts[3].write);
+    CHECK_EQ(done_count, 2);
+    CHECK(done_order[0] == &a && done_order[1] == &b);
+    CHECK_EQ(a.status, SDQ_DONE);
+    CHECK_EQ(a.done, 300);
+    CHECK_EQ(b.status, SDQ_DONE);
+    CHECK(memcmp(buf_a, &fake.data[10 * 512], sizeof(buf_a)) == 0);
+    CHECK(sdq_wait(&a) && sdq_wait(&b));
+}
+
+static void test_errors(void)
+{
+    sdq_request_t a, b;
+
+    // One failed chunk is retried, but only after the card was recovered in thread context
+    reset();
+    fake.poll_results[1] = -1;
+    request(&a, buf_a, 0, 200, 0);
+    sdq_irq();
+    sdq_irq();
+    CHECK_EQ(fake.start_count, 2);
+    CHECK_EQ(fake.recover_count, 0);
+    sdq_tick();
+    CHECK_EQ(fake.start_count, 2);
+    sdq_poll();
+    CHECK_EQ(fake.recover_count, 1);
+    CHECK_EQ(fake.start_count, 3);
+    CHECK_EQ(fake.starts[2].blkno, fake.starts[1].blkno);
+    run_irqs();
+    CHECK_EQ(a.status, SDQ_DONE);
+    CHECK_EQ(fake.recover_count, 1);
+
+    // Failing again gives up on the request, the next one still runs
+    reset();
+    fake.poll_results[0] = -1;
+    fake.poll_results[1] = -1;
+    request(&a, buf_a, 0, 8, 0);
+    request(&b, buf_b, 0, 4, 0);
+    run_irqs();
+    CHECK_EQ(a.status, SDQ_ERROR);
+    CHECK(!sdq_wait(&a));
+    CHECK_EQ(b.status, SDQ_DONE);
+    CHECK(done_order[0] == &a && done_order[1] == &b);
+
+    CHECK_EQ(fake.recover_count, 2);
+
+    // A start the controller refuses counts as a failure as well
+    reset();
+    fake.refuse_start = 1;
+    request(&a, buf_a, 0, 8, 0);
+    CHECK_EQ(fake.start_count, 1);
+    CHECK_EQ(a.status, SDQ_ACTIVE);
+    sdq_poll();
+    CHECK_EQ(a.status, SDQ_ERROR);
+    CHECK_EQ(fake.start_count, SDQ_RETRIES + 1);
+    CHECK(sdq_idle());
+    sdq_poll();
+    CHECK_EQ(fake.recover_count, SDQ_RETRIES + 1);
+}
+
+static void test_timeouts(void)
+{
+    sdq_request_t a, b;
+    unsigned i;
+
+    // A chunk that never completes is aborted after SDQ_TIMEOUT_MS
+    reset();
+    request(&a, buf_a, 0, 8, 0);
+    request(&b, buf_b, 0, 4, 0);
+    fake.poll_results[0] = 0;
+    for (i = 0; i < SDQ_TIMEOUT_MS - 1; i++)
+        sdq_tick();
+    CHECK_EQ(a.status, SDQ_ACTIVE);
+    sdq_tick();
+    CHECK_EQ(a.status, SDQ_TIMEOUT);
+    CHECK_EQ(fake.abort_count, 1);
+    CHECK_EQ(fake.start_count, 1);
+    sdq_poll();
+    CHECK_EQ(fake.recover_count, 1);
+    CHECK_EQ(fake.start_count, 2);
+    run_irqs();
+    CHECK_EQ(b.status, SDQ_DONE);
+
+    // Time held off by a busy card does not count against the chunk
+    reset();
+    fake.busy = 1;
+    request(&a, buf_a, 0, 8, 0);
+    for (i = 0; i < SDQ_TIMEOUT_MS + 10; i++)
+        sdq_tick();
+    CHECK_EQ(fake.start_count, 0);
+    CHECK_EQ(a.status, SDQ_QUEUED);
+    fake.busy = 0;
+    fake.poll_results[0] = 0;
+    sdq_tick();
+    CHECK_EQ(fake.start_count, 1);
+    for (i = 0; i < SDQ_TIMEOUT_MS - 1; i++)
+        sdq_tick();
+    CHECK_EQ(a.status, SDQ_ACTIVE);
+    sdq_irq();
+    CHECK_EQ(a.status, SDQ_DONE);
+
+    // A card that never gets ready fails the head request
+    reset();
+    fake.busy = 1;
+    request(&a, buf_a, 0, 8, 0);
+    request(&b, buf_b, 0, 4, 0);
+    for (i = 0; i < SDQ_BUSY_TIMEOUT_MS; i++)
+        sdq_tick();
+    CHECK_EQ(a.status, SDQ_TIMEOUT);
+    CHECK_EQ(b.status, SDQ_QUEUED);
+}
+
+int main(void)
+{
+    test_order();
+    test_errors();
+    test_timeouts();
+    return TEST_RESULT();
+}
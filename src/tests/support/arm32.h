@@ -0,0 +1,27 @@
+#pragma once
+
+// Host stand-in for arm926/inc/arm32.h, the tests are single threaded. A WFI runs host_interrupt
+// instead, tests point it at the IRQ handler of the device they model.
+
+#include <stdint.h>
+
+extern void (*host_interrupt)(void);
+
+static inline void arm32_interrupt_enable(void) {}
+static inline void arm32_interrupt_disable(void) {}
+
+static inline uint32_t arm32_interrupt_save(void)
+{
+    return 0;
+}
+
+static inline void arm32_interrupt_restore(uint32_t cpsr)
+{
+    (void)cpsr;
+}
+
+static inline void arm32_wait_for_interrupt(void)
+{
+    if (host_interrupt)
+        host_interrupt();
+}
@@ -0,0 +1,46 @@
+#include "cache.h"
+#include "dmamem.h"
+
+// Host stand-ins for cache-v5.S, the tests check which ranges the drivers maintain
+
+cache_op_t cache_ops[CACHE_MAX_OPS];
+unsigned cache_op_count;
+
+static void cache_record(char op, unsigned long start, unsigned long end)
+{
+    if (cache_op_count < CACHE_MAX_OPS)
+        cache_ops[cache_op_count] = (cache_op_t){op, start, end};
+    cache_op_count++;
+}
+
+void v5_cache_inv_range(unsigned long start, unsigned long end)
+{
+    cache_record('i', start, end);
+}
+
+void v5_cache_clean_range(unsigned long start, unsigned long end)
+{
+    cache_record('c', start, end);
+}
+
+void v5_cache_flush_range(unsigned long start, unsigned long end)
+{
+    cache_record('f', start, end);
+}
+
+// Drains the write buffer in front of uncached DMA memory
+void dma_mem_sync(void)
+{
+    cache_record('s', 0, 0);
+}
+
+// Finds the last operation of a kind that covers [start, end)
+const cache_op_t *cache_find(char op, unsigned long start, unsigned long end)
+{
+    unsigned count = cache_op_count < CACHE_MAX_OPS ? cache_op_count : CACHE_MAX_OPS;
+
+    for (unsigned i = count; i-- > 0;)
+        if (cache_ops[i].op == op && cache_ops[i].start <= start && cache_ops[i].end >= end)
+            return &cache_ops[i];
+    return 0;
+}
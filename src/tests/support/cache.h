@@ -0,0 +1,15 @@
+#pragma once
+
+#define CACHE_MAX_OPS 256
+
+typedef struct
+{
+    char op; // 'i'nvalidate, 'c'lean, 'f'lush, 's'ync of the write buffer
+    unsigned long start;
+    unsigned long end;
+} cache_op_t;
+
+extern cache_op_t cache_ops[CACHE_MAX_OPS];
+extern unsigned cache_op_count;
+
+const cache_op_t *cache_find(char op, unsigned long start, unsigned long end);
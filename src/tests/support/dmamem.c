@@ -0,0 +1,45 @@
+#include <malloc.h>
+#include "cache.h"
+#include "dmamem.h"
+
+#define DMA_MEM_MAX_ALLOCS 64
+
+static struct
+{
+    uintptr_t start;
+    size_t size;
+} allocs[DMA_MEM_MAX_ALLOCS];
+static unsigned alloc_count;
+
+void *dma_mem_alloc(uint32_t size)
+{
+    void *p;
+
+    if (alloc_count == DMA_MEM_MAX_ALLOCS)
+        return NULL;
+    p = memalign(DMA_MEM_ALIGN, size);
+    if (p != NULL)
+    {
+        allocs[alloc_count].start = (uintptr_t)p;
+        allocs[alloc_count].size = size;
+        alloc_count++;
+    }
+    return p;
+}
+
+uint32_t dma_mem_available(void)
+{
+    return 1024 * 1024;
+}
+
+int dma_mem_contains(const void *p, size_t size)
+{
+    unsigned i;
+
+    for (i = 0; i < alloc_count; i++)
+    {
+        if ((uintptr_t)p >= allocs[i].start && (uintptr_t)p + size <= allocs[i].start + allocs[i].size)
+            return 1;
+    }
+    return 0;
+}
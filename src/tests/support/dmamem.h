@@ -0,0 +1,16 @@
+#pragma once
+
+// Host stand-in for f1c100s/dmamem.h. Allocations come from the heap and are remembered, so tests
+// can check a buffer lives in DMA memory. dma_mem_sync() is recorded with the cache operations.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define DMA_MEM_ALIGN 32
+
+void *dma_mem_alloc(uint32_t size);
+uint32_t dma_mem_available(void);
+void dma_mem_sync(void);
+
+// Whether [p, p + size) lies in one dma_mem_alloc() allocation
+int dma_mem_contains(const void *p, size_t size);
@@ -0,0 +1,178 @@
+#define _FILE_OFFSET_BITS 64
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "filecard.h"
+
+static int card_fd = -1;
+static uint32_t card_sectors;
+static uint64_t card_time_us;
+static filecard_stats_t card_stats;
+
+uint8_t filecard_open(const char *path, uint32_t sectors)
+{
+    struct stat st;
+    FILE *tmp;
+
+    filecard_close();
+    if (path)
+    {
+        card_fd = open(path, O_RDWR);
+    }
+    else if ((tmp = tmpfile()) != NULL)
+    {
+        card_fd = dup(fileno(tmp));
+        fclose(tmp);
+    }
+    if (card_fd < 0)
+        return 0;
+
+    if (sectors)
+    {
+        if (ftruncate(card_fd, (off_t)sectors * FILECARD_SECTOR_SIZE) != 0)
+            return 0;
+    }
+    else
+    {
+        if (fstat(card_fd, &st) != 0)
+            return 0;
+        sectors = st.st_size / FILECARD_SECTOR_SIZE;
+    }
+    card_sectors = sectors;
+    card_time_us = 0;
+    memset(&card_stats, 0, sizeof(card_stats));
+    return 1;
+}
+
+void filecard_close(void)
+{
+    if (card_fd >= 0)
+        close(card_fd);
+    card_fd = -1;
+    card_sectors = 0;
+}
+
+uint32_t filecard_sectors(void)
+{
+    return card_sectors;
+}
+
+uint8_t filecard_read(uint8_t *buf, uint32_t sector, uint32_t count)
+{
+    size_t len = (size_t)count * FILECARD_SECTOR_SIZE;
+
+    if (card_fd < 0 || count == 0 || sector + (uint64_t)count > card_sectors)
+        return 0;
+    if (pread(card_fd, buf, len, (off_t)sector * FILECARD_SECTOR_SIZE) != (ssize_t)len)
+        return 0;
+
+    // KB/s is bytes per ms, len * 1000 / kbps is microseconds
+    card_time_us += FILECARD_CMD_US + FILECARD_READ_ACCESS_US + len * 1000 / FILECARD_READ_KBPS;
+    card_stats.reads++;
+    card_stats.read_sectors += count;
+    return 1;
+}
+
+uint8_t filecard_write(const uint8_t *buf, uint32_t sector, uint32_t count)
+{
+    size_t len = (size_t)count * FILECARD_SECTOR_SIZE;
+
+    if (card_fd < 0 || count == 0 || sector + (uint64_t)count > card_sectors)
+        return 0;
+    if (pwrite(card_fd, buf, len, (off_t)sector * FILECARD_SECTOR_SIZE) != (ssize_t)len)
+        return 0;
+
+    card_time_us += FILECARD_CMD_US + FILECARD_WRITE_BUSY_US + len * 1000 / FILECARD_WRITE_KBPS;
+    card_stats.writes++;
+    card_stats.written_sectors += count;
+    return 1;
+}
+
+uint64_t filecard_time_us(void)
+{
+    return card_time_us;
+}
+
+const filecard_stats_t *filecard_stats(void)
+{
+    return &card_stats;
+}
+
+static void put16(uint8_t *p, uint16_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+}
+
+static void put32(uint8_t *p, uint32_t v)
+{
+    put16(p, v);
+    put16(p + 2, v >> 16);
+}
+
+uint8_t filecard_format_fat32(uint32_t cluster_sectors)
+{
+    const uint32_t rsvd = 32, fats = 2;
+    uint8_t sec[FILECARD_SECTOR_SIZE];
+    uint32_t fat_sectors = 1, clusters, i;
+
+    // Grow the FAT until it covers every cluster left next to it
+    for (;;)
+    {
+        clusters = (card_sectors - rsvd - fats * fat_sectors) / cluster_sectors;
+        if ((clusters + 2) * 4 <= fat_sectors * FILECARD_SECTOR_SIZE)
+            break;
+        fat_sectors++;
+    }
+    if (clusters < 65526)
+        return 0; // Too small for FAT32
+
+    memset(sec, 0, sizeof(sec));
+    memcpy(sec, "\xEB\x58\x90" "MSWIN4.1", 11);
+    put16(sec + 11, FILECARD_SECTOR_SIZE);
+    sec[13] = cluster_sectors;
+    put16(sec + 14, rsvd);
+    sec[16] = fats;
+    sec[21] = 0xF8;
+    put16(sec + 24, 63);
+    put16(sec + 26, 255);
+    put32(sec + 32, card_sectors);
+    put32(sec + 36, fat_sectors);
+    put32(sec + 44, 2); // Root directory cluster
+    put16(sec + 48, 1); // FSInfo sector
+    put16(sec + 50, 6); // Backup boot sector
+    sec[64] = 0x80;
+    sec[66] = 0x29;
+    put32(sec + 67, 0x12345678);
+    memcpy(sec + 71, "NO NAME    FAT32   ", 19);
+    put16(sec + 510, 0xAA55);
+    if (!filecard_write(sec, 0, 1) || !filecard_write(sec, 6, 1))
+        return 0;
+
+    memset(sec, 0, sizeof(sec));
+    put32(sec, 0x41615252);
+    put32(sec + 484, 0x61417272);
+    put32(sec + 488, 0xFFFFFFFF); // Free count unknown
+    put32(sec + 492, 0xFFFFFFFF);
+    put32(sec + 508, 0xAA550000);
+    if (!filecard_write(sec, 1, 1) || !filecard_write(sec, 7, 1))
+        return 0;
+
+    // Clear the FATs and the root directory, then mark the reserved entries and the root cluster
+    memset(sec, 0, sizeof(sec));
+    for (i = rsvd; i < rsvd + fats * fat_sectors + cluster_sectors; i++)
+        if (!filecard_write(sec, i, 1))
+            return 0;
+    put32(sec, 0x0FFFFFF8);
+    put32(sec + 4, 0x0FFFFFFF);
+    put32(sec + 8, 0x0FFFFFFF);
+    for (i = 0; i < fats; i++)
+        if (!filecard_write(sec, rsvd + i * fat_sectors, 1))
+            return 0;
+
+    card_time_us = 0;
+    memset(&card_stats, 0, sizeof(card_stats));
+    return 1;
+}
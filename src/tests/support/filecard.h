@@ -0,0 +1,40 @@
+#pragma once
+
+#include <stdint.h>
+
+// SD card stand-in backed by a file, for code that sits on FatFs or the sector layer. Transfers also
+// advance a simulated clock with a simple card timing model, so benchmarks report repeatable numbers
+// that follow the number and size of the commands rather than the speed of the host.
+
+#define FILECARD_SECTOR_SIZE 512
+
+// Per command costs and sustained rates of a class 10 card on a 4-bit 50 MHz bus
+#define FILECARD_CMD_US 30           // Command, response and driver setup
+#define FILECARD_READ_ACCESS_US 100  // First block of a read
+#define FILECARD_WRITE_BUSY_US 400   // Programming busy after a write
+#define FILECARD_READ_KBPS 22000
+#define FILECARD_WRITE_KBPS 12000
+
+typedef struct
+{
+    uint32_t reads;
+    uint32_t writes;
+    uint64_t read_sectors;
+    uint64_t written_sectors;
+} filecard_stats_t;
+
+// Opens path as the card, or a temporary file of the given size when path is NULL.
+// The card size comes from the file unless sectors is nonzero. Returns 0 on failure.
+uint8_t filecard_open(const char *path, uint32_t sectors);
+void filecard_close(void);
+uint32_t filecard_sectors(void);
+
+uint8_t filecard_read(uint8_t *buf, uint32_t sector, uint32_t count);
+uint8_t filecard_write(const uint8_t *buf, uint32_t sector, uint32_t count);
+
+// Simulated time spent in transfers since filecard_open
+uint64_t filecard_time_us(void);
+const filecard_stats_t *filecard_stats(void);
+
+// Lays down an empty FAT32 volume over the whole card, no partition table
+uint8_t filecard_format_fat32(uint32_t cluster_sectors);
@@ -0,0 +1,61 @@
+// FatFs disk glue for a filecard, compiled together with the FatFs copy under test
+
+#include "ff.h"
+#include "diskio.h"
+#include "filecard.h"
+
+DSTATUS disk_status(BYTE pdrv)
+{
+    return (pdrv == 0 && filecard_sectors()) ? 0 : STA_NOINIT;
+}
+
+DSTATUS disk_initialize(BYTE pdrv)
+{
+    return disk_status(pdrv);
+}
+
+DRESULT disk_read(BYTE pdrv, BYTE *buff, LBA_t sector, UINT count)
+{
+    if (pdrv != 0)
+        return RES_PARERR;
+    return filecard_read(buff, sector, count) ? RES_OK : RES_ERROR;
+}
+
+#if FF_FS_READONLY == 0
+DRESULT disk_write(BYTE pdrv, const BYTE *buff, LBA_t sector, UINT count)
+{
+    if (pdrv != 0)
+        return RES_PARERR;
+    return filecard_write(buff, sector, count) ? RES_OK : RES_ERROR;
+}
+#endif
+
+DRESULT disk_ioctl(BYTE pdrv, BYTE cmd, void *buff)
+{
+    if (pdrv != 0)
+        return RES_PARERR;
+
+    switch (cmd)
+    {
+    case CTRL_SYNC:
+        return RES_OK;
+    case GET_SECTOR_COUNT:
+        *(LBA_t *)buff = filecard_sectors();
+        return RES_OK;
+    case GET_SECTOR_SIZE:
+        *(WORD *)buff = FILECARD_SECTOR_SIZE;
+        return RES_OK;
+    case GET_BLOCK_SIZE:
+        *(DWORD *)buff = 1;
+        return RES_OK;
+    default:
+        return RES_PARERR;
+    }
+}
+
+#if !FF_FS_NORTC && !FF_FS_READONLY
+DWORD get_fattime(void)
+{
+    return ((DWORD)(FF_NORTC_YEAR - 1980) << 25 | (DWORD)FF_NORTC_MON << 21 | (DWORD)FF_NORTC_MDAY << 16);
+}
+#endif
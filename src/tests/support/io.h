@@ -0,0 +1,18 @@
+#pragma once
+
+// Host stand-in for arm926/inc/io.h, register accesses go to the simulated bus in mmio.c
+
+#include <stdint.h>
+#include "mmio.h"
+
+#define read8(x) ((uint8_t)mmio_read((uintptr_t)(x), 1))
+#define write8(x, y) mmio_write((uintptr_t)(x), (uint8_t)(y), 1)
+
+#define read16(x) ((uint16_t)mmio_read((uintptr_t)(x), 2))
+#define write16(x, y) mmio_write((uintptr_t)(x), (uint16_t)(y), 2)
+
+#define read32(x) mmio_read((uintptr_t)(x), 4)
+#define write32(x, y) mmio_write((uintptr_t)(x), (uint32_t)(y), 4)
+
+#define set32(x, y) write32(x, (read32(x) | y))
+#define clear32(x, y) write32(x, (read32(x) & ~y))
@@ -0,0 +1,81 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "mmio.h"
+
+#define MMIO_MAX_MAPS 8
+
+typedef struct
+{
+    uint32_t base;
+    uint32_t size;
+    mmio_read_fn read;
+    mmio_write_fn write;
+    void *ctx;
+} mmio_map_t;
+
+static uint8_t window[MMIO_WINDOW_SIZE];
+static mmio_map_t maps[MMIO_MAX_MAPS];
+static unsigned map_count;
+
+static uint8_t *mmio_backing(uintptr_t addr, unsigned size)
+{
+    if (addr < MMIO_WINDOW_BASE || addr + size > MMIO_WINDOW_BASE + MMIO_WINDOW_SIZE)
+    {
+        fprintf(stderr, "mmio: access to 0x%08lx outside the peripheral window\n", (unsigned long)addr);
+        abort();
+    }
+    return &window[addr - MMIO_WINDOW_BASE];
+}
+
+static mmio_map_t *mmio_find(uintptr_t addr)
+{
+    for (unsigned i = 0; i < map_count; i++)
+        if (addr >= maps[i].base && addr - maps[i].base < maps[i].size)
+            return &maps[i];
+    return NULL;
+}
+
+void mmio_reset(void)
+{
+    memset(window, 0, sizeof(window));
+    map_count = 0;
+}
+
+void mmio_map(uint32_t base, uint32_t size, mmio_read_fn read, mmio_write_fn write, void *ctx)
+{
+    if (map_count == MMIO_MAX_MAPS)
+        abort();
+    maps[map_count++] = (mmio_map_t){base, size, read, write, ctx};
+}
+
+uint32_t mmio_peek(uint32_t addr, unsigned size)
+{
+    uint32_t value = 0;
+    memcpy(&value, mmio_backing(addr, size), size);
+    return value;
+}
+
+void mmio_poke(uint32_t addr, uint32_t value, unsigned size)
+{
+    memcpy(mmio_backing(addr, size), &value, size);
+}
+
+uint32_t mmio_read(uintptr_t addr, unsigned size)
+{
+    mmio_map_t *map = mmio_find(addr);
+
+    if (map && map->read)
+        return map->read(map->ctx, addr - map->base, size);
+    return mmio_peek(addr, size);
+}
+
+void mmio_write(uintptr_t addr, uint32_t value, unsigned size)
+{
+    mmio_map_t *map = mmio_find(addr);
+
+    if (map && map->write)
+        map->write(map->ctx, addr - map->base, value, size);
+    else
+        mmio_poke(addr, value, size);
+}
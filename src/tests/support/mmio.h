@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stdint.h>
+
+// Simulated peripheral bus for host tests. Everything in the peripheral window reads back what was
+// written unless a device model is mapped over the range.
+
+#define MMIO_WINDOW_BASE 0x01C00000
+#define MMIO_WINDOW_SIZE 0x00100000
+
+typedef uint32_t (*mmio_read_fn)(void *ctx, uint32_t offset, unsigned size);
+typedef void (*mmio_write_fn)(void *ctx, uint32_t offset, uint32_t value, unsigned size);
+
+// Clears the window and drops all device models
+void mmio_reset(void);
+
+// Routes accesses to [base, base + size) to a device model, offsets are relative to base
+void mmio_map(uint32_t base, uint32_t size, mmio_read_fn read, mmio_write_fn write, void *ctx);
+
+uint32_t mmio_read(uintptr_t addr, unsigned size);
+void mmio_write(uintptr_t addr, uint32_t value, unsigned size);
+
+// Backing store access that bypasses device models, for the models themselves and for checks
+uint32_t mmio_peek(uint32_t addr, unsigned size);
+void mmio_poke(uint32_t addr, uint32_t value, unsigned size);
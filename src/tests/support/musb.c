@@ -0,0 +1,581 @@
+#define _GNU_SOURCE
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <ucontext.h>
+#include "mmio.h"
+#include "musb.h"
+
+#ifndef __x86_64__
+#error "The MUSB model decodes x86-64 register accesses"
+#endif
+
+#define MUSB_MAX_PACKET 1024
+#define MUSB_TF 0x100 // Trap flag of EFLAGS, single steps the access
+
+// Common registers
+#define MUSB_POWER 0x40
+#define MUSB_EP_IDX 0x42
+#define MUSB_EP_IS 0x44
+#define MUSB_BUS_IS 0x4C
+
+// Registers of the endpoint EP_IDX selects, as offsets into the indexed block at 0x80
+#define MUSB_INDEXED 0x80
+#define MUSB_TXCSR 0x02
+#define MUSB_RXCSR 0x06
+#define MUSB_RXCOUNT 0x08
+#define MUSB_FADDR 0x18
+
+// CSR0
+#define CSR0_RXPKTRDY 0x01
+#define CSR0_TXPKTRDY 0x02
+#define CSR0_SENTSTALL 0x04
+#define CSR0_DATAEND 0x08
+#define CSR0_SETUPEND 0x10
+#define CSR0_SENDSTALL 0x20
+#define CSR0_SERVICED_RXPKTRDY 0x40
+#define CSR0_SERVICED_SETUPEND 0x80
+
+// TXCSR of endpoints 1 and up
+#define TXCSR_TXPKTRDY 0x01
+#define TXCSR_FIFONOTEMPTY 0x02
+#define TXCSR_FLUSHFIFO 0x08
+#define TXCSR_SENDSTALL 0x10
+#define TXCSR_SENTSTALL 0x20
+#define TXCSR_CLRDATATOG 0x40
+
+// RXCSR of endpoints 1 and up
+#define RXCSR_RXPKTRDY 0x01
+#define RXCSR_FIFOFULL 0x02
+#define RXCSR_FLUSHFIFO 0x10
+#define RXCSR_SENDSTALL 0x20
+#define RXCSR_SENTSTALL 0x40
+#define RXCSR_CLRDATATOG 0x80
+
+typedef struct
+{
+    // OUT packets in the FIFO, oldest at head
+    uint8_t rx[2][MUSB_MAX_PACKET];
+    uint32_t rx_len[2];
+    uint32_t rx_pos;
+    unsigned rx_head, rx_count;
+    // IN packet being written to the FIFO
+    uint8_t tx[MUSB_MAX_PACKET];
+    uint32_t tx_len;
+    // IN packets on the wire, not taken by the host yet
+    uint8_t *log;
+    uint32_t log_len, log_pos, log_cap;
+    uint32_t *packets;
+    unsigned packet_count, packet_pos, packet_cap;
+    uint8_t regs[0x20];
+} musb_ep_t;
+
+static uint8_t musb_regs[MUSB_SIZE];
+static musb_ep_t musb_eps[MUSB_EP_COUNT];
+static uint8_t musb_ep0_stall;
+
+unsigned musb_ep0_status_count;
+unsigned musb_toggle_resets[MUSB_EP_COUNT][2];
+
+// Other peripherals the drivers reach through plain pointers, their accesses go to mmio.c
+#define MUSB_BUS_RANGES 4
+static struct
+{
+    uint32_t base, size;
+} musb_bus[MUSB_BUS_RANGES];
+static unsigned musb_bus_count;
+
+// The access between the fault and the single step, range is 0 for the MUSB, else 1 + the bus range
+static struct
+{
+    uint32_t offset;
+    unsigned size;
+    int write;
+    unsigned range;
+} musb_access;
+
+static uint32_t musb_get(const uint8_t *p, unsigned size)
+{
+    uint32_t value = 0;
+    memcpy(&value, p, size > 4 ? 4 : size);
+    return value;
+}
+
+static void musb_put(uint8_t *p, uint32_t value, unsigned size)
+{
+    memset(p, 0, size);
+    memcpy(p, &value, size > 4 ? 4 : size);
+}
+
+static musb_ep_t *musb_ep(uint8_t ep)
+{
+    if (ep >= MUSB_EP_COUNT)
+    {
+        fprintf(stderr, "musb: endpoint %u not modelled\n", ep);
+        abort();
+    }
+    return &musb_eps[ep];
+}
+
+static void musb_raise_ep(unsigned bit)
+{
+    musb_put(&musb_regs[MUSB_EP_IS], musb_get(&musb_regs[MUSB_EP_IS], 4) | 1u << bit, 4);
+}
+
+static void musb_rx_pop(musb_ep_t *e)
+{
+    e->rx_head ^= 1;
+    e->rx_count--;
+    e->rx_pos = 0;
+}
+
+// The staged FIFO contents go on the wire as one packet
+static void musb_tx_commit(uint8_t ep)
+{
+    musb_ep_t *e = musb_ep(ep);
+
+    if (e->log_len + e->tx_len > e->log_cap)
+    {
+        e->log_cap = (e->log_len + e->tx_len) * 2;
+        e->log = realloc(e->log, e->log_cap);
+    }
+    if (e->packet_count == e->packet_cap)
+    {
+        e->packet_cap = e->packet_cap ? e->packet_cap * 2 : 64;
+        e->packets = realloc(e->packets, e->packet_cap * sizeof(e->packets[0]));
+    }
+    if (!e->log || !e->packets)
+        abort();
+    memcpy(e->log + e->log_len, e->tx, e->tx_len);
+    e->log_len += e->tx_len;
+    e->packets[e->packet_count++] = e->tx_len;
+    e->tx_len = 0;
+}
+
+uint32_t musb_fifo_read(uint8_t ep, unsigned size)
+{
+    musb_ep_t *e = musb_ep(ep);
+    uint32_t value;
+
+    if (!e->rx_count || e->rx_pos + size > e->rx_len[e->rx_head])
+    {
+        fprintf(stderr, "musb: EP%u FIFO read of %u bytes past the packet\n", ep, size);
+        abort();
+    }
+    value = musb_get(&e->rx[e->rx_head][e->rx_pos], size);
+    e->rx_pos += size;
+    return value;
+}
+
+void musb_fifo_write(uint8_t ep, uint32_t value, unsigned size)
+{
+    musb_ep_t *e = musb_ep(ep);
+
+    if (e->tx_len + size > MUSB_MAX_PACKET)
+    {
+        fprintf(stderr, "musb: EP%u FIFO overflow\n", ep);
+        abort();
+    }
+    musb_put(&e->tx[e->tx_len], value, size);
+    e->tx_len += size;
+}
+
+static uint32_t musb_csr0_read(void)
+{
+    uint32_t csr = musb_get(&musb_eps[0].regs[MUSB_TXCSR], 2);
+
+    return musb_eps[0].rx_count ? csr | CSR0_RXPKTRDY : csr;
+}
+
+static void musb_csr0_write(uint32_t value)
+{
+    musb_ep_t *e = &musb_eps[0];
+    uint32_t old = musb_get(&e->regs[MUSB_TXCSR], 2);
+    uint32_t csr = old & CSR0_SETUPEND;
+
+    if (old & value & CSR0_SENTSTALL)
+        csr |= CSR0_SENTSTALL;
+    if (value & CSR0_SERVICED_SETUPEND)
+        csr &= ~CSR0_SETUPEND;
+    // The data stage of a control write follows the setup
+    if ((value & CSR0_SERVICED_RXPKTRDY) && e->rx_count)
+    {
+        musb_rx_pop(e);
+        if (e->rx_count)
+            musb_raise_ep(0);
+    }
+    if (value & CSR0_TXPKTRDY)
+        musb_tx_commit(0);
+    if (value & CSR0_SENDSTALL)
+    {
+        musb_ep0_stall = 1;
+        csr |= CSR0_SENTSTALL;
+        musb_raise_ep(0);
+    }
+    else if (value & CSR0_DATAEND)
+    {
+        // The host runs the status stage at once
+        musb_ep0_status_count++;
+        musb_raise_ep(0);
+    }
+    musb_put(&e->regs[MUSB_TXCSR], csr, 2);
+}
+
+static uint32_t musb_rxcsr_read(musb_ep_t *e)
+{
+    uint32_t csr = musb_get(&e->regs[MUSB_RXCSR], 2) & ~(RXCSR_RXPKTRDY | RXCSR_FIFOFULL);
+
+    if (e->rx_count)
+        csr |= RXCSR_RXPKTRDY;
+    if (e->rx_count == 2)
+        csr |= RXCSR_FIFOFULL;
+    return csr;
+}
+
+static void musb_txcsr_write(uint8_t ep, uint32_t value)
+{
+    musb_ep_t *e = musb_ep(ep);
+    uint32_t old = musb_get(&e->regs[MUSB_TXCSR], 2);
+    uint32_t csr = value & 0xFF10;
+
+    if (old & value & TXCSR_SENTSTALL)
+        csr |= TXCSR_SENTSTALL;
+    if (value & TXCSR_FLUSHFIFO)
+        e->tx_len = 0;
+    if (value & TXCSR_CLRDATATOG)
+        musb_toggle_resets[ep][1]++;
+    if (value & TXCSR_TXPKTRDY)
+    {
+        musb_tx_commit(ep);
+        musb_raise_ep(ep);
+    }
+    musb_put(&e->regs[MUSB_TXCSR], csr, 2);
+}
+
+static void musb_rxcsr_write(uint8_t ep, uint32_t value)
+{
+    musb_ep_t *e = musb_ep(ep);
+    uint32_t old = musb_get(&e->regs[MUSB_RXCSR], 2);
+    uint32_t csr = value & 0xFF20;
+
+    if (old & value & RXCSR_SENTSTALL)
+        csr |= RXCSR_SENTSTALL;
+    if (value & RXCSR_CLRDATATOG)
+        musb_toggle_resets[ep][0]++;
+    // Clearing RxPktRdy or a flush frees the buffer, a packet in the other one is up next
+    if (e->rx_count && (!(value & RXCSR_RXPKTRDY) || (value & RXCSR_FLUSHFIFO)))
+    {
+        musb_rx_pop(e);
+        if (e->rx_count)
+            musb_raise_ep(16 + ep);
+    }
+    musb_put(&e->regs[MUSB_RXCSR], csr, 2);
+}
+
+static uint32_t musb_read(uint32_t offset, unsigned size)
+{
+    uint8_t ep = musb_regs[MUSB_EP_IDX];
+
+    if (offset < 0x40)
+        return musb_fifo_read(offset / 4, size);
+    if (offset >= MUSB_INDEXED && offset < MUSB_INDEXED + 0x20)
+    {
+        musb_ep_t *e = musb_ep(ep);
+
+        offset -= MUSB_INDEXED;
+        if (offset == MUSB_TXCSR)
+            return ep ? musb_get(&e->regs[MUSB_TXCSR], 2) | (e->tx_len ? TXCSR_FIFONOTEMPTY : 0) : musb_csr0_read();
+        if (offset == MUSB_RXCSR && ep)
+            return musb_rxcsr_read(e);
+        if (offset == MUSB_RXCOUNT)
+            return e->rx_count ? e->rx_len[e->rx_head] - e->rx_pos : 0;
+        return musb_get(&e->regs[offset], size);
+    }
+    return musb_get(&musb_regs[offset], size);
+}
+
+static void musb_write(uint32_t offset, uint32_t value, unsigned size)
+{
+    uint8_t ep = musb_regs[MUSB_EP_IDX];
+
+    if (offset < 0x40)
+    {
+        musb_fifo_write(offset / 4, value, size);
+        return;
+    }
+    if (offset >= MUSB_INDEXED && offset < MUSB_INDEXED + 0x20)
+    {
+        offset -= MUSB_INDEXED;
+        if (offset == MUSB_TXCSR && ep == 0)
+            musb_csr0_write(value);
+        else if (offset == MUSB_TXCSR)
+            musb_txcsr_write(ep, value);
+        else if (offset == MUSB_RXCSR && ep)
+            musb_rxcsr_write(ep, value);
+        else
+            musb_put(&musb_ep(ep)->regs[offset], value, size);
+        return;
+    }
+    if (offset == MUSB_EP_IS || offset == MUSB_BUS_IS)
+        value = musb_get(&musb_regs[offset], size) & ~value; // Write 1 to clear
+    musb_put(&musb_regs[offset], value, size);
+}
+
+// Size and direction of the move at ip, 0 for an instruction the model does not know
+static int musb_decode(const uint8_t *ip, unsigned *size, int *write)
+{
+    unsigned opsize = 4;
+
+    for (;; ip++)
+    {
+        if (*ip == 0x66)
+            opsize = 2;
+        else if ((*ip & 0xF0) == 0x40) // REX
+            opsize = *ip & 8 ? 8 : opsize;
+        else
+            break;
+    }
+    switch (ip[0])
+    {
+    case 0x0F: // movzx, movsx
+        if (ip[1] != 0xB6 && ip[1] != 0xB7 && ip[1] != 0xBE && ip[1] != 0xBF)
+            return 0;
+        *size = ip[1] & 1 ? 2 : 1;
+        *write = 0;
+        return 1;
+    case 0x8A:
+    case 0x8B:
+    case 0x88:
+    case 0x89:
+    case 0xC6:
+    case 0xC7:
+        *size = ip[0] & 1 ? opsize : 1;
+        *write = ip[0] != 0x8A && ip[0] != 0x8B;
+        return 1;
+    }
+    return 0;
+}
+
+// Base and size of the trapped range an access goes to
+static uintptr_t musb_range(unsigned range, uint32_t *size)
+{
+    if (!range)
+    {
+        *size = MUSB_SIZE;
+        return MUSB_BASE;
+    }
+    *size = musb_bus[range - 1].size;
+    return musb_bus[range - 1].base;
+}
+
+static void musb_segv(int sig, siginfo_t *info, void *context)
+{
+    ucontext_t *uc = context;
+    uintptr_t addr = (uintptr_t)info->si_addr, base;
+    const uint8_t *ip = (const uint8_t *)uc->uc_mcontext.gregs[REG_RIP];
+    uint32_t size;
+
+    (void)sig;
+    for (musb_access.range = 0; musb_access.range <= musb_bus_count; musb_access.range++)
+    {
+        base = musb_range(musb_access.range, &size);
+        if (addr >= base && addr < base + size)
+            break;
+    }
+    if (musb_access.range > musb_bus_count)
+    {
+        signal(SIGSEGV, SIG_DFL); // Not ours, crash on the way back
+        return;
+    }
+    if (!musb_decode(ip, &musb_access.size, &musb_access.write))
+    {
+        fprintf(stderr, "musb: access to 0x%08lx by %02x %02x %02x %02x not decoded, build without optimisation\n",
+                (unsigned long)addr, ip[0], ip[1], ip[2], ip[3]);
+        abort();
+    }
+    musb_access.offset = addr - base;
+    mprotect((void *)base, size, PROT_READ | PROT_WRITE);
+    if (!musb_access.write)
+        musb_put((uint8_t *)addr,
+                 musb_access.range ? mmio_read(addr, musb_access.size) : musb_read(musb_access.offset, musb_access.size),
+                 musb_access.size);
+    uc->uc_mcontext.gregs[REG_EFL] |= MUSB_TF;
+}
+
+static void musb_trap(int sig, siginfo_t *info, void *context)
+{
+    ucontext_t *uc = context;
+    uint32_t size;
+    uintptr_t base = musb_range(musb_access.range, &size);
+    uint32_t value;
+
+    (void)sig;
+    (void)info;
+    uc->uc_mcontext.gregs[REG_EFL] &= ~MUSB_TF;
+    if (musb_access.write)
+    {
+        value = musb_get((uint8_t *)base + musb_access.offset, musb_access.size);
+        if (musb_access.range)
+            mmio_write(base + musb_access.offset, value, musb_access.size);
+        else
+            musb_write(musb_access.offset, value, musb_access.size);
+    }
+    mprotect((void *)base, size, PROT_NONE);
+}
+
+void musb_init(void)
+{
+    struct sigaction sa;
+
+    if (mmap((void *)MUSB_BASE, MUSB_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0) !=
+        (void *)MUSB_BASE)
+    {
+        perror("musb: mapping the register page");
+        abort();
+    }
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_flags = SA_SIGINFO;
+    sa.sa_sigaction = musb_segv;
+    sigaction(SIGSEGV, &sa, NULL);
+    sa.sa_sigaction = musb_trap;
+    sigaction(SIGTRAP, &sa, NULL);
+    musb_reset();
+}
+
+void musb_trap_bus(uint32_t base, uint32_t size)
+{
+    if (musb_bus_count == MUSB_BUS_RANGES ||
+        mmap((void *)(uintptr_t)base, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0) !=
+            (void *)(uintptr_t)base)
+    {
+        perror("musb: mapping a bus range");
+        abort();
+    }
+    musb_bus[musb_bus_count].base = base;
+    musb_bus[musb_bus_count].size = size;
+    musb_bus_count++;
+}
+
+void musb_reset(void)
+{
+    for (unsigned i = 0; i < MUSB_EP_COUNT; i++)
+    {
+        musb_ep_t *e = &musb_eps[i];
+
+        free(e->log);
+        free(e->packets);
+        memset(e, 0, sizeof(*e));
+    }
+    memset(musb_regs, 0, sizeof(musb_regs));
+    memset(musb_toggle_resets, 0, sizeof(musb_toggle_resets));
+    musb_ep0_stall = 0;
+    musb_ep0_status_count = 0;
+}
+
+void musb_bus_reset(uint8_t high_speed)
+{
+    for (unsigned i = 0; i < MUSB_EP_COUNT; i++)
+    {
+        musb_ep_t *e = &musb_eps[i];
+
+        e->rx_count = 0;
+        e->rx_pos = 0;
+        e->tx_len = 0;
+        musb_put(&e->regs[MUSB_TXCSR], 0, 2);
+        musb_put(&e->regs[MUSB_RXCSR], 0, 2);
+    }
+    musb_eps[0].regs[MUSB_FADDR] = 0;
+    musb_ep0_stall = 0;
+    musb_regs[MUSB_POWER] = (musb_regs[MUSB_POWER] & ~0x10) | (high_speed ? 0x10 : 0);
+    musb_regs[MUSB_BUS_IS] |= 4;
+}
+
+void musb_suspend(void)
+{
+    musb_regs[MUSB_BUS_IS] |= 1;
+}
+
+int musb_setup(const void *setup)
+{
+    musb_ep_t *e = &musb_eps[0];
+
+    if (e->rx_count)
+        return 0;
+    memcpy(e->rx[e->rx_head], setup, 8);
+    e->rx_len[e->rx_head] = 8;
+    e->rx_pos = 0;
+    e->rx_count = 1;
+    musb_ep0_stall = 0;
+    musb_raise_ep(0);
+    return 1;
+}
+
+int musb_out(uint8_t ep, const void *data, uint32_t len)
+{
+    musb_ep_t *e = musb_ep(ep);
+    unsigned slot = (e->rx_head + e->rx_count) & 1;
+
+    if (e->rx_count == 2 || len > MUSB_MAX_PACKET)
+        return 0;
+    memcpy(e->rx[slot], data, len);
+    e->rx_len[slot] = len;
+    if (!e->rx_count++)
+    {
+        e->rx_pos = 0;
+        musb_raise_ep(ep ? 16 + ep : 0);
+    }
+    return 1;
+}
+
+unsigned musb_out_pending(uint8_t ep)
+{
+    return musb_ep(ep)->rx_count;
+}
+
+int musb_in(uint8_t ep, void *data, uint32_t max)
+{
+    musb_ep_t *e = musb_ep(ep);
+    uint32_t len;
+
+    if (e->packet_pos == e->packet_count)
+        return -1;
+    len = e->packets[e->packet_pos++];
+    memcpy(data, e->log + e->log_pos, len < max ? len : max);
+    e->log_pos += len;
+    if (e->packet_pos == e->packet_count)
+    {
+        e->packet_pos = e->packet_count = 0;
+        e->log_pos = e->log_len = 0;
+    }
+    return len;
+}
+
+unsigned musb_in_pending(uint8_t ep)
+{
+    musb_ep_t *e = musb_ep(ep);
+
+    return e->packet_count - e->packet_pos;
+}
+
+uint8_t musb_stalled(uint8_t ep, uint8_t in)
+{
+    musb_ep_t *e = musb_ep(ep);
+
+    if (ep == 0)
+        return musb_ep0_stall;
+    if (in)
+        return (musb_get(&e->regs[MUSB_TXCSR], 2) & TXCSR_SENDSTALL) != 0;
+    return (musb_get(&e->regs[MUSB_RXCSR], 2) & RXCSR_SENDSTALL) != 0;
+}
+
+uint8_t musb_address(void)
+{
+    return musb_eps[0].regs[MUSB_FADDR];
+}
+
+uint32_t musb_peek(uint32_t offset, unsigned size)
+{
+    return musb_read(offset, size);
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <stdint.h>
+
+// Simulated USB OTG controller (Mentor MUSB, Allwinner layout) for the USB device stacks. Those reach the
+// controller through a USB_T pointer at USB_BASE instead of io.h, so the register page is mapped there
+// without access. Every access faults, the model gives the value of a read before the instruction runs
+// again and takes the value of a write after it single stepped. The decoder knows the plain moves the
+// register accesses compile to without optimisation, anything else aborts with the instruction bytes.
+//
+// The host side is instant: a packet the device arms for IN is on the wire at once, an OUT packet or
+// setup is in the FIFO until the device takes it. Up to two OUT packets wait per endpoint, as with a
+// double buffered FIFO.
+
+#define MUSB_BASE 0x01C13000
+#define MUSB_SIZE 0x2000
+#define MUSB_EP_COUNT 6
+
+// Maps the register page and starts from reset, once per test program
+void musb_init(void);
+
+// Traps plain pointer accesses to [base, base + size) the same way and passes them to the bus of mmio.c,
+// for drivers that reach other peripherals through a struct pointer as well. Page aligned, after
+// musb_init.
+void musb_trap_bus(uint32_t base, uint32_t size);
+
+// Device side state back to reset, logged packets are dropped
+void musb_reset(void);
+
+// Bus reset and speed as detected by the PHY, raises the reset interrupt
+void musb_bus_reset(uint8_t high_speed);
+
+// Idle bus, raises the suspend interrupt and leaves the device state alone
+void musb_suspend(void);
+
+// Queues a SETUP on EP0 and raises its interrupt, returns 0 while the last one is not taken yet
+int musb_setup(const void *setup);
+
+// Queues an OUT data packet and raises the endpoint interrupt, returns 0 when both FIFO buffers are full.
+// On EP0 it is the data stage of a control write, queued right after its setup.
+int musb_out(uint8_t ep, const void *data, uint32_t len);
+
+// Number of OUT packets the device has not taken yet
+unsigned musb_out_pending(uint8_t ep);
+
+// Takes the oldest IN packet the device sent on ep, returns its length or -1 when there is none
+int musb_in(uint8_t ep, void *data, uint32_t max);
+
+// Number of IN packets on ep the host has not taken yet
+unsigned musb_in_pending(uint8_t ep);
+
+// Whether an endpoint stalls its next transaction, in is 1 for the IN direction, EP0 uses in = 0
+uint8_t musb_stalled(uint8_t ep, uint8_t in);
+
+// Status stages and data toggle resets the device asked for
+extern unsigned musb_ep0_status_count;
+extern unsigned musb_toggle_resets[MUSB_EP_COUNT][2];
+
+// Device address as last written to FADDR
+uint8_t musb_address(void);
+
+// FIFO data port of an endpoint, for DMA models moving packets without the CPU
+uint32_t musb_fifo_read(uint8_t ep, unsigned size);
+void musb_fifo_write(uint8_t ep, uint32_t value, unsigned size);
+
+// Register contents without going through the trap, offsets 0x80..0x9F are those of the endpoint
+// EP_IDX selects
+uint32_t musb_peek(uint32_t offset, unsigned size);
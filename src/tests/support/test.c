@@ -0,0 +1,13 @@
+#include <malloc.h>
+#include "test.h"
+#include "arm32.h"
+
+int test_failures;
+void (*host_interrupt)(void);
+
+// Drivers keep buffer addresses in 32-bit registers and descriptors. The tests link without PIE so
+// statics sit low, this keeps the heap below 4 GiB as well.
+__attribute__((constructor)) static void test_low_heap(void)
+{
+    mallopt(M_MMAP_MAX, 0);
+}
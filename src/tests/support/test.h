@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stdio.h>
+
+// Minimal checks for the host tests, a test program returns the number of failed checks
+
+extern int test_failures;
+
+#define CHECK(cond)                                                            \
+    do                                                                         \
+    {                                                                          \
+        if (!(cond))                                                           \
+        {                                                                      \
+            printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond);    \
+            test_failures++;                                                   \
+        }                                                                      \
+    } while (0)
+
+#define CHECK_EQ(a, b)                                                         \
+    do                                                                         \
+    {                                                                          \
+        unsigned long long _a = (a), _b = (b);                                 \
+        if (_a != _b)                                                          \
+        {                                                                      \
+            printf("%s:%d: %s == %s failed, 0x%llx != 0x%llx\n", __FILE__,     \
+                   __LINE__, #a, #b, _a, _b);                                  \
+            test_failures++;                                                   \
+        }                                                                      \
+    } while (0)
+
+#define TEST_RESULT() (printf("%s\n", test_failures ? "FAILED" : "OK"), test_failures != 0)
@@ -0,0 +1,192 @@
+// Lump reads through w_file_stdc.c on a fragmented FAT image, with and without the fast-seek map
+//
+// w_file_bench [image file]
+//
+// Without arguments it formats a temporary FAT32 card, writes a 12 MiB WAD-sized file whose
+// clusters are interleaved with a second file, and deletes that one again. An image and the path
+// of a file on it can be given instead. The same random lump reads run once through the cluster
+// link map W_StdC_CreateLinkMap builds and once following the FAT chain; the data has to match.
+
+#include <stdlib.h>
+#include <string.h>
+#include "test.h"
+#include "filecard.h"
+#include "ff.h"
+#include "w_file_stdc.c"
+
+#define CARD_SECTORS (8u * 1024 * 1024)
+#define CARD_CLUSTER 64
+#define WAD_BYTES (12u * 1024 * 1024)
+#define WAD_PATH "DOOM2.WAD"
+#define FILL_PATH "FILL.TMP"
+#define READS 2000
+#define MAX_LUMP (64 * 1024)
+
+static uint8_t chunk[CARD_CLUSTER * 4 * FILECARD_SECTOR_SIZE];
+static uint8_t lump[2][MAX_LUMP];
+static unsigned allocs;
+
+// What w_file_stdc.c needs from the zone and misc code
+
+void *Z_Malloc(int size, int tag, void *ptr)
+{
+    (void)tag;
+    (void)ptr;
+    allocs++;
+    return malloc(size);
+}
+
+void Z_Free(void *ptr)
+{
+    allocs--;
+    free(ptr);
+}
+
+long M_FileLength(FIL *handle)
+{
+    return f_size(handle);
+}
+
+uint8_t disk_cache_prefetch(uint32_t sector, uint32_t count)
+{
+    (void)sector;
+    (void)count;
+    return 1;
+}
+
+static uint8_t wad_byte(uint32_t offset)
+{
+    return (offset * 131u) ^ (offset >> 11);
+}
+
+// Fragments of one to four clusters, every one followed by a cluster of the filler file
+static uint8_t make_fragmented_wad(uint32_t *fragments)
+{
+    FIL wad, fill;
+    UINT done;
+    uint32_t offset = 0, len, i;
+    uint32_t cluster = CARD_CLUSTER * FILECARD_SECTOR_SIZE;
+    uint8_t ok = 1;
+
+    if (f_open(&wad, WAD_PATH, FA_CREATE_ALWAYS | FA_WRITE) != FR_OK)
+        return 0;
+    if (f_open(&fill, FILL_PATH, FA_CREATE_ALWAYS | FA_WRITE) != FR_OK)
+        return 0;
+
+    *fragments = 0;
+    srand(7);
+    while (ok && offset < WAD_BYTES)
+    {
+        len = cluster * (1 + rand() % 4);
+        if (len > WAD_BYTES - offset)
+            len = WAD_BYTES - offset;
+        for (i = 0; i < len; i++)
+            chunk[i] = wad_byte(offset + i);
+        ok = f_write(&wad, chunk, len, &done) == FR_OK && done == len;
+        ok = ok && f_sync(&wad) == FR_OK;
+        ok = ok && f_write(&fill, chunk, cluster, &done) == FR_OK && done == cluster;
+        ok = ok && f_sync(&fill) == FR_OK;
+        offset += len;
+        (*fragments)++;
+    }
+    ok = (f_close(&fill) == FR_OK) && ok;
+    ok = (f_close(&wad) == FR_OK) && ok;
+    return ok && f_unlink(FILL_PATH) == FR_OK;
+}
+
+typedef struct
+{
+    uint64_t us;
+    uint32_t reads;
+    uint64_t sectors;
+} run_t;
+
+// Random lump-sized reads, the same sequence for both runs
+static uint8_t run_reads(wad_file_t *wad, uint8_t *out, run_t *run, uint8_t verify)
+{
+    uint32_t i, j, offset, len, start_reads = filecard_stats()->reads;
+    uint64_t start_us = filecard_time_us(), start_sectors = filecard_stats()->read_sectors;
+    uint8_t ok = 1;
+
+    srand(1234);
+    for (i = 0; i < READS; i++)
+    {
+        // Mostly small lumps, some patches and flats, a few big sounds and maps
+        len = (rand() % 8 == 0) ? MAX_LUMP / 2 + rand() % (MAX_LUMP / 2) : 16 + rand() % 4096;
+        offset = rand() % (wad->length - len);
+        if (W_StdC_Read(wad, offset, out, len) != len)
+            ok = 0;
+        if (verify)
+            for (j = 0; j < len; j++)
+                if (out[j] != wad_byte(offset + j))
+                {
+                    ok = 0;
+                    break;
+                }
+    }
+    run->us = filecard_time_us() - start_us;
+    run->reads = filecard_stats()->reads - start_reads;
+    run->sectors = filecard_stats()->read_sectors - start_sectors;
+    return ok;
+}
+
+int main(int argc, char **argv)
+{
+    FATFS fs;
+    wad_file_t *wad;
+    stdc_wad_file_t *stdc_wad;
+    run_t clmt, chain;
+    uint32_t length;
+    uint32_t fragments = 0;
+    const char *path = WAD_PATH;
+    uint8_t verify = 1;
+
+    if (argc > 2)
+    {
+        CHECK(filecard_open(argv[1], 0));
+        path = argv[2];
+        verify = 0;
+    }
+    else
+    {
+        CHECK(filecard_open(NULL, CARD_SECTORS));
+        CHECK(filecard_format_fat32(CARD_CLUSTER));
+    }
+    CHECK_EQ(f_mount(&fs, "", 1), FR_OK);
+    if (verify)
+        CHECK(make_fragmented_wad(&fragments));
+
+    wad = stdc_wad_file.OpenFile(path);
+    CHECK(wad != NULL);
+    if (wad == NULL)
+        return TEST_RESULT();
+    stdc_wad = (stdc_wad_file_t *)wad;
+    length = wad->length;
+    CHECK(stdc_wad->fstream.cltbl != NULL);
+
+    CHECK(run_reads(wad, lump[0], &clmt, verify));
+
+    // Same handle without the map, FatFs follows the FAT chain again
+    Z_Free(stdc_wad->fstream.cltbl);
+    stdc_wad->fstream.cltbl = NULL;
+    CHECK(run_reads(wad, lump[1], &chain, verify));
+    if (!verify)
+        CHECK(memcmp(lump[0], lump[1], MAX_LUMP) == 0);
+
+    stdc_wad_file.CloseFile(wad);
+    CHECK_EQ(allocs, 0);
+
+    printf("%u lump reads over %u bytes", READS, length);
+    if (verify)
+        printf(" in %u fragments", fragments);
+    printf("\n          card ms  commands   sectors  us/read\n");
+    printf("clmt   %10llu %9u %9llu %8llu\n", (unsigned long long)clmt.us / 1000, clmt.reads,
+           (unsigned long long)clmt.sectors, (unsigned long long)clmt.us / READS);
+    printf("chain  %10llu %9u %9llu %8llu\n", (unsigned long long)chain.us / 1000, chain.reads,
+           (unsigned long long)chain.sectors, (unsigned long long)chain.us / READS);
+
+    // The map must never cost card accesses
+    CHECK(clmt.reads <= chain.reads);
+    CHECK(clmt.us <= chain.us);
+    return TEST_RESULT();
+}
@@ -0,0 +1,449 @@
+// Lump name lookups through w_wad.c against real WAD directories
+//
+// w_wad_bench [IWAD [PWAD...]]
+//
+// The files are added with W_AddFile like the game does. Without arguments a temporary IWAD with a
+// DOOM2-shaped directory is written: the map lumps repeated for every MAPxx, sounds, music, and
+// sprite, patch and flat names, about 2600 lumps. A small PWAD is added on top of either; it
+// overrides two IWAD lumps and has names with bytes above 0x7f.
+//
+// Every directory name, the same names lower-cased and names that are not there are looked up
+// through the open addressing table, the djb2 chains it replaced and the linear scan. All three
+// have to return the last lump of a name.
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "test.h"
+#include "w_wad.c"
+
+#define MISSES 1024
+#define ROUNDS 20
+#define LINEAR_ROUNDS 2
+
+typedef char lumpname_t[9];
+
+// What w_wad.c needs from the rest of the game
+
+void I_Error(const char *error, ...)
+{
+    va_list args;
+
+    va_start(args, error);
+    vprintf(error, args);
+    va_end(args);
+    printf("\n");
+    exit(1);
+}
+
+void *I_Realloc(void *ptr, size_t size)
+{
+    ptr = realloc(ptr, size);
+    if (ptr == NULL && size != 0)
+        I_Error("I_Realloc: failed on reallocation of %zu bytes", size);
+    return ptr;
+}
+
+const char *M_BaseName(const char *path)
+{
+    const char *slash = strrchr(path, '/');
+
+    return slash != NULL ? slash + 1 : path;
+}
+
+void M_ExtractFileBase(const char *path, char *dest)
+{
+    const char *src = M_BaseName(path);
+    int i;
+
+    memset(dest, 0, 8);
+    for (i = 0; i < 8 && src[i] != '\0' && src[i] != '.'; i++)
+        dest[i] = toupper((unsigned char)src[i]);
+}
+
+void V_BeginRead(size_t nbytes)
+{
+    (void)nbytes;
+}
+
+void *Z_Malloc(int size, int tag, void *ptr)
+{
+    (void)tag;
+    (void)ptr;
+    return malloc(size);
+}
+
+void Z_Free(void *ptr)
+{
+    free(ptr);
+}
+
+void Z_ChangeTag2(void *ptr, int tag, const char *file, int line)
+{
+    (void)ptr;
+    (void)tag;
+    (void)file;
+    (void)line;
+}
+
+int stricmp(const char *a, const char *b)
+{
+    return strnicmp(a, b, 0x7fffffff);
+}
+
+int strnicmp(const char *a, const char *b, int num)
+{
+    int i, d;
+
+    for (i = 0; i < num; i++)
+    {
+        d = toupper((unsigned char)a[i]) - toupper((unsigned char)b[i]);
+        if (d != 0 || a[i] == '\0')
+            return d;
+    }
+    return 0;
+}
+
+typedef struct
+{
+    wad_file_t wad;
+    FILE *fp;
+} host_wad_file_t;
+
+wad_file_t *W_OpenFile(const char *path)
+{
+    host_wad_file_t *file;
+    FILE *fp = fopen(path, "rb");
+
+    if (fp == NULL)
+        return NULL;
+    file = calloc(1, sizeof(*file));
+    file->fp = fp;
+    fseek(fp, 0, SEEK_END);
+    file->wad.length = ftell(fp);
+    file->wad.path = path;
+    return &file->wad;
+}
+
+void W_CloseFile(wad_file_t *wad)
+{
+    fclose(((host_wad_file_t *)wad)->fp);
+    free(wad);
+}
+
+size_t W_Read(wad_file_t *wad, unsigned int offset, void *buffer, size_t buffer_len)
+{
+    FILE *fp = ((host_wad_file_t *)wad)->fp;
+
+    if (fseek(fp, offset, SEEK_SET) != 0)
+        return 0;
+    return fread(buffer, 1, buffer_len, fp);
+}
+
+void W_Prefetch(wad_file_t *wad, unsigned int offset, size_t length)
+{
+    (void)wad;
+    (void)offset;
+    (void)length;
+}
+
+// Temporary WADs, the directory is all that is read
+
+static lumpname_t *dir;
+static unsigned dir_count, dir_size;
+
+static void dir_add(const char *name)
+{
+    if (dir_count == dir_size)
+    {
+        dir_size = dir_size ? dir_size * 2 : 256;
+        dir = realloc(dir, dir_size * sizeof(*dir));
+    }
+    strncpy(dir[dir_count], name, 8);
+    dir[dir_count][8] = '\0';
+    dir_count++;
+}
+
+static void random_name(char *name, unsigned len)
+{
+    static const char chars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
+    unsigned i;
+
+    for (i = 0; i < len; i++)
+        name[i] = chars[rand() % (sizeof(chars) - 1)];
+    name[len] = '\0';
+}
+
+static char *write_wad(const char *ident)
+{
+    static const char suffix[] = ".wad";
+    char *path = strdup("/tmp/w_wad_benchXXXXXX.wad");
+    int fd = mkstemps(path, sizeof(suffix) - 1);
+    FILE *fp = fd >= 0 ? fdopen(fd, "wb") : NULL;
+    wadinfo_t header;
+    filelump_t lump;
+    unsigned i;
+
+    CHECK(fp != NULL);
+    memcpy(header.identification, ident, 4);
+    header.numlumps = dir_count;
+    header.infotableofs = sizeof(header);
+    fwrite(&header, sizeof(header), 1, fp);
+    for (i = 0; i < dir_count; i++)
+    {
+        lump.filepos = 0;
+        lump.size = 0;
+        memcpy(lump.name, dir[i], 8);
+        fwrite(&lump, sizeof(lump), 1, fp);
+    }
+    fclose(fp);
+    dir_count = 0;
+    return path;
+}
+
+static char *make_iwad(void)
+{
+    static const char *maplumps[] = {
+        "THINGS", "LINEDEFS", "SIDEDEFS", "VERTEXES", "SEGS",
+        "SSECTORS", "NODES", "SECTORS", "REJECT", "BLOCKMAP",
+    };
+    char name[9];
+    unsigned i, j;
+
+    srand(13);
+    dir_add("PLAYPAL");
+    dir_add("COLORMAP");
+    dir_add("ENDOOM");
+    dir_add("DEMO1");
+    dir_add("DEMO2");
+    dir_add("DEMO3");
+    for (i = 1; i <= 32; i++)
+    {
+        snprintf(name, sizeof(name), "MAP%02u", i);
+        dir_add(name);
+        for (j = 0; j < sizeof(maplumps) / sizeof(maplumps[0]); j++)
+            dir_add(maplumps[j]);
+    }
+    for (i = 0; i < 110; i++)
+    {
+        memcpy(name, "DS", 2);
+        random_name(name + 2, 3 + rand() % 4);
+        dir_add(name);
+        name[1] = 'P';
+        dir_add(name);
+    }
+    for (i = 0; i < 35; i++)
+    {
+        memcpy(name, "D_", 2);
+        random_name(name + 2, 3 + rand() % 5);
+        dir_add(name);
+    }
+    dir_add("S_START");
+    for (i = 0; i < 125; i++)
+    {
+        random_name(name, 4);
+        for (j = 0; j < 11; j++)
+        {
+            name[4] = 'A' + j;
+            name[5] = '0' + (j < 8 ? j % 5 + 1 : 0);
+            name[6] = '\0';
+            dir_add(name);
+        }
+    }
+    dir_add("S_END");
+    dir_add("P_START");
+    for (i = 0; i < 470; i++)
+    {
+        random_name(name, 4);
+        snprintf(name + 4, 5, "%02u_%u", i % 100, i % 10);
+        dir_add(name);
+    }
+    dir_add("P_END");
+    dir_add("F_START");
+    for (i = 0; i < 150; i++)
+    {
+        random_name(name, 5);
+        snprintf(name + 5, 4, "_%u", i % 10);
+        dir_add(name);
+    }
+    dir_add("F_END");
+    return write_wad("IWAD");
+}
+
+static char *make_pwad(void)
+{
+    dir_add("PLAYPAL");
+    dir_add("MAP01");
+    dir_add("THINGS");
+    dir_add("\xc9" "CRAN");
+    dir_add("T\xd6" "NE");
+    dir_add("\xff\xfe\xfd\xfc\xfb\xfa\xf9\xf8");
+    return write_wad("PWAD");
+}
+
+// The djb2 chains W_GenerateHashTable built before
+
+static lumpindex_t *chain_head, *chain_next;
+
+static void chain_build(void)
+{
+    unsigned i, hash;
+
+    chain_head = malloc(numlumps * sizeof(*chain_head));
+    chain_next = malloc(numlumps * sizeof(*chain_next));
+    for (i = 0; i < numlumps; i++)
+        chain_head[i] = -1;
+    for (i = 0; i < numlumps; i++)
+    {
+        hash = W_LumpNameHash(lumpinfo[i]->name) % numlumps;
+        chain_next[i] = chain_head[hash];
+        chain_head[hash] = i;
+    }
+}
+
+static lumpindex_t chain_lookup(const char *name)
+{
+    lumpindex_t i;
+
+    for (i = chain_head[W_LumpNameHash(name) % numlumps]; i != -1; i = chain_next[i])
+    {
+        if (!strncasecmp(lumpinfo[i]->name, name, 8))
+            return i;
+    }
+    return -1;
+}
+
+static lumpindex_t linear_lookup(const char *name)
+{
+    lumpindex_t i;
+
+    for (i = numlumps - 1; i >= 0; --i)
+    {
+        if (!strncasecmp(lumpinfo[i]->name, name, 8))
+            return i;
+    }
+    return -1;
+}
+
+static lumpindex_t table_lookup(const char *name)
+{
+    return W_CheckNumForName(name);
+}
+
+static double now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static volatile lumpindex_t sink;
+
+static double time_lookups(lumpindex_t (*lookup)(const char *), lumpname_t *names, unsigned count,
+                           unsigned rounds)
+{
+    double start = now_ns();
+    unsigned r, i;
+
+    for (r = 0; r < rounds; r++)
+    {
+        for (i = 0; i < count; i++)
+            sink = lookup(names[i]);
+    }
+    return (now_ns() - start) / ((double)rounds * count);
+}
+
+int main(int argc, char **argv)
+{
+    static const struct
+    {
+        const char *name;
+        lumpindex_t (*lookup)(const char *);
+        unsigned rounds;
+    } methods[] = {
+        { "table", table_lookup, ROUNDS },
+        { "chains", chain_lookup, ROUNDS },
+        { "linear", linear_lookup, LINEAR_ROUNDS },
+    };
+    lumpname_t *hits, *lower, *misses;
+    char *iwad = NULL, *pwad;
+    unsigned i, j, m, bad = 0;
+    lumpindex_t want;
+
+    if (argc > 1)
+    {
+        for (i = 1; i < (unsigned)argc; i++)
+            CHECK(W_AddFile(argv[i]) != NULL);
+    }
+    else
+    {
+        iwad = make_iwad();
+        CHECK(W_AddFile(iwad) != NULL);
+    }
+    pwad = make_pwad();
+    CHECK(W_AddFile(pwad) != NULL);
+    CHECK(lumphash == NULL);
+    W_GenerateHashTable();
+    chain_build();
+
+    hits = malloc(numlumps * sizeof(*hits));
+    lower = malloc(numlumps * sizeof(*lower));
+    misses = malloc(MISSES * sizeof(*misses));
+    for (i = 0; i < numlumps; i++)
+    {
+        strncpy(hits[i], lumpinfo[i]->name, 8);
+        hits[i][8] = '\0';
+        for (j = 0; j < 9; j++)
+            lower[i][j] = tolower((unsigned char)hits[i][j]);
+    }
+    srand(29);
+    for (i = 0; i < MISSES; i++)
+    {
+        do
+            random_name(misses[i], 1 + rand() % 8);
+        while (linear_lookup(misses[i]) >= 0);
+    }
+
+    // Every method finds the last lump of a name, whatever the case of its ASCII letters
+    for (i = 0; i < numlumps; i++)
+    {
+        want = linear_lookup(hits[i]);
+        bad += want < (lumpindex_t)i;
+        for (m = 0; m < sizeof(methods) / sizeof(methods[0]); m++)
+        {
+            bad += methods[m].lookup(hits[i]) != want;
+            bad += methods[m].lookup(lower[i]) != want;
+        }
+    }
+    for (i = 0; i < MISSES; i++)
+    {
+        bad += table_lookup(misses[i]) != -1;
+        bad += chain_lookup(misses[i]) != -1;
+    }
+    CHECK_EQ(bad, 0);
+
+    CHECK_EQ(W_CheckNumForName("playpal"), numlumps - 6);
+    CHECK_EQ(W_CheckNumForName("THINGS"), numlumps - 4);
+    CHECK_EQ(W_CheckNumForName("\xc9" "cran"), numlumps - 3);
+    CHECK_EQ(W_CheckNumForName("t\xd6" "ne"), numlumps - 2);
+    CHECK_EQ(W_CheckNumForName("\xff\xfe\xfd\xfc\xfb\xfa\xf9\xf8xx"), numlumps - 1);
+    CHECK_EQ(W_CheckNumForName("\xc9" "CRANX"), -1);
+    CHECK_EQ(W_CheckNumForName(""), -1);
+
+    printf("%u lumps, %u table slots\n\n", numlumps, lumphash_mask + 1);
+    printf("method     hit ns  lower-case ns    miss ns\n");
+    for (m = 0; m < sizeof(methods) / sizeof(methods[0]); m++)
+    {
+        printf("%-6s  %9.1f  %13.1f  %9.1f\n", methods[m].name,
+               time_lookups(methods[m].lookup, hits, numlumps, methods[m].rounds),
+               time_lookups(methods[m].lookup, lower, numlumps, methods[m].rounds),
+               time_lookups(methods[m].lookup, misses, MISSES, methods[m].rounds));
+    }
+
+    if (iwad != NULL)
+        unlink(iwad);
+    unlink(pwad);
+    return TEST_RESULT();
+}
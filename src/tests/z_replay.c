@@ -0,0 +1,550 @@
+// Zone allocation traces replayed against z_zone.c and z_bins.c
+//
+// z_replay [-mb zone MiB] [trace]
+//
+// A trace is the "Z ..." lines z_bins.c prints when it is built with ZONE_TRACE, other lines of a
+// UART log are skipped. Without a trace a synthetic one is generated: startup data, then several
+// levels, each freeing the last level's blocks, allocating its own and running tics that cache
+// lumps from a per-level set with a few very popular ones, lock some of them and spawn and remove
+// thinkers. Its cached lumps add up to more than the zone.
+//
+// The game only calls Z_Malloc for cached data when its user pointer is NULL, so a trace records
+// what the game asked for from the allocator it ran on. The replay keeps its own user pointers: a
+// Z_Malloc whose purgable block is still there is a hit and only retags it, a Z_Malloc or
+// Z_ChangeTag for data this allocator has purged is a reload, a read from the card on the device.
+//
+// Every Z_Malloc is timed on its own. One that threw out cached blocks to make room is a purge, it
+// shows up in its own columns along with the slowest call, the frame-time spike on the device.
+
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "test.h"
+#include "doomtype.h"
+#include "z_zone.h"
+
+#define ZONE_MIB 16
+
+// Both allocators are compiled with their Z_ names prefixed, see CMakeLists.txt
+#define ALLOCATOR_PROTOS(p)                                                    \
+    void p##_Z_Init(void);                                                     \
+    void *p##_Z_Malloc(int size, int tag, void *user);                         \
+    void p##_Z_Free(void *ptr);                                                \
+    void p##_Z_FreeTags(int lowtag, int hightag);                              \
+    void p##_Z_CheckHeap(void);                                                \
+    void p##_Z_ChangeTag2(void *ptr, int tag, const char *file, int line);     \
+    void p##_Z_ChangeUser(void *ptr, void **user);                             \
+    int p##_Z_FreeMemory(void);
+
+ALLOCATOR_PROTOS(zone)
+ALLOCATOR_PROTOS(bins)
+
+typedef struct
+{
+    const char *name;
+    void (*init)(void);
+    void *(*malloc)(int size, int tag, void *user);
+    void (*free)(void *ptr);
+    void (*freetags)(int lowtag, int hightag);
+    void (*checkheap)(void);
+    void (*changetag)(void *ptr, int tag, const char *file, int line);
+    void (*changeuser)(void *ptr, void **user);
+} allocator_t;
+
+static const allocator_t allocators[] = {
+    { "z_zone.c", zone_Z_Init, zone_Z_Malloc, zone_Z_Free, zone_Z_FreeTags, zone_Z_CheckHeap,
+      zone_Z_ChangeTag2, zone_Z_ChangeUser },
+    { "z_bins.c", bins_Z_Init, bins_Z_Malloc, bins_Z_Free, bins_Z_FreeTags, bins_Z_CheckHeap,
+      bins_Z_ChangeTag2, bins_Z_ChangeUser },
+};
+
+// What the allocators need from the rest of the game
+
+static byte *zone;
+static int zone_size;
+
+void I_Error(const char *error, ...)
+{
+    va_list args;
+
+    va_start(args, error);
+    vprintf(error, args);
+    va_end(args);
+    printf("\n");
+    exit(1);
+}
+
+byte *I_ZoneBase(int *size)
+{
+    *size = zone_size;
+    return zone;
+}
+
+boolean M_ParmExists(const char *check)
+{
+    (void)check;
+    return false;
+}
+
+// Recorded pointers to small ids
+
+typedef struct
+{
+    unsigned long *keys;
+    int *vals;
+    unsigned mask, count;
+} map_t;
+
+static int *map_slot(map_t *map, unsigned long key)
+{
+    unsigned i = (key * 0x9e3779b1u) >> 4;
+
+    for (;; i++)
+    {
+        i &= map->mask;
+        if (map->vals[i] < 0 || map->keys[i] == key)
+        {
+            map->keys[i] = key;
+            return &map->vals[i];
+        }
+    }
+}
+
+static void map_grow(map_t *map)
+{
+    map_t old = *map;
+    unsigned i, size = old.keys ? (old.mask + 1) * 2 : 4096;
+
+    map->keys = malloc(size * sizeof(*map->keys));
+    map->vals = malloc(size * sizeof(*map->vals));
+    map->mask = size - 1;
+    for (i = 0; i < size; i++)
+        map->vals[i] = -1;
+    for (i = 0; old.keys && i <= old.mask; i++)
+    {
+        if (old.vals[i] >= 0)
+            *map_slot(map, old.keys[i]) = old.vals[i];
+    }
+    free(old.keys);
+    free(old.vals);
+}
+
+static int *map_get(map_t *map, unsigned long key)
+{
+    if (map->count * 2 >= map->mask)
+        map_grow(map);
+    return map_slot(map, key);
+}
+
+// The parsed trace
+
+typedef struct
+{
+    char op;        // m f t u F
+    int block;      // m: new block, f t u: block of the recorded pointer
+    int user;       // m u: user slot or -1
+    int a, b;       // m: size tag, t: tag, F: lowtag hightag
+} op_t;
+
+static op_t *ops;
+static unsigned num_ops, max_ops, num_blocks, num_users, skipped;
+static map_t block_ids, user_ids;
+
+static op_t *new_op(char op)
+{
+    if (num_ops == max_ops)
+    {
+        max_ops = max_ops ? max_ops * 2 : 65536;
+        ops = realloc(ops, max_ops * sizeof(*ops));
+    }
+    memset(&ops[num_ops], 0, sizeof(*ops));
+    ops[num_ops].op = op;
+    return &ops[num_ops++];
+}
+
+static int user_id(unsigned long user)
+{
+    int *id;
+
+    if (user == 0)
+        return -1;
+    id = map_get(&user_ids, user);
+    if (*id < 0)
+    {
+        *id = num_users++;
+        user_ids.count++;
+    }
+    return *id;
+}
+
+static void parse(FILE *fp)
+{
+    char line[128], op;
+    unsigned long ptr, user;
+    int a, b, *id;
+    op_t *o;
+
+    while (fgets(line, sizeof(line), fp) != NULL)
+    {
+        if (sscanf(line, "Z %c", &op) != 1)
+            continue;
+
+        if (op == 'F' && sscanf(line, "Z F %i %i", &a, &b) == 2)
+        {
+            o = new_op(op);
+            o->a = a;
+            o->b = b;
+            continue;
+        }
+        if (op == 'm' && sscanf(line, "Z m %lx %i %i %lx", &ptr, &a, &b, &user) == 4)
+        {
+            id = map_get(&block_ids, ptr);
+            if (*id < 0)
+                block_ids.count++;
+            *id = num_blocks++;
+            o = new_op(op);
+            o->block = *id;
+            o->user = user_id(user);
+            o->a = a;
+            o->b = b;
+            continue;
+        }
+        if (sscanf(line, "Z %c %lx %lx", &op, &ptr, &user) < 2 || strchr("ftu", op) == NULL)
+            continue;
+
+        id = map_get(&block_ids, ptr);
+        if (*id < 0)
+        {
+            // Allocated before the log was started
+            *id = -1;
+            skipped++;
+            continue;
+        }
+        o = new_op(op);
+        o->block = *id;
+        o->user = op == 'u' ? user_id(user) : -1;
+        o->a = op == 't' ? (int)user : 0;
+    }
+}
+
+// A level based game, written in the format z_bins.c prints
+
+#define GEN_LUMPS 1200
+#define GEN_COMMON 40
+#define GEN_LEVEL_SET 400
+#define GEN_LEVELS 6
+#define GEN_TICS 2000
+#define GEN_ACCESSES 30
+#define GEN_THINKERS 300
+
+static unsigned long gen_next;
+
+static unsigned long gen_malloc(FILE *fp, int size, int tag, unsigned long user)
+{
+    gen_next += 16;
+    fprintf(fp, "Z m %lx %i %i %lx\n", gen_next, size, tag, user);
+    return gen_next;
+}
+
+static int gen_zipf(int n)
+{
+    return (rand() % n) * (rand() % n) / n;
+}
+
+static void generate(FILE *fp)
+{
+    static unsigned long cached[GEN_LUMPS], thinkers[GEN_THINKERS];
+    static int size[GEN_LUMPS], set[GEN_LEVEL_SET];
+    unsigned long locked[GEN_ACCESSES];
+    int level, tic, i, j, r, lump, nlocked;
+
+    srand(31);
+    gen_next = 0x10000000;
+    for (i = 0; i < GEN_LUMPS; i++)
+    {
+        r = rand() % 100;
+        size[i] = r < 60 ? 512 + rand() % 8192 : r < 90 ? 8192 + rand() % 24576 : 32768 + rand() % 65536;
+    }
+
+    gen_malloc(fp, 1024 * 1024, PU_STATIC, 0);
+    for (i = 0; i < 100; i++)
+        gen_malloc(fp, 1024 + rand() % 65536, PU_STATIC, 0);
+
+    for (level = 0; level < GEN_LEVELS; level++)
+    {
+        fprintf(fp, "Z F %i %i\n", PU_LEVEL, PU_PURGELEVEL - 1);
+        for (i = 0; i < 12; i++)
+            gen_malloc(fp, 4096 + rand() % 204800, PU_LEVEL, 0);
+        for (i = 0; i < GEN_THINKERS; i++)
+            thinkers[i] = gen_malloc(fp, 150 + rand() % 150, PU_LEVEL, 0);
+        for (i = 0; i < GEN_LEVEL_SET; i++)
+            set[i] = GEN_COMMON + rand() % (GEN_LUMPS - GEN_COMMON);
+
+        for (tic = 0; tic < GEN_TICS; tic++)
+        {
+            nlocked = 0;
+            for (j = 0; j < GEN_ACCESSES; j++)
+            {
+                lump = j < 3 ? rand() % GEN_COMMON : set[gen_zipf(GEN_LEVEL_SET)];
+                r = rand() % 20 == 0 ? PU_STATIC : PU_CACHE;
+
+                // W_CacheLumpNum
+                if (cached[lump] == 0)
+                    cached[lump] = gen_malloc(fp, size[lump], r, 0x80000000ul + lump * 4);
+                else
+                    fprintf(fp, "Z t %lx %i\n", cached[lump], r);
+
+                if (r == PU_STATIC)
+                    locked[nlocked++] = cached[lump];
+            }
+
+            // W_ReleaseLumpNum at the end of the tic
+            for (j = 0; j < nlocked; j++)
+                fprintf(fp, "Z t %lx %i\n", locked[j], PU_CACHE);
+
+            for (j = 0; j < 2; j++)
+            {
+                i = rand() % GEN_THINKERS;
+                fprintf(fp, "Z f %lx\n", thinkers[i]);
+                thinkers[i] = gen_malloc(fp, 150 + rand() % 150, PU_LEVEL, 0);
+            }
+        }
+    }
+}
+
+// Replay
+
+typedef struct
+{
+    double ns, malloc_ns, purge_ns, max_ns, scan_ns;
+    unsigned mallocs, purges, purged, hits, reloads;
+    unsigned long reload_bytes;
+} result_t;
+
+static void **slots, **before;
+static int *owner;
+static byte *seen;
+static void **ptrs;
+static int *users, *tags, *sizes;
+
+static boolean live(int block)
+{
+    return ptrs[block] != NULL && (users[block] < 0 || slots[users[block]] == ptrs[block]);
+}
+
+static double elapsed_ns(const struct timespec *t0, const struct timespec *t1)
+{
+    return (t1->tv_sec - t0->tv_sec) * 1e9 + (t1->tv_nsec - t0->tv_nsec);
+}
+
+// Z_Malloc timed, user pointers it cleared tell whether it purged
+static void *timed_malloc(const allocator_t *a, result_t *r, int size, int tag, void **user)
+{
+    struct timespec t0, t1;
+    unsigned i, purged = 0;
+    double ns;
+    void *ptr;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    memcpy(before, slots, num_users * sizeof(*slots));
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    r->scan_ns += elapsed_ns(&t0, &t1);
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    ptr = a->malloc(size, tag, user);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    ns = elapsed_ns(&t0, &t1);
+
+    for (i = 0; i < num_users; i++)
+    {
+        if (before[i] != NULL && slots[i] == NULL)
+            purged++;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    r->scan_ns += elapsed_ns(&t1, &t0);
+    r->mallocs++;
+    if (purged)
+    {
+        r->purges++;
+        r->purged += purged;
+        r->purge_ns += ns;
+    }
+    else
+    {
+        r->malloc_ns += ns;
+    }
+    if (ns > r->max_ns)
+        r->max_ns = ns;
+    return ptr;
+}
+
+static void reload(const allocator_t *a, result_t *r, int block, int tag)
+{
+    int s = users[block];
+
+    r->reloads++;
+    r->reload_bytes += sizes[block];
+    ptrs[block] = timed_malloc(a, r, sizes[block], tag, &slots[s]);
+    owner[s] = block;
+    tags[block] = tag;
+}
+
+static void replay(const allocator_t *a, result_t *r)
+{
+    struct timespec t0, t1;
+    unsigned i, b;
+    op_t *o;
+    int s, old;
+
+    memset(r, 0, sizeof(*r));
+    memset(slots, 0, num_users * sizeof(*slots));
+    memset(seen, 0, num_users);
+    memset(ptrs, 0, num_blocks * sizeof(*ptrs));
+    for (i = 0; i < num_users; i++)
+        owner[i] = -1;
+    a->init();
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (i = 0; i < num_ops; i++)
+    {
+        o = &ops[i];
+        switch (o->op)
+        {
+        case 'm':
+            s = o->user;
+            users[o->block] = s;
+            sizes[o->block] = o->a;
+            if (s >= 0 && slots[s] != NULL)
+            {
+                old = owner[s];
+                if (tags[old] >= PU_PURGELEVEL && sizes[old] == o->a)
+                {
+                    // Purged on the recording, still here
+                    r->hits++;
+                    a->changetag(slots[s], o->b, __FILE__, __LINE__);
+                    ptrs[o->block] = slots[s];
+                    tags[o->block] = o->b;
+                    owner[s] = o->block;
+                    break;
+                }
+            }
+            if (s >= 0 && seen[s])
+            {
+                reload(a, r, o->block, o->b);
+                break;
+            }
+            ptrs[o->block] = timed_malloc(a, r, o->a, o->b, s >= 0 ? &slots[s] : NULL);
+            tags[o->block] = o->b;
+            if (s >= 0)
+            {
+                owner[s] = o->block;
+                seen[s] = 1;
+            }
+            break;
+
+        case 't':
+            if (live(o->block))
+            {
+                a->changetag(ptrs[o->block], o->a, __FILE__, __LINE__);
+                tags[o->block] = o->a;
+            }
+            else if (users[o->block] >= 0)
+            {
+                reload(a, r, o->block, o->a);
+            }
+            break;
+
+        case 'f':
+            if (live(o->block))
+                a->free(ptrs[o->block]);
+            ptrs[o->block] = NULL;
+            break;
+
+        case 'u':
+            if (live(o->block))
+            {
+                a->changeuser(ptrs[o->block], &slots[o->user]);
+                users[o->block] = o->user;
+                owner[o->user] = o->block;
+            }
+            break;
+
+        case 'F':
+            a->freetags(o->a, o->b);
+            for (b = 0; b < num_blocks; b++)
+            {
+                if (ptrs[b] != NULL && tags[b] >= o->a && tags[b] <= o->b)
+                    ptrs[b] = NULL;
+            }
+            break;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    r->ns = elapsed_ns(&t0, &t1) - r->scan_ns; // Without looking for purged blocks
+
+    a->checkheap();
+}
+
+int main(int argc, char **argv)
+{
+    result_t results[sizeof(allocators) / sizeof(allocators[0])];
+    unsigned i;
+    FILE *fp;
+
+    zone_size = ZONE_MIB;
+    if (argc > 2 && !strcmp(argv[1], "-mb"))
+    {
+        zone_size = atoi(argv[2]);
+        argc -= 2;
+        argv += 2;
+    }
+    zone_size *= 1024 * 1024;
+    zone = malloc(zone_size);
+    map_grow(&block_ids);
+    map_grow(&user_ids);
+
+    if (argc > 1)
+    {
+        fp = fopen(argv[1], "r");
+        if (fp == NULL)
+        {
+            printf("can't open %s\n", argv[1]);
+            return 1;
+        }
+    }
+    else
+    {
+        fp = tmpfile();
+        generate(fp);
+        rewind(fp);
+    }
+    parse(fp);
+    fclose(fp);
+    CHECK(num_ops > 0);
+
+    slots = calloc(num_users + 1, sizeof(*slots));
+    before = calloc(num_users + 1, sizeof(*before));
+    owner = calloc(num_users + 1, sizeof(*owner));
+    seen = calloc(num_users + 1, 1);
+    ptrs = calloc(num_blocks + 1, sizeof(*ptrs));
+    users = calloc(num_blocks + 1, sizeof(*users));
+    tags = calloc(num_blocks + 1, sizeof(*tags));
+    sizes = calloc(num_blocks + 1, sizeof(*sizes));
+
+    printf("%u calls, %u blocks, %u user pointers, %u calls on unknown blocks, %d KiB zone\n\n",
+           num_ops, num_blocks, num_users, skipped, zone_size / 1024);
+    printf("allocator   ns/call  ns/malloc   purges  ns/purge  blocks/purge  max us      hits   reloads  reload KiB\n");
+    for (i = 0; i < sizeof(allocators) / sizeof(allocators[0]); i++)
+    {
+        result_t *r = &results[i];
+
+        replay(&allocators[i], r);
+        printf("%-9s  %8.1f  %9.1f  %7u  %8.1f  %12.1f  %6.1f  %8u  %8u  %10lu\n", allocators[i].name,
+               r->ns / num_ops, r->malloc_ns / (r->mallocs - r->purges ? r->mallocs - r->purges : 1), r->purges,
+               r->purges ? r->purge_ns / r->purges : 0.0, r->purges ? (double)r->purged / r->purges : 0.0,
+               r->max_ns / 1000, r->hits, r->reloads, r->reload_bytes / 1024);
+    }
+
+    return TEST_RESULT();
+}
@@ -0,0 +1,369 @@
+﻿using System.Globalization;
+using System.Text.RegularExpressions;
+
+namespace prof_symbolize
+{
+    class Args
+    {
+        public string MapFile;
+        public string LogFile;
+        public int Top = 40;
+    }
+
+    class Symbol
+    {
+        public uint Address;
+        public uint Size;
+        public string Name = "";
+    }
+
+    class Zone
+    {
+        public ulong Calls;
+        public ulong TotalUs;
+        public ulong MaxUs;
+    }
+
+    class Irq
+    {
+        public ulong Calls;
+        public ulong Nested;
+        public ulong MaxLatencyUs;
+        public ulong MaxUs;
+        public ulong TotalUs;
+    }
+
+    internal class Program
+    {
+        // Input section of the memory map, the address is on the next line when the name is long:
+        //  .text.R_RenderPlayerView
+        //                 0x80012340       0x80 build/obj/doom/r_main.o
+        static Regex _sectionRegex = new Regex(@"^ \.text(?:\.(\S+))?\s*$|^ \.text(?:\.(\S+))?\s+0x([0-9a-f]+)\s+0x([0-9a-f]+)\s+\S", RegexOptions.Compiled);
+        static Regex _sectionAddrRegex = new Regex(@"^\s+0x([0-9a-f]+)\s+0x([0-9a-f]+)\s+\S", RegexOptions.Compiled);
+        // Global symbol inside the current input section
+        static Regex _symbolRegex = new Regex(@"^\s+0x([0-9a-f]+)\s+([A-Za-z_.$][\w.$]*)\s*$", RegexOptions.Compiled);
+
+        static void Log(ConsoleColor color, string message)
+        {
+            Console.ForegroundColor = color;
+            Console.WriteLine(message);
+        }
+
+        static Args ParseArgs(string[] args)
+        {
+            Args obj = new Args();
+
+            Queue<string> argStack = new Queue<string>(args);
+            while (argStack.Count > 0)
+            {
+                string param = argStack.Dequeue();
+                if (!param.StartsWith("--"))
+                {
+                    throw new Exception($"Invalid argument '{param}'");
+                }
+
+                param = param.Substring(2);
+
+                if (argStack.Count == 0)
+                {
+                    throw new Exception($"Argument '{param}' requires a value");
+                }
+
+                string value = argStack.Dequeue();
+
+                switch (param)
+                {
+                    case "map":
+                        obj.MapFile = value;
+                        break;
+                    case "log":
+                        obj.LogFile = value;
+                        break;
+                    case "top":
+                        obj.Top = Convert.ToInt32(value);
+                        break;
+
+                    default:
+                        throw new Exception($"Unknown parameter '{param}'");
+                }
+            }
+
+            return obj;
+        }
+
+        static uint ParseHex(string value)
+        {
+            return (uint)ulong.Parse(value, NumberStyles.HexNumber);
+        }
+
+        // Functions from the linker map. With -ffunction-sections every function, static ones included,
+        // has its own .text.<name> input section. Global labels add the entry points of assembly files.
+        static List<Symbol> LoadMap(string path)
+        {
+            List<Symbol> symbols = new List<Symbol>();
+            bool inMemoryMap = false;
+            string? pendingName = null;
+            Symbol? section = null;
+
+            foreach (string line in File.ReadLines(path))
+            {
+                if (!inMemoryMap)
+                {
+                    inMemoryMap = line.StartsWith("Linker script and memory map");
+                    continue;
+                }
+
+                if (pendingName != null)
+                {
+                    Match addr = _sectionAddrRegex.Match(line);
+                    section = addr.Success ? AddSection(symbols, pendingName, addr.Groups[1].Value, addr.Groups[2].Value) : null;
+                    pendingName = null;
+                    continue;
+                }
+
+                Match match = _sectionRegex.Match(line);
+                if (match.Success)
+                {
+                    if (match.Groups[3].Success)
+                    {
+                        section = AddSection(symbols, match.Groups[2].Value, match.Groups[3].Value, match.Groups[4].Value);
+                    }
+                    else
+                    {
+                        pendingName = match.Groups[1].Value;
+                    }
+                    continue;
+                }
+
+                if (line.StartsWith(" .") || line.StartsWith("."))
+                {
+                    section = null; // Some other input or output section
+                    continue;
+                }
+
+                match = _symbolRegex.Match(line);
+                if (match.Success && section != null)
+                {
+                    uint address = ParseHex(match.Groups[1].Value);
+                    if (address >= section.Address && address < section.Address + section.Size)
+                    {
+                        symbols.Add(new Symbol { Address = address, Name = match.Groups[2].Value });
+                    }
+                }
+            }
+
+            // Labels end at the next label, or at the end of their input section
+            symbols = symbols.OrderBy(s => s.Address).ThenByDescending(s => s.Size).ToList();
+            List<Symbol> result = new List<Symbol>();
+            for (int i = 0; i < symbols.Count; i++)
+            {
+                Symbol symbol = symbols[i];
+                if (result.Count > 0 && result[^1].Address == symbol.Address)
+                {
+                    if (result[^1].Name.Length == 0)
+                    {
+                        result[^1].Name = symbol.Name;
+                    }
+                    continue;
+                }
+                result.Add(symbol);
+            }
+
+            for (int i = 0; i < result.Count; i++)
+            {
+                if (result[i].Size == 0 || (i + 1 < result.Count && result[i].Address + result[i].Size > result[i + 1].Address))
+                {
+                    result[i].Size = i + 1 < result.Count ? result[i + 1].Address - result[i].Address : 4;
+                }
+            }
+
+            return result.Where(s => s.Name.Length > 0).ToList();
+        }
+
+        static Symbol? AddSection(List<Symbol> symbols, string name, string address, string size)
+        {
+            Symbol section = new Symbol { Address = ParseHex(address), Size = ParseHex(size), Name = name };
+            if (section.Size == 0)
+            {
+                return null;
+            }
+            symbols.Add(section);
+            return section;
+        }
+
+        static Symbol? Lookup(List<Symbol> symbols, uint address)
+        {
+            int lo = 0, hi = symbols.Count - 1;
+            while (lo <= hi)
+            {
+                int mid = (lo + hi) / 2;
+                if (symbols[mid].Address <= address)
+                {
+                    lo = mid + 1;
+                }
+                else
+                {
+                    hi = mid - 1;
+                }
+            }
+
+            if (hi < 0 || address >= symbols[hi].Address + symbols[hi].Size)
+            {
+                return null;
+            }
+            return symbols[hi];
+        }
+
+        static void Main(string[] strArgs)
+        {
+            Args args = ParseArgs(strArgs);
+            if (string.IsNullOrEmpty(args.MapFile) || string.IsNullOrEmpty(args.LogFile))
+            {
+                throw new Exception($"Usage: prof-symbolize --map build.map --log uart.log [--top 40]");
+            }
+
+            List<Symbol> symbols = LoadMap(args.MapFile);
+            Log(ConsoleColor.Gray, $"Loaded {symbols.Count} functions from {args.MapFile}");
+
+            // Sum up every complete dump in the log, see prof_dump() in prof.c for the format
+            Dictionary<string, ulong> functions = new Dictionary<string, ulong>();
+            Dictionary<string, Zone> zones = new Dictionary<string, Zone>();
+            Dictionary<string, ulong> dumpFunctions = new Dictionary<string, ulong>();
+            Dictionary<string, Zone> dumpZones = new Dictionary<string, Zone>();
+            SortedDictionary<int, Irq> irqs = new SortedDictionary<int, Irq>();
+            Dictionary<int, Irq> dumpIrqs = new Dictionary<int, Irq>();
+            ulong samples = 0, other = 0, rest = 0, ms = 0;
+            ulong dumpSamples = 0, dumpOther = 0, dumpRest = 0, dumpMs = 0;
+            int dumps = 0;
+            int bucketSize = 4;
+            bool inDump = false;
+
+            foreach (string rawLine in File.ReadLines(args.LogFile))
+            {
+                int start = rawLine.IndexOf("prof: ");
+                if (start < 0)
+                {
+                    continue;
+                }
+
+                string[] parts = rawLine.Substring(start + 6).Trim().Split(' ', StringSplitOptions.RemoveEmptyEntries);
+                if (parts.Length == 0)
+                {
+                    continue;
+                }
+
+                switch (parts[0])
+                {
+                    case "begin" when parts.Length >= 7:
+                        inDump = true;
+                        dumpFunctions.Clear();
+                        dumpZones.Clear();
+                        dumpIrqs.Clear();
+                        dumpMs = ulong.Parse(parts[1]);
+                        dumpSamples = ulong.Parse(parts[2]);
+                        dumpOther = ulong.Parse(parts[3]);
+                        dumpRest = 0;
+                        bucketSize = 1 << int.Parse(parts[6]);
+                        break;
+                    case "pc" when inDump && parts.Length >= 3:
+                        Symbol? symbol = Lookup(symbols, ParseHex(parts[1]));
+                        string name = symbol != null ? symbol.Name : $"0x{parts[1]}";
+                        dumpFunctions[name] = dumpFunctions.GetValueOrDefault(name) + ulong.Parse(parts[2]);
+                        break;
+                    case "rest" when inDump && parts.Length >= 2:
+                        dumpRest = ulong.Parse(parts[1]);
+                        break;
+                    case "zone" when inDump && parts.Length >= 5:
+                        Zone zone = dumpZones.GetValueOrDefault(parts[1]) ?? new Zone();
+                        zone.Calls += ulong.Parse(parts[2]);
+                        zone.TotalUs += ulong.Parse(parts[3]);
+                        zone.MaxUs = Math.Max(zone.MaxUs, ulong.Parse(parts[4]));
+                        dumpZones[parts[1]] = zone;
+                        break;
+                    case "irq" when inDump && parts.Length >= 7:
+                        dumpIrqs[int.Parse(parts[1])] = new Irq
+                        {
+                            Calls = ulong.Parse(parts[2]),
+                            Nested = ulong.Parse(parts[3]),
+                            MaxLatencyUs = ulong.Parse(parts[4]),
+                            MaxUs = ulong.Parse(parts[5]),
+                            TotalUs = ulong.Parse(parts[6]),
+                        };
+                        break;
+                    case "end" when inDump:
+                        inDump = false;
+                        dumps++;
+                        samples += dumpSamples;
+                        other += dumpOther;
+                        rest += dumpRest;
+                        ms += dumpMs;
+                        foreach (var entry in dumpFunctions)
+                        {
+                            functions[entry.Key] = functions.GetValueOrDefault(entry.Key) + entry.Value;
+                        }
+                        foreach (var entry in dumpZones)
+                        {
+                            Zone total = zones.GetValueOrDefault(entry.Key) ?? new Zone();
+                            total.Calls += entry.Value.Calls;
+                            total.TotalUs += entry.Value.TotalUs;
+                            total.MaxUs = Math.Max(total.MaxUs, entry.Value.MaxUs);
+                            zones[entry.Key] = total;
+                        }
+                        foreach (var entry in dumpIrqs)
+                        {
+                            Irq total = irqs.GetValueOrDefault(entry.Key) ?? new Irq();
+                            total.Calls += entry.Value.Calls;
+                            total.Nested += entry.Value.Nested;
+                            total.MaxLatencyUs = Math.Max(total.MaxLatencyUs, entry.Value.MaxLatencyUs);
+                            total.MaxUs = Math.Max(total.MaxUs, entry.Value.MaxUs);
+                            total.TotalUs += entry.Value.TotalUs;
+                            irqs[entry.Key] = total;
+                        }
+                        break;
+                }
+            }
+
+            if (dumps == 0 || samples == 0)
+            {
+                Log(ConsoleColor.Red, $"No complete profile dump in {args.LogFile}");
+                return;
+            }
+
+            Log(ConsoleColor.Gray, $"{dumps} dumps, {samples} samples over {ms / 1000.0:F1} s, {bucketSize} byte buckets");
+            Log(ConsoleColor.Gray, "");
+            Log(ConsoleColor.White, "     %  samples  function");
+            foreach (var entry in functions.OrderByDescending(e => e.Value).Take(args.Top))
+            {
+                Log(ConsoleColor.Gray, $"{100.0 * entry.Value / samples,6:F2} {entry.Value,8}  {entry.Key}");
+            }
+            Log(ConsoleColor.DarkGray, $"{100.0 * rest / samples,6:F2} {rest,8}  (below dump threshold)");
+            Log(ConsoleColor.DarkGray, $"{100.0 * other / samples,6:F2} {other,8}  (outside .text)");
+
+            if (zones.Count > 0)
+            {
+                Log(ConsoleColor.Gray, "");
+                Log(ConsoleColor.White, "  time %     calls   avg us   max us  zone");
+                foreach (var entry in zones.OrderByDescending(e => e.Value.TotalUs))
+                {
+                    Zone zone = entry.Value;
+                    double avg = zone.Calls > 0 ? (double)zone.TotalUs / zone.Calls : 0;
+                    Log(ConsoleColor.Gray, $"{100.0 * zone.TotalUs / (ms * 1000.0),8:F2} {zone.Calls,9} {avg,8:F0} {zone.MaxUs,8}  {entry.Key}");
+                }
+            }
+
+            if (irqs.Count > 0)
+            {
+                Log(ConsoleColor.Gray, "");
+                Log(ConsoleColor.White, " irq  time %     calls   nested  max wait us   avg us   max us");
+                foreach (var entry in irqs)
+                {
+                    Irq irq = entry.Value;
+                    double avg = irq.Calls > 0 ? (double)irq.TotalUs / irq.Calls : 0;
+                    Log(ConsoleColor.Gray, $"{entry.Key,4} {100.0 * irq.TotalUs / (ms * 1000.0),7:F2} {irq.Calls,9} {irq.Nested,8} {irq.MaxLatencyUs,12} {avg,8:F1} {irq.MaxUs,8}");
+                }
+            }
+
+            Console.ResetColor();
+        }
+    }
+}
@@ -41,6 +41,28 @@ static inline void arm32_interrupt_disable(void) {
                          : "memory");
 }
 
+// Masks IRQs and returns the previous CPSR, safe to nest and to use from IRQ context
+static inline uint32_t arm32_interrupt_save(void) {
+    uint32_t cpsr, tmp;
+
+    __asm__ __volatile__("mrs %0, cpsr\n"
+                         "orr %1, %0, #(1<<7)\n"
+                         "msr cpsr_c, %1"
+                         : "=r"(cpsr), "=r"(tmp)
+                         :
+                         : "memory");
+    return cpsr;
+}
+
+static inline void arm32_interrupt_restore(uint32_t cpsr) {
+    __asm__ __volatile__("msr cpsr_c, %0" : : "r"(cpsr) : "memory");
+}
+
+// Stops the core until an IRQ or FIQ is asserted, this happens even while the CPSR masks them
+static inline void arm32_wait_for_interrupt(void) {
+    __asm__ __volatile__("mcr p15, 0, %0, c7, c0, 4" : : "r"(0) : "memory");
+}
+
 static inline void arm32_mmu_enable(void) {
     uint32_t value = arm32_read_p15_c1();
     arm32_write_p15_c1(value | (1 << 0));
@@ -8,6 +8,7 @@
 #include "f1c100s_uart.h"
 #include "f1c100s_gpio.h"
 #include "f1c100s_clock.h"
+#include "f1c100s_intc.h"
 #include "usb_cdc.h"
 
 int main(void)
@@ -20,11 +21,20 @@ int main(void)
 
     printf("USB init\n");
     cdc_init();
+    intc_set_irq_handler(IRQ_USBOTG, cdc_irq_handler);
+    intc_enable_irq(IRQ_USBOTG);
 
     printf("Loop\n");
     while (1)
     {
-        cdc_handler();
+        if (!cdc_handler() && cdc_bytes_in() == 0)
+        {
+            // Sleep until the next USB event, unless one came in since
+            uint32_t cpsr = arm32_interrupt_save();
+            if (!cdc_pending())
+                arm32_wait_for_interrupt();
+            arm32_interrupt_restore(cpsr);
+        }
 
         if (cdc_bytes_in() > 0)
         {
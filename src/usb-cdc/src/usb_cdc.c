@@ -1,5 +1,6 @@
 #include <string.h>
 #include "f1c100s_clock.h"
+#include "arm32.h"
 #include "usb_cdc.h"
 #include "ringbuffer.h"
 #include <stdio.h>
@@ -211,6 +212,9 @@ static RINGBUFFER txBuffer = {
 
 static int txInProgress = 0;
 
+// BUS_IS and EP_IS bits latched by cdc_irq_handler() and not handled yet
+static volatile uint32_t pendingBus, pendingEp;
+
 static void phy_write(uint8_t addr, uint8_t data, uint8_t len)
 {
     for (uint32_t i = 0; i < len; i++)
@@ -279,10 +283,12 @@ void cdc_init()
     // Usb thingy
     USB->ISCR = (USB->ISCR & ~0x70) | (0x3F << 12); // FORCE_VBUS_VALID to HIGH, FORCE_ID to HIGH, DPDM_PULLUP_EN enable, ID_PULLUP_EN enable
     USB->VEND0 = 0;
-    USB->BUS_IE = 0xFF; // enable all
+    USB->BUS_IE = 0x07; // Suspend, resume, reset, the SOF would wake the CPU every frame
     USB->BUS_IS = 0xFF; // Clear interrupts
-    USB->EP_IE = 0;
+    USB->EP_IE = 1 | (1 << 2) | (1 << 19); // EP0, data in done, data out received
     USB->EP_IS = 0xFFFFFFFF;              // Clear endpoint iterrupts
+    pendingBus = 0;
+    pendingEp = 0;
     USB->POWER &= ~((1 << 7) | (1 << 6)); // Disable ISO update & soft connect
     USB->POWER |= ((1 << 6) | (1 << 5));  // Enable soft connect & high speed mode
 }
@@ -433,8 +439,8 @@ static void handle_ep0()
 
             // Get next packet for data - secion 21.1.2
             USB->TXCSR = 0x40; // Set ServicedRxPktRdy
-            
-            while ((USB->EP_IS & 1) == 0); // Wait for another EP0 RIQ
+
+            // EP_IS belongs to cdc_irq_handler, the RxPktRdy flag tells when the data is there
             while ((USB->TXCSR & 1) == 0); // Wait for the RxPktRdy flag
 
             // Now the FIFO has the next packet
@@ -560,13 +566,33 @@ static void handle_ep2_iqr()
     transfer_bytes();
 }
 
-void cdc_handler()
+void cdc_irq_handler()
 {
-    // Handle USB BUS events first
     uint32_t isr;
     isr = USB->BUS_IS;
     USB->BUS_IS = isr;
+    pendingBus |= isr;
+    isr = USB->EP_IS;
+    USB->EP_IS = isr;
+    pendingEp |= isr;
+}
+
+int cdc_pending()
+{
+    return (pendingBus | pendingEp) != 0;
+}
 
+int cdc_handler()
+{
+    // Take the latched events, the IRQ may add more meanwhile
+    uint32_t cpsr = arm32_interrupt_save();
+    uint32_t isr = pendingBus;
+    uint32_t epIsr = pendingEp;
+    pendingBus = 0;
+    pendingEp = 0;
+    arm32_interrupt_restore(cpsr);
+
+    // Handle USB BUS events first
     if (isr & 1)
     {
         printf("USB suspend\n");
@@ -582,34 +608,35 @@ void cdc_handler()
         USB->EP_IS = 0xFFFFFFFF;
         USB->EP_IDX = 0;
         USB->TXFUNCADDR = 0;
+        epIsr = 0;        // Whatever was latched before belongs to the old session,
+        txInProgress = 0; // including the end of a transfer
     }
 
-    isr = USB->EP_IS; // Read endpoint irq status register
-    USB->EP_IS = isr;
-
-    if (isr != 0)
+    if (epIsr != 0)
     {
-        printf("ISR %08lx\n", isr);
+        printf("ISR %08lx\n", epIsr);
     }
     
     // Check EP0 RX ISR
-    if (isr & 1)
+    if (epIsr & 1)
     {
         handle_ep0();
     }
 
     // Check EP2 transfer ready ISR
-    if (isr & (1 << 2))
+    if (epIsr & (1 << 2))
     {
         handle_ep2_iqr();
     }
 
     // Check EP3 RX ISR
     // This is where we receive data from the host
-    if (isr & (1 << 19))
+    if (epIsr & (1 << 19))
     {
         handle_ep3_in();
     }
+
+    return isr != 0 || epIsr != 0;
 }
 
 int cdc_bytes_in()
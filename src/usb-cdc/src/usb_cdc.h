@@ -212,7 +212,7 @@ typedef struct PACKED
 typedef union PACKED
 {
     uint8_t data[7];
-    struct
+    struct PACKED // 7 bytes on the wire, unpacked the union would be 8
     {
         uint32_t dwDTERate; // Baud
         uint8_t bCharFormat; // 0 = 1 stop bit, 1 = 1.5 stop bit, 2 = 2 stop bit
@@ -223,7 +223,13 @@ typedef union PACKED
 
 void cdc_init();
 void cdc_deinit();
-void cdc_handler();
+
+// cdc_irq_handler() only latches the interrupt sources for IRQ_USBOTG, cdc_handler() then handles them
+// from the main loop and returns 0 when there was nothing to do. Check cdc_pending() with IRQs masked
+// before going to sleep.
+void cdc_irq_handler();
+int cdc_handler();
+int cdc_pending();
 
 int cdc_bytes_in();
 int cdc_read_byte();
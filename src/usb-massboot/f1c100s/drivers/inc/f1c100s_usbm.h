@@ -244,7 +244,13 @@ typedef void (*usbm_sector_callback)(uint8_t* buffer, uint32_t blockIndex, uint3
 void usb_mux(enum USB_MUX_STATE i);
 void usb_deinit(void);
 void usbd_init(uint32_t numBlocks, usbm_sector_callback readSector, usbm_sector_callback writeSector);
-void usbd_handler(void);
+
+// usbd_irq_handler() only latches the interrupt sources for IRQ_USBOTG, usbd_handler() then handles them
+// from the main loop and returns 0 when there was nothing to do. Check usbd_pending() with IRQs masked
+// before going to sleep.
+void usbd_irq_handler(void);
+uint8_t usbd_handler(void);
+uint8_t usbd_pending(void);
 
 #ifdef __cplusplus
 }
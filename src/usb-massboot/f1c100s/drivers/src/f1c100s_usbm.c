@@ -1,6 +1,7 @@
 #include <string.h>
 #include "f1c100s_usbm.h"
 #include "f1c100s_clock.h"
+#include "arm32.h"
 
 enum USB_MUX_STATE usb_mux_state;
 
@@ -14,6 +15,9 @@ static SETUP_PACKET setup;
 
 static uint32_t cbw_tag, cbw_len, cbw_cmd, cbw_addr, bulk_len, bulk_idx;
 
+// BUS_IS and EP_IS bits latched by usbd_irq_handler() and not handled yet
+static volatile uint32_t pending_bus, pending_ep;
+
 static union
 {
     uint32_t dat[65536 / 4];
@@ -552,44 +556,66 @@ void usbd_init(uint32_t numBlocks, usbm_sector_callback read, usbm_sector_callba
     USB->BUS_IS = 0xFF;
     USB->EP_IE = 0;
     USB->EP_IS = 0xFFFFFFFF;
+    pending_bus = 0;
+    pending_ep = 0;
+    USB->EP_IE = 1 | 1 << (EP_BULK_OUT + 16); // EP0 and bulk out, the bulk in side is waited for
+    USB->BUS_IE = 7;                          // Suspend, Resume, Reset, IRQ_USBOTG has to be enabled by the application
     USB->POWER &= ~((1 << 7) | (1 << 6));
     USB->POWER |= ((1 << 6) | (1 << 5));
 }
 
-void usbd_handler(void)
+void usbd_irq_handler(void)
 {
     uint32_t isr;
     isr = USB->BUS_IS;
     USB->BUS_IS = isr;
+    pending_bus |= isr;
+    isr = USB->EP_IS;
+    USB->EP_IS = isr;
+    pending_ep |= isr;
+}
+
+uint8_t usbd_pending(void)
+{
+    return (pending_bus | pending_ep) != 0;
+}
+
+uint8_t usbd_handler(void)
+{
+    uint32_t cpsr, bus, ep;
+
+    cpsr = arm32_interrupt_save();
+    bus = pending_bus;
+    ep = pending_ep;
+    pending_bus = 0;
+    pending_ep = 0;
+    arm32_interrupt_restore(cpsr);
 
     // bus events
-    if (isr & 1)
+    if (bus & 1)
     {
         // printf("USB Suspend\r\n");
-        // USB->BUS_IS |= 1;
     }
-    if (isr & 2)
+    if (bus & 2)
     {
         // printf("USB Resume\r\n");
-        // USB->BUS_IS |= 2;
     }
-    if (isr & 4)
+    if (bus & 4)
     {
         // printf("USB Reset\r\n");
-        // USB->BUS_IS = 0xFF;
         USB->EP_IS = 0xFFFFFFFF;
         USB->EP_IDX = 0;
         USB->TXFUNCADDR = 0;
+        ep = 0; // Whatever was latched before belongs to the old session
     }
-    isr = USB->EP_IS;
-    USB->EP_IS = isr;
 
-    if (isr & 1)
+    if (ep & 1)
     {
         ep0_handler();
     }
-    if (isr & (1 << (EP_BULK_OUT + 16)))
+    if (ep & (1 << (EP_BULK_OUT + 16)))
     {
         bulk_out_handler();
     }
+    return bus || ep;
 }
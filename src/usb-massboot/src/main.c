@@ -8,6 +8,7 @@
 #include "f1c100s_uart.h"
 #include "f1c100s_gpio.h"
 #include "f1c100s_clock.h"
+#include "f1c100s_intc.h"
 #include "f1c100s_usbm.h"
 
 static uint8_t block0[512] = {
@@ -147,11 +148,20 @@ int main(void)
     printf("USB init\n");
     usb_mux(USB_MUX_DEVICE);
     usbd_init(0x20000, usb_block_read, usb_block_write);
+    intc_set_irq_handler(IRQ_USBOTG, usbd_irq_handler);
+    intc_enable_irq(IRQ_USBOTG);
 
     printf("Loop\n");
     while (1)
     {
-        usbd_handler();
+        if (!usbd_handler())
+        {
+            // Sleep until the next USB event, unless one came in since
+            uint32_t cpsr = arm32_interrupt_save();
+            if (!usbd_pending())
+                arm32_wait_for_interrupt();
+            arm32_interrupt_restore(cpsr);
+        }
     }
     return 0;
 }
@@ -0,0 +1,52 @@
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include "f1c100s_periph.h"
+
+typedef enum {
+    DMA_INT_CTRL = 0x00,
+    DMA_INT_STA  = 0x04,
+    DMA_PTY_CFG  = 0x08,
+
+    // Normal DMA channel 0, the others follow every NDMA_CH_SIZE bytes
+    NDMA_CFG  = 0x100,
+    NDMA_SRC  = 0x104,
+    NDMA_DST  = 0x108,
+    NDMA_BCNT = 0x10C,
+} dma_reg_e;
+
+#define NDMA_CH_SIZE 0x20
+#define NDMA_CH_COUNT 4
+
+typedef enum {
+    DMA_DRQ_UART1_TX = 0x09,
+    DMA_DRQ_SDRAM    = 0x11, // Memory, no flow control
+} dma_drq_e;
+
+typedef enum {
+    DMA_ADDR_LINEAR = 0,
+    DMA_ADDR_IO     = 1, // Fixed address, for FIFO registers
+} dma_addr_mode_e;
+
+typedef enum {
+    DMA_WIDTH_8  = 0,
+    DMA_WIDTH_16 = 1,
+    DMA_WIDTH_32 = 2,
+} dma_width_e;
+
+// Bus clock and reset of the DMA controller
+void dma_init(void);
+
+// Memory to memory copy on a normal DMA channel, either side may be a FIFO register in DMA_ADDR_IO mode.
+// Nothing paces the transfer, the data has to be in the FIFO (or fit into it) before the start.
+void ndma_start(uint8_t ch, uint32_t src, dma_addr_mode_e src_mode, uint32_t dst, dma_addr_mode_e dst_mode, uint32_t len, dma_width_e width);
+
+uint8_t ndma_busy(uint8_t ch);
+
+#ifdef __cplusplus
+}
+#endif
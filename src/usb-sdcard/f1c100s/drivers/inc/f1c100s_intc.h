@@ -72,6 +72,21 @@ typedef enum {
 
 typedef void (*intc_irq_handler)(void);
 
+// Free-running up-counter for the statistics, any unit
+typedef uint32_t (*intc_clock_fn)(void);
+
+// Priority levels of intc_set_priority(), 0 is the lowest and the default. A handler runs with IRQs enabled
+// when a level above its own has sources, these may preempt it, its own level and the ones below stay masked.
+#define INTC_PRIO_LEVELS 4
+
+typedef struct {
+    uint32_t count;       // Handler calls
+    uint32_t nested;      // Calls that preempted another handler
+    uint32_t latency_max; // Longest wait behind other handlers, in clock ticks
+    uint32_t run_max;     // Longest handler run including preemption, in clock ticks
+    uint32_t run_total;
+} intc_stats_t;
+
 void intc_init(void);
 
 void intc_enable_irq(intc_irq_vector_e irq);
@@ -82,6 +97,13 @@ void intc_set_priority(intc_irq_vector_e irq, uint8_t prio);
 
 void intc_set_irq_handler(intc_irq_vector_e irq, intc_irq_handler handler);
 
+// Times handlers with clock, without one only the counts are kept
+void intc_set_stats_clock(intc_clock_fn clock);
+
+const intc_stats_t* intc_get_stats(intc_irq_vector_e irq);
+
+void intc_reset_stats(void);
+
 #ifdef __cplusplus
 }
 #endif
@@ -182,6 +182,28 @@ enum USB_MUX_STATE
 #define RD_CAPACITY 0x25
 #define RD10 0x28
 #define WR10 0x2A
+#define VERIFY10 0x2F
+#define SYNC_CACHE10 0x35
+#define MODE_SENSE10 0x5A
+#define RD16 0x88
+#define WR16 0x8A
+#define SYNC_CACHE16 0x91
+#define SERVICE_ACTION_IN16 0x9E // READ CAPACITY(16) with service action 0x10
+#define RD12 0xA8
+#define WR12 0xAA
+
+/* SCSI Sense Keys */
+#define SENSE_NONE 0x00
+#define SENSE_MEDIUM_ERROR 0x03
+#define SENSE_ILLEGAL_REQUEST 0x05
+
+/* SCSI Additional Sense Codes */
+#define ASC_WRITE_ERROR 0x0C
+#define ASC_UNRECOVERED_READ_ERROR 0x11
+#define ASC_INVALID_OPCODE 0x20
+#define ASC_LBA_OUT_OF_RANGE 0x21
+#define ASC_INVALID_FIELD_IN_CDB 0x24
+#define ASC_LUN_NOT_SUPPORTED 0x25
 
 /* Inquiry Response */
 typedef struct PACKED
@@ -215,6 +237,14 @@ typedef struct PACKED
     uint32_t block_size; // Block size in bytes
 } RD_CAPACITY_RES;
 
+/* Read Capacity(16) Response */
+typedef struct PACKED
+{
+    uint64_t last_lba;   // The last Logical Block Address of the device
+    uint32_t block_size; // Block size in bytes
+    uint8_t rsv[20];
+} RD_CAPACITY16_RES;
+
 /* Request Sense Response */
 typedef struct PACKED
 {
@@ -239,12 +269,47 @@ typedef struct PACKED
     uint8_t bdsc_len;
 } MODE_SENSE6_RES;
 
-typedef void (*usbm_sector_callback)(uint8_t* buffer, uint32_t blockIndex, uint32_t numBlocks);
+/* Mode Sense(10) Response */
+typedef struct PACKED
+{
+    uint16_t data_len;
+    uint8_t medium_type;
+    uint8_t param;
+    uint8_t rsv[2];
+    uint16_t bdsc_len;
+} MODE_SENSE10_RES;
+
+// Set to 1 to expose a second LUN that stores nothing, reading or writing it with dd reports the
+// reached USB throughput over UART. Needs the application's 1 ms systime.
+#ifndef USBM_BENCH_LUN
+#define USBM_BENCH_LUN 0
+#endif
+
+// Sector callbacks return 0 on failure, the host then gets a MEDIUM ERROR
+typedef uint8_t (*usbm_sector_callback)(uint8_t* buffer, uint64_t blockIndex, uint32_t numBlocks);
+// Optional non-blocking reads: start returns 0 when it can not take the request, poll returns 0 while
+// busy, 1 when done and -1 on error. RD10 then reads the next chunk while the current one is sent.
+typedef uint8_t (*usbm_read_start_callback)(uint8_t* buffer, uint64_t blockIndex, uint32_t numBlocks);
+typedef int8_t (*usbm_read_poll_callback)(void);
+// Optional SYNCHRONIZE CACHE hook, returns once written data is stored on the medium, 0 on failure
+typedef uint8_t (*usbm_flush_callback)(void);
 
 void usb_mux(enum USB_MUX_STATE i);
 void usb_deinit(void);
-void usbd_init(uint32_t numBlocks, usbm_sector_callback readSector, usbm_sector_callback writeSector);
-void usbd_handler(void);
+void usbd_init(uint64_t numBlocks, usbm_sector_callback readSector, usbm_sector_callback writeSector);
+void usbd_set_async_read(usbm_read_start_callback start, usbm_read_poll_callback poll);
+void usbd_set_flush(usbm_flush_callback flush);
+
+// Runs in the main loop for events of an endpoint, ep is its address with 0x80 for IN
+typedef void (*usbd_ep_callback)(void);
+void usbd_set_ep_callback(uint8_t ep, usbd_ep_callback callback);
+
+// usbd_irq_handler() only latches the interrupt sources for IRQ_USBOTG, usbd_handler() then handles them
+// from the main loop and returns 0 when there was nothing to do. Check usbd_pending() with IRQs masked
+// before going to sleep.
+void usbd_irq_handler(void);
+uint8_t usbd_handler(void);
+uint8_t usbd_pending(void);
 
 #ifdef __cplusplus
 }
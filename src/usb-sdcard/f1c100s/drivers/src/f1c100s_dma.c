@@ -0,0 +1,26 @@
+#include "f1c100s_dma.h"
+#include "f1c100s_clock.h"
+#include "io.h"
+
+#define NDMA_LOAD (1 << 31)
+#define NDMA_BUSY (1 << 30)
+
+void dma_init(void) {
+    clk_enable(CCU_BUS_CLK_GATE0, 6);
+    clk_reset_clear(CCU_BUS_SOFT_RST0, 6);
+    set32(DMA_BASE + DMA_PTY_CFG, (1 << 16)); // Auto clock gating
+}
+
+void ndma_start(uint8_t ch, uint32_t src, dma_addr_mode_e src_mode, uint32_t dst, dma_addr_mode_e dst_mode, uint32_t len, dma_width_e width) {
+    uint32_t base = DMA_BASE + ch * NDMA_CH_SIZE;
+
+    write32(base + NDMA_SRC, src);
+    write32(base + NDMA_DST, dst);
+    write32(base + NDMA_BCNT, len);
+    write32(base + NDMA_CFG, DMA_DRQ_SDRAM | (src_mode << 5) | (width << 8) | (DMA_DRQ_SDRAM << 16) | (dst_mode << 21) |
+                                 (width << 24) | NDMA_LOAD);
+}
+
+uint8_t ndma_busy(uint8_t ch) {
+    return (read32(DMA_BASE + ch * NDMA_CH_SIZE + NDMA_CFG) & (NDMA_LOAD | NDMA_BUSY)) != 0;
+}
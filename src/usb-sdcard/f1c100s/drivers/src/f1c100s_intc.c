@@ -3,7 +3,38 @@
 #include <stddef.h>
 #include <string.h>
 
-static intc_irq_handler irq_handlers[41];
+#define IRQ_COUNT 41
+
+static intc_irq_handler irq_handlers[IRQ_COUNT];
+static uint8_t irq_prio[IRQ_COUNT];
+static uint32_t prio_sources[INTC_PRIO_LEVELS][2]; // Sources at each priority level, as ENABLE0/1 bits
+static uint32_t prio_masked[INTC_PRIO_LEVELS][2];  // Masked while a handler of the level runs nested
+static uint8_t prio_preempt[INTC_PRIO_LEVELS];     // A level above has sources, handlers run nested
+
+static intc_clock_fn irq_clock;
+static intc_stats_t irq_stats[IRQ_COUNT];
+static uint32_t irq_pend_time[IRQ_COUNT]; // When a waiting IRQ was first seen pending
+static uint32_t irq_pend_seen[2];
+static uint8_t irq_depth;
+
+// Runs handler in SVC mode with IRQs enabled, in vectors.S
+extern void intc_call_nested(intc_irq_handler handler);
+
+static void intc_update_prio_masks(void) {
+    uint32_t upto0 = 0, upto1 = 0;
+
+    for(uint8_t p = 0; p < INTC_PRIO_LEVELS; p++) {
+        upto0 |= prio_sources[p][0];
+        upto1 |= prio_sources[p][1];
+        prio_masked[p][0] = upto0;
+        prio_masked[p][1] = upto1;
+        prio_preempt[p] = 0;
+        for(uint8_t above = p + 1; above < INTC_PRIO_LEVELS; above++) {
+            if(prio_sources[above][0] | prio_sources[above][1])
+                prio_preempt[p] = 1;
+        }
+    }
+}
 
 void intc_enable_irq(intc_irq_vector_e irq) {
     if(irq < 32)
@@ -24,6 +55,11 @@ void intc_set_priority(intc_irq_vector_e irq, uint8_t prio) {
 
     uint32_t val = read32(reg) & ~(0x3 << ((irq % 16) * 2));
     write32(reg, val | (prio << ((irq % 16) * 2)));
+
+    prio_sources[irq_prio[irq]][irq / 32] &= ~(1 << (irq % 32));
+    prio_sources[prio][irq / 32] |= (1 << (irq % 32));
+    irq_prio[irq] = prio;
+    intc_update_prio_masks();
 }
 
 void intc_set_irq_handler(intc_irq_vector_e irq, intc_irq_handler handler) {
@@ -33,16 +69,108 @@ void intc_set_irq_handler(intc_irq_vector_e irq, intc_irq_handler handler) {
 void intc_init(void) {
     write32(INTC_BASE + INTC_ENABLE0, 0); // Disable all interrupts
     write32(INTC_BASE + INTC_ENABLE1, 0);
+    write32(INTC_BASE + INTC_MASK0, 0); // Only masked during nested dispatch
+    write32(INTC_BASE + INTC_MASK1, 0);
     memset(irq_handlers, 0, sizeof(irq_handlers)); // Clear handlers table
     write32(INTC_BASE + INTC_BASE_ADDR, 0); // Set offset to 0
+
+    // Everything at the lowest level
+    for(uint8_t i = 0; i < 4; i++)
+        write32(INTC_BASE + INTC_PRIORITY0 + i * 4, 0);
+    memset(irq_prio, 0, sizeof(irq_prio));
+    memset(prio_sources, 0, sizeof(prio_sources));
+    prio_sources[0][0] = 0xFFFFFFFF;
+    prio_sources[0][1] = (1 << (IRQ_COUNT - 32)) - 1;
+    intc_update_prio_masks();
+}
+
+void intc_set_stats_clock(intc_clock_fn clock) {
+    irq_clock = clock;
+    intc_reset_stats();
+}
+
+const intc_stats_t* intc_get_stats(intc_irq_vector_e irq) {
+    return &irq_stats[irq];
+}
+
+void intc_reset_stats(void) {
+    memset(irq_stats, 0, sizeof(irq_stats));
+    irq_pend_seen[0] = 0;
+    irq_pend_seen[1] = 0;
+}
+
+// Stamps IRQs that became pending while a handler ran, their wait is the latency
+static void intc_stamp_pending(uint32_t now) {
+    for(uint8_t r = 0; r < 2; r++) {
+        uint32_t pend = read32(INTC_BASE + INTC_PEND0 + r * 4) & read32(INTC_BASE + INTC_ENABLE0 + r * 4) & ~irq_pend_seen[r];
+
+        irq_pend_seen[r] |= pend;
+        while(pend) {
+            uint32_t bit = 31 - __builtin_clz(pend);
+            irq_pend_time[r * 32 + bit] = now;
+            pend &= ~(1 << bit);
+        }
+    }
+}
+
+static void intc_dispatch(uint32_t irq_src) {
+    intc_irq_handler handler = irq_handlers[irq_src];
+    uint8_t prio = irq_prio[irq_src];
+    uint32_t mask0, mask1;
+
+    if(!prio_preempt[prio]) {
+        handler();
+        return;
+    }
+
+    // Sources above this level may preempt the handler, the rest stays masked until it returns
+    mask0 = read32(INTC_BASE + INTC_MASK0);
+    mask1 = read32(INTC_BASE + INTC_MASK1);
+    write32(INTC_BASE + INTC_MASK0, mask0 | prio_masked[prio][0]);
+    write32(INTC_BASE + INTC_MASK1, mask1 | prio_masked[prio][1]);
+
+    intc_call_nested(handler);
+
+    write32(INTC_BASE + INTC_MASK0, mask0);
+    write32(INTC_BASE + INTC_MASK1, mask1);
 }
 
 // Global IRQ handler
 void irq_handler(void) {
     uint32_t irq_src = read32(INTC_BASE) >> 2;
+    intc_stats_t* stats = &irq_stats[irq_src];
+    uint32_t start = 0;
 
-    if(irq_handlers[irq_src] != NULL)
-        irq_handlers[irq_src]();
-    else
+    if(irq_handlers[irq_src] == NULL) {
         intc_disable_irq(irq_src); // Disable undefined IRQ, not to get stuck in it
+        return;
+    }
+
+    stats->count++;
+    if(irq_depth)
+        stats->nested++;
+
+    if(irq_clock) {
+        start = irq_clock();
+        if(irq_pend_seen[irq_src / 32] & (1 << (irq_src % 32))) {
+            uint32_t latency = start - irq_pend_time[irq_src];
+            if(latency > stats->latency_max)
+                stats->latency_max = latency;
+            irq_pend_seen[irq_src / 32] &= ~(1 << (irq_src % 32));
+        }
+    }
+
+    irq_depth++;
+    intc_dispatch(irq_src);
+    irq_depth--;
+
+    if(irq_clock) {
+        uint32_t now = irq_clock();
+        uint32_t run = now - start;
+
+        stats->run_total += run;
+        if(run > stats->run_max)
+            stats->run_max = run;
+        intc_stamp_pending(now);
+    }
 }
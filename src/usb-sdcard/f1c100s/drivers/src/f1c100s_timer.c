@@ -12,6 +12,10 @@ void tim_set_period(uint8_t ch, uint32_t val) {
     write32(TIMER_BASE + TIM_0_INTV + ch * 0x10, val);
 }
 
+inline uint32_t tim_get_period(uint8_t ch) {
+    return read32(TIMER_BASE + TIM_0_INTV + ch * 0x10);
+}
+
 inline uint32_t tim_get_cnt(uint8_t ch) {
     return read32(TIMER_BASE + TIM_0_CUR + ch * 0x10);
 }
@@ -1,6 +1,10 @@
 #include <string.h>
+#include <stdio.h>
 #include "f1c100s_usbm.h"
 #include "f1c100s_clock.h"
+#include "f1c100s_dma.h"
+#include "armv5_cache.h"
+#include "arm32.h"
 
 enum USB_MUX_STATE usb_mux_state;
 
@@ -12,32 +16,132 @@ static uint8_t serial[] = "000000000000";
 
 static SETUP_PACKET setup;
 
-static uint32_t cbw_tag, cbw_len, cbw_cmd, cbw_addr, bulk_len, bulk_idx;
+// BUS_IS and EP_IS bits latched by usbd_irq_handler() and not handled yet
+static volatile uint32_t pending_bus, pending_ep;
+
+// By EP_IS bit, TX (IN) endpoints in the low half and RX (OUT) endpoints in the high half
+static usbd_ep_callback ep_callbacks[32];
+
+static uint32_t cbw_tag, cbw_len, cbw_lun, bulk_len, bulk_idx;
+static uint64_t cbw_addr; // LBA of the next chunk of a READ or WRITE
+static uint8_t cbw_dir_in, csw_status, csw_pending, bulk_out_active;
+static uint8_t sense_key, sense_asc; // Of the last failed command, cleared by REQUEST SENSE
+
+static union
+{
+    uint32_t w[8];
+    uint8_t b[32];
+} cbw; // Last Command Block Wrapper, laid out as on the wire
+#define CBWCB (cbw.b + 15)
+static uint16_t bulk_maxp = 64; // 512 once the host settled on high-speed
 
 static union
 {
     uint32_t dat[65536 / 4];
     RD_CAPACITIES_RES res_fmt_cap;
     RD_CAPACITY_RES res_cap;
+    RD_CAPACITY16_RES res_cap16;
     REQUEST_SENSE_RES res_reqsense;
     MODE_SENSE6_RES res_sense6;
-} buf;
+    MODE_SENSE10_RES res_sense10;
+} buf __attribute__((aligned(32))); // Cache line aligned, the NDMA moves bulk data in and out
 
 #define CBW_SIGNATURE 0x43425355
 #define CSW_SIGNATURE 0x53425355
 
+#define CSW_PASSED 0
+#define CSW_FAILED 1
+#define CSW_PHASE_ERROR 2
+
+#define SCSI_DIR_NONE 0
+#define SCSI_DIR_IN 1
+#define SCSI_DIR_OUT 2
+
+#define SCSI_DATA_OUT 0xFFFFFFFF // Handler result, the CSW follows the data-out stage
+
+typedef struct
+{
+    uint8_t opcode;
+    uint8_t dir;               // Data stage the command has, SCSI_DIR_*
+    uint32_t (*handler)(void); // Fills buf, returns the number of bytes to send
+} SCSI_CMD;
+
 #define EP_BULK_IN 1
 #define EP_BULK_OUT 1
 
-static struct
+#define USB_DMA_CH 0
+
+#define RD_CHUNK (sizeof(buf.dat) / 2) // RD10 ping-pong half, 64 blocks
+
+static uint32_t rd_half, rd_blocks[2];
+static uint64_t rd_addr[2];
+static uint8_t rd_pending[2];
+
+#define BULK_MAXP_FS 64
+#define BULK_MAXP_HS 512
+
+// Configuration, interface and both bulk endpoints, sent as one block
+typedef struct PACKED
 {
-    DSC_DEV dev;
-    DSC_QUAL qual;
     DSC_CFG cfg;
     DSC_IF itf;
     DSC_EP ep1;
     DSC_EP ep2;
+} DSC_CFG_SET;
+
+#define DSC_CFG_SET_INIT(maxp) \
+    { \
+        { \
+            /* Configuration Descriptor */ \
+            sizeof(DSC_CFG),     /* bLength */ \
+            2,                   /* bDescriptorType */ \
+            sizeof(DSC_CFG_SET), /* wTotalLength */ \
+            1,                   /* bNumInterfaces */ \
+            1,                   /* bConfigurationValue */ \
+            0,                   /* iConfiguration */ \
+            128,                 /* bmAttributes:        Bus powered */ \
+            100 / 2              /* bMaxPower:           100 mA */ \
+        }, \
+        { \
+            /*  Interface Descriptor */ \
+            sizeof(DSC_IF), /* bLength */ \
+            4,              /* bDescriptorType */ \
+            0,              /* bInterfaceNumber */ \
+            0,              /* bAlternateSetting */ \
+            2,              /* bNumEndpoints */ \
+            8,              /* bInterfaceClass      Mass Storage Class */ \
+            6,              /* bInterfaceSubClass   SCSI */ \
+            80,             /* bInterfaceProtocol   Bulk Only Protocol */ \
+            0               /* iInterface */ \
+        }, \
+        { \
+            /* Endpoint 1 Descriptor */ \
+            sizeof(DSC_EP),   /* bLength */ \
+            5,                /* bDescriptorType */ \
+            128 | EP_BULK_IN, /* bEndpointAddress:    In */ \
+            2,                /* bmAttributes:        Bulk */ \
+            maxp,             /* wMaxPacketSize */ \
+            0                 /* bInterval */ \
+        }, \
+        { \
+            /* Endpoint 2 Descriptor */ \
+            sizeof(DSC_EP),  /* bLength */ \
+            5,               /* bDescriptorType */ \
+            0 | EP_BULK_OUT, /* bEndpointAddress:    Out */ \
+            2,               /* bmAttributes:        Bulk */ \
+            maxp,            /* wMaxPacketSize */ \
+            0                /* bInterval */ \
+        } \
+    }
+
+static struct
+{
+    DSC_DEV dev;
+    DSC_QUAL qual;
     DSC_LNID str0;
+    DSC_CFG_SET fs;
+    DSC_CFG_SET hs;
+    DSC_CFG_SET other; // The set of the speed not in use, sent as Other Speed Configuration
 } dsc = {
     {
         /* Device Descriptor */
@@ -68,56 +172,15 @@ static struct
         1,                // bNumConfigurations
         0                 // bReserved
     },
-    {
-        /* Configuration Descriptor */
-        sizeof(DSC_CFG),  // bLength
-        2,                // bDescriptorType
-        sizeof(DSC_CFG) + // wTotalLength
-            sizeof(DSC_IF) +
-            sizeof(DSC_EP) +
-            sizeof(DSC_EP),
-        1,      // bNumInterfaces
-        1,      // bConfigurationValue
-        0,      // iConfiguration
-        128,    // bmAttributes:        Bus powered
-        100 / 2 // bMaxPower:           100 mA
-    },
-    {
-        /*  Interface Descriptor */
-        sizeof(DSC_IF), // bLength
-        4,              // bDescriptorType
-        0,              // bInterfaceNumber
-        0,              // bAlternateSetting
-        2,              // bNumEndpoints
-        8,              // bInterfaceClass      Mass Storage Class
-        6,              // bInterfaceSubClass   SCSI
-        80,             // bInterfaceProtocol   Bulk Only Protocol
-        0               // iInterface
-    },
-    {
-        /* Endpoint 1 Descriptor */
-        sizeof(DSC_EP),   // bLength
-        5,                // bDescriptorType
-        128 | EP_BULK_IN, // bEndpointAddress:    In
-        2,                // bmAttributes:        Bulk
-        64,               // wMaxPacketSize
-        0                 // bInterval
-    },
-    {
-        /* Endpoint 2 Descriptor */
-        sizeof(DSC_EP),  // bLength
-        5,               // bDescriptorType:     Out
-        0 | EP_BULK_OUT, // bEndpointAddress:    Bulk
-        2,               // bmAttributes
-        64,              // wMaxPacketSize
-        0                // bInterval
-    },
     {
         /* String Descriptor 0 */
         sizeof(DSC_LNID), // bLength
         3,                // bDescriptorType
         0x0409            // wLANGID:             English (US)
-    }};
+    },
+    DSC_CFG_SET_INIT(BULK_MAXP_FS),
+    DSC_CFG_SET_INIT(BULK_MAXP_HS),
+    DSC_CFG_SET_INIT(BULK_MAXP_FS)};
 
 /* USB Mass Storage Responses */
 INQUIRY_RES inq = {
@@ -136,9 +199,51 @@ INQUIRY_RES inq = {
     // Product Revision Level (4 bytes)
     {'0', '0', '0', '1'}};
 
-static uint32_t blockCount = 0;
+static uint64_t blockCount = 0;
 static usbm_sector_callback readSector = NULL;
 static usbm_sector_callback writeSector = NULL;
+static usbm_read_start_callback readStart = NULL;
+static usbm_read_poll_callback readPoll = NULL;
+static usbm_flush_callback flushCache = NULL;
+
+#if USBM_BENCH_LUN
+#define BENCH_LUN 1
+#define BENCH_BLOCKS (2 * 1024 * 1024) // 1 GiB that is never stored anywhere
+#define BENCH_REPORT_MS 1000
+#define BENCH_IDLE_MS 200
+
+extern volatile uint32_t systime; // 1 ms tick of the application
+
+static uint32_t bench_start, bench_last, bench_read, bench_written;
+
+static void bench_count(uint32_t *counter, uint32_t bytes)
+{
+    if (bench_read == 0 && bench_written == 0)
+        bench_start = systime;
+    *counter += bytes;
+    bench_last = systime;
+}
+
+// Prints the throughput every BENCH_REPORT_MS of traffic and when the host goes idle
+static void bench_report(void)
+{
+    uint32_t ms;
+
+    if (bench_read == 0 && bench_written == 0)
+        return;
+    if (systime - bench_start < BENCH_REPORT_MS && systime - bench_last < BENCH_IDLE_MS)
+        return;
+
+    ms = bench_last - bench_start;
+    if (ms == 0)
+        ms = 1;
+    // Bytes per ms is KB/s
+    printf("USB bench %s: read %lu.%02lu MB/s, write %lu.%02lu MB/s\n", bulk_maxp == BULK_MAXP_HS ? "HS" : "FS",
+           bench_read / ms / 1000, (bench_read / ms % 1000) / 10, bench_written / ms / 1000, (bench_written / ms % 1000) / 10);
+    bench_read = 0;
+    bench_written = 0;
+}
+#endif
 
 static inline void sdelay(int loops)
 {
@@ -183,8 +288,8 @@ static void ep0_send_dsc(void *ptr)
 {
     uint8_t *dsc = ptr;
     uint16_t len = setup.wLength, dlen = dsc[0];
-    if (dsc[1] == 2)
-        dlen = dsc[2];
+    if (dsc[1] == 2 || dsc[1] == 7)
+        dlen = dsc[2] | dsc[3] << 8; // wTotalLength of a configuration
     if (dlen < len)
         len = dlen;
     ep0_send_buf(dsc, len);
@@ -206,6 +311,8 @@ static void ep0_send_str(void *ptr)
     USB->TXCSR = 0x0A; // TxPktRdy | DataEnd
 }
 
+static void ums_csw(void);
+
 static void ep0_handler(void)
 {
     USB->EP_IDX = 0; // Select endpoint 0
@@ -235,19 +342,47 @@ static void ep0_handler(void)
         if (setup.wRequest == 0xFEA1)
         {
             USB->TXCSR = 0x40; // Serviced RxPktRdy
-            USB->FIFO[0].byte = 0;
+            USB->FIFO[0].byte = USBM_BENCH_LUN ? 1 : 0;
             USB->TXCSR = 0x0A; // TxPktRdy | DataEnd
             // printf("Get Max LUN\r\n");
         }
+        else if (setup.wRequest == 0xFF21)
+        {
+            // Bulk-Only Mass Storage Reset, the host clears both halts next
+            bulk_out_active = 0;
+            csw_pending = 0;
+            USB->TXCSR = 0x48; // Serviced RxPktRdy | DataEnd
+        }
+        else if (setup.wRequest == 0x0102 && (setup.wIndex_l == (128 | EP_BULK_IN) || setup.wIndex_l == EP_BULK_OUT))
+        {
+            // Clear Feature ENDPOINT_HALT, also resets the data toggle
+            if (setup.wIndex_l & 128)
+            {
+                USB->EP_IDX = EP_BULK_IN;
+                USB->TXCSR = (USB->TXCSR & ~0x30) | 0x40; // SendStall, SentStall off, ClrDataTog
+            }
+            else
+            {
+                USB->EP_IDX = EP_BULK_OUT;
+                USB->RXCSR = (USB->RXCSR & ~0x60) | 0x80; // SendStall, SentStall off, ClrDataTog
+            }
+            USB->EP_IDX = 0;
+            USB->TXCSR = 0x48; // Serviced RxPktRdy | DataEnd
+            if (csw_pending && (setup.wIndex_l & 128))
+            {
+                csw_pending = 0;
+                ums_csw();
+            }
+        }
         else if (setup.wRequest == 0x0500)
         {
-            dsc.ep1.wMaxPacketSize = dsc.ep2.wMaxPacketSize = USB->POWER & 16 ? 512 : 64;
+            bulk_maxp = USB->POWER & 16 ? BULK_MAXP_HS : BULK_MAXP_FS; // HSMode, settled by now
             setup.wValue_l &= 127;
             USB->TXCSR = 0x48;
             while (USB->TXCSR & 0x08)
                 ;
             USB->TXFUNCADDR = setup.wValue_l;
-            // printf("Set Addr(%d) %cS-mode\n", setup.wValue, dsc.ep1.wMaxPacketSize > 64 ? 'H' : 'F');
+            // printf("Set Addr(%d) %cS-mode\n", setup.wValue, bulk_maxp > 64 ? 'H' : 'F');
         }
         else if (setup.wRequest == 0x0900)
         {
@@ -255,16 +390,16 @@ static void ep0_handler(void)
             // if(USB_Config)
             {
                 USB->EP_IDX = EP_BULK_IN; // in ep: device -> host
-                USB->TXFIFOSZ = 6;        // 2^(size + 3): 2^(6+3)=512
+                USB->TXFIFOSZ = 0x16;     // 2^(size + 3): 2^(6+3)=512, double buffered
                 USB->TXFIFOADDR = 64 / 8; // Offset(addr * 8)
-                USB->TXMAXP = dsc.ep1.wMaxPacketSize;
+                USB->TXMAXP = bulk_maxp;
                 USB->TXCSR = 0x2048; // fifo flush, clr data toggle, auto set, mode in
 #if EP_BULK_IN != EP_BULK_OUT
                 USB->EP_IDX = EP_BULK_OUT; // out ep: host -> device
 #endif
-                USB->RXFIFOSZ = 6;                // 2^(size + 3): 2^(6+3)=512
-                USB->RXFIFOADDR = (512 + 64) / 8; // Offset(addr * 8)
-                USB->RXMAXP = dsc.ep2.wMaxPacketSize;
+                USB->RXFIFOSZ = 0x16;              // 2^(size + 3): 2^(6+3)=512, double buffered
+                USB->RXFIFOADDR = (64 + 1024) / 8; // Offset(addr * 8)
+                USB->RXMAXP = bulk_maxp;
                 USB->RXCSR = 0x0090; // fifo flush, clr data toggle, auto clr, ?
                 USB->EP_IDX = 0;
                 USB->TXCSR = 0x48; // Serviced RxPktRdy | DataEnd
@@ -293,7 +428,7 @@ static void ep0_handler(void)
                 else if (setup.wValue_h == 2)
                 {
                     // printf("Get Cfg Dsc\r\n");
-                    ep0_send_dsc(&dsc.cfg);
+                    ep0_send_dsc(bulk_maxp == BULK_MAXP_HS ? &dsc.hs : &dsc.fs);
                     return;
                 }
                 else if (setup.wValue_h == 3)
@@ -326,6 +461,14 @@ static void ep0_handler(void)
                     ep0_send_dsc(&dsc.qual);
                     return;
                 }
+                else if (setup.wValue_h == 7)
+                {
+                    // printf("Get Other Speed Cfg Dsc\r\n");
+                    memcpy(&dsc.other, bulk_maxp == BULK_MAXP_HS ? &dsc.fs : &dsc.hs, sizeof(dsc.other));
+                    dsc.other.cfg.bDescriptorType = 7;
+                    ep0_send_dsc(&dsc.other);
+                    return;
+                }
             }
             // printf("Invalid Request\r\n");
             USB->TXCSR = 0x60; // Serviced RxPktRdy | SendStall
@@ -335,16 +478,58 @@ static void ep0_handler(void)
 
 static void ums_csw(void)
 {
-#if EP_BULK_IN != EP_BULK_OUT
-    USB->EP_IDX = EP_BULK_IN;
-#endif
-    while (USB->TXCSR & 3)
+    USB->EP_IDX = EP_BULK_IN; // Also called from EP0 once the host cleared the halt
+    while (USB->TXCSR & 1) // One of the two FIFO buffers free
         ;
     USB->FIFO[EP_BULK_IN].word32 = 0x53425355; // 'USBS'
     USB->FIFO[EP_BULK_IN].word32 = cbw_tag;
-    USB->FIFO[EP_BULK_IN].word32 = cbw_len;
-    USB->FIFO[EP_BULK_IN].byte = 0; // bCSWStatus
-    USB->TXCSR |= 1;                // TxPktRdy
+    USB->FIFO[EP_BULK_IN].word32 = cbw_len; // dCSWDataResidue
+    USB->FIFO[EP_BULK_IN].byte = csw_status;
+    USB->TXCSR |= 1; // TxPktRdy
+}
+
+// Ends a command, the data the host still expects is refused by stalling its pipe
+static void ums_finish(void)
+{
+    if (cbw_len && cbw_dir_in)
+    {
+        USB->EP_IDX = EP_BULK_IN;
+        USB->TXCSR |= 0x10; // SendStall
+        csw_pending = 1;    // Sent once the host cleared the halt
+        return;
+    }
+    if (cbw_len)
+    {
+        USB->EP_IDX = EP_BULK_OUT;
+        USB->RXCSR |= 0x20; // SendStall
+    }
+    ums_csw();
+}
+
+static uint32_t scsi_fail(uint8_t key, uint8_t asc)
+{
+    if (csw_status == CSW_PASSED)
+    {
+        sense_key = key;
+        sense_asc = asc;
+    }
+    csw_status = CSW_FAILED;
+    return 0;
+}
+
+static uint32_t scsi_phase_error(void)
+{
+    csw_status = CSW_PHASE_ERROR;
+    return 0;
+}
+
+static uint64_t lun_blocks(void)
+{
+#if USBM_BENCH_LUN
+    if (cbw_lun == BENCH_LUN)
+        return BENCH_BLOCKS;
+#endif
+    return blockCount;
 }
 
 static void bulk_init(void)
@@ -354,28 +539,364 @@ static void bulk_init(void)
     cbw_len -= bulk_len;
 }
 
+// Moves one packet between buf and an endpoint FIFO, the packet is complete in the FIFO or fits into it
+static void bulk_dma(uint32_t src, dma_addr_mode_e src_mode, uint32_t dst, dma_addr_mode_e dst_mode, uint32_t len)
+{
+    ndma_start(USB_DMA_CH, src, src_mode, dst, dst_mode, len, DMA_WIDTH_32);
+    while (ndma_busy(USB_DMA_CH))
+        ;
+}
+
+static void bulk_rx_init(void)
+{
+    bulk_init();
+    // No dirty line may get evicted over what the NDMA writes
+    cache_flush_range((uint32_t)buf.dat, (uint32_t)buf.dat + bulk_len);
+}
+
+// Starts reading the next chunk of the READ into one half of buf, returns its length or 0 when done
+static uint32_t bulk_read_next(uint32_t half)
+{
+    uint8_t *dst = (uint8_t *)&buf.dat[half * RD_CHUNK / 4];
+    uint32_t len = cbw_len > RD_CHUNK ? RD_CHUNK : cbw_len;
+
+    if (!len)
+        return 0;
+    cbw_len -= len;
+    rd_addr[half] = cbw_addr;
+    rd_blocks[half] = len / 512;
+    rd_pending[half] = 0;
+    cbw_addr += rd_blocks[half];
+#if USBM_BENCH_LUN
+    if (cbw_lun == BENCH_LUN)
+        return len;
+#endif
+    if (readStart && readStart(dst, rd_addr[half], rd_blocks[half]))
+        rd_pending[half] = 1;
+    else if (!readSector(dst, rd_addr[half], rd_blocks[half]))
+        scsi_fail(SENSE_MEDIUM_ERROR, ASC_UNRECOVERED_READ_ERROR);
+    return len;
+}
+
+// Waits for the chunk started into one half of buf, a failed one is read again the blocking way
+static void bulk_read_wait(uint32_t half)
+{
+    int8_t ret;
+
+    if (!rd_pending[half])
+        return;
+    rd_pending[half] = 0;
+    while ((ret = readPoll()) == 0)
+        ;
+    if (ret < 0 && !readSector((uint8_t *)&buf.dat[half * RD_CHUNK / 4], rd_addr[half], rd_blocks[half]))
+        scsi_fail(SENSE_MEDIUM_ERROR, ASC_UNRECOVERED_READ_ERROR);
+}
+
+// Sends len bytes through the bulk in endpoint, one FIFO buffer fills while the other one is on the wire.
+// The NDMA reads DRAM, each packet is cleaned out of the cache while the one before is moved.
+static void bulk_send(uint8_t *ptr, uint32_t len)
+{
+#if USBM_BENCH_LUN
+    if (cbw_lun == BENCH_LUN)
+        bench_count(&bench_read, len);
+#endif
+    cache_clean_range((uint32_t)ptr, (uint32_t)ptr + bulk_maxp);
+    for (; len; len -= bulk_maxp, ptr += bulk_maxp)
+    {
+        while (USB->TXCSR & 1)
+            ;
+        ndma_start(USB_DMA_CH, (uint32_t)ptr, DMA_ADDR_LINEAR, (uint32_t)&USB->FIFO[EP_BULK_IN].word32, DMA_ADDR_IO,
+                   bulk_maxp, DMA_WIDTH_32);
+        if (len > bulk_maxp)
+            cache_clean_range((uint32_t)ptr + bulk_maxp, (uint32_t)ptr + 2 * bulk_maxp);
+        while (ndma_busy(USB_DMA_CH))
+            ;
+        USB->TXCSR |= 1; // TxPktRdy
+    }
+}
+
+static uint16_t cb_be16(uint32_t i)
+{
+    return CBWCB[i] << 8 | CBWCB[i + 1];
+}
+
+static uint32_t cb_be32(uint32_t i)
+{
+    return (uint32_t)cb_be16(i) << 16 | cb_be16(i + 2);
+}
+
+// Decodes LBA and length of a READ or WRITE(10/12/16) into cbw_addr, returns the number of blocks
+static uint32_t scsi_block_range(void)
+{
+    uint64_t lba;
+    uint32_t blocks;
+
+    switch (CBWCB[0])
+    {
+    case RD10:
+    case WR10:
+        lba = cb_be32(2);
+        blocks = cb_be16(7);
+        break;
+    case RD12:
+    case WR12:
+        lba = cb_be32(2);
+        blocks = cb_be32(6);
+        break;
+    default: // RD16, WR16
+        lba = (uint64_t)cb_be32(2) << 32 | cb_be32(6);
+        blocks = cb_be32(10);
+        break;
+    }
+    // Host and command have to agree on the amount of data, case 7, 8, 10 and 13 of the Bulk Only spec
+    if ((uint64_t)blocks * 512 != cbw_len)
+        return scsi_phase_error();
+    if (lba > lun_blocks() || blocks > lun_blocks() - lba)
+        return scsi_fail(SENSE_ILLEGAL_REQUEST, ASC_LBA_OUT_OF_RANGE);
+    cbw_addr = lba;
+    return blocks;
+}
+
+static uint32_t scsi_read(void)
+{
+    uint32_t len, next;
+
+    if (!scsi_block_range())
+        return 0;
+    // The card fills one half of buf while the other half goes out over USB
+    rd_half = 0;
+    len = bulk_read_next(rd_half);
+    while (len)
+    {
+        bulk_read_wait(rd_half);
+        next = bulk_read_next(rd_half ^ 1);
+        bulk_send((uint8_t *)&buf.dat[rd_half * RD_CHUNK / 4], len);
+        rd_half ^= 1;
+        len = next;
+    }
+    return 0;
+}
+
+static uint32_t scsi_write(void)
+{
+    if (!scsi_block_range())
+        return 0;
+    bulk_rx_init();
+    bulk_out_active = 1;
+    return SCSI_DATA_OUT;
+}
+
+static uint32_t scsi_no_data(void)
+{
+    return 0;
+}
+
+static uint32_t scsi_sync_cache(void)
+{
+    if (flushCache && !flushCache())
+        return scsi_fail(SENSE_MEDIUM_ERROR, ASC_WRITE_ERROR);
+    return 0;
+}
+
+static uint32_t scsi_inquiry(void)
+{
+    uint8_t *vpd = (uint8_t *)buf.dat;
+
+    if (CBWCB[1] & 1) // EVPD
+    {
+        vpd[1] = CBWCB[2];
+        if (CBWCB[2] == 0x00) // Supported VPD pages
+        {
+            vpd[3] = 2;
+            vpd[5] = 0x80;
+            return 6;
+        }
+        if (CBWCB[2] == 0x80) // Unit serial number
+        {
+            vpd[3] = sizeof(serial) - 1;
+            memcpy(&vpd[4], serial, sizeof(serial) - 1);
+            return 4 + sizeof(serial) - 1;
+        }
+    }
+    if (CBWCB[1] & 1 || CBWCB[2])
+        return scsi_fail(SENSE_ILLEGAL_REQUEST, ASC_INVALID_FIELD_IN_CDB);
+    memcpy(buf.dat, &inq, sizeof(inq));
+#if USBM_BENCH_LUN
+    if (cbw_lun == BENCH_LUN)
+        memcpy(((INQUIRY_RES *)buf.dat)->pid, "USB Bench LUN   ", 16);
+#endif
+    return sizeof(inq);
+}
+
+static uint32_t scsi_request_sense(void)
+{
+    buf.res_reqsense.res_code = 0x70; // Current error, fixed format
+    buf.res_reqsense.sense_key = sense_key;
+    buf.res_reqsense.sense_len = sizeof(buf.res_reqsense) - 8;
+    buf.res_reqsense.sense_code = sense_asc;
+    sense_key = SENSE_NONE;
+    sense_asc = 0;
+    return sizeof(buf.res_reqsense);
+}
+
+static uint32_t scsi_read_format_capacities(void)
+{
+    uint64_t blocks = lun_blocks();
+
+    buf.res_fmt_cap.list_len = 8 << 24;
+    buf.res_fmt_cap.block_num = __builtin_bswap32(blocks > 0xFFFFFFFF ? 0xFFFFFFFF : blocks);
+    buf.res_fmt_cap.dsc_type = 0x0002;
+    buf.res_fmt_cap.block_size = 0x0002;
+    return sizeof(buf.res_fmt_cap);
+}
+
+static uint32_t scsi_read_capacity(void)
+{
+    uint64_t last = lun_blocks() - 1;
+
+    // 0xFFFFFFFF sends the host on to READ CAPACITY(16)
+    buf.res_cap.last_lba = __builtin_bswap32(last > 0xFFFFFFFF ? 0xFFFFFFFF : last);
+    buf.res_cap.block_size = 0x00020000;
+    return sizeof(buf.res_cap);
+}
+
+static uint32_t scsi_service_action_in(void)
+{
+    if ((CBWCB[1] & 31) != 0x10) // READ CAPACITY(16)
+        return scsi_fail(SENSE_ILLEGAL_REQUEST, ASC_INVALID_FIELD_IN_CDB);
+    buf.res_cap16.last_lba = __builtin_bswap64(lun_blocks() - 1);
+    buf.res_cap16.block_size = 0x00020000;
+    return sizeof(buf.res_cap16);
+}
+
+// Appends the mode pages asked for by MODE SENSE(6/10) at dst, returns their length
+static uint32_t scsi_mode_pages(uint8_t *dst)
+{
+    uint8_t page = CBWCB[2] & 63;
+
+    if (page != 0x08 && page != 0x3F)
+        return scsi_fail(SENSE_ILLEGAL_REQUEST, ASC_INVALID_FIELD_IN_CDB);
+    // Caching page, writes are on the card when the CSW is sent so WCE stays 0
+    dst[0] = 0x08;
+    dst[1] = 18;
+    return 20;
+}
+
+static uint32_t scsi_mode_sense6(void)
+{
+    uint32_t len = sizeof(buf.res_sense6) + scsi_mode_pages((uint8_t *)&buf + sizeof(buf.res_sense6));
+
+    buf.res_sense6.data_len = len - 1;
+    return csw_status == CSW_PASSED ? len : 0;
+}
+
+static uint32_t scsi_mode_sense10(void)
+{
+    uint32_t len = sizeof(buf.res_sense10) + scsi_mode_pages((uint8_t *)&buf + sizeof(buf.res_sense10));
+
+    buf.res_sense10.data_len = __builtin_bswap16(len - 2);
+    return csw_status == CSW_PASSED ? len : 0;
+}
+
+static const SCSI_CMD scsi_cmds[] = {
+    {TEST_UNIT_READY, SCSI_DIR_NONE, scsi_no_data},
+    {REQUEST_SENSE, SCSI_DIR_IN, scsi_request_sense},
+    {INQUIRY, SCSI_DIR_IN, scsi_inquiry},
+    {MODE_SENSE6, SCSI_DIR_IN, scsi_mode_sense6},
+    {START_STOP_UNIT, SCSI_DIR_NONE, scsi_no_data},
+    {MEDIUM_REMOVAL, SCSI_DIR_NONE, scsi_no_data},
+    {RD_CAPACITIES, SCSI_DIR_IN, scsi_read_format_capacities},
+    {RD_CAPACITY, SCSI_DIR_IN, scsi_read_capacity},
+    {RD10, SCSI_DIR_IN, scsi_read},
+    {WR10, SCSI_DIR_OUT, scsi_write},
+    {VERIFY10, SCSI_DIR_NONE, scsi_no_data},
+    {SYNC_CACHE10, SCSI_DIR_NONE, scsi_sync_cache},
+    {MODE_SENSE10, SCSI_DIR_IN, scsi_mode_sense10},
+    {RD16, SCSI_DIR_IN, scsi_read},
+    {WR16, SCSI_DIR_OUT, scsi_write},
+    {SYNC_CACHE16, SCSI_DIR_NONE, scsi_sync_cache},
+    {SERVICE_ACTION_IN16, SCSI_DIR_IN, scsi_service_action_in},
+    {RD12, SCSI_DIR_IN, scsi_read},
+    {WR12, SCSI_DIR_OUT, scsi_write},
+};
+
+static void scsi_dispatch(void)
+{
+    const SCSI_CMD *cmd = NULL;
+    uint8_t *ptr = (uint8_t *)&buf;
+    uint32_t i;
+
+    csw_status = CSW_PASSED;
+    for (i = 0; i < sizeof(scsi_cmds) / sizeof(scsi_cmds[0]); i++)
+        if (scsi_cmds[i].opcode == CBWCB[0])
+            cmd = &scsi_cmds[i];
+
+    memset(buf.dat, 0, 64);
+    if (cbw_lun > (USBM_BENCH_LUN ? 1 : 0) && CBWCB[0] != REQUEST_SENSE)
+        i = scsi_fail(SENSE_ILLEGAL_REQUEST, ASC_LUN_NOT_SUPPORTED);
+    else if (!cmd)
+        i = scsi_fail(SENSE_ILLEGAL_REQUEST, ASC_INVALID_OPCODE);
+    else if (cbw_len && cmd->dir != (cbw_dir_in ? SCSI_DIR_IN : SCSI_DIR_OUT))
+        i = scsi_phase_error();
+    else
+        i = cmd->handler();
+
+    if (i == SCSI_DATA_OUT)
+        return; // CSW follows the data
+    if (i > cbw_len)
+        i = cbw_len;
+    if (i)
+    {
+        // Responses fit into one packet, being short it ends the data stage, the residue goes with the CSW
+        cbw_len -= i;
+#if EP_BULK_IN != EP_BULK_OUT
+        USB->EP_IDX = EP_BULK_IN;
+#endif
+        do
+        {
+            USB->FIFO[EP_BULK_IN].byte = *ptr++;
+        } while (--i);
+        USB->TXCSR |= 1; // TxPktRdy
+        ums_csw();
+        return;
+    }
+    ums_finish();
+}
+
 static void bulk_out_handler(void)
 {
-    uint8_t *ptr;
     uint32_t i;
     USB->EP_IDX = EP_BULK_OUT;
-    if (cbw_cmd == 0x2A)
+    if (!(USB->RXCSR & 1))
+        return; // Already taken together with the packet before
+    if (bulk_out_active)
     {
-        i = USB->RXCOUNT / 4;
-        while (i--)
-            buf.dat[bulk_idx++] = USB->FIFO[EP_BULK_OUT].word32;
-        USB->RXCSR &= ~1; // RxPktRdy
-        if (bulk_idx == bulk_len / 4)
+        // The second FIFO buffer may already hold the next packet
+        while (bulk_out_active && (USB->RXCSR & 1))
         {
-            writeSector((uint8_t *)&buf.dat[0], cbw_addr, bulk_len / 512);
-
-            cbw_addr += bulk_len / 512;
-            if (cbw_len)
-                bulk_init();
-            else
+            i = USB->RXCOUNT & ~3;
+            bulk_dma((uint32_t)&USB->FIFO[EP_BULK_OUT].word32, DMA_ADDR_IO, (uint32_t)&buf.dat[bulk_idx], DMA_ADDR_LINEAR, i);
+            bulk_idx += i / 4;
+            USB->RXCSR &= ~1; // RxPktRdy
+            if (bulk_idx == bulk_len / 4)
             {
-                cbw_cmd = 0;
-                ums_csw();
+                cache_inv_range((uint32_t)buf.dat, (uint32_t)buf.dat + bulk_len);
+#if USBM_BENCH_LUN
+                if (cbw_lun == BENCH_LUN)
+                    bench_count(&bench_written, bulk_len);
+                else
+#endif
+                if (!writeSector((uint8_t *)&buf.dat[0], cbw_addr, bulk_len / 512))
+                    scsi_fail(SENSE_MEDIUM_ERROR, ASC_WRITE_ERROR);
+
+                cbw_addr += bulk_len / 512;
+                if (cbw_len)
+                    bulk_rx_init();
+                else
+                {
+                    bulk_out_active = 0;
+                    ums_csw();
+                }
             }
         }
     }
@@ -387,108 +908,31 @@ static void bulk_out_handler(void)
     }
     else
     {
-        cbw_tag = USB->FIFO[EP_BULK_OUT].word32;       // dCBWTag
-        cbw_len = USB->FIFO[EP_BULK_OUT].word32;       // dCBWDataTransferLength
-        cbw_cmd = USB->FIFO[EP_BULK_OUT].word32 >> 24; // CBWCB, bCBWCBLength, bCBWLUN, bmCBWFlags
-        cbw_addr = USB->FIFO[EP_BULK_OUT].word32 >> 8;
-        cbw_addr = __builtin_bswap32(cbw_addr | (USB->FIFO[EP_BULK_OUT].word32 << 24));
-        USB->FIFO[EP_BULK_OUT].word32;
-        USB->FIFO[EP_BULK_OUT].word16;
-        USB->FIFO[EP_BULK_OUT].byte;
+        for (i = 1; i < 7; i++)
+            cbw.w[i] = USB->FIFO[EP_BULK_OUT].word32;
+        i = USB->FIFO[EP_BULK_OUT].word16;
+        cbw.b[28] = i;
+        cbw.b[29] = i >> 8;
+        cbw.b[30] = USB->FIFO[EP_BULK_OUT].byte;
+        cbw_tag = cbw.w[1];             // dCBWTag
+        cbw_len = cbw.w[2];             // dCBWDataTransferLength
+        cbw_dir_in = cbw.b[12] >> 7;    // bmCBWFlags
+        cbw_lun = cbw.b[13] & 15;       // bCBWLUN
         USB->RXCSR &= ~1; // RxPktRdy
-        // printf("EP%d CMD %08X\r\n", EP_BULK_OUT, cbw_cmd);
-        if (cbw_cmd == WR10)
-        {
-            // printf("WR10 0x%08lX %lu\r\n", cbw_addr, cbw_len);
-            bulk_init();
-        }
-        else if (cbw_cmd == RD10)
-        {
-            // printf("RD10 0x%08lX %lu\r\n", cbw_addr, cbw_len);
-#if EP_BULK_IN != EP_BULK_OUT
-            USB->EP_IDX = EP_BULK_IN;
-#endif
-            do
-            {
-                bulk_init();
+        // printf("EP%d CMD %02X\r\n", EP_BULK_OUT, CBWCB[0]);
+        scsi_dispatch();
+    }
+}
 
-                readSector((uint8_t *)&buf.dat[0], cbw_addr, bulk_len / 512);
+void usbd_set_async_read(usbm_read_start_callback start, usbm_read_poll_callback poll)
+{
+    readStart = start;
+    readPoll = poll;
+}
 
-                cbw_addr += bulk_len / 512;
-                for (bulk_len /= dsc.ep2.wMaxPacketSize; bulk_len; bulk_len--)
-                {
-                    for (i = 0; i < dsc.ep2.wMaxPacketSize; i += 4)
-                        USB->FIFO[EP_BULK_IN].word32 = buf.dat[bulk_idx++];
-                    for (USB->TXCSR |= 1; USB->TXCSR & 3;)
-                    {
-                    };
-                }
-            } while (cbw_len);
-            ums_csw();
-        }
-        else
-        {
-            i = 0;
-            ptr = (uint8_t *)&buf;
-            memset(buf.dat, 0, 512);
-            switch (cbw_cmd)
-            {
-            case INQUIRY:
-                // printf("Inquiry\r\n");
-                i = sizeof(inq);
-                ptr = (uint8_t *)&inq;
-                break;
-            case RD_CAPACITIES:
-                // printf("Read Format Capacity\r\n");
-                buf.res_fmt_cap.list_len = 8 << 24;
-                buf.res_fmt_cap.block_num = __builtin_bswap32(blockCount);
-                buf.res_fmt_cap.dsc_type = 0x0002;
-                buf.res_fmt_cap.block_size = 0x0002;
-                i = sizeof(buf.res_fmt_cap);
-                break;
-            case RD_CAPACITY:
-                // printf("Read Capacity\r\n");
-                buf.res_cap.last_lba = __builtin_bswap32(blockCount - 1);
-                buf.res_cap.block_size = 0x00020000;
-                i = sizeof(buf.res_cap);
-                break;
-            case TEST_UNIT_READY:
-                // printf("Test Unit Ready\r\n");
-                break;
-            case 0x1E:
-                // printf("Pre Allow Medium Removal\r\n");
-                break;
-            case MODE_SENSE6:
-                // printf("Mode Sense(6)\r\n");
-                buf.res_sense6.data_len = 3;
-                i = sizeof(buf.res_sense6);
-                break;
-            case REQUEST_SENSE:
-                // printf("Request Sense\r\n");
-                buf.res_reqsense.res_code = 0x70;
-                i = sizeof(buf.res_reqsense);
-                break;
-            default:
-                // printf("Command Not Support\r\n");
-                USB->EP_IDX = EP_BULK_IN;
-                USB->TXCSR = 0x10; // SendStall
-                return;
-            }
-            if (i)
-            {
-                cbw_len -= i;
-#if EP_BULK_IN != EP_BULK_OUT
-                USB->EP_IDX = EP_BULK_IN;
-#endif
-                do
-                {
-                    USB->FIFO[EP_BULK_IN].byte = *ptr++;
-                } while (--i);
-                USB->TXCSR |= 1; // TxPktRdy
-            }
-            ums_csw();
-        }
-    }
+void usbd_set_flush(usbm_flush_callback flush)
+{
+    flushCache = flush;
 }
 
 void usb_mux(enum USB_MUX_STATE i)
@@ -503,6 +947,9 @@ void usb_mux(enum USB_MUX_STATE i)
 
 void usb_deinit(void)
 {
+    USB->BUS_IE = 0;
+    USB->EP_IE = 0;
+
     // CCU->USBPHY_CFG &= ~3; // Clock OFF, Assert reset
     clk_usb_config(0, 1);
 
@@ -515,12 +962,14 @@ void usb_deinit(void)
     usb_mux(USB_MUX_DISABLE);
 }
 
-void usbd_init(uint32_t numBlocks, usbm_sector_callback read, usbm_sector_callback write)
+void usbd_init(uint64_t numBlocks, usbm_sector_callback read, usbm_sector_callback write)
 {
     blockCount = numBlocks;
     readSector = read;
     writeSector = write;
 
+    dma_init(); // Bulk data goes through the NDMA
+
     // printf("USB: MUX\r\n");
     usb_mux(USB_MUX_DEVICE);
 
@@ -552,44 +1001,82 @@ void usbd_init(uint32_t numBlocks, usbm_sector_callback read, usbm_sector_callba
     USB->BUS_IS = 0xFF;
     USB->EP_IE = 0;
     USB->EP_IS = 0xFFFFFFFF;
+    pending_bus = 0;
+    pending_ep = 0;
+    usbd_set_ep_callback(0, ep0_handler);
+    usbd_set_ep_callback(EP_BULK_OUT, bulk_out_handler);
+    USB->BUS_IE = 7; // Suspend, Resume, Reset, IRQ_USBOTG has to be enabled by the application
     USB->POWER &= ~((1 << 7) | (1 << 6));
     USB->POWER |= ((1 << 6) | (1 << 5));
 }
 
-void usbd_handler(void)
+void usbd_set_ep_callback(uint8_t ep, usbd_ep_callback callback)
+{
+    uint32_t bit = ep & 128 || (ep & 15) == 0 ? ep & 15 : (ep & 15) + 16;
+
+    ep_callbacks[bit] = callback;
+    if (callback)
+        USB->EP_IE |= 1 << bit;
+    else
+        USB->EP_IE &= ~(1 << bit);
+}
+
+void usbd_irq_handler(void)
 {
     uint32_t isr;
     isr = USB->BUS_IS;
     USB->BUS_IS = isr;
+    pending_bus |= isr;
+    isr = USB->EP_IS;
+    USB->EP_IS = isr;
+    pending_ep |= isr;
+}
+
+uint8_t usbd_pending(void)
+{
+    return (pending_bus | pending_ep) != 0;
+}
+
+uint8_t usbd_handler(void)
+{
+    uint32_t cpsr, bus, ep, i;
+
+    cpsr = arm32_interrupt_save();
+    bus = pending_bus;
+    ep = pending_ep;
+    pending_bus = 0;
+    pending_ep = 0;
+    arm32_interrupt_restore(cpsr);
 
     // bus events
-    if (isr & 1)
+    if (bus & 1)
     {
         // printf("USB Suspend\r\n");
-        // USB->BUS_IS |= 1;
     }
-    if (isr & 2)
+    if (bus & 2)
     {
         // printf("USB Resume\r\n");
-        // USB->BUS_IS |= 2;
     }
-    if (isr & 4)
+    if (bus & 4)
     {
         // printf("USB Reset\r\n");
-        // USB->BUS_IS = 0xFF;
         USB->EP_IS = 0xFFFFFFFF;
         USB->EP_IDX = 0;
         USB->TXFUNCADDR = 0;
+        bulk_maxp = BULK_MAXP_FS;
+        bulk_out_active = 0;
+        csw_pending = 0;
+        ep = 0; // Whatever was latched before belongs to the old session
     }
-    isr = USB->EP_IS;
-    USB->EP_IS = isr;
 
-    if (isr & 1)
+    // endpoint events, EP0 first
+    for (i = 0; i < 32; i++)
     {
-        ep0_handler();
-    }
-    if (isr & (1 << (EP_BULK_OUT + 16)))
-    {
-        bulk_out_handler();
+        if (ep & (1 << i) && ep_callbacks[i])
+            ep_callbacks[i]();
     }
+#if USBM_BENCH_LUN
+    bench_report();
+#endif
+    return bus || ep;
 }
@@ -10,17 +10,60 @@
 #include "f1c100s_clock.h"
 #include "f1c100s_sdc.h"
 #include "f1c100s_usbm.h"
+#include "f1c100s_timer.h"
+#include "f1c100s_intc.h"
+
+#define CARD_POLL_MS 100
+#define CARD_FLUSH_MS 500
+
+// Set to 1 to measure write throughput over UART before the card is exported over USB
+#define SD_WRITE_BENCHMARK 0
+#define BENCH_MAX_CHUNK (128 * 1024)
+#define BENCH_TOTAL (4 * 1024 * 1024) // Bytes written per chunk size
 
 static sdcard_t sdcard;
 
-static void usb_block_read(uint8_t* buffer, uint32_t blockIndex, uint32_t numBlocks)
+volatile uint32_t systime = 0;
+
+static void timer_init(void);
+static void timer_irq_handler(void);
+static uint32_t irq_clock(void);
+static void irq_stats_print(void);
+#if SD_WRITE_BENCHMARK
+static void sd_write_benchmark(void);
+#endif
+
+static uint8_t usb_block_read(uint8_t* buffer, uint64_t blockIndex, uint32_t numBlocks)
+{
+    return sdcard_read(&sdcard, buffer, blockIndex, numBlocks) == numBlocks;
+}
+
+static uint8_t usb_block_read_start(uint8_t* buffer, uint64_t blockIndex, uint32_t numBlocks)
+{
+    // Called from the main loop, so this is where a failed read gets the card back in shape
+    sdcard_recover(&sdcard);
+    return sdcard_transfer_start(&sdcard, buffer, blockIndex, numBlocks, 0);
+}
+
+static int8_t usb_block_read_poll(void)
+{
+    return sdcard_transfer_poll(&sdcard);
+}
+
+static uint8_t usb_block_write(uint8_t* buffer, uint64_t blockIndex, uint32_t numBlocks)
 {
-    sdcard_read(&sdcard, buffer, blockIndex, numBlocks);
+    return sdcard_write(&sdcard, buffer, blockIndex, numBlocks) == numBlocks;
 }
 
-static void usb_block_write(uint8_t* buffer, uint32_t blockIndex, uint32_t numBlocks)
+// Writes already wait for the card to finish programming, this only catches a card still busy
+static uint8_t usb_block_flush(void)
 {
-    sdcard_write(&sdcard, buffer, blockIndex, numBlocks);
+    uint32_t start = systime;
+
+    while (sdcard_busy(&sdcard))
+        if (systime - start > CARD_FLUSH_MS)
+            return 0;
+    return 1;
 }
 
 int main(void)
@@ -28,16 +71,18 @@ int main(void)
     system_init();            // Initialize clocks, mmu, cache, uart, ...
     arm32_interrupt_enable(); // Enable interrupts
 
+    timer_init(); // 1ms tick, also the time base of the SD driver
+
     // Init MMC interface
     clk_reset_set(CCU_BUS_SOFT_RST0, 8);
     clk_enable(CCU_BUS_CLK_GATE0, 8);
     clk_reset_clear(CCU_BUS_SOFT_RST0, 8);
 
-    gpio_init(GPIOF, PIN1 | PIN2 | PIN3, GPIO_MODE_AF2, GPIO_PULL_NONE, GPIO_DRV_3);
+    gpio_init(GPIOF, PIN0 | PIN1 | PIN2 | PIN3 | PIN4 | PIN5, GPIO_MODE_AF2, GPIO_PULL_NONE, GPIO_DRV_3);
 
     sdcard.sdc_base = SDC0_BASE;
     sdcard.voltage = MMC_VDD_27_36;
-    sdcard.width = MMC_BUS_WIDTH_1;
+    sdcard.width = MMC_BUS_WIDTH_4;
     sdcard.clock = 50000000;
 
     // Log some stuff
@@ -65,18 +110,45 @@ int main(void)
             printf("Read block length: %lu\n", sdcard.read_bl_len);
             printf("Write block length: %lu\n", sdcard.write_bl_len);
             printf("Block count: %llu\n", sdcard.blk_cnt);
+            printf("Bus: %lu bit, %lu Hz\n", sdcard.bus_width == MMC_BUS_WIDTH_4 ? 4UL : 1UL, sdcard.bus_clock);
+#if SD_WRITE_BENCHMARK
+            sd_write_benchmark();
+#endif
 
             printf("Init USB mux\n");
             usb_mux(USB_MUX_DEVICE);
             usbd_init(sdcard.blk_cnt, usb_block_read, usb_block_write);
+            usbd_set_async_read(usb_block_read_start, usb_block_read_poll);
+            usbd_set_flush(usb_block_flush);
+            // Default lowest level, the handler only latches the sources for usbd_handler()
+            intc_set_irq_handler(IRQ_USBOTG, usbd_irq_handler);
+            intc_enable_irq(IRQ_USBOTG);
 
-            while (sdcard_status(&sdcard))
+            // CMD13 only every CARD_POLL_MS to notice card removal
+            uint32_t next_poll = systime + CARD_POLL_MS;
+            while (1)
             {
-                usbd_handler();
+                if (!usbd_handler())
+                {
+                    // Sleep until the next USB event or tick, unless one came in since
+                    uint32_t cpsr = arm32_interrupt_save();
+                    if (!usbd_pending())
+                        arm32_wait_for_interrupt();
+                    arm32_interrupt_restore(cpsr);
+                }
+
+                if ((int32_t)(systime - next_poll) >= 0)
+                {
+                    if (!sdcard_status(&sdcard))
+                        break;
+                    next_poll = systime + CARD_POLL_MS;
+                }
             }
 
             printf("USB deinit\n");
+            intc_disable_irq(IRQ_USBOTG);
             usb_deinit();
+            irq_stats_print();
         }
         else
         {
@@ -89,3 +161,89 @@ int main(void)
     }
     return 0;
 }
+
+static void timer_init(void)
+{
+    // Configure timer to generate update event every 1ms
+    tim_init(TIM0, TIM_MODE_CONT, TIM_SRC_HOSC, TIM_PSC_1);
+    tim_set_period(TIM0, 24000000UL / 1000UL);
+    tim_int_enable(TIM0);
+    // IRQ configuration, the tick preempts handlers at lower levels
+    intc_set_irq_handler(IRQ_TIMER0, timer_irq_handler);
+    intc_set_priority(IRQ_TIMER0, INTC_PRIO_LEVELS - 1);
+    intc_enable_irq(IRQ_TIMER0);
+
+    tim_start(TIM0);
+
+    // Free-running 24 MHz count for the IRQ statistics
+    tim_init(TIM1, TIM_MODE_CONT, TIM_SRC_HOSC, TIM_PSC_1);
+    tim_set_period(TIM1, 0xFFFFFFFF);
+    tim_start(TIM1);
+    intc_set_stats_clock(irq_clock);
+}
+
+static void timer_irq_handler(void)
+{
+    systime++;
+    tim_clear_irq(TIM0);
+}
+
+static uint32_t irq_clock(void)
+{
+    return ~tim_get_cnt(TIM1); // Counts down
+}
+
+static void irq_stats_print(void)
+{
+    printf("IRQ  count  nested  max latency us  max run us  avg run us\n");
+    for (uint32_t irq = 0; irq <= IRQ_GPIOF; irq++)
+    {
+        const intc_stats_t* stats = intc_get_stats(irq);
+        if (stats->count == 0)
+            continue;
+        printf("%3lu %6lu %7lu %15lu %11lu %11lu\n", irq, stats->count, stats->nested, stats->latency_max / 24,
+               stats->run_max / 24, stats->run_total / stats->count / 24);
+    }
+    intc_reset_stats();
+}
+
+#if SD_WRITE_BENCHMARK
+static uint8_t bench_buf[BENCH_MAX_CHUNK] __attribute__((aligned(32)));
+
+// Rewrites the last BENCH_TOTAL bytes of the card with their own contents, so no data is lost
+static void sd_write_benchmark(void)
+{
+    uint32_t blksz = sdcard.write_bl_len;
+    uint32_t start = sdcard.blk_cnt - BENCH_TOTAL / blksz;
+
+    printf("Write benchmark\n");
+    for (uint32_t chunk = 4096; chunk <= BENCH_MAX_CHUNK; chunk *= 2)
+    {
+        uint32_t blocks = chunk / blksz;
+        uint32_t elapsed = 0;
+
+        for (uint32_t blk = start; blk < sdcard.blk_cnt; blk += blocks)
+        {
+            if (sdcard_read(&sdcard, bench_buf, blk, blocks) != blocks)
+            {
+                printf("  read failed at %lu\n", blk);
+                return;
+            }
+
+            uint32_t t0 = systime;
+            if (sdcard_write(&sdcard, bench_buf, blk, blocks) != blocks)
+            {
+                printf("  write failed at %lu\n", blk);
+                return;
+            }
+            elapsed += systime - t0;
+        }
+
+        if (elapsed == 0)
+            elapsed = 1;
+        // Bytes per ms is KB/s
+        printf("  %3lu KiB chunks: %lu.%02lu MB/s\n", chunk / 1024,
+               (BENCH_TOTAL / elapsed) / 1000, ((BENCH_TOTAL / elapsed) % 1000) / 10);
+    }
+}
+#endif
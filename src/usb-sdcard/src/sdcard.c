@@ -1,10 +1,19 @@
 #include <stdint.h>
 #include <stddef.h>
 #include "f1c100s_sdc.h"
+#include "f1c100s_timer.h"
 #include "sdcard.h"
 
-static inline void sdelay(int loops);
+#define SD_TIMER_TICKS_US (24) // TIM0 runs from the 24MHz HOSC without prescaler
+#define SD_WRITE_TIMEOUT_US (500000)
+#define SD_RETRIES (1) // Extra attempts for a failed block transfer after recovery
+
+static uint32_t sd_timer_elapsed(uint32_t* last);
+static void sd_delay_us(uint32_t us);
+static uint8_t sd_wait_ready(sdcard_t* card, uint32_t timeout_us);
+static uint8_t sd_set_write_count(sdcard_t* card, sdc_data_t* dat);
 static int mmc_status(sdcard_t* card);
+static void mmc_recover(sdcard_t* card);
 static uint64_t mmc_read_blocks(sdcard_t* card, uint8_t* buf, uint64_t start, uint64_t blkcnt);
 static uint64_t mmc_write_blocks(sdcard_t* card, uint8_t* buf, uint64_t start, uint64_t blkcnt);
 
@@ -13,6 +22,9 @@ static const unsigned tran_speed_unit[] = {10000, 100000, 1000000, 10000000};
 static const unsigned char tran_speed_time[] =
     {0, 10, 12, 13, 15, 20, 25, 30, 35, 40, 45, 50, 55, 60, 70, 80};
 
+// Scratch buffer for SCR / SWITCH_FUNC status reads, cache line aligned for the IDMAC
+static uint32_t sd_data_buf[16] __attribute__((aligned(32)));
+
 static uint8_t go_idle_state(sdcard_t* card) {
     sdc_cmd_t cmd = {0};
 
@@ -104,6 +116,147 @@ static uint8_t mmc_send_op_cond(sdcard_t* card) {
     return 1;
 }
 
+static uint8_t sd_app_cmd(sdcard_t* card) {
+    sdc_cmd_t cmd = {0};
+
+    cmd.cmdidx = MMC_APP_CMD;
+    cmd.cmdarg = card->rca << 16;
+    cmd.resptype = MMC_RESP_R1;
+    return sdc_transfer(card->sdc_base, &cmd, NULL);
+}
+
+static uint8_t sd_send_scr(sdcard_t* card) {
+    sdc_cmd_t cmd = {0};
+    sdc_data_t dat = {0};
+    int status;
+
+    if(!sd_app_cmd(card)) return 0;
+
+    cmd.cmdidx = MMC_SD_APP_SEND_SCR;
+    cmd.cmdarg = 0;
+    cmd.resptype = MMC_RESP_R1;
+    dat.buf = (uint8_t*)sd_data_buf;
+    dat.flag = MMC_DATA_READ;
+    dat.blksz = 8;
+    dat.blkcnt = 1;
+    if(!sdc_transfer(card->sdc_base, &cmd, &dat)) return 0;
+
+    do {
+        status = mmc_status(card);
+        if(status < 0) return 0;
+    } while(status != MMC_STATUS_TRAN);
+
+    // The SCR is sent MSB first
+    card->scr[0] = __builtin_bswap32(sd_data_buf[0]);
+    card->scr[1] = __builtin_bswap32(sd_data_buf[1]);
+    return 1;
+}
+
+static uint8_t sd_switch_func(sdcard_t* card, uint32_t mode, uint32_t group, uint32_t value) {
+    sdc_cmd_t cmd = {0};
+    sdc_data_t dat = {0};
+    int status;
+
+    cmd.cmdidx = MMC_SD_SWITCH_FUNC;
+    cmd.cmdarg = (mode << 31) | 0x00ffffff;
+    cmd.cmdarg &= ~(0xf << (group * 4));
+    cmd.cmdarg |= value << (group * 4);
+    cmd.resptype = MMC_RESP_R1;
+    dat.buf = (uint8_t*)sd_data_buf;
+    dat.flag = MMC_DATA_READ;
+    dat.blksz = 64;
+    dat.blkcnt = 1;
+    if(!sdc_transfer(card->sdc_base, &cmd, &dat)) return 0;
+
+    do {
+        status = mmc_status(card);
+        if(status < 0) return 0;
+    } while(status != MMC_STATUS_TRAN);
+    return 1;
+}
+
+static uint8_t sd_switch_high_speed(sdcard_t* card) {
+    uint8_t* sw = (uint8_t*)sd_data_buf;
+
+    // CMD6 is only there from SD 1.10 on
+    if(SD_SCR_SPEC(card->scr) < 1) return 0;
+
+    // Check function group 1 for high speed support, then switch to it
+    if(!sd_switch_func(card, 0, 0, 1)) return 0;
+    if(!(sw[13] & (1 << 1))) return 0;
+    if(!sd_switch_func(card, 1, 0, 1)) return 0;
+    if((sw[16] & 0xf) != 1) return 0;
+    return 1;
+}
+
+static uint8_t sd_set_bus(sdcard_t* card, uint32_t width, uint32_t clock) {
+    sdc_cmd_t cmd = {0};
+
+    if(!sd_app_cmd(card)) return 0;
+
+    cmd.cmdidx = MMC_SD_APP_SET_BUS_WIDTH;
+    cmd.cmdarg = (width == MMC_BUS_WIDTH_4) ? 2 : 0;
+    cmd.resptype = MMC_RESP_R1;
+    if(!sdc_transfer(card->sdc_base, &cmd, NULL)) return 0;
+
+    if(!sdc_set_clock(card->sdc_base, clock)) return 0;
+    return sdc_set_bus_width(card->sdc_base, width);
+}
+
+static uint8_t sd_setup_bus(sdcard_t* card) {
+    uint32_t width = MMC_BUS_WIDTH_1;
+    uint32_t clock;
+
+    if(!sd_send_scr(card)) {
+        card->scr[0] = 0;
+        card->scr[1] = 0;
+    }
+
+    if((card->width & (MMC_BUS_WIDTH_4 | MMC_BUS_WIDTH_8)) && (SD_SCR_BUS_WIDTHS(card->scr) & (1 << 2)))
+        width = MMC_BUS_WIDTH_4;
+    if((card->clock > card->tran_speed) && sd_switch_high_speed(card)) card->tran_speed = 50000000;
+
+    // Fall back from high speed to default speed, then from 4 to 1 bit, until data comes in clean
+    clock = (card->tran_speed < card->clock) ? card->tran_speed : card->clock;
+    while(1) {
+        if(sd_set_bus(card, width, clock) && (sd_send_scr(card) || sd_send_scr(card))) {
+            card->bus_width = width;
+            card->bus_clock = clock;
+            return 1;
+        }
+
+        if(clock > 25000000)
+            clock = 25000000;
+        else if(width != MMC_BUS_WIDTH_1)
+            width = MMC_BUS_WIDTH_1;
+        else
+            return 0;
+    }
+}
+
+// Announces the length of a CMD25 burst: CMD23 if the SCR lists it (the card then ends it by itself),
+// otherwise ACMD23 so the card can pre-erase
+static uint8_t sd_set_write_count(sdcard_t* card, sdc_data_t* dat) {
+    sdc_cmd_t cmd = {0};
+
+    if(!(card->version & MMC_VERSION_SD) || (dat->blkcnt < 2)) return 1;
+
+    if(SD_SCR_CMD_SUPPORT(card->scr) & SD_SCR_CMD23) {
+        cmd.cmdidx = MMC_SET_BLOCK_COUNT;
+        cmd.cmdarg = dat->blkcnt;
+        cmd.resptype = MMC_RESP_R1;
+        if(!sdc_transfer(card->sdc_base, &cmd, NULL)) return 0;
+        dat->flag |= MMC_DATA_PREDEFINED;
+        return 1;
+    }
+
+    if(!sd_app_cmd(card)) return 0;
+    cmd.cmdidx = MMC_SD_APP_SET_WR_BLK_ERASE_COUNT;
+    cmd.cmdarg = dat->blkcnt & 0x7fffff;
+    cmd.resptype = MMC_RESP_R1;
+    return sdc_transfer(card->sdc_base, &cmd, NULL);
+}
+
 static int mmc_status(sdcard_t* card) {
     sdc_cmd_t cmd = {0};
     int retries = 100;
@@ -111,33 +264,36 @@ static int mmc_status(sdcard_t* card) {
     cmd.cmdidx = MMC_SEND_STATUS;
     cmd.resptype = MMC_RESP_R1;
     cmd.cmdarg = card->rca << 16;
-    
     do {
-        if (!sdc_transfer(card->sdc_base, &cmd, NULL)) {
-            sdelay(50000); //TODO: delay_ms(1);
-            retries -= 1;
-            continue;
-        }
+        if(!sdc_transfer(card->sdc_base, &cmd, NULL)) continue;
+        if(cmd.response[0] & (1 << 8)) break;
+        sd_delay_us(1000);
+    } while(retries-- > 0);
+    if(retries > 0) return ((cmd.response[0] >> 9) & 0xf);
+    return -1;
+}
 
-        if (cmd.response[0] & (1 << 8)) {
-            break;
-        }
-        
-        sdelay(50000); //TODO: delay_ms(1);
-        retries -= 1;
-    } while(retries > 0);
-    
-    if (retries > 0) {
-        return ((cmd.response[0] >> 9) & 0xf);
+// Gets controller and card back to the transfer state after a failed data command
+static void mmc_recover(sdcard_t* card) {
+    sdc_cmd_t cmd = {0};
+    int status;
+
+    // The driver resets the controller on errors, the card clock has to be reloaded
+    sdc_set_clock(card->sdc_base, card->bus_clock);
+
+    status = mmc_status(card);
+    if((status == MMC_STATUS_DATA) || (status == MMC_STATUS_RCV)) {
+        cmd.cmdidx = MMC_STOP_TRANSMISSION;
+        cmd.cmdarg = 0;
+        cmd.resptype = MMC_RESP_R1B;
+        sdc_transfer(card->sdc_base, &cmd, NULL);
     }
-    
-    return -1;
+    sd_wait_ready(card, SD_WRITE_TIMEOUT_US);
 }
 
 static uint64_t mmc_read_blocks(sdcard_t* card, uint8_t* buf, uint64_t start, uint64_t blkcnt) {
     sdc_cmd_t cmd = {0};
     sdc_data_t dat = {0};
-    int status;
 
     if(blkcnt > 1)
         cmd.cmdidx = MMC_READ_MULTIPLE_BLOCK;
@@ -152,18 +308,10 @@ static uint64_t mmc_read_blocks(sdcard_t* card, uint8_t* buf, uint64_t start, ui
     dat.flag = MMC_DATA_READ;
     dat.blksz = card->read_bl_len;
     dat.blkcnt = blkcnt;
-    if(!sdc_transfer(card->sdc_base, &cmd, &dat)) return 0;
-
-    do {
-        status = mmc_status(card);
-        if(status < 0) return 0;
-    } while((status != MMC_STATUS_TRAN) && (status != MMC_STATUS_DATA));
-
-    if(blkcnt > 1) {
-        cmd.cmdidx = MMC_STOP_TRANSMISSION;
-        cmd.cmdarg = 0;
-        cmd.resptype = MMC_RESP_R1B;
-        if(!sdc_transfer(card->sdc_base, &cmd, NULL)) return 0;
+    // Multi-block reads are ended by the controller auto-stop, CMD13 is only needed to resync after an error
+    if(!sdc_transfer(card->sdc_base, &cmd, &dat)) {
+        mmc_recover(card);
+        return 0;
     }
     return blkcnt;
 }
@@ -171,7 +319,6 @@ static uint64_t mmc_read_blocks(sdcard_t* card, uint8_t* buf, uint64_t start, ui
 static uint64_t mmc_write_blocks(sdcard_t* card, uint8_t* buf, uint64_t start, uint64_t blkcnt) {
     sdc_cmd_t cmd = {0};
     sdc_data_t dat = {0};
-    int status;
 
     if(blkcnt > 1)
         cmd.cmdidx = MMC_WRITE_MULTIPLE_BLOCK;
@@ -186,18 +333,17 @@ static uint64_t mmc_write_blocks(sdcard_t* card, uint8_t* buf, uint64_t start, u
     dat.flag = MMC_DATA_WRITE;
     dat.blksz = card->write_bl_len;
     dat.blkcnt = blkcnt;
-    if(!sdc_transfer(card->sdc_base, &cmd, &dat)) return 0;
-    do {
-        status = mmc_status(card);
-        if(status < 0) return 0;
-    } while((status != MMC_STATUS_TRAN) && (status != MMC_STATUS_RCV));
-
-    if(blkcnt > 1) {
-        cmd.cmdidx = MMC_STOP_TRANSMISSION;
-        cmd.cmdarg = 0;
-        cmd.resptype = MMC_RESP_R1B;
-        if(!sdc_transfer(card->sdc_base, &cmd, NULL)) return 0;
+    if(!sd_set_write_count(card, &dat)) {
+        mmc_recover(card);
+        return 0;
     }
+    if(!sdc_transfer(card->sdc_base, &cmd, &dat)) {
+        mmc_recover(card);
+        return 0;
+    }
+
+    // Data and auto-stop are done, the card signals programming by holding DAT0 low
+    if(!sd_wait_ready(card, SD_WRITE_TIMEOUT_US)) return 0;
     return blkcnt;
 }
 
@@ -209,6 +355,7 @@ uint8_t sdcard_detect(sdcard_t* card) {
     int width;
     int status;
 
+    card->recover = 0; // Initialisation starts the card over anyway
     sdc_reset(card->sdc_base);
     sdc_set_clock(card->sdc_base, 400 * 1000);
     sdc_set_bus_width(card->sdc_base, MMC_BUS_WIDTH_1);
@@ -348,29 +495,7 @@ uint8_t sdcard_detect(sdcard_t* card) {
     card->capacity = card->blk_cnt * card->read_bl_len;
 
     if(card->version & MMC_VERSION_SD) {
-        if((card->width & MMC_BUS_WIDTH_8) || (card->width & MMC_BUS_WIDTH_4))
-            width = 2;
-        else
-            width = 0;
-
-        cmd.cmdidx = MMC_APP_CMD;
-        cmd.cmdarg = card->rca << 16;
-        cmd.resptype = MMC_RESP_R5;
-        if(!sdc_transfer(card->sdc_base, &cmd, NULL)) return 0;
-
-        cmd.cmdidx = MMC_SD_SWITCH_FUNC;
-        cmd.cmdarg = width;
-        cmd.resptype = MMC_RESP_R1;
-        if(!sdc_transfer(card->sdc_base, &cmd, NULL)) return 0;
-
-        if(card->tran_speed < card->clock)
-            sdc_set_clock(card->sdc_base, card->tran_speed);
-        else
-            sdc_set_clock(card->sdc_base, card->clock);
-        if((card->width & MMC_BUS_WIDTH_8) || (card->width & MMC_BUS_WIDTH_4))
-            sdc_set_bus_width(card->sdc_base, MMC_BUS_WIDTH_4);
-        else
-            sdc_set_bus_width(card->sdc_base, MMC_BUS_WIDTH_1);
+        if(!sd_setup_bus(card)) return 0;
     } else if(card->version & MMC_VERSION_MMC) {
         if(card->width & MMC_BUS_WIDTH_8)
             width = 2;
@@ -390,15 +515,17 @@ uint8_t sdcard_detect(sdcard_t* card) {
         if(!sdc_transfer(card->sdc_base, &cmd, NULL)) return 0;
 
         if(card->tran_speed < card->clock)
-            sdc_set_clock(card->sdc_base, card->tran_speed);
+            card->bus_clock = card->tran_speed;
         else
-            sdc_set_clock(card->sdc_base, card->clock);
+            card->bus_clock = card->clock;
+        sdc_set_clock(card->sdc_base, card->bus_clock);
         if(card->width & MMC_BUS_WIDTH_8)
-            sdc_set_bus_width(card->sdc_base, MMC_BUS_WIDTH_8);
+            card->bus_width = MMC_BUS_WIDTH_8;
         else if(card->width & MMC_BUS_WIDTH_4)
-            sdc_set_bus_width(card->sdc_base, MMC_BUS_WIDTH_4);
-        else if(card->width & MMC_BUS_WIDTH_1)
-            sdc_set_bus_width(card->sdc_base, MMC_BUS_WIDTH_1);
+            card->bus_width = MMC_BUS_WIDTH_4;
+        else
+            card->bus_width = MMC_BUS_WIDTH_1;
+        sdc_set_bus_width(card->sdc_base, card->bus_width);
     }
 
     cmd.cmdidx = MMC_SET_BLOCKLEN;
@@ -410,10 +537,14 @@ uint8_t sdcard_detect(sdcard_t* card) {
 
 uint64_t sdcard_read(sdcard_t* card, uint8_t* buf, uint64_t blkno, uint64_t blkcnt) {
     uint64_t cnt, blks = blkcnt;
+    int retries;
 
+    sdcard_recover(card);
     while(blks > 0) {
-        cnt = (blks > 127) ? 127 : blks;
-        if(mmc_read_blocks(card, buf, blkno, cnt) != cnt) return 0;
+        cnt = (blks > SDCARD_MAX_TRANSFER_BLOCKS) ? SDCARD_MAX_TRANSFER_BLOCKS : blks;
+        retries = SD_RETRIES;
+        while(mmc_read_blocks(card, buf, blkno, cnt) != cnt)
+            if(retries-- == 0) return 0;
         blks -= cnt;
         blkno += cnt;
         buf += cnt * card->read_bl_len;
@@ -423,10 +554,14 @@ uint64_t sdcard_read(sdcard_t* card, uint8_t* buf, uint64_t blkno, uint64_t blkc
 
 uint64_t sdcard_write(sdcard_t* card, uint8_t* buf, uint64_t blkno, uint64_t blkcnt) {
     uint64_t cnt, blks = blkcnt;
+    int retries;
 
+    sdcard_recover(card);
     while(blks > 0) {
-        cnt = (blks > 127) ? 127 : blks;
-        if(mmc_write_blocks(card, buf, blkno, cnt) != cnt) return 0;
+        cnt = (blks > SDCARD_MAX_TRANSFER_BLOCKS) ? SDCARD_MAX_TRANSFER_BLOCKS : blks;
+        retries = SD_RETRIES;
+        while(mmc_write_blocks(card, buf, blkno, cnt) != cnt)
+            if(retries-- == 0) return 0;
         blks -= cnt;
         blkno += cnt;
         buf += cnt * card->write_bl_len;
@@ -434,15 +569,85 @@ uint64_t sdcard_write(sdcard_t* card, uint8_t* buf, uint64_t blkno, uint64_t blk
     return blkcnt;
 }
 
+uint8_t sdcard_transfer_start(sdcard_t* card, uint8_t* buf, uint64_t blkno, uint64_t blkcnt, uint8_t write) {
+    sdc_cmd_t cmd = {0};
+    sdc_data_t* dat = &card->xfer;
+    uint32_t bl_len = write ? card->write_bl_len : card->read_bl_len;
+
+    if(card->recover || (blkcnt == 0) || (blkcnt > SDCARD_MAX_TRANSFER_BLOCKS)) return 0;
+
+    if(write)
+        cmd.cmdidx = (blkcnt > 1) ? MMC_WRITE_MULTIPLE_BLOCK : MMC_WRITE_SINGLE_BLOCK;
+    else
+        cmd.cmdidx = (blkcnt > 1) ? MMC_READ_MULTIPLE_BLOCK : MMC_READ_SINGLE_BLOCK;
+    if(card->high_capacity)
+        cmd.cmdarg = blkno;
+    else
+        cmd.cmdarg = blkno * bl_len;
+    cmd.resptype = MMC_RESP_R1;
+    dat->buf = buf;
+    dat->flag = write ? MMC_DATA_WRITE : MMC_DATA_READ;
+    dat->blksz = bl_len;
+    dat->blkcnt = blkcnt;
+    if((write && !sd_set_write_count(card, dat)) || !sdc_transfer_start(card->sdc_base, &cmd, dat)) {
+        card->recover = 1;
+        return 0;
+    }
+    return 1;
+}
+
+int8_t sdcard_transfer_poll(sdcard_t* card) {
+    int8_t ret = sdc_transfer_poll(card->sdc_base, &card->xfer);
+
+    if(ret < 0) card->recover = 1;
+    return ret;
+}
+
+void sdcard_transfer_abort(sdcard_t* card) {
+    sdc_transfer_abort(card->sdc_base, &card->xfer);
+    card->recover = 1;
+}
+
+void sdcard_recover(sdcard_t* card) {
+    if(!card->recover) return;
+    mmc_recover(card);
+    card->recover = 0;
+}
+
 int sdcard_status(sdcard_t* card) {
     int status = mmc_status(card);
     return status >= 0;
 }
 
-static inline void sdelay(int loops) {
-    __asm__ __volatile__("1:\n"
-                         "subs %0, %1, #1\n"
-                         "bne 1b"
-                         : "=r"(loops)
-                         : "0"(loops));
+uint8_t sdcard_busy(sdcard_t* card) {
+    return sdc_card_busy(card->sdc_base);
+}
+
+// TIM0 ticks since *last, has to be called at least once per TIM0 reload period
+static uint32_t sd_timer_elapsed(uint32_t* last) {
+    uint32_t now = tim_get_cnt(TIM0);
+    uint32_t ticks = (*last >= now) ? (*last - now) : (*last + tim_get_period(TIM0) - now);
+
+    *last = now;
+    return ticks;
+}
+
+static void sd_delay_us(uint32_t us) {
+    uint32_t last = tim_get_cnt(TIM0);
+    uint32_t ticks = 0;
+
+    while(ticks < us * SD_TIMER_TICKS_US)
+        ticks += sd_timer_elapsed(&last);
+}
+
+// Waits for the card to release DAT0 after a write
+static uint8_t sd_wait_ready(sdcard_t* card, uint32_t timeout_us) {
+    uint32_t last = tim_get_cnt(TIM0);
+    uint32_t ticks = 0;
+
+    while(sdc_card_busy(card->sdc_base)) {
+        ticks += sd_timer_elapsed(&last);
+        if(ticks >= timeout_us * SD_TIMER_TICKS_US) return 0;
+    }
+    return 1;
 }
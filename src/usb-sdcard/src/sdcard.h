@@ -4,17 +4,29 @@
 extern "C" {
 #endif
 
+#include <stdint.h>
+#include "f1c100s_sdc.h"
+
+#define SDCARD_MAX_TRANSFER_BLOCKS (127)
+
+// SCR fields, scr[0] holds bits 63:32
+#define SD_SCR_SPEC(scr) (((scr)[0] >> 24) & 0xf)
+#define SD_SCR_BUS_WIDTHS(scr) (((scr)[0] >> 16) & 0xf)
+#define SD_SCR_CMD_SUPPORT(scr) ((scr)[0] & 0x3)
+#define SD_SCR_CMD23 (1 << 1)
+
 typedef struct {
     uint32_t sdc_base;
 
     uint32_t voltage;
-    uint32_t width;
-    uint32_t clock;
+    uint32_t width; // Widest bus to try
+    uint32_t clock; // Highest clock to try
 
     uint32_t version;
     uint32_t ocr;
     uint32_t rca;
     uint32_t csd[4];
+    uint32_t scr[2];
     uint8_t extcsd[512];
 
     uint32_t high_capacity;
@@ -23,13 +35,30 @@ typedef struct {
     uint32_t write_bl_len;
     uint64_t blk_cnt;
     uint64_t capacity;
+
+    uint32_t bus_width; // Negotiated bus width
+    uint32_t bus_clock; // Negotiated bus clock
+
+    sdc_data_t xfer; // Transfer started by sdcard_transfer_start
+    volatile uint8_t recover; // A non-blocking transfer failed, sdcard_recover() has to run before the next one
 } sdcard_t;
 
-int sdcard_status(sdcard_t* card);
 uint8_t sdcard_detect(sdcard_t* card);
+int sdcard_status(sdcard_t* card);
 uint64_t sdcard_read(sdcard_t* card, uint8_t* buf, uint64_t blkno, uint64_t blkcnt);
 uint64_t sdcard_write(sdcard_t* card, uint8_t* buf, uint64_t blkno, uint64_t blkcnt);
 
+// Non-blocking single transfer of up to SDCARD_MAX_TRANSFER_BLOCKS, completion is signalled by the SDC IRQ.
+// These may run from IRQ context and never wait on the card: a failed or aborted transfer only sets
+// card->recover, and sdcard_transfer_start refuses to start anything until sdcard_recover() ran.
+uint8_t sdcard_transfer_start(sdcard_t* card, uint8_t* buf, uint64_t blkno, uint64_t blkcnt, uint8_t write);
+int8_t sdcard_transfer_poll(sdcard_t* card);
+void sdcard_transfer_abort(sdcard_t* card);
+uint8_t sdcard_busy(sdcard_t* card);
+// Gets the card back to the transfer state after a failed non-blocking transfer. Blocks for up to the
+// write timeout, thread context only. Returns at once if nothing failed, sdcard_read/sdcard_write call it too.
+void sdcard_recover(sdcard_t* card);
+
 #ifdef __cplusplus
 }
 #endif